@@ -0,0 +1,18 @@
+// Writes the readable and the compact single header of include/sob.hpp into the working directory, for
+// compact_header_bench.sh to time how long the compiler takes to parse each.
+#include "sob.hpp"
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::cerr << "usage: compact_header_bench <repository root>\n";
+        return 2;
+    }
+    auto header = (std::filesystem::path{argv[1]} / "include" / "sob.hpp").string();
+    sopho::single_header_generator(header, sopho::GeneratorOptions{"readable.hpp"});
+    sopho::GeneratorOptions compact{"compact.hpp"};
+    compact.compact = true;
+    sopho::single_header_generator(header, compact);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Compares the readable and the compact single header: line and byte counts, and the best of RUNS (default 5) g++
+# -fsyntax-only parses of a file including each. Usage: bench/compact_header_bench.sh
+set -eu
+root=$(cd "$(dirname "$0")/.." && pwd)
+cxx=${CXX:-g++}
+runs=${RUNS:-5}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+"$cxx" -std=c++20 -O1 -I"$root/include" -pthread "$root/bench/compact_header_bench.cpp" -o generate
+./generate "$root"
+for variant in readable compact; do
+    printf '#include "%s.hpp"\nint main() {}\n' "$variant" > "$variant.cpp"
+    best=
+    i=0
+    while [ "$i" -lt "$runs" ]; do
+        start=$(date +%s%N)
+        "$cxx" -std=c++20 -fsyntax-only "$variant.cpp"
+        elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+        i=$((i + 1))
+    done
+    printf '%-9s %6d lines %8d bytes %6d ms\n' "$variant" "$(wc -l < "$variant.hpp")" "$(wc -c < "$variant.hpp")" "$best"
+done
@@ -0,0 +1,41 @@
+// Time to plan a deep build graph: enqueue() of Root, from deep_graph.hpp, into a fresh JobPool and CompileCommands,
+// without running a job. deep_graph_bench.sh generates the chain and the sources it names, and builds this.
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include "sob.hpp"
+#include "deep_graph.hpp"
+
+struct Context
+{
+    static constexpr std::string_view cxx{"g++"};
+    static constexpr sopho::StaticString obj_prefix{" -o "};
+    static constexpr sopho::StaticString obj_postfix{".o"};
+    static constexpr sopho::StaticString bin_prefix{" -o "};
+    static constexpr sopho::StaticString build_prefix{"build/"};
+    static constexpr sopho::StaticString shared_prefix{" -shared -o "};
+    static constexpr sopho::StaticString shared_postfix{".so"};
+    static constexpr std::array<std::string_view, 1> shared_cxxflags{"-fPIC"};
+    static constexpr sopho::StaticString rpath_prefix{"-Wl,-rpath,"};
+    static constexpr sopho::StaticString soname_prefix{"-Wl,-soname,"};
+};
+
+int main(int argc, char** argv)
+{
+    using Toolchain = sopho::CxxToolchain<Context>;
+    const auto& plan = Toolchain::build_plan<Root>;
+    int repetitions = argc > 1 ? std::atoi(argv[1]) : 100;
+    std::size_t entries = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < repetitions; ++i)
+    {
+        sopho::JobPool pool{};
+        sopho::CompileCommands commands{};
+        Toolchain::enqueue(pool, plan, commands);
+        entries = commands.entries().size();
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << plan.nodes.size() << " nodes, " << entries << " compile commands: "
+              << elapsed.count() / repetitions << " us per plan\n";
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Compile time and planning time of a chain of DEPTH shared libraries, each built from one source and linking the one
+# before it, under a binary. Usage: bench/deep_graph_bench.sh [depth...] (default 10 50 100)
+set -eu
+root=$(cd "$(dirname "$0")/.." && pwd)
+cxx=${CXX:-g++}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work"
+[ "$#" -gt 0 ] || set -- 10 50 100
+for depth in "$@"; do
+    {
+        echo '#pragma once'
+        previous=
+        i=0
+        while [ "$i" -lt "$depth" ]; do
+            : > "s$i.cpp"
+            echo "using L$i = sopho::SharedLibrary<std::tuple<sopho::Source<sopho::StaticString{\"s$i.cpp\"}>$previous>,"
+            echo "                                   sopho::StaticString{\"lib$i\"}>;"
+            previous=", L$i"
+            i=$((i + 1))
+        done
+        : > main.cpp
+        echo "using Root = sopho::Target<std::tuple<sopho::Source<sopho::StaticString{\"main.cpp\"}>$previous>,"
+        echo "                           sopho::StaticString{\"app\"}>;"
+    } > deep_graph.hpp
+    start=$(date +%s%N)
+    "$cxx" -std=c++20 -O2 -I"$root/include" -I. -pthread "$root/bench/deep_graph_bench.cpp" -o bench
+    printf 'depth %4d: compiled in %6d ms, ' "$depth" $(( ($(date +%s%N) - start) / 1000000 ))
+    ./bench
+done
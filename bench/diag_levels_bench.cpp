@@ -0,0 +1,32 @@
+// Cost of one SOPHO_STACK scope holding one SOPHO_VALUE at the SOPHO_DIAG_LEVEL this is compiled with: times CALLS
+// (argv[1], default 1e8) calls of a leaf that cannot be inlined. diag_levels_bench.sh builds and runs every level.
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include "diag.hpp"
+
+namespace
+{
+    [[gnu::noinline]] std::uint64_t leaf(std::uint64_t i)
+    {
+        SOPHO_STACK();
+        SOPHO_VALUE(i);
+        return i * 2654435761u;
+    }
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::uint64_t calls = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 100000000;
+    std::uint64_t sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (std::uint64_t i = 0; i < calls; ++i)
+    {
+        sum += leaf(i);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    // Printing the sum keeps the loop from being optimized away.
+    std::cout << elapsed.count() / static_cast<double>(calls) << " ns/call (checksum " << sum % 1000 << ")\n";
+    return 0;
+}
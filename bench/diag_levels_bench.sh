@@ -0,0 +1,14 @@
+#!/bin/sh
+# Per-call cost of a SOPHO_STACK scope with one SOPHO_VALUE at each diagnostics level, built at -O2.
+# Usage: bench/diag_levels_bench.sh [calls]
+set -eu
+root=$(cd "$(dirname "$0")/.." && pwd)
+cxx=${CXX:-g++}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+for level in OFF ASSERT FULL SAMPLED; do
+    "$cxx" -std=c++20 -O2 -DSOPHO_DIAG_LEVEL=SOPHO_DIAG_$level -I"$root/include" -pthread \
+        "$root/bench/diag_levels_bench.cpp" -o "$work/bench_$level"
+    printf '%-8s ' "$level"
+    "$work/bench_$level" "$@"
+done
@@ -0,0 +1,64 @@
+#!/bin/sh
+# Compile time of Foldl over N list elements and of CxxBuilder<Target with N sources>::build(), best of RUNS
+# (default 3) g++ -fsyntax-only runs. Usage: bench/foldl_compile_bench.sh [N...] (default 10 100 1000 3000)
+set -eu
+root=$(cd "$(dirname "$0")/.." && pwd)
+cxx=${CXX:-g++}
+runs=${RUNS:-3}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+[ "$#" -gt 0 ] || set -- 10 100 1000 3000
+
+# Prints the best time of compiling $1 in milliseconds, or "failed".
+best_ms() {
+    best=
+    i=0
+    while [ "$i" -lt "$runs" ]; do
+        start=$(date +%s%N)
+        if ! "$cxx" -std=c++20 -fsyntax-only -I"$root/include" "$1" 2> "$work/errors"; then
+            echo failed
+            return
+        fi
+        elapsed=$(( ($(date +%s%N) - start) / 1000000 ))
+        if [ -z "$best" ] || [ "$elapsed" -lt "$best" ]; then
+            best=$elapsed
+        fi
+        i=$((i + 1))
+    done
+    echo "$best"
+}
+
+# Comma-separated list of $2 items, each printed by the printf format $1 with its index.
+list() {
+    seq 0 $(($2 - 1)) | sed "s/.*/$(printf "$1" '&')/" | paste -sd, -
+}
+
+printf '%6s %12s %12s\n' N "Foldl ms" "build() ms"
+for n in "$@"; do
+    cat > "$work/foldl.cpp" <<CPP
+#include <type_traits>
+#include "meta.hpp"
+template <typename Count, typename T>
+struct CountFolder
+{
+    using type = std::integral_constant<int, Count::value + 1>;
+};
+using List = std::tuple<$(list 'std::integral_constant<int, %s>' "$n")>;
+static_assert(sopho::Foldl<CountFolder, std::integral_constant<int, 0>, List>::value == $n);
+CPP
+    cat > "$work/builder.cpp" <<CPP
+#include "sob.hpp"
+struct Context
+{
+    static constexpr std::string_view cxx{"g++"};
+    static constexpr sopho::StaticString obj_prefix{" -o "};
+    static constexpr sopho::StaticString obj_postfix{".o"};
+    static constexpr sopho::StaticString bin_prefix{" -o "};
+    static constexpr sopho::StaticString build_prefix{"build/"};
+};
+using App = sopho::Target<std::tuple<$(list 'sopho::Source<sopho::StaticString{"s%s.cpp"}>' "$n")>,
+                          sopho::StaticString{"app"}>;
+sopho::BuildResult (*build)() = &sopho::CxxToolchain<Context>::CxxBuilder<App>::build;
+CPP
+    printf '%6d %12s %12s\n' "$n" "$(best_ms "$work/foldl.cpp")" "$(best_ms "$work/builder.cpp")"
+done
@@ -0,0 +1,148 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#if !defined(_WIN32)
+#include <csignal>
+#include <sys/mman.h>
+#endif
+#include "diag.hpp"
+#include "trace.hpp"
+
+namespace sopho
+{
+    // Frames beyond this depth are not printed, which also bounds the walk if a crash corrupted the frame list.
+    inline constexpr std::uint32_t max_crash_frames = 256;
+
+    // Signal-safe counterpart of dump_callstack: locations are static data and values are formatted in place, so
+    // nothing allocates or locks.
+    inline void dump_callstack(SignalSafeWriter& out)
+    {
+        if constexpr (diag_level == DiagLevel::Off)
+        {
+            out << "(callstack not recorded, SOPHO_DIAG_LEVEL is SOPHO_DIAG_OFF)\n";
+            return;
+        }
+        else if constexpr (diag_level == DiagLevel::Sampled)
+        {
+            out << "(callstack sampled 1 in " << diag_sample_rate << " scopes, frames may be missing)\n";
+        }
+        std::uint32_t size{0};
+        char buffer[stack_value_buffer_size];
+        for (const auto* info = StackInfoInstance::get().top; info != nullptr && size < max_crash_frames;
+             info = info->parent)
+        {
+            const auto& location = *info->source_location;
+            out << "stack" << size << ": " << location.file_name << ":" << location.line_number << "@"
+                << location.function_name << "\n";
+            for (std::uint32_t i = 0; i < info->value_count && i < max_stack_values; ++i)
+            {
+                const auto& value = *info->stack_values[i];
+                out << "name:" << value.name << " value:" << format_stack_value(value.value, buffer, sizeof(buffer));
+                out << "\n";
+            }
+            if (info->value_count > max_stack_values)
+            {
+                out << "(" << info->value_count - max_stack_values << " more values)\n";
+            }
+            ++size;
+        }
+        if (size == max_crash_frames)
+        {
+            out << "(frame walk stopped at " << max_crash_frames << " frames)\n";
+        }
+    }
+
+#if !defined(_WIN32)
+    // Large enough for the handler's own frames plus a 1 KiB writer buffer, with room to spare.
+    inline constexpr std::size_t crash_signal_stack_size = 64 * 1024;
+
+    // Gives the calling thread an alternate signal stack, so a stack overflow can still be reported. Signal stacks
+    // are per thread: install_crash_handler() covers its caller, other threads call this themselves. The stack is
+    // kept for the life of the thread.
+    inline bool install_crash_signal_stack()
+    {
+        static thread_local bool installed = false;
+        if (installed)
+        {
+            return true;
+        }
+        void* memory =
+            ::mmap(nullptr, crash_signal_stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+        stack_t stack{};
+        stack.ss_sp = memory;
+        stack.ss_size = crash_signal_stack_size;
+        if (::sigaltstack(&stack, nullptr) != 0)
+        {
+            ::munmap(memory, crash_signal_stack_size);
+            return false;
+        }
+        installed = true;
+        return true;
+    }
+
+    namespace detail
+    {
+        struct CrashSignal
+        {
+            int number;
+            std::string_view name;
+        };
+
+        inline constexpr CrashSignal crash_signals[] = {
+            {SIGSEGV, "SIGSEGV"}, {SIGBUS, "SIGBUS"}, {SIGABRT, "SIGABRT"}, {SIGFPE, "SIGFPE"}, {SIGILL, "SIGILL"},
+        };
+
+        inline void crash_signal_handler(int signal_number, siginfo_t* info, void*)
+        {
+            // An aborting SOPHO_ASSERT has already printed everything.
+            if (begin_crash_report())
+            {
+                SignalSafeWriter out{2};
+                out << "fatal signal " << signal_number;
+                for (const auto& crash_signal : crash_signals)
+                {
+                    if (crash_signal.number == signal_number)
+                    {
+                        out << " (" << crash_signal.name << ")";
+                    }
+                }
+                if (info != nullptr && signal_number != SIGABRT)
+                {
+                    out << " at ";
+                    out.hex(reinterpret_cast<std::uintptr_t>(info->si_addr));
+                }
+                out << "\n";
+                dump_callstack(out);
+                dump_threads(out, StackInfoInstance::get().slot);
+                dump_trace(out);
+            }
+            // SA_RESETHAND restored the default action; re-raise to terminate with the original signal.
+            ::raise(signal_number);
+        }
+    } // namespace detail
+
+    // Reports the SOPHO_STACK frames of the crashing thread (and the trace rings, when enabled) on SIGSEGV, SIGBUS,
+    // SIGABRT, SIGFPE and SIGILL, then lets the signal terminate the process as usual.
+    inline void install_crash_handler()
+    {
+        install_crash_signal_stack();
+        struct sigaction action{};
+        action.sa_sigaction = detail::crash_signal_handler;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+        sigemptyset(&action.sa_mask);
+        for (const auto& crash_signal : detail::crash_signals)
+        {
+            ::sigaction(crash_signal.number, &action, nullptr);
+        }
+    }
+#else
+    inline bool install_crash_signal_stack() { return false; }
+
+    inline void install_crash_handler() {}
+#endif
+} // namespace sopho
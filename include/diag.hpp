@@ -1,21 +1,51 @@
 #pragma once
+#include <array>
 #include <cstdint>
-#include <filesystem>
-#include <functional>
 #include <iostream>
 #include <sstream>
-#include <list>
-#include <map>
 #include <string>
-#include <variant>
-#include "meta.hpp"
+#include <string_view>
+#include "profiler.hpp"
+#include "source_location.hpp"
+#include "thread_registry.hpp"
+#include "trace.hpp"
+#include "value_formatter.hpp"
 
 #define SOPHO_DETAIL_JOIN2_IMPL(a, b) a##b
 #define SOPHO_DETAIL_JOIN2(a, b) SOPHO_DETAIL_JOIN2_IMPL(a, b)
-#define SOPHO_STACK()                                                                                                  \
-    ::sopho::StackScope SOPHO_DETAIL_JOIN2(_sopho_stack_scope_, __COUNTER__) { __FILE__, __func__, __LINE__ }
+// Diagnostics level, chosen with -DSOPHO_DIAG_LEVEL=... before sob.hpp is included:
+//   SOPHO_DIAG_OFF     SOPHO_STACK/SOPHO_VALUE compile to nothing; a failed assert reports only its own location.
+//   SOPHO_DIAG_ASSERT  frames are recorded as assert context, SOPHO_VALUE compiles to nothing.
+//   SOPHO_DIAG_FULL    frames and values are recorded (default).
+//   SOPHO_DIAG_SAMPLED frames and values are recorded for 1 in SOPHO_DIAG_SAMPLE_RATE scopes per thread.
+#define SOPHO_DIAG_OFF 0
+#define SOPHO_DIAG_ASSERT 1
+#define SOPHO_DIAG_FULL 2
+#define SOPHO_DIAG_SAMPLED 3
+#ifndef SOPHO_DIAG_LEVEL
+#define SOPHO_DIAG_LEVEL SOPHO_DIAG_FULL
+#endif
+#ifndef SOPHO_DIAG_SAMPLE_RATE
+#define SOPHO_DIAG_SAMPLE_RATE 64
+#endif
+
+#if SOPHO_DIAG_LEVEL == SOPHO_DIAG_OFF
+#define SOPHO_STACK() static_cast<void>(0)
+#else
+#define SOPHO_STACK() SOPHO_DETAIL_STACK(SOPHO_DETAIL_JOIN2(_sopho_stack_scope_, __COUNTER__))
+#endif
+// The location is a constant-initialized static, so entering a scope only links a pointer into the frame list.
+#define SOPHO_DETAIL_STACK(name)                                                                                       \
+    static constexpr ::sopho::SourceLocation SOPHO_DETAIL_JOIN2(name, _location){                                      \
+        __FILE__, __func__, static_cast<std::uint32_t>(__LINE__)};                                                     \
+    ::sopho::StackScope name { SOPHO_DETAIL_JOIN2(name, _location) }
+#if SOPHO_DIAG_LEVEL == SOPHO_DIAG_OFF || SOPHO_DIAG_LEVEL == SOPHO_DIAG_ASSERT
+// sizeof keeps the operand "used" without evaluating it.
+#define SOPHO_VALUE(value) static_cast<void>(sizeof(value))
+#else
 #define SOPHO_VALUE(value)                                                                                             \
-    ::sopho::StackValue SOPHO_DETAIL_JOIN2(_sopho_stack_value_, __COUNTER__) { std::string(#value), value }
+    ::sopho::StackValue SOPHO_DETAIL_JOIN2(_sopho_stack_value_, __COUNTER__) { #value, value }
+#endif
 
 
 #define SOPHO_SOURCE_LOCATION                                                                                          \
@@ -34,19 +64,6 @@
 
 namespace sopho
 {
-    struct SourceLocation
-    {
-        const char* file_name{};
-        const char* function_name{};
-        std::uint32_t line_number{};
-    };
-
-    template <typename T>
-    struct ReferenceWrapper
-    {
-        using type = std::reference_wrapper<const T>;
-    };
-
     [[noreturn]] inline void assert_fail(std::string_view expr, std::string msg, SourceLocation loc);
 
     // Build message only on failure path.
@@ -58,45 +75,44 @@ namespace sopho
         return os.str();
     }
 
-    using StackValueReference =
-        Map<ReferenceWrapper, std::variant<std::int64_t, std::uint64_t, double, std::string, std::filesystem::path>>;
-
-    struct StackInfo
+    enum class DiagLevel : std::uint8_t
     {
-        SourceLocation source_location{};
-        std::map<std::string, StackValueReference> stack_values{};
+        Off = SOPHO_DIAG_OFF,
+        Assert = SOPHO_DIAG_ASSERT,
+        Full = SOPHO_DIAG_FULL,
+        Sampled = SOPHO_DIAG_SAMPLED,
     };
 
-    inline std::string stack_value_to_string(const StackValueReference& v)
-    {
-        return std::visit(
-            [](const auto& ref) -> std::string
-            {
-                const auto& x = ref.get();
-                using T = std::decay_t<decltype(x)>;
+    inline constexpr DiagLevel diag_level = static_cast<DiagLevel>(SOPHO_DIAG_LEVEL);
+    inline constexpr std::uint32_t diag_sample_rate = SOPHO_DIAG_SAMPLE_RATE;
+    static_assert(diag_sample_rate > 0, "SOPHO_DIAG_SAMPLE_RATE must be positive");
 
-                if constexpr (std::is_same_v<T, std::string>)
-                {
-                    return x;
-                }
-                else if constexpr (std::is_same_v<T, std::filesystem::path>)
-                {
-                    // Note: string() is platform/native encoding; for cross-platform stable output you might prefer
-                    // generic_u8string().
-                    return x.string();
-                }
-                else
-                {
-                    // Covers int64_t / uint64_t / double
-                    return std::to_string(x);
-                }
-            },
-            v);
-    }
+    struct StackValue;
+
+    // Values beyond this many per frame are counted but not shown in the dump.
+    inline constexpr std::uint32_t max_stack_values = 8;
+
+    // One frame of the diagnostic stack. Frames live inside their StackScope and are linked innermost first, so
+    // entering and leaving a scope never allocates. Captured values register themselves in the inline slots; only
+    // the first value_count entries are meaningful, so the slots are deliberately left uninitialized.
+    struct StackInfo
+    {
+        const SourceLocation* source_location{};
+        StackInfo* parent{};
+        std::uint32_t value_count{};
+        std::array<const StackValue*, max_stack_values> stack_values;
+    };
 
     struct StackInfoInstance
     {
-        std::list<StackInfo> stack_infos;
+        StackInfo* top{};
+        // Sampled level only: scopes entered so far and whether the innermost scope is being recorded.
+        std::uint32_t sample_counter{};
+        bool recording{true};
+        // Registry slot mirroring this thread's frames for other threads, claimed when the first scope is entered.
+        bool registered{};
+        std::uint32_t depth{};
+        ThreadSlot* slot{};
         static StackInfoInstance& get()
         {
             static thread_local StackInfoInstance instance{};
@@ -104,22 +120,79 @@ namespace sopho
         }
     };
 
+    // Names the calling thread in dumps of other threads; defaults to the OS thread name where there is one.
+    inline void set_thread_name(std::string_view name)
+    {
+        auto& instance = StackInfoInstance::get();
+        instance.registered = true;
+        if (auto* slot = instance.slot ? instance.slot : register_thread(instance.slot))
+        {
+            detail::set_slot_name(*slot, name);
+        }
+    }
+
     struct StackScope
     {
-        StackInfo* p_stack_info{};
-        StackScope(const char* file_name, const char* function_name, std::uint32_t line_number)
+        StackInfo stack_info;
+        bool recorded{true};
+        bool parent_recording{true};
+        [[no_unique_address]] ScopeTimer<diag_profile> timer;
+        explicit StackScope(const SourceLocation& source_location)
         {
-            StackInfo stack_info{};
-            stack_info.source_location.file_name = file_name;
-            stack_info.source_location.function_name = function_name;
-            stack_info.source_location.line_number = line_number;
-            p_stack_info = &StackInfoInstance::get().stack_infos.emplace_front(stack_info);
+            timer.start();
+            stack_info.source_location = &source_location;
+            auto& instance = StackInfoInstance::get();
+            if constexpr (diag_level == DiagLevel::Sampled)
+            {
+                recorded = ++instance.sample_counter % diag_sample_rate == 0;
+                parent_recording = instance.recording;
+                instance.recording = recorded;
+                if (!recorded)
+                {
+                    return;
+                }
+            }
+            stack_info.parent = instance.top;
+            instance.top = &stack_info;
+            if (!instance.registered)
+            {
+                instance.registered = true;
+                register_thread(instance.slot);
+            }
+            if (instance.slot != nullptr)
+            {
+                instance.slot->push(instance.depth, &source_location);
+            }
+            ++instance.depth;
+            if constexpr (diag_trace)
+            {
+                trace_scope(TraceEventKind::Enter, source_location.function_name, source_location.line_number);
+            }
         }
         ~StackScope()
         {
-            SOPHO_ASSERT(!StackInfoInstance::get().stack_infos.empty(), "Stack has been cleared");
-            SOPHO_ASSERT(&StackInfoInstance::get().stack_infos.front() == p_stack_info, "Stack Corrupted");
-            StackInfoInstance::get().stack_infos.pop_front();
+            timer.stop(*stack_info.source_location);
+            auto& instance = StackInfoInstance::get();
+            if constexpr (diag_level == DiagLevel::Sampled)
+            {
+                instance.recording = parent_recording;
+                if (!recorded)
+                {
+                    return;
+                }
+            }
+            SOPHO_ASSERT(instance.top == &stack_info, "Stack Corrupted");
+            if constexpr (diag_trace)
+            {
+                trace_scope(TraceEventKind::Exit, stack_info.source_location->function_name,
+                            stack_info.source_location->line_number);
+            }
+            instance.top = stack_info.parent;
+            --instance.depth;
+            if (instance.slot != nullptr)
+            {
+                instance.slot->pop(instance.depth);
+            }
         }
         StackScope(const StackScope&) = delete;
         StackScope& operator=(const StackScope&) = delete;
@@ -127,32 +200,86 @@ namespace sopho
         StackScope& operator=(StackScope&&) = delete;
     };
 
+    // Captures a value by reference under its spelling in the source. Formatting is deferred to dump_callstack and
+    // goes through StackValueFormatter<T>; temporaries are rejected since they would dangle.
     struct StackValue
     {
-        std::string name{};
-        StackValue(std::string value_name, StackValueReference value)
+        std::string_view name{};
+        StackValueReference value;
+        StackInfo* stack_info{};
+        template <typename T>
+        StackValue(std::string_view value_name, const T& captured) :
+            name(value_name), value(StackValueReference::of(captured))
         {
-            name = value_name;
-            StackInfoInstance::get().stack_infos.front().stack_values.insert_or_assign(value_name, value);
+            auto& instance = StackInfoInstance::get();
+            // Values outside of any recorded scope have no frame to attach to and are dropped.
+            if (!instance.recording || instance.top == nullptr)
+            {
+                return;
+            }
+            stack_info = instance.top;
+            if (stack_info->value_count < max_stack_values)
+            {
+                stack_info->stack_values[stack_info->value_count] = this;
+            }
+            ++stack_info->value_count;
+            if constexpr (diag_trace)
+            {
+                trace_event(TraceEventKind::Value, name, 0, [this](TraceEvent& event) { encode(event); });
+            }
+        }
+        ~StackValue()
+        {
+            if (stack_info != nullptr)
+            {
+                --stack_info->value_count;
+            }
         }
-        ~StackValue() { StackInfoInstance::get().stack_infos.front().stack_values.erase(name); }
+        template <typename T>
+        StackValue(std::string_view, const T&&) = delete;
         StackValue(const StackValue&) = delete;
         StackValue& operator=(const StackValue&) = delete;
         StackValue(StackValue&&) = delete;
         StackValue& operator=(StackValue&&) = delete;
+
+    private:
+        // Trace events outlive the referenced value, so the formatted value is copied in (truncated).
+        void encode(TraceEvent& event) const
+        {
+            auto* text = event.payload.text;
+            event.value_kind = TraceValueKind::Text;
+            auto* end = value.format(value.object, text, text + sizeof(event.payload.text));
+            event.text_size = static_cast<std::uint8_t>(end - text);
+        }
     };
 
     void dump_callstack(std::ostringstream& ss)
     {
-        auto& infos = StackInfoInstance::get().stack_infos;
+        if constexpr (diag_level == DiagLevel::Off)
+        {
+            ss << "(callstack not recorded, SOPHO_DIAG_LEVEL is SOPHO_DIAG_OFF)" << std::endl;
+            return;
+        }
+        else if constexpr (diag_level == DiagLevel::Sampled)
+        {
+            ss << "(callstack sampled 1 in " << diag_sample_rate << " scopes, frames may be missing)" << std::endl;
+        }
         std::uint32_t size{0};
-        for (const auto& info : infos)
+        char buffer[stack_value_buffer_size];
+        for (const auto* info = StackInfoInstance::get().top; info != nullptr; info = info->parent)
         {
-            ss << "stack" << size << ": " << info.source_location.file_name << ":" << info.source_location.line_number
-               << "@" << info.source_location.function_name << std::endl;
-            for (const auto& [key, value] : info.stack_values)
+            const auto& location = *info->source_location;
+            ss << "stack" << size << ": " << location.file_name << ":" << location.line_number << "@"
+               << location.function_name << std::endl;
+            for (std::uint32_t i = 0; i < info->value_count && i < max_stack_values; ++i)
             {
-                ss << "name:" << key << " value:" << stack_value_to_string(value) << std::endl;
+                const auto& value = *info->stack_values[i];
+                ss << "name:" << value.name << " value:" << format_stack_value(value.value, buffer, sizeof(buffer))
+                   << std::endl;
+            }
+            if (info->value_count > max_stack_values)
+            {
+                ss << "(" << info->value_count - max_stack_values << " more values)" << std::endl;
             }
             ++size;
         }
@@ -172,9 +299,16 @@ namespace sopho
            << (loc.function_name ? loc.function_name : "<unknown>") << "\n";
 
         dump_callstack(ss);
+        dump_threads(ss, StackInfoInstance::get().slot);
 
         std::cerr << ss.str();
         std::cerr.flush();
+        // Claiming the report also keeps the SIGABRT handler from printing the stack a second time.
+        if (begin_crash_report() && diag_trace)
+        {
+            SignalSafeWriter out{2};
+            dump_trace(out);
+        }
         std::abort();
     }
 
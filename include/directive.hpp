@@ -0,0 +1,679 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace sopho
+{
+    // What the directive evaluator knows about macros. Names in neither set are unknown, and conditions that depend on
+    // them are kept verbatim in the output (unifdef style).
+    struct MacroSet
+    {
+        std::map<std::string, std::string, std::less<>> defined{};
+        std::set<std::string, std::less<>> undefined{};
+
+        void define(std::string_view name, std::string_view value = {})
+        {
+            undefined.erase(std::string(name));
+            defined.insert_or_assign(std::string(name), std::string(value));
+        }
+        void undefine(std::string_view name)
+        {
+            defined.erase(std::string(name));
+            undefined.emplace(name);
+        }
+        void forget(std::string_view name)
+        {
+            defined.erase(std::string(name));
+            undefined.erase(std::string(name));
+        }
+    };
+
+    enum class Tristate : std::uint8_t
+    {
+        False,
+        True,
+        Unknown,
+    };
+
+    inline Tristate is_defined(const MacroSet& macros, std::string_view name)
+    {
+        if (macros.defined.find(name) != macros.defined.end())
+        {
+            return Tristate::True;
+        }
+        if (macros.undefined.find(name) != macros.undefined.end())
+        {
+            return Tristate::False;
+        }
+        return Tristate::Unknown;
+    }
+
+    namespace detail
+    {
+        inline bool is_identifier_start(char c)
+        {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+        }
+
+        inline bool is_identifier_char(char c) { return is_identifier_start(c) || (c >= '0' && c <= '9'); }
+
+        inline std::vector<std::string_view> tokenize_expression(std::string_view expr)
+        {
+            std::vector<std::string_view> tokens{};
+            std::size_t i = 0;
+            while (i < expr.size())
+            {
+                char c = expr[i];
+                if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+                {
+                    ++i;
+                    continue;
+                }
+                if (expr.compare(i, 2, "//") == 0)
+                {
+                    break;
+                }
+                if (expr.compare(i, 2, "/*") == 0)
+                {
+                    auto end = expr.find("*/", i + 2);
+                    i = end == std::string_view::npos ? expr.size() : end + 2;
+                    continue;
+                }
+                std::size_t start = i;
+                if (is_identifier_char(c))
+                {
+                    // Identifiers and pp-numbers (including suffixes such as 1L or 0x10u).
+                    while (i < expr.size() && is_identifier_char(expr[i]))
+                    {
+                        ++i;
+                    }
+                }
+                else if (c == '\'' || c == '"')
+                {
+                    ++i;
+                    while (i < expr.size() && expr[i] != c)
+                    {
+                        i += expr[i] == '\\' ? 2 : 1;
+                    }
+                    i = i < expr.size() ? i + 1 : expr.size();
+                }
+                else
+                {
+                    static constexpr std::string_view two_char_ops[] = {"&&", "||", "==", "!=", "<=", ">=", "<<", ">>"};
+                    i += 1;
+                    for (auto op : two_char_ops)
+                    {
+                        if (expr.compare(start, 2, op) == 0)
+                        {
+                            i = start + 2;
+                            break;
+                        }
+                    }
+                }
+                tokens.emplace_back(expr.substr(start, i - start));
+            }
+            return tokens;
+        }
+
+        // Recursive descent over the #if grammar. Every value is optional: std::nullopt means "depends on an unknown
+        // macro", and && / || / ?: short-circuit so that "0 && UNKNOWN" is still a known 0.
+        class ExpressionEvaluator
+        {
+        public:
+            using Value = std::optional<std::int64_t>;
+
+            ExpressionEvaluator(std::vector<std::string_view> tokens, const MacroSet& macros, int depth) :
+                tokens_(std::move(tokens)), macros_(macros), depth_(depth)
+            {
+            }
+
+            Value evaluate()
+            {
+                auto value = conditional();
+                return pos_ == tokens_.size() && !error_ ? value : std::nullopt;
+            }
+
+        private:
+            std::vector<std::string_view> tokens_;
+            const MacroSet& macros_;
+            int depth_{};
+            std::size_t pos_{};
+            bool error_{};
+
+            std::string_view peek() const { return pos_ < tokens_.size() ? tokens_[pos_] : std::string_view{}; }
+
+            bool accept(std::string_view token)
+            {
+                if (peek() == token)
+                {
+                    ++pos_;
+                    return true;
+                }
+                return false;
+            }
+
+            void expect(std::string_view token)
+            {
+                if (!accept(token))
+                {
+                    error_ = true;
+                }
+            }
+
+            template <typename Op>
+            static Value apply(const Value& l, const Value& r, Op op)
+            {
+                if (!l || !r)
+                {
+                    return std::nullopt;
+                }
+                return op(*l, *r);
+            }
+
+            Value conditional()
+            {
+                auto cond = logical_or();
+                if (!accept("?"))
+                {
+                    return cond;
+                }
+                auto if_true = conditional();
+                expect(":");
+                auto if_false = conditional();
+                if (!cond)
+                {
+                    return if_true && if_false && *if_true == *if_false ? if_true : std::nullopt;
+                }
+                return *cond ? if_true : if_false;
+            }
+
+            Value logical_or()
+            {
+                auto l = logical_and();
+                while (accept("||"))
+                {
+                    auto r = logical_and();
+                    if ((l && *l) || (r && *r))
+                    {
+                        l = 1;
+                    }
+                    else
+                    {
+                        l = apply(l, r, [](auto, auto) { return std::int64_t{0}; });
+                    }
+                }
+                return l;
+            }
+
+            Value logical_and()
+            {
+                auto l = bit_or();
+                while (accept("&&"))
+                {
+                    auto r = bit_or();
+                    if ((l && !*l) || (r && !*r))
+                    {
+                        l = 0;
+                    }
+                    else
+                    {
+                        l = apply(l, r, [](auto, auto) { return std::int64_t{1}; });
+                    }
+                }
+                return l;
+            }
+
+            Value bit_or()
+            {
+                auto l = bit_xor();
+                while (peek() == "|")
+                {
+                    ++pos_;
+                    l = apply(l, bit_xor(), [](auto a, auto b) { return a | b; });
+                }
+                return l;
+            }
+
+            Value bit_xor()
+            {
+                auto l = bit_and();
+                while (accept("^"))
+                {
+                    l = apply(l, bit_and(), [](auto a, auto b) { return a ^ b; });
+                }
+                return l;
+            }
+
+            Value bit_and()
+            {
+                auto l = equality();
+                while (peek() == "&")
+                {
+                    ++pos_;
+                    l = apply(l, equality(), [](auto a, auto b) { return a & b; });
+                }
+                return l;
+            }
+
+            Value equality()
+            {
+                auto l = relational();
+                while (true)
+                {
+                    if (accept("=="))
+                    {
+                        l = apply(l, relational(), [](auto a, auto b) { return std::int64_t{a == b}; });
+                    }
+                    else if (accept("!="))
+                    {
+                        l = apply(l, relational(), [](auto a, auto b) { return std::int64_t{a != b}; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+
+            Value relational()
+            {
+                auto l = shift();
+                while (true)
+                {
+                    if (accept("<"))
+                    {
+                        l = apply(l, shift(), [](auto a, auto b) { return std::int64_t{a < b}; });
+                    }
+                    else if (accept(">"))
+                    {
+                        l = apply(l, shift(), [](auto a, auto b) { return std::int64_t{a > b}; });
+                    }
+                    else if (accept("<="))
+                    {
+                        l = apply(l, shift(), [](auto a, auto b) { return std::int64_t{a <= b}; });
+                    }
+                    else if (accept(">="))
+                    {
+                        l = apply(l, shift(), [](auto a, auto b) { return std::int64_t{a >= b}; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+
+            Value shift()
+            {
+                auto l = additive();
+                while (true)
+                {
+                    if (accept("<<"))
+                    {
+                        l = apply(l, additive(), [](auto a, auto b) { return b < 0 || b > 62 ? 0 : a << b; });
+                    }
+                    else if (accept(">>"))
+                    {
+                        l = apply(l, additive(), [](auto a, auto b) { return b < 0 || b > 62 ? 0 : a >> b; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+
+            Value additive()
+            {
+                auto l = multiplicative();
+                while (true)
+                {
+                    if (accept("+"))
+                    {
+                        l = apply(l, multiplicative(), [](auto a, auto b) { return a + b; });
+                    }
+                    else if (accept("-"))
+                    {
+                        l = apply(l, multiplicative(), [](auto a, auto b) { return a - b; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+
+            Value multiplicative()
+            {
+                auto l = unary();
+                while (true)
+                {
+                    if (accept("*"))
+                    {
+                        l = apply(l, unary(), [](auto a, auto b) { return a * b; });
+                    }
+                    else if (peek() == "/" || peek() == "%")
+                    {
+                        bool divide = peek() == "/";
+                        ++pos_;
+                        auto r = unary();
+                        if (r && *r == 0)
+                        {
+                            l = std::nullopt;
+                            continue;
+                        }
+                        l = apply(l, r, [divide](auto a, auto b) { return divide ? a / b : a % b; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+
+            Value unary()
+            {
+                if (accept("!"))
+                {
+                    auto v = unary();
+                    return v ? Value{!*v} : std::nullopt;
+                }
+                if (accept("-"))
+                {
+                    auto v = unary();
+                    return v ? Value{-*v} : std::nullopt;
+                }
+                if (accept("+"))
+                {
+                    return unary();
+                }
+                if (accept("~"))
+                {
+                    auto v = unary();
+                    return v ? Value{~*v} : std::nullopt;
+                }
+                return primary();
+            }
+
+            void skip_parenthesized()
+            {
+                int level = 0;
+                do
+                {
+                    if (pos_ >= tokens_.size())
+                    {
+                        error_ = true;
+                        return;
+                    }
+                    if (tokens_[pos_] == "(")
+                    {
+                        ++level;
+                    }
+                    else if (tokens_[pos_] == ")")
+                    {
+                        --level;
+                    }
+                    ++pos_;
+                }
+                while (level > 0);
+            }
+
+            static Value parse_number(std::string_view token)
+            {
+                std::int64_t value{0};
+                std::size_t i = 0;
+                int base = 10;
+                if (token.size() > 1 && token[0] == '0' && (token[1] == 'x' || token[1] == 'X'))
+                {
+                    base = 16;
+                    i = 2;
+                }
+                else if (token.size() > 1 && token[0] == '0' && (token[1] == 'b' || token[1] == 'B'))
+                {
+                    base = 2;
+                    i = 2;
+                }
+                else if (token.size() > 1 && token[0] == '0')
+                {
+                    base = 8;
+                    i = 1;
+                }
+                for (; i < token.size(); ++i)
+                {
+                    char c = token[i];
+                    int digit{};
+                    if (c >= '0' && c <= '9')
+                    {
+                        digit = c - '0';
+                    }
+                    else if (c >= 'a' && c <= 'f' && base == 16)
+                    {
+                        digit = c - 'a' + 10;
+                    }
+                    else if (c >= 'A' && c <= 'F' && base == 16)
+                    {
+                        digit = c - 'A' + 10;
+                    }
+                    else if (c == '\'')
+                    {
+                        continue;
+                    }
+                    else
+                    {
+                        break;
+                    }
+                    if (digit >= base)
+                    {
+                        return std::nullopt;
+                    }
+                    value = value * base + digit;
+                }
+                // Only integer suffixes may follow; anything else (e.g. a float) is not a valid #if operand.
+                for (; i < token.size(); ++i)
+                {
+                    char c = token[i];
+                    if (c != 'u' && c != 'U' && c != 'l' && c != 'L' && c != 'z' && c != 'Z')
+                    {
+                        return std::nullopt;
+                    }
+                }
+                return value;
+            }
+
+            Value primary()
+            {
+                if (accept("("))
+                {
+                    auto value = conditional();
+                    expect(")");
+                    return value;
+                }
+                auto token = peek();
+                if (token.empty())
+                {
+                    error_ = true;
+                    return std::nullopt;
+                }
+                ++pos_;
+                if (token[0] >= '0' && token[0] <= '9')
+                {
+                    return parse_number(token);
+                }
+                if (!is_identifier_start(token[0]))
+                {
+                    // Character literals and stray punctuation are left to the real preprocessor.
+                    return std::nullopt;
+                }
+                if (token == "defined")
+                {
+                    bool parenthesized = accept("(");
+                    auto name = peek();
+                    ++pos_;
+                    if (parenthesized)
+                    {
+                        expect(")");
+                    }
+                    switch (is_defined(macros_, name))
+                    {
+                        case Tristate::True:
+                            return 1;
+                        case Tristate::False:
+                            return 0;
+                        default:
+                            return std::nullopt;
+                    }
+                }
+                if (token == "true")
+                {
+                    return 1;
+                }
+                if (token == "false")
+                {
+                    return 0;
+                }
+                if (peek() == "(")
+                {
+                    // Function-like macros and __has_include & co.
+                    skip_parenthesized();
+                    return std::nullopt;
+                }
+                if (auto iter = macros_.defined.find(token); iter != macros_.defined.end())
+                {
+                    if (iter->second.empty() || depth_ > 16)
+                    {
+                        return std::nullopt;
+                    }
+                    return ExpressionEvaluator(tokenize_expression(iter->second), macros_, depth_ + 1).evaluate();
+                }
+                if (macros_.undefined.find(token) != macros_.undefined.end())
+                {
+                    return 0;
+                }
+                return std::nullopt;
+            }
+        };
+    } // namespace detail
+
+    // Evaluates the expression of an #if / #elif; Unknown when it depends on macros outside of `macros`.
+    inline Tristate evaluate_condition(std::string_view expr, const MacroSet& macros)
+    {
+        auto value = detail::ExpressionEvaluator(detail::tokenize_expression(expr), macros, 0).evaluate();
+        if (!value)
+        {
+            return Tristate::Unknown;
+        }
+        return *value ? Tristate::True : Tristate::False;
+    }
+
+    // How a conditional directive line has to appear in the output.
+    enum class DirectiveEmit : std::uint8_t
+    {
+        Drop,
+        Verbatim,
+        AsIf,   // an #elif that now opens the chain
+        AsElse, // a known-true #elif after branches that stayed in the output
+    };
+
+    // Tracks #if/#elif/#else/#endif nesting. A region is live when its lines are kept, and certain when it is kept
+    // unconditionally (no enclosing conditional is left in the output).
+    class ConditionalStack
+    {
+    public:
+        bool live() const { return frames_.empty() || frames_.back().live; }
+        bool certain() const { return frames_.empty() || (frames_.back().live && frames_.back().certain); }
+        std::size_t depth() const { return frames_.size(); }
+
+        // `verbatim` keeps the directive in the output even when its condition is known to be true.
+        DirectiveEmit on_if(Tristate cond, bool verbatim = false)
+        {
+            Frame frame{};
+            frame.parent_live = live();
+            frame.parent_certain = certain();
+            if (!frame.parent_live)
+            {
+                frames_.push_back(frame);
+                return DirectiveEmit::Drop;
+            }
+            switch (cond)
+            {
+                case Tristate::True:
+                    frame.live = true;
+                    frame.resolved = true;
+                    frame.certain = frame.parent_certain;
+                    frame.open = verbatim;
+                    break;
+                case Tristate::False:
+                    break;
+                default:
+                    frame.live = true;
+                    frame.open = true;
+                    break;
+            }
+            frames_.push_back(frame);
+            return frame.open ? DirectiveEmit::Verbatim : DirectiveEmit::Drop;
+        }
+
+        DirectiveEmit on_elif(Tristate cond)
+        {
+            if (frames_.empty())
+            {
+                return DirectiveEmit::Verbatim;
+            }
+            auto& frame = frames_.back();
+            if (!frame.parent_live || frame.resolved || cond == Tristate::False)
+            {
+                frame.live = false;
+                return DirectiveEmit::Drop;
+            }
+            frame.live = true;
+            if (cond == Tristate::True)
+            {
+                frame.resolved = true;
+                frame.certain = !frame.open && frame.parent_certain;
+                return frame.open ? DirectiveEmit::AsElse : DirectiveEmit::Drop;
+            }
+            frame.certain = false;
+            if (frame.open)
+            {
+                return DirectiveEmit::Verbatim;
+            }
+            frame.open = true;
+            return DirectiveEmit::AsIf;
+        }
+
+        DirectiveEmit on_else()
+        {
+            auto emit = on_elif(Tristate::True);
+            return emit == DirectiveEmit::AsElse ? DirectiveEmit::Verbatim : emit;
+        }
+
+        DirectiveEmit on_endif()
+        {
+            if (frames_.empty())
+            {
+                return DirectiveEmit::Verbatim;
+            }
+            auto frame = frames_.back();
+            frames_.pop_back();
+            return frame.parent_live && frame.open ? DirectiveEmit::Verbatim : DirectiveEmit::Drop;
+        }
+
+    private:
+        struct Frame
+        {
+            bool parent_live{};
+            bool parent_certain{};
+            bool live{};
+            bool certain{};
+            bool resolved{}; // an earlier branch of the chain was taken for sure
+            bool open{};     // the chain has a directive in the output and needs its #endif
+        };
+        std::vector<Frame> frames_{};
+    };
+} // namespace sopho
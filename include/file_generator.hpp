@@ -1,4 +1,6 @@
 #pragma once
+#include <algorithm>
+#include <cerrno>
 #include <cstdint>
 #include <deque>
 #include <filesystem>
@@ -6,11 +8,22 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <set>
+#include <sstream>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
 #include "diag.hpp"
+#include "directive.hpp"
+#include "static_string.hpp"
 namespace sopho
 {
 
@@ -70,6 +83,11 @@ namespace sopho
         return sv.size() >= prefix.size() && sv.compare(0, prefix.size(), prefix) == 0;
     }
 
+    std::int64_t file_mtime(const std::filesystem::path& fs_path)
+    {
+        return static_cast<std::int64_t>(std::filesystem::last_write_time(fs_path).time_since_epoch().count());
+    }
+
     struct FileEntry
     {
         std::string name{};
@@ -98,42 +116,462 @@ namespace sopho
         FileEntry entry{};
         entry.name = fs_path.filename().string();
         entry.size = file_content.size();
-        entry.hash = std::hash<std::string>{}(file_content);
+        entry.hash = fnv1a(file_content);
         entry.content = std::make_unique<std::string>(std::move(file_content));
 
         return entry;
     }
 
+    // One input of the generator as recorded in the manifest next to the output.
+    struct ManifestEntry
+    {
+        std::string path{};
+        std::uint64_t size{};
+        std::int64_t mtime{};
+        std::uint64_t hash{};
+    };
+
+    struct GeneratorOptions
+    {
+        std::filesystem::path output{"sob.hpp"};
+        // Resolve #if/#ifdef/#elif/#else/#endif against `macros` and drop dead branches. Conditions on macros that are
+        // neither defined nor undefined in `macros` stay in the output untouched.
+        bool evaluate_directives{false};
+        MacroSet macros{};
+        // Consumer-optimized output: unconditional system includes are hoisted into one sorted prelude, comments,
+        // blank lines and file markers are stripped, and #line directives map the remaining lines back to their
+        // sources. Hoisting assumes no system header depends on macros defined by the amalgamated files.
+        bool compact{false};
+        // How many source lines compact output may run behind its sources before a #line resynchronizes them. Every
+        // stripped gap would otherwise cost a directive, more lines than the readable output, which drops blank lines
+        // without one. 0 keeps every line exact; with the default, diagnostics point at most 2 lines early.
+        std::size_t line_slack{2};
+    };
+
+    struct GeneratorReport
+    {
+        std::uint64_t readable_lines{};
+        std::uint64_t readable_bytes{};
+        std::uint64_t output_lines{};
+        std::uint64_t output_bytes{};
+    };
+
     struct Context
     {
-        std::filesystem::path include_path{};
+        std::vector<std::filesystem::path> include_paths{};
         std::deque<std::string> file_content{};
         std::set<FileEntry> file_entries{};
         std::set<std::string> std_header{};
+        std::vector<ManifestEntry> inputs{};
+        bool evaluate_directives{false};
+        MacroSet macros{};
+        ConditionalStack conditionals{};
+        std::set<std::string, std::less<>> include_guards{};
+        bool compact{false};
+        std::size_t line_slack{};
+        std::string line_file{};
+        std::size_t next_line{};
+        GeneratorReport report{};
+    };
+
+    std::string_view read_identifier(std::string_view sv)
+    {
+        sv = ltrim(sv);
+        std::size_t i = 0;
+        while (i < sv.size() && detail::is_identifier_char(sv[i]))
+        {
+            ++i;
+        }
+        return sv.substr(0, i);
+    }
+
+    // Splits "#  keyword rest" into keyword and rest; the keyword is empty for non-directive lines.
+    std::pair<std::string_view, std::string_view> split_directive(std::string_view line)
+    {
+        auto line_content = ltrim(line);
+        if (line_content.empty() || line_content[0] != '#')
+        {
+            return {};
+        }
+        auto keyword = read_identifier(line_content.substr(1));
+        auto rest = ltrim(line_content.substr(1));
+        return {keyword, ltrim(rest.substr(keyword.size()))};
+    }
+
+    // Resolves an #include: quoted names relative to the including file first, then each include path in order.
+    // Returns nullopt when nothing matches, e.g. for system headers that live outside of `include_paths`.
+    std::optional<std::filesystem::path> resolve_include(const std::filesystem::path& including_file,
+                                                         std::string_view name, bool quoted,
+                                                         const std::vector<std::filesystem::path>& include_paths)
+    {
+        std::error_code ec{};
+        if (quoted)
+        {
+            auto candidate = including_file.parent_path() / name;
+            if (std::filesystem::is_regular_file(candidate, ec))
+            {
+                return candidate;
+            }
+        }
+        for (const auto& include_path : include_paths)
+        {
+            auto candidate = include_path / name;
+            if (std::filesystem::is_regular_file(candidate, ec))
+            {
+                return candidate;
+            }
+        }
+        return std::nullopt;
+    }
+
+    struct IncludeGuard
+    {
+        std::string_view name{};
+        std::size_t if_line{};
     };
 
+    // Recognizes the classic "#ifndef X / #define X ... #endif" guard spanning the whole file, ignoring blank lines
+    // and comments around it.
+    std::optional<IncludeGuard> detect_include_guard(const std::vector<std::string_view>& lines)
+    {
+        std::vector<std::size_t> significant{};
+        bool in_comment = false;
+        for (std::size_t i = 0; i < lines.size(); ++i)
+        {
+            auto line_content = ltrim(lines[i]);
+            if (in_comment)
+            {
+                in_comment = line_content.find("*/") == std::string_view::npos;
+                continue;
+            }
+            if (line_content.empty() || starts_with(line_content, "//"))
+            {
+                continue;
+            }
+            if (starts_with(line_content, "/*"))
+            {
+                in_comment = line_content.find("*/", 2) == std::string_view::npos;
+                continue;
+            }
+            significant.push_back(i);
+        }
+        if (significant.size() < 3)
+        {
+            return std::nullopt;
+        }
+        auto [if_keyword, if_rest] = split_directive(lines[significant[0]]);
+        auto [define_keyword, define_rest] = split_directive(lines[significant[1]]);
+        auto name = read_identifier(if_rest);
+        if (if_keyword != "ifndef" || define_keyword != "define" || name.empty() ||
+            read_identifier(define_rest) != name)
+        {
+            return std::nullopt;
+        }
+        // The #endif matching the guard has to be the last significant line, with no #else/#elif on the guard level.
+        std::size_t depth = 0;
+        for (std::size_t k = 0; k < significant.size(); ++k)
+        {
+            auto keyword = split_directive(lines[significant[k]]).first;
+            if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef")
+            {
+                ++depth;
+            }
+            else if (depth == 1 && (starts_with(keyword, "el")))
+            {
+                return std::nullopt;
+            }
+            else if (keyword == "endif" && --depth == 0)
+            {
+                if (k + 1 != significant.size())
+                {
+                    return std::nullopt;
+                }
+                return IncludeGuard{name, significant[0]};
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Feeds one conditional directive to context.conditionals and returns the line to emit, or nullopt to drop it.
+    std::optional<std::string_view> handle_conditional(std::string_view line, std::string_view keyword,
+                                                       std::string_view rest, bool is_guard, Context& context)
+    {
+        bool evaluate = context.evaluate_directives && !line.empty() && line.back() != '\\';
+        auto condition = [&]() -> Tristate
+        {
+            if (!evaluate)
+            {
+                return Tristate::Unknown;
+            }
+            if (keyword == "if" || keyword == "elif")
+            {
+                return evaluate_condition(rest, context.macros);
+            }
+            auto defined = is_defined(context.macros, read_identifier(rest));
+            bool negate = keyword == "ifndef" || keyword == "elifndef";
+            if (defined == Tristate::Unknown || !negate)
+            {
+                return defined;
+            }
+            return defined == Tristate::True ? Tristate::False : Tristate::True;
+        };
+
+        DirectiveEmit emit{};
+        if (is_guard)
+        {
+            // A guard seen for the first time is entered for sure unless the user defined its macro.
+            auto defined = is_defined(context.macros, read_identifier(rest)) == Tristate::True;
+            emit = context.conditionals.on_if(defined ? Tristate::False : Tristate::True, !context.evaluate_directives);
+        }
+        else if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef")
+        {
+            emit = context.conditionals.on_if(condition());
+        }
+        else if (keyword == "elif" || keyword == "elifdef" || keyword == "elifndef")
+        {
+            emit = context.conditionals.on_elif(condition());
+        }
+        else if (keyword == "else")
+        {
+            emit = context.conditionals.on_else();
+        }
+        else
+        {
+            emit = context.conditionals.on_endif();
+        }
+
+        switch (emit)
+        {
+            case DirectiveEmit::Verbatim:
+                return line;
+            case DirectiveEmit::AsIf:
+                return context.file_content.emplace_back("#" + std::string(keyword.substr(2)) + " " +
+                                                         std::string(rest));
+            case DirectiveEmit::AsElse:
+                return std::string_view{"#else"};
+            default:
+                return std::nullopt;
+        }
+    }
+
+    void handle_define(std::string_view keyword, std::string_view rest, Context& context)
+    {
+        if (!context.evaluate_directives)
+        {
+            return;
+        }
+        auto name = read_identifier(rest);
+        if (!context.conditionals.certain())
+        {
+            context.macros.forget(name);
+        }
+        else if (keyword == "undef")
+        {
+            context.macros.undefine(name);
+        }
+        else
+        {
+            auto value = rest.substr(name.size());
+            // Function-like macros are only tracked for defined(); their expansion is left to the compiler.
+            context.macros.define(name, starts_with(value, "(") ? std::string_view{} : ltrim(value));
+        }
+    }
+
+    // Lexer state carried from one line to the next while stripping comments in compact mode.
+    struct CommentStripper
+    {
+        bool in_block_comment{false};
+        std::string raw_terminator{}; // ")delim\"" while inside a multi-line raw string literal
+
+        // Returns `line` itself when nothing had to be removed, otherwise the stripped text kept alive in `storage`.
+        std::string_view strip(std::string_view line, std::deque<std::string>& storage)
+        {
+            std::string out{};
+            bool stripped = false;
+            std::size_t copy_from = 0;
+            std::size_t i = 0;
+            while (i < line.size())
+            {
+                if (in_block_comment)
+                {
+                    auto end = line.find("*/", i);
+                    in_block_comment = end == std::string_view::npos;
+                    i = in_block_comment ? line.size() : end + 2;
+                    copy_from = i;
+                    if (!in_block_comment && !out.empty())
+                    {
+                        out += ' ';
+                    }
+                    continue;
+                }
+                if (!raw_terminator.empty())
+                {
+                    auto end = line.find(raw_terminator, i);
+                    i = end == std::string_view::npos ? line.size() : end + raw_terminator.size();
+                    if (end != std::string_view::npos)
+                    {
+                        raw_terminator.clear();
+                    }
+                    continue;
+                }
+                char c = line[i];
+                if (c == '/' && i + 1 < line.size() && (line[i + 1] == '/' || line[i + 1] == '*'))
+                {
+                    out.append(line.substr(copy_from, i - copy_from));
+                    stripped = true;
+                    if (line[i + 1] == '/')
+                    {
+                        copy_from = i = line.size();
+                        break;
+                    }
+                    in_block_comment = true;
+                    i += 2;
+                    copy_from = i;
+                }
+                else if (c == '"' && i > 0 && line[i - 1] == 'R' &&
+                         (i < 2 || !detail::is_identifier_char(line[i - 2]) || line.substr(0, i).ends_with("u8R") ||
+                          line[i - 2] == 'u' || line[i - 2] == 'U' || line[i - 2] == 'L'))
+                {
+                    auto open = line.find('(', i);
+                    if (open == std::string_view::npos)
+                    {
+                        break;
+                    }
+                    raw_terminator = ")" + std::string(line.substr(i + 1, open - i - 1)) + "\"";
+                    i = open + 1;
+                }
+                else if (c == '"' || c == '\'')
+                {
+                    // A quote right after the digits of a number is a digit separator (1'000), not a literal.
+                    std::size_t start = i;
+                    while (start > 0 && (detail::is_identifier_char(line[start - 1]) || line[start - 1] == '\''))
+                    {
+                        --start;
+                    }
+                    if (c == '\'' && start < i && line[start] >= '0' && line[start] <= '9')
+                    {
+                        ++i;
+                        continue;
+                    }
+                    ++i;
+                    while (i < line.size() && line[i] != c)
+                    {
+                        i += line[i] == '\\' ? 2 : 1;
+                    }
+                    i = std::min(i + 1, line.size());
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+            if (!stripped && copy_from == 0)
+            {
+                return line;
+            }
+            out.append(line.substr(std::min(copy_from, line.size())));
+            while (!out.empty() && (out.back() == ' ' || out.back() == '\t'))
+            {
+                out.pop_back();
+            }
+            if (ltrim(out).empty())
+            {
+                return {};
+            }
+            return storage.emplace_back(std::move(out));
+        }
+    };
+
+    // Generated lines such as the "// path" markers; they only appear in the readable output.
+    void emit_marker(std::vector<std::string_view>& result, std::string_view text, Context& context)
+    {
+        ++context.report.readable_lines;
+        context.report.readable_bytes += text.size() + 1;
+        if (!context.compact)
+        {
+            result.emplace_back(text);
+        }
+    }
+
+    // Lines taken from `file_path`, with `line_number` counted from 1. Compact output strips their comments and
+    // emits a #line directive when the file changes or the compiler's count would fall more than line_slack lines
+    // behind the source.
+    void emit_line(std::vector<std::string_view>& result, std::string_view text, std::string_view file_path,
+                   std::size_t line_number, CommentStripper& stripper, Context& context)
+    {
+        ++context.report.readable_lines;
+        context.report.readable_bytes += text.size() + 1;
+        if (!context.compact)
+        {
+            result.emplace_back(text);
+            return;
+        }
+        text = stripper.strip(text, context.file_content);
+        if (text.empty())
+        {
+            return;
+        }
+        // next_line is the line the compiler assigns to the next output line.
+        bool in_sync = context.line_file == file_path && line_number >= context.next_line &&
+                       line_number - context.next_line <= context.line_slack;
+        if (!in_sync)
+        {
+            std::string directive = "#line " + std::to_string(line_number) + " \"";
+            for (char c : file_path)
+            {
+                if (c == '\\' || c == '"')
+                {
+                    directive += '\\';
+                }
+                directive += c;
+            }
+            directive += '"';
+            result.emplace_back(context.file_content.emplace_back(std::move(directive)));
+            context.line_file = file_path;
+            context.next_line = line_number;
+        }
+        result.emplace_back(text);
+        ++context.next_line;
+    }
 
     std::vector<std::string_view> collect_file(std::string_view file_path, Context& context)
     {
+        SOPHO_STACK();
         std::vector<std::string_view> result{};
 
-        std::string file_name_comment = "// " + std::string(file_path);
-        auto& comment = context.file_content.emplace_back(file_name_comment);
-        result.emplace_back(comment);
-
         std::filesystem::path fs_path = file_path;
         SOPHO_ASSERT(std::filesystem::exists(fs_path), "file not exist ", fs_path.string());
+        auto mtime = file_mtime(fs_path);
         auto [iter, inserted] = context.file_entries.emplace(make_entry(fs_path));
 
         if (!inserted)
         {
             return {};
         }
+        context.inputs.emplace_back(ManifestEntry{fs_path.string(), iter->size, mtime, iter->hash});
 
         auto lines = split_lines(std::string_view(*iter->content));
 
-        for (const auto& line : lines)
+        auto guard = detect_include_guard(lines);
+        if (guard)
+        {
+            if (context.include_guards.find(guard->name) != context.include_guards.end())
+            {
+                return {};
+            }
+            context.include_guards.emplace(guard->name);
+        }
+
+        std::string file_name_comment = "// " + std::string(file_path);
+        auto& comment = context.file_content.emplace_back(file_name_comment);
+        emit_marker(result, comment, context);
+        CommentStripper stripper{};
+        auto emit = [&](std::string_view text, std::size_t line_index)
+        { emit_line(result, text, file_path, line_index + 1, stripper, context); };
+
+        for (std::size_t line_index = 0; line_index < lines.size(); ++line_index)
         {
+            const auto& line = lines[line_index];
             auto line_content = ltrim(line);
             if (line_content.length() == 0)
             {
@@ -141,7 +579,25 @@ namespace sopho
             }
             if (line_content[0] != '#')
             {
-                result.emplace_back(line);
+                if (context.conditionals.live())
+                {
+                    emit(line, line_index);
+                }
+                continue;
+            }
+            auto [keyword, rest] = split_directive(line);
+            if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef" || keyword == "elif" ||
+                keyword == "elifdef" || keyword == "elifndef" || keyword == "else" || keyword == "endif")
+            {
+                bool is_guard = guard && guard->if_line == line_index;
+                if (auto emitted = handle_conditional(line, keyword, rest, is_guard, context))
+                {
+                    emit(*emitted, line_index);
+                }
+                continue;
+            }
+            if (!context.conditionals.live())
+            {
                 continue;
             }
             line_content = line_content.substr(1);
@@ -160,8 +616,19 @@ namespace sopho
                     {
                         continue;
                     }
-                    context.std_header.emplace(file_name);
-                    result.emplace_back(line);
+                    // A header included under a condition may still be needed unconditionally later on.
+                    if (context.conditionals.certain())
+                    {
+                        context.std_header.emplace(file_name);
+                        if (context.compact)
+                        {
+                            // Counted as readable output here, emitted with the prelude.
+                            ++context.report.readable_lines;
+                            context.report.readable_bytes += line.size() + 1;
+                            continue;
+                        }
+                    }
+                    emit(line, line_index);
                     continue;
                 }
                 else if (line_content[0] == '"')
@@ -170,18 +637,21 @@ namespace sopho
                     auto index = line_content.find('"');
                     SOPHO_ASSERT(index != std::string_view::npos, "find \" failed");
                     std::string file_name{line_content.substr(0, index)};
-                    std::filesystem::path new_fs_path = fs_path.parent_path() / file_name;
-                    if (!std::filesystem::exists(new_fs_path))
+                    auto resolved = resolve_include(fs_path, file_name, true, context.include_paths);
+                    if (!resolved && !context.conditionals.certain())
                     {
-                        new_fs_path = context.include_path / file_name;
+                        // Left to the compiler, e.g. a platform header that only exists where its branch is taken.
+                        emit(line, line_index);
+                        continue;
                     }
+                    std::filesystem::path new_fs_path = resolved ? *resolved : fs_path.parent_path() / file_name;
                     auto file_content = collect_file(std::string_view(new_fs_path.string()), context);
                     result.insert(result.end(), file_content.begin(), file_content.end());
-                    result.emplace_back(comment);
+                    emit_marker(result, comment, context);
                 }
                 else
                 {
-                    result.emplace_back(line);
+                    emit(line, line_index);
                 }
             }
             else if (starts_with(line_content, "pragma"))
@@ -192,32 +662,319 @@ namespace sopho
                 {
                     continue;
                 }
-                result.emplace_back(line);
+                emit(line, line_index);
             }
             else
             {
-                result.emplace_back(line);
+                if (keyword == "define" || keyword == "undef")
+                {
+                    handle_define(keyword, rest, context);
+                }
+                emit(line, line_index);
             }
         }
         return result;
     }
 
-    void single_header_generator(std::string_view file_path)
+    constexpr std::string_view manifest_magic{"sob-manifest 2"};
+
+    struct Manifest
+    {
+        std::uint64_t options{};
+        std::vector<ManifestEntry> entries{};
+    };
+
+    // Manifest layout: a magic line, the fingerprint of the generator options, then one "size mtime hash path" line
+    // per file. The first entry describes the output itself so that a hand-edited or deleted output is regenerated.
+    Manifest read_manifest(const std::filesystem::path& manifest_path)
+    {
+        Manifest manifest{};
+        std::ifstream in(manifest_path, std::ios::binary);
+        if (!in.is_open())
+        {
+            return manifest;
+        }
+        std::string line{};
+        if (!std::getline(in, line) || line != manifest_magic || !(in >> manifest.options) || in.get() != '\n')
+        {
+            return {};
+        }
+        while (std::getline(in, line))
+        {
+            std::istringstream ss(line);
+            ManifestEntry entry{};
+            if (!(ss >> entry.size >> entry.mtime >> entry.hash) || ss.get() != ' ' || !std::getline(ss, entry.path))
+            {
+                return {};
+            }
+            manifest.entries.emplace_back(std::move(entry));
+        }
+        return manifest;
+    }
+
+    void write_manifest(const std::filesystem::path& manifest_path, const Manifest& manifest)
+    {
+        auto tmp_path = manifest_path;
+        tmp_path += ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            SOPHO_ASSERT(out.is_open(), "open file failed, file name:", tmp_path.string());
+            out << manifest_magic << '\n' << manifest.options << '\n';
+            for (const auto& entry : manifest.entries)
+            {
+                out << entry.size << ' ' << entry.mtime << ' ' << entry.hash << ' ' << entry.path << '\n';
+            }
+        }
+        std::filesystem::rename(tmp_path, manifest_path);
+    }
+
+    std::uint64_t options_fingerprint(const GeneratorOptions& options)
+    {
+        std::string text{options.evaluate_directives ? "evaluate\n" : "\n"};
+        text += options.compact ? "compact " + std::to_string(options.line_slack) + "\n" : "\n";
+        for (const auto& [name, value] : options.macros.defined)
+        {
+            text += "D" + name + "=" + value + "\n";
+        }
+        for (const auto& name : options.macros.undefined)
+        {
+            text += "U" + name + "\n";
+        }
+        return fnv1a(text);
+    }
+
+    // Compares size and mtime only, so an unchanged tree is detected without reading any file contents.
+    bool manifest_entry_unchanged(const ManifestEntry& entry)
+    {
+        std::error_code ec{};
+        std::filesystem::path fs_path = entry.path;
+        auto size = std::filesystem::file_size(fs_path, ec);
+        if (ec || size != entry.size)
+        {
+            return false;
+        }
+        auto mtime = std::filesystem::last_write_time(fs_path, ec);
+        return !ec && static_cast<std::int64_t>(mtime.time_since_epoch().count()) == entry.mtime;
+    }
+
+    // Fallback for touched files: the inputs only count as changed if their contents differ.
+    bool manifest_entry_same_content(const ManifestEntry& entry)
+    {
+        std::error_code ec{};
+        std::filesystem::path fs_path = entry.path;
+        if (std::filesystem::file_size(fs_path, ec) != entry.size || ec)
+        {
+            return false;
+        }
+        return fnv1a(read_file(fs_path)) == entry.hash;
+    }
+
+    ManifestEntry make_output_entry(const std::filesystem::path& fs_path)
+    {
+        auto content = read_file(fs_path);
+        return ManifestEntry{fs_path.string(), content.size(), file_mtime(fs_path), fnv1a(content)};
+    }
+
+    // Turns output lines into as few contiguous segments as possible. Every line views a NUL-terminated buffer (a
+    // source file, a generated marker or a literal), so a line still followed by its '\n' in that buffer is emitted
+    // together with it, and runs of untouched source lines collapse into a single segment.
+    std::vector<std::string_view> gather_segments(const std::vector<std::string_view>& lines)
+    {
+        static constexpr std::string_view newline{"\n"};
+        std::vector<std::string_view> segments{};
+        for (auto sv : lines)
+        {
+            bool has_newline = sv.data()[sv.size()] == '\n';
+            if (!segments.empty() && segments.back().data() + segments.back().size() == sv.data() &&
+                segments.back().data() != newline.data())
+            {
+                auto& last = segments.back();
+                last = std::string_view{last.data(), last.size() + sv.size() + (has_newline ? 1 : 0)};
+            }
+            else
+            {
+                segments.emplace_back(sv.data(), sv.size() + (has_newline ? 1 : 0));
+            }
+            if (!has_newline)
+            {
+                segments.emplace_back(newline);
+            }
+        }
+        return segments;
+    }
+
+    bool output_matches(const std::filesystem::path& fs_path, const std::vector<std::string_view>& segments)
+    {
+        std::error_code ec{};
+        auto size = std::filesystem::file_size(fs_path, ec);
+        if (ec)
+        {
+            return false;
+        }
+        std::uint64_t expected_size{0};
+        for (auto sv : segments)
+        {
+            expected_size += sv.size();
+        }
+        if (size != expected_size)
+        {
+            return false;
+        }
+        auto content = read_file(fs_path);
+        std::string_view rest{content};
+        for (auto sv : segments)
+        {
+            if (rest.compare(0, sv.size(), sv) != 0)
+            {
+                return false;
+            }
+            rest.remove_prefix(sv.size());
+        }
+        return true;
+    }
+
+    // Writes the segments to a temporary file next to `fs_path` and renames it into place, so readers never observe
+    // a partially written output.
+    void write_segments_atomic(const std::filesystem::path& fs_path, const std::vector<std::string_view>& segments)
+    {
+        SOPHO_STACK();
+        auto tmp_path = fs_path;
+        tmp_path += ".tmp";
+        SOPHO_VALUE(tmp_path);
+#if defined(_WIN32)
+        std::size_t total_size{0};
+        for (auto sv : segments)
+        {
+            total_size += sv.size();
+        }
+        std::string buffer{};
+        buffer.reserve(total_size);
+        for (auto sv : segments)
+        {
+            buffer.append(sv);
+        }
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            SOPHO_ASSERT(out.is_open(), "open file failed");
+            out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            SOPHO_ASSERT(out.good(), "write file failed");
+        }
+#else
+#if defined(IOV_MAX)
+        constexpr std::size_t max_iov = IOV_MAX;
+#else
+        constexpr std::size_t max_iov = 1024;
+#endif
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        SOPHO_ASSERT(fd >= 0, "open file failed");
+        std::vector<iovec> iovs{};
+        iovs.reserve(segments.size());
+        for (auto sv : segments)
+        {
+            iovs.push_back(iovec{const_cast<char*>(sv.data()), sv.size()});
+        }
+        std::size_t index{0};
+        while (index < iovs.size())
+        {
+            auto count = std::min(iovs.size() - index, max_iov);
+            auto written = ::writev(fd, iovs.data() + index, static_cast<int>(count));
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            SOPHO_ASSERT(written >= 0, "writev failed, errno:", errno);
+            // Skip fully written buffers and trim a partially written one.
+            auto remaining = static_cast<std::size_t>(written);
+            while (index < iovs.size() && remaining >= iovs[index].iov_len)
+            {
+                remaining -= iovs[index].iov_len;
+                ++index;
+            }
+            if (remaining > 0)
+            {
+                iovs[index].iov_base = static_cast<char*>(iovs[index].iov_base) + remaining;
+                iovs[index].iov_len -= remaining;
+            }
+        }
+        SOPHO_ASSERT(::close(fd) == 0, "close file failed, errno:", errno);
+#endif
+        std::filesystem::rename(tmp_path, fs_path);
+    }
+
+    void single_header_generator(std::string_view file_path, const GeneratorOptions& options = {})
     {
         SOPHO_STACK();
         Context context{};
         std::filesystem::path fs_path = file_path;
         SOPHO_VALUE(fs_path);
         SOPHO_ASSERT(std::filesystem::exists(fs_path), "file not exist");
-        context.include_path = fs_path.parent_path();
+        const auto& out_path = options.output;
+        auto manifest_path = out_path;
+        manifest_path += ".manifest";
+
+        auto manifest = read_manifest(manifest_path);
+        auto& entries = manifest.entries;
+        bool same_options = manifest.options == options_fingerprint(options);
+        if (same_options && !entries.empty() && std::all_of(entries.begin(), entries.end(), manifest_entry_unchanged))
+        {
+            return;
+        }
+        if (same_options && !entries.empty() &&
+            std::all_of(entries.begin(), entries.end(), manifest_entry_same_content))
+        {
+            for (auto& entry : entries)
+            {
+                entry.mtime = file_mtime(entry.path);
+            }
+            write_manifest(manifest_path, manifest);
+            return;
+        }
+
+        context.include_paths = {fs_path.parent_path()};
+        context.evaluate_directives = options.evaluate_directives;
+        context.macros = options.macros;
+        context.compact = options.compact;
+        context.line_slack = options.line_slack;
         auto lines = collect_file(file_path, context);
-        std::ofstream out("sob.hpp", std::ios::binary);
-        SOPHO_ASSERT(out.is_open(), "open file failed");
+        if (context.compact)
+        {
+            std::vector<std::string_view> prelude{};
+            for (const auto& header : context.std_header)
+            {
+                prelude.emplace_back(context.file_content.emplace_back("#include <" + header + ">"));
+            }
+            lines.insert(lines.begin(), prelude.begin(), prelude.end());
+        }
 
-        for (auto sv : lines)
+        auto segments = gather_segments(lines);
+        if (!output_matches(out_path, segments))
         {
-            out.write(sv.data(), sv.size());
-            out.put('\n');
+            write_segments_atomic(out_path, segments);
         }
+
+        if (context.compact)
+        {
+            auto& report = context.report;
+            report.output_lines = lines.size();
+            for (auto sv : segments)
+            {
+                report.output_bytes += sv.size();
+            }
+            auto percent = [](std::uint64_t before, std::uint64_t after)
+            {
+                auto change = before == 0 ? 0 : static_cast<std::int64_t>(after * 100 / before) - 100;
+                return (change > 0 ? "+" : "") + std::to_string(change) + "%";
+            };
+            std::cout << "single header " << out_path.string() << ": " << report.readable_lines << " -> "
+                      << report.output_lines << " lines (" << percent(report.readable_lines, report.output_lines)
+                      << "), " << report.readable_bytes << " -> " << report.output_bytes << " bytes ("
+                      << percent(report.readable_bytes, report.output_bytes) << ")" << std::endl;
+        }
+
+        manifest.options = options_fingerprint(options);
+        entries.clear();
+        entries.emplace_back(make_output_entry(out_path));
+        entries.insert(entries.end(), context.inputs.begin(), context.inputs.end());
+        write_manifest(manifest_path, manifest);
     }
 } // namespace sopho
@@ -0,0 +1,221 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+#include "diag.hpp"
+#include "file_generator.hpp"
+
+namespace sopho
+{
+    // Identity of a file independent of the spelling of its path (device and inode where available).
+    struct FileIdentity
+    {
+        std::uint64_t device{};
+        std::uint64_t inode{};
+        friend auto operator<=>(const FileIdentity&, const FileIdentity&) = default;
+    };
+
+    struct FileStat
+    {
+        FileIdentity identity{};
+        std::uint64_t size{};
+        std::int64_t mtime{};
+    };
+
+    std::optional<FileStat> stat_file(const std::filesystem::path& fs_path)
+    {
+#if defined(_WIN32)
+        std::error_code ec{};
+        auto canonical = std::filesystem::canonical(fs_path, ec);
+        if (ec || !std::filesystem::is_regular_file(canonical, ec))
+        {
+            return std::nullopt;
+        }
+        FileStat result{};
+        result.identity = FileIdentity{0, fnv1a(canonical.string())};
+        result.size = std::filesystem::file_size(canonical, ec);
+        result.mtime = file_mtime(canonical);
+        return result;
+#else
+        struct stat st{};
+        if (::stat(fs_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            return std::nullopt;
+        }
+        FileStat result{};
+        result.identity = FileIdentity{static_cast<std::uint64_t>(st.st_dev), static_cast<std::uint64_t>(st.st_ino)};
+        result.size = static_cast<std::uint64_t>(st.st_size);
+        result.mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        return result;
+#endif
+    }
+
+    // The named module a translation unit belongs to and the modules it imports. `name` is empty outside of
+    // modules; partitions are spelled "primary:partition". Header units are not tracked.
+    struct ModuleUnit
+    {
+        std::string name{};
+        bool interface{};
+        std::vector<std::string> imports{};
+    };
+
+    // Records an `[export] module name;` or `[export] import name;` line in `unit`; other lines leave it untouched.
+    // The global module fragment ("module;") and the private one ("module :private;") are not declarations.
+    inline void scan_module_line(std::string_view line, ModuleUnit& unit)
+    {
+        auto rest = ltrim(line);
+        auto keyword = read_identifier(rest);
+        bool exported = keyword == "export";
+        if (exported)
+        {
+            rest = ltrim(rest.substr(keyword.size()));
+            keyword = read_identifier(rest);
+        }
+        if (keyword != "module" && keyword != "import")
+        {
+            return;
+        }
+        rest = ltrim(rest.substr(keyword.size()));
+        std::size_t end = 0;
+        while (end < rest.size() && (detail::is_identifier_char(rest[end]) || rest[end] == '.' || rest[end] == ':'))
+        {
+            ++end;
+        }
+        auto name = rest.substr(0, end);
+        if (name.empty() || !starts_with(ltrim(rest.substr(end)), ";"))
+        {
+            return;
+        }
+        if (keyword == "module")
+        {
+            if (name[0] != ':')
+            {
+                unit.name = name;
+                unit.interface = exported;
+            }
+            return;
+        }
+        if (name[0] == ':')
+        {
+            unit.imports.push_back(unit.name.substr(0, unit.name.find(':')) + std::string{name});
+        }
+        else
+        {
+            unit.imports.emplace_back(name);
+        }
+    }
+
+    // In-process replacement for "-MM": follows #include lines to find the headers a source depends on, without a
+    // compiler round-trip. Conditional directives are not evaluated, so a header included under any configuration
+    // counts as a dependency. <...> includes that do not resolve in `include_paths` are system headers and skipped.
+    // The same pass records the module declaration and imports of each file, which stand in for P1689 scanning.
+    //
+    // Direct includes are cached per file identity and revalidated by size and mtime, so repeated queries over an
+    // unchanged tree cost one stat per header and read nothing.
+    class IncludeScanner
+    {
+    public:
+        explicit IncludeScanner(std::vector<std::filesystem::path> include_paths = {}) :
+            include_paths_(std::move(include_paths))
+        {
+        }
+
+        // Transitive header set of `source` in first-seen order, not including `source` itself. Missing quoted
+        // includes are skipped as well; the compiler reports them.
+        std::vector<std::filesystem::path> dependencies(const std::filesystem::path& source)
+        {
+            std::vector<std::filesystem::path> result{};
+            std::set<FileIdentity> visited{};
+            auto source_stat = stat_file(source);
+            SOPHO_ASSERT(source_stat.has_value(), "source not found: ", source.string());
+            visited.insert(source_stat->identity);
+            collect(source, *source_stat, visited, result);
+            return result;
+        }
+
+        // Module declaration and imports of `source` itself; imports in its headers are not followed.
+        ModuleUnit module_unit(const std::filesystem::path& source)
+        {
+            auto source_stat = stat_file(source);
+            SOPHO_ASSERT(source_stat.has_value(), "source not found: ", source.string());
+            return direct_includes(source, *source_stat).module;
+        }
+
+        const std::vector<std::filesystem::path>& include_paths() const { return include_paths_; }
+
+        void clear() { cache_.clear(); }
+
+    private:
+        struct CacheEntry
+        {
+            bool scanned{};
+            std::uint64_t size{};
+            std::int64_t mtime{};
+            std::vector<std::filesystem::path> includes{};
+            ModuleUnit module{};
+        };
+
+        std::vector<std::filesystem::path> include_paths_{};
+        std::map<FileIdentity, CacheEntry> cache_{};
+
+        const CacheEntry& direct_includes(const std::filesystem::path& fs_path, const FileStat& stat)
+        {
+            auto& entry = cache_[stat.identity];
+            if (entry.scanned && entry.size == stat.size && entry.mtime == stat.mtime)
+            {
+                return entry;
+            }
+            entry = CacheEntry{true, stat.size, stat.mtime, {}};
+            auto content = read_file(fs_path);
+            for (auto line : split_lines(content))
+            {
+                auto [keyword, rest] = split_directive(line);
+                if (keyword.empty())
+                {
+                    scan_module_line(line, entry.module);
+                    continue;
+                }
+                if (keyword != "include" || rest.empty() || (rest[0] != '"' && rest[0] != '<'))
+                {
+                    continue;
+                }
+                bool quoted = rest[0] == '"';
+                auto end = rest.find(quoted ? '"' : '>', 1);
+                if (end == std::string_view::npos)
+                {
+                    continue;
+                }
+                if (auto resolved = resolve_include(fs_path, rest.substr(1, end - 1), quoted, include_paths_))
+                {
+                    entry.includes.emplace_back(std::move(*resolved));
+                }
+            }
+            return entry;
+        }
+
+        void collect(const std::filesystem::path& fs_path, const FileStat& stat, std::set<FileIdentity>& visited,
+                     std::vector<std::filesystem::path>& result)
+        {
+            // Entries stay put in the map, and `visited` keeps the recursion from rescanning this one.
+            const auto& includes = direct_includes(fs_path, stat).includes;
+            for (const auto& include : includes)
+            {
+                auto include_stat = stat_file(include);
+                if (!include_stat || !visited.insert(include_stat->identity).second)
+                {
+                    continue;
+                }
+                result.push_back(include);
+                collect(include, *include_stat, visited, result);
+            }
+        }
+    };
+} // namespace sopho
@@ -0,0 +1,504 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#if !defined(_WIN32)
+#include <cerrno>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+#include "diag.hpp"
+#include "jobserver.hpp"
+
+namespace sopho
+{
+    // An output is up to date when it exists and is not older than any of its inputs.
+    inline bool is_up_to_date(const std::filesystem::path& output, const std::vector<std::filesystem::path>& inputs)
+    {
+        std::error_code ec{};
+        auto output_time = std::filesystem::last_write_time(output, ec);
+        if (ec)
+        {
+            return false;
+        }
+        for (const auto& input : inputs)
+        {
+            auto input_time = std::filesystem::last_write_time(input, ec);
+            if (ec || input_time > output_time)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Duration of each job's last successful run, one "seconds key" line per job.
+    class DurationHistory
+    {
+    public:
+        explicit DurationHistory(std::filesystem::path path) : path_(std::move(path))
+        {
+            std::ifstream in(path_);
+            double seconds{};
+            std::string name{};
+            while (in >> seconds && in.get() == ' ' && std::getline(in, name))
+            {
+                seconds_[name] = seconds;
+            }
+        }
+
+        std::optional<double> seconds(std::string_view name) const
+        {
+            auto iter = seconds_.find(name);
+            return iter == seconds_.end() ? std::nullopt : std::optional<double>{iter->second};
+        }
+
+        // Zero for jobs never run, so they start after the known slow ones.
+        double expected_seconds(std::string_view name) const { return seconds(name).value_or(0.0); }
+
+        void record(const std::string& name, double seconds) { seconds_[name] = seconds; }
+
+        void save() const
+        {
+            if (path_.has_parent_path())
+            {
+                std::filesystem::create_directories(path_.parent_path());
+            }
+            std::ofstream out(path_);
+            for (const auto& [name, seconds] : seconds_)
+            {
+                out << seconds << ' ' << name << '\n';
+            }
+        }
+
+    private:
+        std::filesystem::path path_{};
+        std::map<std::string, double, std::less<>> seconds_{};
+    };
+
+    // Durations of the jobs of every build, tests aside, from which the pool estimates critical paths. Jobs are keyed
+    // by their first output: job names come from type names, which GCC abbreviates past a length, so two targets
+    // may share one.
+    inline DurationHistory& job_history()
+    {
+        static DurationHistory history{"build/job_durations.txt"};
+        return history;
+    }
+
+    struct CommandResult
+    {
+        int exit_code{};
+        bool timed_out{};
+    };
+
+    // Runs `command` through the shell. With a non-zero `timeout` the command runs in a process group of its own that
+    // is killed as a whole when the time is up; on Windows the timeout is not enforced.
+    inline CommandResult run_command(const std::string& command, std::chrono::milliseconds timeout = {})
+    {
+#if defined(_WIN32)
+        static_cast<void>(timeout);
+        return CommandResult{std::system(command.data()), false};
+#else
+        if (timeout.count() == 0)
+        {
+            int status = std::system(command.data());
+            return CommandResult{WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status), false};
+        }
+        pid_t pid = ::fork();
+        if (pid == 0)
+        {
+            ::setpgid(0, 0);
+            ::execl("/bin/sh", "sh", "-c", command.data(), static_cast<char*>(nullptr));
+            ::_exit(127);
+        }
+        if (pid < 0)
+        {
+            return CommandResult{-1, false};
+        }
+        // Also set here, so the group exists even if the child has not run yet when the timeout kills it.
+        ::setpgid(pid, pid);
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        int status = 0;
+        while (true)
+        {
+            auto result = ::waitpid(pid, &status, WNOHANG);
+            if (result == pid)
+            {
+                break;
+            }
+            if (result < 0 && errno != EINTR)
+            {
+                return CommandResult{-1, false};
+            }
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                ::kill(-pid, SIGKILL);
+                ::waitpid(pid, &status, 0);
+                return CommandResult{-1, true};
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        }
+        return CommandResult{WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status), false};
+#endif
+    }
+
+    // One command of a build. It runs unless every output is up to date with respect to `inputs`, and only after its
+    // dependencies, which are always jobs added to the pool before it.
+    struct BuildJob
+    {
+        std::string name{};
+        std::string command{};
+        // Runs in-process instead of `command`, which then only describes it; returns whether it succeeded.
+        std::function<bool()> action{};
+        std::vector<std::filesystem::path> inputs{};
+        std::vector<std::filesystem::path> outputs{};
+        std::vector<std::size_t> dependencies{};
+        // Zero for no limit.
+        std::chrono::milliseconds timeout{};
+        std::uint32_t retries{};
+        // The outputs are stamps the pool writes when the command succeeds, and removes before it runs.
+        bool stamp_outputs{};
+        bool test{};
+        // Among ready jobs the one with the longest expected path through its dependents, itself included, starts
+        // first, so the slowest chain of the build is never left for last.
+        double expected_seconds{};
+    };
+
+    enum class JobStatus : std::uint8_t
+    {
+        UpToDate,
+        Succeeded,
+        Failed,
+        TimedOut,
+        Skipped,
+    };
+
+    struct JobResult
+    {
+        std::string name{};
+        // The job's first output, or empty; keys job_history().
+        std::string output{};
+        bool test{};
+        JobStatus status{};
+        int exit_code{};
+        std::uint32_t attempts{};
+        // Measured when the job ran; expected_seconds stands in for it otherwise.
+        double seconds{};
+        double expected_seconds{};
+    };
+
+    // Runs the jobs of any number of build plans on one set of worker threads, so several variants of a target build
+    // side by side instead of one after another. Each job that runs holds a token of the process's jobserver(), which
+    // the first pool to run sizes to its worker count.
+    class JobPool
+    {
+    public:
+        explicit JobPool(std::size_t workers = std::max(1u, std::thread::hardware_concurrency())) :
+            workers_(std::max<std::size_t>(1, workers))
+        {
+        }
+
+        // Returns the index to depend on. A job whose first output an earlier job already produces is not added;
+        // the earlier one is returned, so outputs shared between plans are built once.
+        std::size_t add(BuildJob job)
+        {
+            SOPHO_ASSERT(!job.outputs.empty(), "job ", job.name, " has no outputs");
+            if (auto iter = producers_.find(job.outputs.front()); iter != producers_.end())
+            {
+                const auto& existing = jobs_[iter->second];
+                SOPHO_ASSERT(existing.command == job.command, job.outputs.front().string(),
+                             " is produced by two different commands:\n  ", existing.command, "\n  ", job.command);
+                return iter->second;
+            }
+            for (auto dependency : job.dependencies)
+            {
+                SOPHO_ASSERT(dependency < jobs_.size(), "job ", job.name, " depends on a job not added yet");
+            }
+            producers_.emplace(job.outputs.front(), jobs_.size());
+            jobs_.push_back(std::move(job));
+            return jobs_.size() - 1;
+        }
+
+        std::size_t size() const { return jobs_.size(); }
+
+        const std::vector<JobResult>& results() const { return results_; }
+
+        // Indices into results() of the longest chain of dependent jobs of the last run, first job first. Jobs count
+        // with their measured time when they ran and their expected time otherwise.
+        const std::vector<std::size_t>& critical_path() const { return critical_path_; }
+
+        // Runs every job once its dependencies are done and empties the pool; results() then describes each job in the
+        // order they were added. Jobs depending on a failed one are skipped. Returns whether every job succeeded.
+        bool run()
+        {
+            SOPHO_STACK();
+            auto& tokens = jobserver(workers_);
+            results_.assign(jobs_.size(), JobResult{});
+            std::vector<std::size_t> pending(jobs_.size());
+            std::vector<std::vector<std::size_t>> dependents(jobs_.size());
+            std::vector<bool> failed(jobs_.size());
+            std::deque<std::size_t> ready{};
+            for (std::size_t index = 0; index < jobs_.size(); ++index)
+            {
+                pending[index] = jobs_[index].dependencies.size();
+                for (auto dependency : jobs_[index].dependencies)
+                {
+                    dependents[dependency].push_back(index);
+                }
+                if (pending[index] == 0)
+                {
+                    ready.push_back(index);
+                }
+            }
+            // Dependencies are added before their dependents, so walking backwards sees every dependent first.
+            std::vector<double> priority(jobs_.size());
+            for (std::size_t index = jobs_.size(); index-- > 0;)
+            {
+                double longest = 0;
+                for (auto dependent : dependents[index])
+                {
+                    longest = std::max(longest, priority[dependent]);
+                }
+                priority[index] = jobs_[index].expected_seconds + longest;
+            }
+
+            std::mutex mutex{};
+            std::condition_variable changed{};
+            std::size_t remaining = jobs_.size();
+            bool succeeded = true;
+            auto print = [&mutex](const std::string& name, std::string_view message)
+            {
+                std::lock_guard lock{mutex};
+                std::cout << name << ":" << message << std::endl;
+            };
+
+            auto work = [&](std::size_t worker)
+            {
+                set_thread_name("sob-job-" + std::to_string(worker));
+                SOPHO_STACK();
+                while (true)
+                {
+                    std::size_t index{};
+                    bool skip{};
+                    {
+                        std::unique_lock lock{mutex};
+                        changed.wait(lock, [&] { return !ready.empty() || remaining == 0; });
+                        if (ready.empty())
+                        {
+                            return;
+                        }
+                        auto by_priority = [&priority](std::size_t a, std::size_t b)
+                        { return priority[a] < priority[b]; };
+                        auto next = std::max_element(ready.begin(), ready.end(), by_priority);
+                        index = *next;
+                        ready.erase(next);
+                        const auto& dependencies = jobs_[index].dependencies;
+                        skip = std::any_of(dependencies.begin(), dependencies.end(),
+                                           [&failed](std::size_t dependency) { return failed[dependency]; });
+                    }
+
+                    const auto& job = jobs_[index];
+                    SOPHO_VALUE(job.name);
+                    JobResult result{job.name, {}, job.test, JobStatus::Skipped};
+                    if (!job.outputs.empty())
+                    {
+                        result.output = job.outputs.front().string();
+                    }
+                    result.expected_seconds = job.expected_seconds;
+                    if (skip)
+                    {
+                        print(job.name, "skipped, a dependency failed");
+                    }
+                    else if (std::all_of(job.outputs.begin(), job.outputs.end(),
+                                         [&job](const auto& output) { return is_up_to_date(output, job.inputs); }))
+                    {
+                        result.status = JobStatus::UpToDate;
+                        print(job.name, "up to date");
+                    }
+                    else
+                    {
+                        // Held for every attempt, so an outer make or a sibling build does not oversubscribe.
+                        auto token = tokens.acquire();
+                        run_job(job, result, print);
+                    }
+                    bool ok = result.status == JobStatus::UpToDate || result.status == JobStatus::Succeeded;
+
+                    std::lock_guard lock{mutex};
+                    results_[index] = std::move(result);
+                    failed[index] = !ok;
+                    succeeded = succeeded && ok;
+                    --remaining;
+                    for (auto dependent : dependents[index])
+                    {
+                        if (--pending[dependent] == 0)
+                        {
+                            ready.push_back(dependent);
+                        }
+                    }
+                    changed.notify_all();
+                }
+            };
+
+            std::vector<std::thread> threads{};
+            for (std::size_t worker = 0; worker < std::min(workers_, jobs_.size()); ++worker)
+            {
+                threads.emplace_back(work, worker);
+            }
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+            find_critical_path();
+            jobs_.clear();
+            producers_.clear();
+            return succeeded;
+        }
+
+    private:
+        void find_critical_path()
+        {
+            std::vector<double> finish(jobs_.size());
+            std::vector<std::size_t> previous(jobs_.size());
+            std::size_t last = 0;
+            for (std::size_t index = 0; index < jobs_.size(); ++index)
+            {
+                const auto& result = results_[index];
+                bool ran = result.status != JobStatus::UpToDate && result.status != JobStatus::Skipped;
+                previous[index] = index;
+                double start = 0;
+                for (auto dependency : jobs_[index].dependencies)
+                {
+                    if (finish[dependency] > start)
+                    {
+                        start = finish[dependency];
+                        previous[index] = dependency;
+                    }
+                }
+                finish[index] = start + (ran ? result.seconds : result.expected_seconds);
+                last = finish[index] > finish[last] ? index : last;
+            }
+            critical_path_.clear();
+            if (jobs_.empty())
+            {
+                return;
+            }
+            critical_path_.push_back(last);
+            while (previous[critical_path_.back()] != critical_path_.back())
+            {
+                critical_path_.push_back(previous[critical_path_.back()]);
+            }
+            std::reverse(critical_path_.begin(), critical_path_.end());
+        }
+
+        template <typename Print>
+        static void run_job(const BuildJob& job, JobResult& result, const Print& print)
+        {
+            std::error_code ec{};
+            if (job.stamp_outputs)
+            {
+                for (const auto& output : job.outputs)
+                {
+                    std::filesystem::remove(output, ec);
+                }
+            }
+            auto start = std::chrono::steady_clock::now();
+            CommandResult command_result{};
+            do
+            {
+                if (result.attempts > 0)
+                {
+                    print(job.name, "retrying (attempt " + std::to_string(result.attempts + 1) + ")");
+                }
+                ++result.attempts;
+                print(job.name, job.command);
+                command_result = job.action ? CommandResult{job.action() ? 0 : 1, false}
+                                            : run_command(job.command, job.timeout);
+            }
+            while (command_result.exit_code != 0 && result.attempts <= job.retries);
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            result.exit_code = command_result.exit_code;
+            result.status = command_result.timed_out ? JobStatus::TimedOut
+                            : command_result.exit_code == 0 ? JobStatus::Succeeded
+                                                            : JobStatus::Failed;
+            if (result.status == JobStatus::Succeeded && job.stamp_outputs)
+            {
+                for (const auto& output : job.outputs)
+                {
+                    std::ofstream{output};
+                }
+            }
+            print(job.name, result.status == JobStatus::Succeeded ? "finished"
+                            : result.status == JobStatus::TimedOut ? "timed out"
+                                                                   : "failed");
+        }
+
+        std::size_t workers_{};
+        std::vector<BuildJob> jobs_{};
+        std::map<std::filesystem::path, std::size_t> producers_{};
+        std::vector<JobResult> results_{};
+        std::vector<std::size_t> critical_path_{};
+    };
+
+    // Remembers how long the jobs of the last run took, tests aside, and prints its critical path: the chain of jobs
+    // that bounds the build's wall time however many workers there are, and where splitting a TU pays off. Prints
+    // nothing when no job ran.
+    inline void report_build(const JobPool& pool)
+    {
+        SOPHO_STACK();
+        const auto& results = pool.results();
+        auto& history = job_history();
+        bool ran = false;
+        for (const auto& result : results)
+        {
+            if (result.status == JobStatus::Succeeded && !result.test && !result.output.empty())
+            {
+                history.record(result.output, result.seconds);
+            }
+            ran = ran || (result.status != JobStatus::UpToDate && result.status != JobStatus::Skipped);
+        }
+        if (!ran)
+        {
+            return;
+        }
+        history.save();
+        auto seconds_of = [](const JobResult& result)
+        {
+            bool measured = result.status != JobStatus::UpToDate && result.status != JobStatus::Skipped;
+            return measured ? result.seconds : result.expected_seconds;
+        };
+        double total_seconds = 0;
+        for (auto index : pool.critical_path())
+        {
+            total_seconds += seconds_of(results[index]);
+        }
+        // Formatted apart, so std::cout keeps the caller's precision.
+        std::ostringstream report{};
+        report << "critical path: " << pool.critical_path().size() << " jobs in " << std::fixed
+               << std::setprecision(3) << total_seconds << "s\n";
+        for (auto index : pool.critical_path())
+        {
+            const auto& result = results[index];
+            report << "  " << std::setw(9) << seconds_of(result) << "s " << result.name
+                   << (result.status == JobStatus::UpToDate ? " (up to date)" : "") << "\n";
+        }
+        std::cout << report.str() << std::flush;
+    }
+} // namespace sopho
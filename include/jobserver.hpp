@@ -0,0 +1,304 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#if !defined(_WIN32)
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "diag.hpp"
+
+namespace sopho
+{
+    // Where a GNU make jobserver's tokens are, as advertised in MAKEFLAGS: "--jobserver-auth=fifo:PATH" (make 4.4),
+    // "--jobserver-auth=R,W" or the older "--jobserver-fds=R,W" with inherited pipe descriptors.
+    struct JobserverAuth
+    {
+        std::string fifo{};
+        int read_fd{-1};
+        int write_fd{-1};
+
+        // The last advertisement wins, as in make; nullopt when there is none.
+        static std::optional<JobserverAuth> parse(std::string_view makeflags)
+        {
+            std::optional<JobserverAuth> result{};
+            std::size_t position = 0;
+            while (position < makeflags.size())
+            {
+                auto end = makeflags.find(' ', position);
+                auto word = makeflags.substr(position, end == std::string_view::npos ? end : end - position);
+                position = end == std::string_view::npos ? makeflags.size() : end + 1;
+                std::string_view value{};
+                for (std::string_view option : {"--jobserver-auth=", "--jobserver-fds="})
+                {
+                    if (word.substr(0, option.size()) == option)
+                    {
+                        value = word.substr(option.size());
+                    }
+                }
+                if (value.empty())
+                {
+                    continue;
+                }
+                JobserverAuth auth{};
+                if (value.substr(0, 5) == "fifo:")
+                {
+                    auth.fifo = value.substr(5);
+                    result = auth;
+                    continue;
+                }
+                auto comma = value.find(',');
+                if (comma == std::string_view::npos)
+                {
+                    // "fifo:" is the only other form; Windows semaphore names are not supported.
+                    continue;
+                }
+                auth.read_fd = std::atoi(std::string{value.substr(0, comma)}.data());
+                auth.write_fd = std::atoi(std::string{value.substr(comma + 1)}.data());
+                if (auth.read_fd >= 0 && auth.write_fd >= 0)
+                {
+                    result = auth;
+                }
+            }
+            return result;
+        }
+    };
+
+    // A client of GNU make's jobserver, so an outer make and this build together run at most make's -j jobs, and a
+    // server for the processes this build starts, so sub-makes and nested builds share this build's limit.
+    //
+    // Every process holds one implicit token; each further job in flight holds a one-byte token read from the
+    // jobserver pipe or fifo, and writes the same byte back when it finishes. On Windows, and when no jobserver is
+    // usable, acquire() never blocks and the pool's worker count is the only limit.
+    class Jobserver
+    {
+    public:
+        // A slot to run one job in; destroying it gives the slot back.
+        class Token
+        {
+        public:
+            Token() = default;
+            Token(const Token&) = delete;
+            Token& operator=(const Token&) = delete;
+
+            Token(Token&& other) noexcept :
+                owner_(std::exchange(other.owner_, nullptr)), byte_(other.byte_), implicit_(other.implicit_)
+            {
+            }
+
+            Token& operator=(Token&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    release();
+                    owner_ = std::exchange(other.owner_, nullptr);
+                    byte_ = other.byte_;
+                    implicit_ = other.implicit_;
+                }
+                return *this;
+            }
+
+            ~Token() { release(); }
+
+        private:
+            friend class Jobserver;
+
+            Token(Jobserver* owner, char byte, bool implicit) : owner_(owner), byte_(byte), implicit_(implicit) {}
+
+            void release()
+            {
+                if (owner_ != nullptr)
+                {
+                    std::exchange(owner_, nullptr)->release(byte_, implicit_);
+                }
+            }
+
+            Jobserver* owner_{};
+            char byte_{};
+            bool implicit_{};
+        };
+
+        // Joins the jobserver MAKEFLAGS advertises, or else serves `slots` tokens to child processes through a pipe
+        // and advertises it in this process's MAKEFLAGS.
+        explicit Jobserver(std::size_t slots)
+        {
+#if !defined(_WIN32)
+            if (const char* makeflags = std::getenv("MAKEFLAGS"); makeflags != nullptr)
+            {
+                if (auto auth = JobserverAuth::parse(makeflags))
+                {
+                    connect(*auth);
+                    return;
+                }
+            }
+            serve(slots);
+#else
+            static_cast<void>(slots);
+#endif
+        }
+
+        Jobserver(const Jobserver&) = delete;
+        Jobserver& operator=(const Jobserver&) = delete;
+
+        ~Jobserver()
+        {
+#if !defined(_WIN32)
+            if (owns_fds_)
+            {
+                ::close(read_fd_);
+                if (write_fd_ != read_fd_)
+                {
+                    ::close(write_fd_);
+                }
+            }
+#endif
+        }
+
+        bool active() const { return read_fd_ >= 0; }
+
+        bool is_client() const { return client_; }
+
+        // Blocks until a job may start. A job takes this process's implicit token whenever it is free.
+        Token acquire()
+        {
+            while (true)
+            {
+                {
+                    std::lock_guard lock{mutex_};
+                    if (implicit_free_)
+                    {
+                        implicit_free_ = false;
+                        return Token{this, '+', true};
+                    }
+                }
+                if (!active())
+                {
+                    return Token{this, '+', false};
+                }
+#if !defined(_WIN32)
+                // Waits in short slices, so a job of this process giving back the implicit token is noticed.
+                pollfd readable{read_fd_, POLLIN, 0};
+                if (::poll(&readable, 1, 10) <= 0)
+                {
+                    continue;
+                }
+                char byte{};
+                auto count = ::read(read_fd_, &byte, 1);
+                if (count == 1)
+                {
+                    return Token{this, byte, false};
+                }
+                // make 4.3 and later set the pipe non-blocking, and another client may have taken the token.
+                SOPHO_ASSERT(count < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK),
+                             "cannot read a jobserver token: ",
+                             count == 0 ? "the jobserver closed" : std::strerror(errno));
+#endif
+            }
+        }
+
+    private:
+#if !defined(_WIN32)
+        void connect(const JobserverAuth& auth)
+        {
+            if (!auth.fifo.empty())
+            {
+                read_fd_ = write_fd_ = ::open(auth.fifo.data(), O_RDWR | O_CLOEXEC);
+                owns_fds_ = read_fd_ >= 0;
+            }
+            else if (is_pipe(auth.read_fd) && is_pipe(auth.write_fd))
+            {
+                // Inherited, and left open for children, so sub-makes join the same jobserver.
+                read_fd_ = auth.read_fd;
+                write_fd_ = auth.write_fd;
+            }
+            if (!active())
+            {
+                // make closes the descriptors for recipes not marked with '+'; it warns about that case itself.
+                read_fd_ = write_fd_ = -1;
+                std::cout << "jobserver:advertised in MAKEFLAGS but not accessible, running without it" << std::endl;
+                return;
+            }
+            client_ = true;
+        }
+
+        // An open descriptor could be any file the parent left at that number, and writing tokens to it would
+        // corrupt it; make's jobserver is always a pipe.
+        static bool is_pipe(int fd)
+        {
+            struct stat st{};
+            return ::fcntl(fd, F_GETFD) >= 0 && ::fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+        }
+
+        void serve(std::size_t slots)
+        {
+            if (slots <= 1)
+            {
+                return;
+            }
+            int fds[2]{};
+            if (::pipe(fds) != 0)
+            {
+                return;
+            }
+            read_fd_ = fds[0];
+            write_fd_ = fds[1];
+            owns_fds_ = true;
+            std::string tokens(slots - 1, '+');
+            auto written = ::write(write_fd_, tokens.data(), tokens.size());
+            SOPHO_ASSERT(written == static_cast<ssize_t>(tokens.size()), "cannot fill the jobserver pipe");
+            // The descriptors stay open across exec, so children started through the shell inherit them. Flags already
+            // in MAKEFLAGS, such as -k or variable assignments, still reach the sub-makes.
+            const char* inherited = std::getenv("MAKEFLAGS");
+            auto makeflags = std::string{inherited != nullptr ? inherited : ""} + " -j" + std::to_string(slots) +
+                             " --jobserver-auth=" + std::to_string(read_fd_) + "," + std::to_string(write_fd_);
+            ::setenv("MAKEFLAGS", makeflags.data(), 1);
+        }
+#endif
+
+        void release(char byte, bool implicit)
+        {
+            if (implicit)
+            {
+                std::lock_guard lock{mutex_};
+                implicit_free_ = true;
+                return;
+            }
+#if !defined(_WIN32)
+            if (active())
+            {
+                while (::write(write_fd_, &byte, 1) < 0 && errno == EINTR)
+                {
+                }
+            }
+#else
+            static_cast<void>(byte);
+#endif
+        }
+
+        std::mutex mutex_{};
+        bool implicit_free_{true};
+        bool client_{};
+        bool owns_fds_{};
+        int read_fd_{-1};
+        int write_fd_{-1};
+    };
+
+    // The jobserver of this process, joined or started on first use; every JobPool takes its tokens from it. `slots`
+    // only counts on that first use, when it sizes the server.
+    inline Jobserver& jobserver(std::size_t slots = std::max(1u, std::thread::hardware_concurrency()))
+    {
+        static Jobserver instance{slots};
+        return instance;
+    }
+} // namespace sopho
@@ -0,0 +1,132 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "file_generator.hpp"
+#include "static_string.hpp"
+
+namespace sopho
+{
+    namespace detail
+    {
+        // Little-endian field of `size` bytes at `offset`; false when it lies outside of `data`.
+        inline bool read_elf_field(std::string_view data, std::uint64_t offset, std::size_t size, std::uint64_t& value)
+        {
+            if (offset > data.size() || data.size() - offset < size)
+            {
+                return false;
+            }
+            value = 0;
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                value |= static_cast<std::uint64_t>(static_cast<unsigned char>(data[offset + i])) << (i * 8);
+            }
+            return true;
+        }
+
+        // "name type binding [size]" of every defined, visible dynamic symbol of a little-endian ELF file, or nullopt
+        // when `data` is not one. Object sizes are part of the interface because executables copy-relocate data.
+        inline std::optional<std::vector<std::string>> elf_exported_symbols(std::string_view data)
+        {
+            // "\x7fELF" would read as the escape \x7fE.
+            constexpr std::string_view magic{"\x7f"
+                                             "ELF"};
+            if (data.size() < 64 || data.substr(0, 4) != magic || data[5] != 1)
+            {
+                return std::nullopt;
+            }
+            bool is64 = data[4] == 2;
+            std::uint64_t section_offset{}, section_size{}, section_count{};
+            if (!read_elf_field(data, is64 ? 0x28 : 0x20, is64 ? 8 : 4, section_offset) ||
+                !read_elf_field(data, is64 ? 0x3a : 0x2e, 2, section_size) ||
+                !read_elf_field(data, is64 ? 0x3c : 0x30, 2, section_count))
+            {
+                return std::nullopt;
+            }
+
+            struct Section
+            {
+                std::uint64_t type{}, offset{}, size{}, link{}, entry_size{};
+            };
+            auto section = [&](std::uint64_t index, Section& result)
+            {
+                auto base = section_offset + index * section_size;
+                std::size_t word = is64 ? 8 : 4;
+                return read_elf_field(data, base + 4, 4, result.type) &&
+                       read_elf_field(data, base + (is64 ? 0x18 : 0x10), word, result.offset) &&
+                       read_elf_field(data, base + (is64 ? 0x20 : 0x14), word, result.size) &&
+                       read_elf_field(data, base + (is64 ? 0x28 : 0x18), 4, result.link) &&
+                       read_elf_field(data, base + (is64 ? 0x38 : 0x24), word, result.entry_size);
+            };
+
+            constexpr std::uint64_t section_dynsym = 11;
+            std::vector<std::string> result{};
+            for (std::uint64_t index = 0; index < section_count; ++index)
+            {
+                Section symbols{}, strings{};
+                if (!section(index, symbols) || symbols.type != section_dynsym || symbols.entry_size == 0 ||
+                    !section(symbols.link, strings))
+                {
+                    continue;
+                }
+                for (std::uint64_t offset = symbols.offset; offset + symbols.entry_size <= symbols.offset + symbols.size;
+                     offset += symbols.entry_size)
+                {
+                    std::uint64_t name{}, info{}, other{}, section_index{}, size{};
+                    if (!read_elf_field(data, offset, 4, name) ||
+                        !read_elf_field(data, offset + (is64 ? 4 : 12), 1, info) ||
+                        !read_elf_field(data, offset + (is64 ? 5 : 13), 1, other) ||
+                        !read_elf_field(data, offset + (is64 ? 6 : 14), 2, section_index) ||
+                        !read_elf_field(data, offset + (is64 ? 16 : 8), is64 ? 8 : 4, size))
+                    {
+                        return std::nullopt;
+                    }
+                    auto binding = info >> 4;
+                    auto type = info & 0xf;
+                    auto visibility = other & 0x3;
+                    // Undefined symbols are imports; local, internal and hidden ones are not visible to users.
+                    bool exported = section_index != 0 && (binding == 1 || binding == 2 || binding == 10) &&
+                                    (visibility == 0 || visibility == 3);
+                    if (!exported || strings.offset + name >= data.size())
+                    {
+                        continue;
+                    }
+                    auto name_start = data.substr(strings.offset + name);
+                    std::string entry{name_start.substr(0, name_start.find('\0'))};
+                    entry += " " + std::to_string(type) + " " + std::to_string(binding);
+                    if (type == 1)
+                    {
+                        entry += " " + std::to_string(size);
+                    }
+                    result.push_back(std::move(entry));
+                }
+            }
+            std::sort(result.begin(), result.end());
+            return result;
+        }
+    } // namespace detail
+
+    // Hash of what a shared library offers to the binaries linking against it: its exported dynamic symbols. Code
+    // changes behind an unchanged interface keep the hash, so dependents need not relink. Files that are not ELF
+    // hash their whole content, making every change an interface change.
+    inline std::uint64_t library_interface_hash(const std::filesystem::path& library)
+    {
+        auto content = read_file(library);
+        auto symbols = detail::elf_exported_symbols(content);
+        if (!symbols)
+        {
+            return fnv1a(content);
+        }
+        std::uint64_t hash = fnv1a_offset_basis;
+        for (const auto& symbol : *symbols)
+        {
+            hash = hash_combine(hash, fnv1a(symbol));
+        }
+        return hash;
+    }
+} // namespace sopho
@@ -34,35 +34,37 @@ namespace sopho
 
     namespace detail
     {
-        template <template <typename, typename> typename Folder, typename Value, typename List>
-        struct FoldlImpl;
-
-        template <template <typename, typename> typename Folder, typename Value, typename T, typename... Ts>
-        struct FoldlImpl<Folder, Value, std::tuple<T, Ts...>>
+        // Foldl is a left fold expression over operator<< on these tag types, so instantiation depth stays constant
+        // however long the list is; each step only instantiates Folder<Value, T> with an already complete Value.
+        template <template <typename, typename> typename Folder, typename Value>
+        struct FoldState
         {
-            // The "return value" of a metafunction is usually defined as 'type'
-            using type = typename FoldlImpl<Folder, typename Folder<Value, T>::type, std::tuple<Ts...>>::type;
+            using type = Value;
         };
 
-        template <template <typename, typename> typename Folder, typename Value>
-        struct FoldlImpl<Folder, Value, std::tuple<>>
+        template <typename T>
+        struct FoldElement
         {
-            // The "return value" of a metafunction is usually defined as 'type'
-            using type = Value;
         };
 
-        template <template <typename, typename> typename Folder, typename Value, typename T, typename... Ts>
-        struct FoldlImpl<Folder, Value, std::variant<T, Ts...>>
+        template <template <typename, typename> typename Folder, typename Value, typename T>
+        FoldState<Folder, typename Folder<Value, T>::type> operator<<(FoldState<Folder, Value>, FoldElement<T>);
+
+        template <template <typename, typename> typename Folder, typename Value, typename List>
+        struct FoldlImpl;
+
+        template <template <typename, typename> typename Folder, typename Value, typename... Ts>
+        struct FoldlImpl<Folder, Value, std::tuple<Ts...>>
         {
             // The "return value" of a metafunction is usually defined as 'type'
-            using type = typename FoldlImpl<Folder, typename Folder<Value, T>::type, std::variant<Ts...>>::type;
+            using type = typename decltype((FoldState<Folder, Value>{} << ... << FoldElement<Ts>{}))::type;
         };
 
-        template <template <typename, typename> typename Folder, typename Value>
-        struct FoldlImpl<Folder, Value, std::variant<>>
+        template <template <typename, typename> typename Folder, typename Value, typename... Ts>
+        struct FoldlImpl<Folder, Value, std::variant<Ts...>>
         {
             // The "return value" of a metafunction is usually defined as 'type'
-            using type = Value;
+            using type = typename decltype((FoldState<Folder, Value>{} << ... << FoldElement<Ts>{}))::type;
         };
 
     } // namespace detail
@@ -0,0 +1,352 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string_view>
+#include <vector>
+#if defined(__linux__)
+#include <time.h>
+#endif
+#include "source_location.hpp"
+
+// Scope profiler, enabled with -DSOPHO_DIAG_PROFILE=1. Every SOPHO_STACK scope records its inclusive wall time into
+// per-thread aggregates keyed by its static SourceLocation; at exit a hot-spot report goes to stderr, and to the JSON
+// file named by the SOPHO_PROFILE_JSON environment variable when set. Needs a SOPHO_DIAG_LEVEL other than OFF, and
+// times every scope even at the SAMPLED level. SOPHO_PROFILE_SITES is the number of distinct scopes each thread can
+// track; scopes beyond it are counted as dropped.
+#ifndef SOPHO_DIAG_PROFILE
+#define SOPHO_DIAG_PROFILE 0
+#endif
+#ifndef SOPHO_PROFILE_SITES
+#define SOPHO_PROFILE_SITES 256
+#endif
+
+namespace sopho
+{
+    inline constexpr bool diag_profile = SOPHO_DIAG_PROFILE != 0;
+    inline constexpr std::uint32_t profile_sites = SOPHO_PROFILE_SITES;
+    static_assert(profile_sites > 0 && (profile_sites & (profile_sites - 1)) == 0,
+                  "SOPHO_PROFILE_SITES must be a power of two");
+    // Bucket 0 holds 0 ns, bucket b holds [2^(b-1), 2^b) ns; the last bucket also takes everything longer.
+    inline constexpr std::uint32_t profile_buckets = 40;
+
+    inline std::uint64_t profile_clock_ns()
+    {
+#if defined(__linux__)
+        // Not slewed by NTP, and served from the vDSO without a syscall.
+        timespec ts{};
+        ::clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000 + static_cast<std::uint64_t>(ts.tv_nsec);
+#else
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                              std::chrono::steady_clock::now().time_since_epoch())
+                                              .count());
+#endif
+    }
+
+    // Only the owning thread writes a site, so updates are plain load + store; the atomics just make concurrent
+    // reports well defined.
+    struct ProfileSite
+    {
+        std::atomic<const SourceLocation*> location{};
+        std::atomic<std::uint64_t> count{};
+        std::atomic<std::uint64_t> total_ns{};
+        std::atomic<std::uint64_t> min_ns{std::numeric_limits<std::uint64_t>::max()};
+        std::atomic<std::uint64_t> max_ns{};
+        std::array<std::atomic<std::uint32_t>, profile_buckets> histogram{};
+    };
+
+    // Open-addressed by location address. Tables are never freed: a thread that exits hands its table (and its
+    // aggregates) to the next new thread, so thread churn does not grow memory.
+    struct ProfileTable
+    {
+        std::atomic<bool> owned{true};
+        ProfileTable* next{};
+        std::atomic<std::uint64_t> dropped{};
+        std::array<ProfileSite, profile_sites> sites{};
+    };
+
+    // One merged row of the report; times are inclusive of nested scopes.
+    struct ProfileEntry
+    {
+        const SourceLocation* location{};
+        std::uint64_t count{};
+        std::uint64_t total_ns{};
+        std::uint64_t min_ns{std::numeric_limits<std::uint64_t>::max()};
+        std::uint64_t max_ns{};
+        std::array<std::uint64_t, profile_buckets> histogram{};
+
+        // Upper bound of the histogram bucket holding the given fraction of the calls, clamped to max_ns.
+        std::uint64_t percentile_ns(double fraction) const
+        {
+            auto wanted = static_cast<std::uint64_t>(fraction * static_cast<double>(count));
+            std::uint64_t seen = 0;
+            for (std::uint32_t bucket = 0; bucket < profile_buckets; ++bucket)
+            {
+                seen += histogram[bucket];
+                if (seen > wanted || seen == count)
+                {
+                    return std::min(bucket == 0 ? 0 : std::uint64_t{1} << bucket, max_ns);
+                }
+            }
+            return max_ns;
+        }
+    };
+
+    inline void print_profile(std::ostream& out, std::size_t limit = 30);
+    inline void write_profile_json(const std::filesystem::path& fs_path);
+
+    namespace detail
+    {
+        struct ProfileRegistry
+        {
+            std::atomic<ProfileTable*> head{};
+            ~ProfileRegistry()
+            {
+                if (head.load(std::memory_order_acquire) == nullptr)
+                {
+                    return;
+                }
+                print_profile(std::cerr);
+                if (const char* json = std::getenv("SOPHO_PROFILE_JSON"); json != nullptr && *json != '\0')
+                {
+                    write_profile_json(json);
+                }
+            }
+        };
+
+        inline ProfileRegistry& profile_registry()
+        {
+            static ProfileRegistry registry{};
+            return registry;
+        }
+
+        inline ProfileTable* claim_profile_table()
+        {
+            auto& registry = profile_registry();
+            for (auto* table = registry.head.load(std::memory_order_acquire); table != nullptr; table = table->next)
+            {
+                bool expected = false;
+                if (table->owned.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+                {
+                    return table;
+                }
+            }
+            auto* table = new ProfileTable{};
+            table->next = registry.head.load(std::memory_order_relaxed);
+            while (!registry.head.compare_exchange_weak(table->next, table, std::memory_order_release,
+                                                        std::memory_order_relaxed))
+            {
+            }
+            return table;
+        }
+
+        struct ProfileTableOwner
+        {
+            ProfileTable* table{claim_profile_table()};
+            ~ProfileTableOwner() { table->owned.store(false, std::memory_order_release); }
+        };
+
+        inline ProfileTable& this_thread_profile_table()
+        {
+            static thread_local ProfileTableOwner owner{};
+            return *owner.table;
+        }
+
+        inline void profile_bump(std::atomic<std::uint64_t>& value, std::uint64_t delta)
+        {
+            value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        }
+    } // namespace detail
+
+    // Adds one call of `elapsed_ns` to the calling thread's aggregate for `location`.
+    inline void profile_record(const SourceLocation& location, std::uint64_t elapsed_ns)
+    {
+        auto& table = detail::this_thread_profile_table();
+        auto hash = ((reinterpret_cast<std::uintptr_t>(&location) >> 3) * 0x9E3779B97F4A7C15ull) >> 32;
+        for (std::uint32_t probe = 0; probe < profile_sites; ++probe)
+        {
+            auto& site = table.sites[(hash + probe) & (profile_sites - 1)];
+            auto* current = site.location.load(std::memory_order_relaxed);
+            if (current == nullptr)
+            {
+                site.location.store(&location, std::memory_order_release);
+            }
+            else if (current != &location)
+            {
+                continue;
+            }
+            detail::profile_bump(site.count, 1);
+            detail::profile_bump(site.total_ns, elapsed_ns);
+            if (elapsed_ns < site.min_ns.load(std::memory_order_relaxed))
+            {
+                site.min_ns.store(elapsed_ns, std::memory_order_relaxed);
+            }
+            if (elapsed_ns > site.max_ns.load(std::memory_order_relaxed))
+            {
+                site.max_ns.store(elapsed_ns, std::memory_order_relaxed);
+            }
+            auto bucket = std::min<std::uint32_t>(std::bit_width(elapsed_ns), profile_buckets - 1);
+            auto& slot = site.histogram[bucket];
+            slot.store(slot.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
+        }
+        detail::profile_bump(table.dropped, 1);
+    }
+
+    // Timing state of one StackScope; empty when profiling is disabled.
+    template <bool Enabled>
+    struct ScopeTimer
+    {
+        void start() {}
+        void stop(const SourceLocation&) {}
+    };
+
+    template <>
+    struct ScopeTimer<true>
+    {
+        std::uint64_t start_ns;
+        void start() { start_ns = profile_clock_ns(); }
+        void stop(const SourceLocation& location) { profile_record(location, profile_clock_ns() - start_ns); }
+    };
+
+    // Merges every thread's aggregates, hottest (largest total) first. Scopes of threads still running are read
+    // while they are being updated, so a report taken mid-run is approximate.
+    inline std::vector<ProfileEntry> collect_profile(std::uint64_t* dropped = nullptr)
+    {
+        std::map<const SourceLocation*, ProfileEntry> merged{};
+        std::uint64_t dropped_count = 0;
+        for (auto* table = detail::profile_registry().head.load(std::memory_order_acquire); table != nullptr;
+             table = table->next)
+        {
+            dropped_count += table->dropped.load(std::memory_order_relaxed);
+            for (const auto& site : table->sites)
+            {
+                const auto* location = site.location.load(std::memory_order_acquire);
+                if (location == nullptr)
+                {
+                    continue;
+                }
+                auto& entry = merged[location];
+                entry.location = location;
+                entry.count += site.count.load(std::memory_order_relaxed);
+                entry.total_ns += site.total_ns.load(std::memory_order_relaxed);
+                entry.min_ns = std::min(entry.min_ns, site.min_ns.load(std::memory_order_relaxed));
+                entry.max_ns = std::max(entry.max_ns, site.max_ns.load(std::memory_order_relaxed));
+                for (std::uint32_t bucket = 0; bucket < profile_buckets; ++bucket)
+                {
+                    entry.histogram[bucket] += site.histogram[bucket].load(std::memory_order_relaxed);
+                }
+            }
+        }
+        if (dropped != nullptr)
+        {
+            *dropped = dropped_count;
+        }
+        std::vector<ProfileEntry> result{};
+        result.reserve(merged.size());
+        for (auto& [location, entry] : merged)
+        {
+            result.push_back(entry);
+        }
+        std::sort(result.begin(), result.end(),
+                  [](const ProfileEntry& a, const ProfileEntry& b) { return a.total_ns > b.total_ns; });
+        return result;
+    }
+
+    inline void print_profile(std::ostream& out, std::size_t limit)
+    {
+        std::uint64_t dropped = 0;
+        auto entries = collect_profile(&dropped);
+        auto us = [](std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+        // Formatted apart, so `out` keeps the caller's precision.
+        std::ostringstream text{};
+        text << "profile: " << entries.size() << " scopes (inclusive times, p50/p99 are histogram bounds)\n";
+        text << std::fixed << std::setprecision(1);
+        text << std::setw(12) << "total us" << std::setw(10) << "count" << std::setw(10) << "mean us" << std::setw(10)
+             << "min us" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(10) << "max us"
+             << "  scope\n";
+        for (std::size_t i = 0; i < entries.size() && i < limit; ++i)
+        {
+            const auto& entry = entries[i];
+            const auto& location = *entry.location;
+            text << std::setw(12) << us(entry.total_ns) << std::setw(10) << entry.count << std::setw(10)
+                 << us(entry.total_ns) / static_cast<double>(entry.count) << std::setw(10) << us(entry.min_ns)
+                 << std::setw(10) << us(entry.percentile_ns(0.5)) << std::setw(10) << us(entry.percentile_ns(0.99))
+                 << std::setw(10) << us(entry.max_ns) << "  " << location.function_name << " ("
+                 << location.file_name << ":" << location.line_number << ")\n";
+        }
+        if (entries.size() > limit)
+        {
+            text << "(" << entries.size() - limit << " more scopes)\n";
+        }
+        if (dropped != 0)
+        {
+            text << "(" << dropped << " calls dropped, raise SOPHO_PROFILE_SITES)\n";
+        }
+        out << text.str();
+    }
+
+    namespace detail
+    {
+        inline void write_json_string(std::ostream& out, std::string_view str)
+        {
+            out << '"';
+            for (char c : str)
+            {
+                if (c == '"' || c == '\\')
+                {
+                    out << '\\' << c;
+                }
+                else if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                    out << escaped;
+                }
+                else
+                {
+                    out << c;
+                }
+            }
+            out << '"';
+        }
+    } // namespace detail
+
+    inline void write_profile_json(const std::filesystem::path& fs_path)
+    {
+        std::uint64_t dropped = 0;
+        auto entries = collect_profile(&dropped);
+        std::ofstream out(fs_path);
+        out << "{\n  \"dropped\": " << dropped << ",\n  \"scopes\": [";
+        for (std::size_t i = 0; i < entries.size(); ++i)
+        {
+            const auto& entry = entries[i];
+            out << (i == 0 ? "\n" : ",\n") << "    {\"file\": ";
+            detail::write_json_string(out, entry.location->file_name);
+            out << ", \"function\": ";
+            detail::write_json_string(out, entry.location->function_name);
+            out << ", \"line\": " << entry.location->line_number << ", \"count\": " << entry.count
+                << ", \"total_ns\": " << entry.total_ns << ", \"min_ns\": " << entry.min_ns
+                << ", \"max_ns\": " << entry.max_ns << ", \"histogram\": [";
+            for (std::uint32_t bucket = 0; bucket < profile_buckets; ++bucket)
+            {
+                out << (bucket == 0 ? "" : ", ") << entry.histogram[bucket];
+            }
+            out << "]}";
+        }
+        out << "\n  ]\n}\n";
+    }
+} // namespace sopho
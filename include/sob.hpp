@@ -1,19 +1,30 @@
 #pragma once
+#include <algorithm>
+#include <array>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
+#include <span>
 #include <sstream>
 #include <string_view>
 #include <tuple>
 #include <type_traits>
 #include <utility>
 #include <vector>
+#include "crash_handler.hpp"
 #include "diag.hpp"
 #include "file_generator.hpp"
+#include "include_scanner.hpp"
+#include "job_pool.hpp"
+#include "library_interface.hpp"
 #include "meta.hpp"
 #include "static_string.hpp"
+#include "test_runner.hpp"
 
 template <class T>
 constexpr std::string_view type_name()
@@ -45,39 +56,121 @@ constexpr std::string_view type_name()
 namespace sopho
 {
 
+    // One compile_commands.json entry. Its strings are views into static storage or into the CompileCommands that
+    // holds it; the arguments are a range of that collection's argument list.
     struct CompileCommand
     {
-        std::string directory{};
-        std::vector<std::string> arguments{};
-        std::string file{};
+        std::string_view directory{};
+        std::uint32_t first_argument{};
+        std::uint32_t argument_count{};
+        std::string_view file{};
     };
 
-    inline void write_compile_commands_json(const std::string& path, const std::vector<CompileCommand>& commands)
+    // The compile_commands.json entries of a build. The pipeline appends to one caller-provided collection instead of
+    // returning vectors of strings, and strings that are not in static storage, such as the directory and include or
+    // module flags, are interned, so entries sharing them store one copy.
+    class CompileCommands
+    {
+    public:
+        CompileCommands() = default;
+        // Entries point into strings_, which a copy would not own.
+        CompileCommands(const CompileCommands&) = delete;
+        CompileCommands& operator=(const CompileCommands&) = delete;
+        CompileCommands(CompileCommands&&) = default;
+        CompileCommands& operator=(CompileCommands&&) = default;
+
+        // A view of `text` that lives as long as the collection.
+        std::string_view intern(std::string_view text)
+        {
+            auto iter = strings_.find(text);
+            if (iter == strings_.end())
+            {
+                iter = strings_.emplace(text).first;
+            }
+            return *iter;
+        }
+
+        // Starts an entry; add_argument() appends to the latest one. Both take views that outlive the collection,
+        // static strings or results of intern().
+        void add(std::string_view directory, std::string_view file)
+        {
+            commands_.push_back(
+                CompileCommand{directory, static_cast<std::uint32_t>(arguments_.size()), 0, file});
+        }
+
+        void add_argument(std::string_view argument)
+        {
+            SOPHO_ASSERT(!commands_.empty(), "argument ", argument, " added before any compile command");
+            arguments_.push_back(argument);
+            ++commands_.back().argument_count;
+        }
+
+        std::size_t size() const { return commands_.size(); }
+
+        const std::vector<CompileCommand>& entries() const { return commands_; }
+
+        std::span<const std::string_view> arguments_of(const CompileCommand& command) const
+        {
+            return std::span<const std::string_view>{arguments_}.subspan(command.first_argument,
+                                                                          command.argument_count);
+        }
+
+    private:
+        std::set<std::string, std::less<>> strings_{};
+        std::vector<CompileCommand> commands_{};
+        std::vector<std::string_view> arguments_{};
+    };
+
+    // What a build returns: its compile_commands.json entries, and whether every job, tests included, succeeded.
+    struct BuildResult
+    {
+        CompileCommands commands{};
+        bool succeeded{};
+    };
+
+    inline void write_compile_commands_json(const std::string& path, const CompileCommands& commands)
     {
         std::ofstream out(path);
         out << "[\n";
-        for (size_t i = 0; i < commands.size(); ++i)
+        const auto& entries = commands.entries();
+        for (size_t i = 0; i < entries.size(); ++i)
         {
-            const auto& cmd = commands[i];
+            const auto& cmd = entries[i];
+            auto arguments = commands.arguments_of(cmd);
             out << "  {\n";
             out << "    \"directory\": \"" << cmd.directory << "\",\n";
             out << "    \"file\": \"" << cmd.file << "\",\n";
             out << "    \"arguments\": [";
-            for (size_t j = 0; j < cmd.arguments.size(); ++j)
+            for (size_t j = 0; j < arguments.size(); ++j)
             {
-                out << "\"" << cmd.arguments[j] << "\"";
-                if (j + 1 < cmd.arguments.size())
+                out << "\"" << arguments[j] << "\"";
+                if (j + 1 < arguments.size())
                     out << ", ";
             }
             out << "]\n";
             out << "  }";
-            if (i + 1 < commands.size())
+            if (i + 1 < entries.size())
                 out << ",";
             out << "\n";
         }
         out << "]\n";
     }
 
+    // A path as it appears on a build line of a ninja file, where spaces, colons and dollars are special.
+    inline std::string ninja_escape(std::string_view path)
+    {
+        std::string result{};
+        for (char c : path)
+        {
+            if (c == ' ' || c == ':' || c == '$')
+            {
+                result.push_back('$');
+            }
+            result.push_back(c);
+        }
+        return result;
+    }
+
     // Generic detection idiom core
     template <typename, template <typename> class, typename = void>
     struct is_detected : std::false_type
@@ -98,6 +191,25 @@ namespace sopho
         static constexpr auto source = S;
     };
 
+    // A module interface unit (.cppm, .ixx). Its BMI is built before every unit that imports it; which modules those
+    // are is scanned from the sources at build time.
+    template <StaticString S>
+    struct ModuleSource
+    {
+        static constexpr auto source = S;
+        static constexpr bool module_interface = true;
+    };
+
+    // Runs the binary of link target `Target` with `Args` as soon as it is linked. A test passes when it exits with 0
+    // within `TimeoutSeconds`, and is not run again until its binary changes.
+    template <typename Target, StaticString Args = StaticString{""}, std::uint32_t TimeoutSeconds = 300>
+    struct Test
+    {
+        using Dependent = std::tuple<Target>;
+        static constexpr auto test_args = Args;
+        static constexpr std::uint32_t timeout_seconds = TimeoutSeconds;
+    };
+
     template <typename Deps, StaticString Name>
     struct Target
     {
@@ -105,6 +217,17 @@ namespace sopho
         static constexpr auto target = Name;
     };
 
+    // A shared library linked from `Deps`, named `Name` plus the Context's shared_postfix. Its sources are compiled
+    // with the Context's shared_cxxflags (-fPIC, visibility). Binaries linking it relink only when its exported
+    // symbols change, not on every rebuild of the library.
+    template <typename Deps, StaticString Name>
+    struct SharedLibrary
+    {
+        using Dependent = Deps;
+        static constexpr auto target = Name;
+        static constexpr bool shared_library = true;
+    };
+
     // Expression template: get type of 'T::source' (works for static and non-static)
     template <typename T>
     using detect_source = decltype(std::declval<T&>().source);
@@ -125,6 +248,129 @@ namespace sopho
     template <typename T>
     inline constexpr bool has_cxxflags_v = is_detected_v<T, detect_cxxflags>;
 
+    template <typename T>
+    using detect_include_paths = decltype(std::declval<T&>().include_paths);
+
+    template <typename T>
+    inline constexpr bool has_include_paths_v = is_detected_v<T, detect_include_paths>;
+
+    template <typename T>
+    using detect_module_interface = decltype(std::declval<T&>().module_interface);
+
+    template <typename T>
+    inline constexpr bool has_module_interface_v = is_detected_v<T, detect_module_interface>;
+
+    template <typename T>
+    using detect_shared_library = decltype(std::declval<T&>().shared_library);
+
+    template <typename T>
+    inline constexpr bool has_shared_library_v = is_detected_v<T, detect_shared_library>;
+
+    template <typename T>
+    using detect_shared_prefix = decltype(std::declval<T&>().shared_prefix);
+
+    template <typename T>
+    inline constexpr bool has_shared_prefix_v = is_detected_v<T, detect_shared_prefix>;
+
+    // Linker flag a runtime library search path follows, e.g. "-Wl,-rpath,". Binaries linking shared libraries of the
+    // plan find them relative to their own location through it.
+    template <typename T>
+    using detect_rpath_prefix = decltype(std::declval<T&>().rpath_prefix);
+
+    template <typename T>
+    inline constexpr bool has_rpath_prefix_v = is_detected_v<T, detect_rpath_prefix>;
+
+    // Linker flag a shared library's own name follows, e.g. "-Wl,-soname,". Without one, binaries record the path the
+    // library was linked by, which only resolves from the directory the build ran in.
+    template <typename T>
+    using detect_soname_prefix = decltype(std::declval<T&>().soname_prefix);
+
+    template <typename T>
+    inline constexpr bool has_soname_prefix_v = is_detected_v<T, detect_soname_prefix>;
+
+    template <typename T>
+    using detect_shared_cxxflags = decltype(std::declval<T&>().shared_cxxflags);
+
+    template <typename T>
+    inline constexpr bool has_shared_cxxflags_v = is_detected_v<T, detect_shared_cxxflags>;
+
+    // Flags that make the compiler write a gcc-style depfile; the exported ninja file appends its path.
+    template <typename T>
+    using detect_depfile_flags = decltype(std::declval<T&>().depfile_flags);
+
+    template <typename T>
+    inline constexpr bool has_depfile_flags_v = is_detected_v<T, detect_depfile_flags>;
+
+    // Flags that make the compiler print the headers it reads, as ninja's "deps = msvc" parses them.
+    template <typename T>
+    using detect_show_includes_flags = decltype(std::declval<T&>().show_includes_flags);
+
+    template <typename T>
+    inline constexpr bool has_show_includes_flags_v = is_detected_v<T, detect_show_includes_flags>;
+
+    template <typename T>
+    using detect_test_args = decltype(std::declval<T&>().test_args);
+
+    template <typename T>
+    inline constexpr bool has_test_v = is_detected_v<T, detect_test_args>;
+
+    template <typename T>
+    using detect_bmi_postfix = decltype(std::declval<T&>().bmi_postfix);
+
+    template <typename T>
+    inline constexpr bool has_bmi_postfix_v = is_detected_v<T, detect_bmi_postfix>;
+
+    template <typename T>
+    using detect_module_flags = decltype(std::declval<T&>().module_flags);
+
+    template <typename T>
+    inline constexpr bool has_module_flags_v = is_detected_v<T, detect_module_flags>;
+
+    template <typename T>
+    using detect_module_interface_flags = decltype(std::declval<T&>().module_interface_flags);
+
+    template <typename T>
+    inline constexpr bool has_module_interface_flags_v = is_detected_v<T, detect_module_interface_flags>;
+
+    // g++ style: one mapper file names the BMI of every module.
+    template <typename T>
+    using detect_module_mapper_prefix = decltype(std::declval<T&>().module_mapper_prefix);
+
+    template <typename T>
+    inline constexpr bool has_module_mapper_prefix_v = is_detected_v<T, detect_module_mapper_prefix>;
+
+    // clang/cl style: the interface names its BMI output and importers reference each BMI as "name=path".
+    template <typename T>
+    using detect_module_reference_prefix = decltype(std::declval<T&>().module_reference_prefix);
+
+    template <typename T>
+    inline constexpr bool has_module_reference_prefix_v = is_detected_v<T, detect_module_reference_prefix>;
+
+    // Directory the final binaries of a link are placed in; the working directory when absent.
+    template <typename T>
+    using detect_target_prefix = decltype(std::declval<T&>().target_prefix);
+
+    template <typename T>
+    inline constexpr bool has_target_prefix_v = is_detected_v<T, detect_target_prefix>;
+
+    template <typename T>
+    using detect_variant_name = decltype(std::declval<T&>().variant_name);
+
+    template <typename T>
+    inline constexpr bool has_variant_name_v = is_detected_v<T, detect_variant_name>;
+
+    template <typename T>
+    using detect_pgo_merge_command = decltype(std::declval<T&>().pgo_merge_command);
+
+    template <typename T>
+    inline constexpr bool has_pgo_merge_command_v = is_detected_v<T, detect_pgo_merge_command>;
+
+    template <typename T>
+    using detect_pgo_use = decltype(std::declval<T&>().pgo_use);
+
+    template <typename T>
+    inline constexpr bool has_pgo_use_v = is_detected_v<T, detect_pgo_use>;
+
     template <typename T>
     using detect_dependent_type = typename T::Dependent;
 
@@ -146,145 +392,1385 @@ namespace sopho
     template <typename T>
     using dependent_or_empty_t = typename dependent_or_empty<T>::type;
 
-    template <typename Context>
-    struct CxxToolchain
+    enum class BuildNodeKind : std::uint8_t
     {
+        Compile,
+        ModuleInterface,
+        Link,
+        SharedLink,
+        Test,
+    };
 
-        template <typename Target>
-        struct CxxBuilder;
+    constexpr bool is_compile(BuildNodeKind kind)
+    {
+        return kind == BuildNodeKind::Compile || kind == BuildNodeKind::ModuleInterface;
+    }
 
-        template <size_t Size>
-        constexpr static auto source_to_target(StaticString<Size> source)
+    // One step of a build plan. The strings live in static storage of the target types; inputs are indices of
+    // earlier nodes, whose outputs this node consumes.
+    struct BuildNode
+    {
+        BuildNodeKind kind{};
+        std::string_view name{};
+        std::string_view source{};
+        std::string_view output{};
+        // Command-line arguments and time limit of a test.
+        std::string_view arguments{};
+        std::uint32_t timeout_seconds{};
+        // Compiled for a shared library.
+        bool position_independent{};
+        std::uint32_t first_input{};
+        std::uint32_t input_count{};
+        // Hash of the static part of the node's command: compiler, flags, source, output and input paths. Cache keys
+        // fold file contents and environment into it at runtime.
+        std::uint64_t fingerprint{};
+    };
+
+    // Flat, topologically ordered (dependencies first) and de-duplicated form of a target graph, computed at
+    // compile time so consumers iterate contiguous data instead of instantiating per-target functions.
+    template <std::size_t NodeCount, std::size_t InputCount>
+    struct BuildPlan
+    {
+        std::array<BuildNode, NodeCount> nodes{};
+        std::array<std::uint32_t, InputCount> inputs{};
+
+        constexpr std::span<const std::uint32_t> inputs_of(const BuildNode& node) const
         {
-            return append(append(Context::build_prefix, strip_suffix(source, StaticString{".cpp"})),
-                          Context::obj_postfix);
+            return std::span<const std::uint32_t>{inputs}.subspan(node.first_input, node.input_count);
         }
+    };
 
-        template <typename Target>
-        struct CxxBuilderWrapper
+    namespace detail
+    {
+        template <typename List, typename T>
+        inline constexpr bool contains_v = false;
+
+        template <typename... Ts, typename T>
+        inline constexpr bool contains_v<std::tuple<Ts...>, T> = (std::is_same_v<T, Ts> || ...);
+
+        // Whether a shared library in List links T, which then has to be compiled position independent.
+        template <typename List, typename T>
+        inline constexpr bool linked_into_shared_v = false;
+
+        template <typename... Ts, typename T>
+        inline constexpr bool linked_into_shared_v<std::tuple<Ts...>, T> =
+            ((has_shared_library_v<Ts> && contains_v<dependent_or_empty_t<Ts>, T>) || ...);
+
+        template <typename List, typename T>
+        struct PostorderFolder;
+
+        // Visits the dependencies of T before T itself; a type already in the list is skipped with its subgraph.
+        template <typename List, typename T, bool Seen = contains_v<List, T>>
+        struct PostorderStep
         {
-            using type = CxxBuilder<Target>;
+            using type = List;
         };
 
-        template <typename Target>
-        struct CxxBuilder
+        template <typename... Ts, typename T>
+        struct PostorderStep<std::tuple<Ts...>, T, false>
         {
+            template <typename Visited>
+            struct Append;
 
-            template <typename L, typename R>
-            struct BuildFolder
+            template <typename... Vs>
+            struct Append<std::tuple<Vs...>>
             {
-                struct Builder
-                {
-                    static std::vector<CompileCommand> build()
-                    {
-                        std::vector<CompileCommand> result;
-                        auto left = L::build();
-                        auto right = R::build();
-                        result.insert(result.end(), left.begin(), left.end());
-                        result.insert(result.end(), right.begin(), right.end());
-                        return result;
-                    }
-                };
-                using type = Builder;
+                using type = std::tuple<Vs..., T>;
             };
 
-            struct DumbBuilder
-            {
-                static std::vector<CompileCommand> build() { return {}; }
-            };
+            using type = typename Append<Foldl<PostorderFolder, std::tuple<Ts...>, dependent_or_empty_t<T>>>::type;
+        };
 
-            using DependentBuilder =
-                Foldl<BuildFolder, DumbBuilder, Map<CxxBuilderWrapper, dependent_or_empty_t<Target>>>;
+        template <typename List, typename T>
+        struct PostorderFolder
+        {
+            using type = typename PostorderStep<List, T>::type;
+        };
 
-            template <typename T>
-            struct SourceToTarget
+        constexpr StaticString<16> to_hex(std::uint64_t value)
+        {
+            StaticString<16> result{};
+            for (std::size_t i = 0; i < 16; ++i)
             {
-                struct Result
-                {
+                result.data[15 - i] = "0123456789abcdef"[(value >> (i * 4)) & 0xf];
+            }
+            return result;
+        }
 
-                    constexpr static auto target = source_to_target(T::source);
-                };
-                using type = Result;
-            };
+        template <typename T, typename... Ts>
+        constexpr std::uint32_t index_of(std::tuple<Ts...>*)
+        {
+            std::uint32_t index = 0;
+            std::uint32_t result = 0;
+            ((std::is_same_v<T, Ts> ? (result = index++) : index++), ...);
+            return result;
+        }
+    } // namespace detail
 
-            template <typename L, typename R>
-            struct TargetStringFolder
-            {
-                struct TargetString
-                {
-                    static constexpr auto target = append(append(L::target, StaticString(" ")), R::target);
-                };
-                using type = TargetString;
-            };
+    namespace detail
+    {
+        template <typename Target>
+        struct BuildOrderOf
+        {
+            using type = typename PostorderStep<std::tuple<>, Target>::type;
+        };
 
-            struct DumbTargetString
-            {
-                static constexpr StaticString target{""};
-            };
+        // A tuple of roots builds them all in one plan, e.g. a binary and the tests that run while it compiles.
+        template <typename... Targets>
+        struct BuildOrderOf<std::tuple<Targets...>>
+        {
+            using type = Foldl<PostorderFolder, std::tuple<>, std::tuple<Targets...>>;
+        };
+    } // namespace detail
 
-            using DependentNameCollector =
-                Foldl<TargetStringFolder, DumbTargetString, Map<SourceToTarget, dependent_or_empty_t<Target>>>;
+    // Every type reachable from Target, dependencies first, each once.
+    template <typename Target>
+    using BuildOrder = typename detail::BuildOrderOf<Target>::type;
 
-            static std::vector<CompileCommand> build()
-            {
-                std::vector<CompileCommand> commands = DependentBuilder::build();
+    template <std::size_t N, std::size_t M>
+    constexpr std::array<std::string_view, N + M> concat_flags(const std::array<std::string_view, N>& a,
+                                                               const std::array<std::string_view, M>& b)
+    {
+        std::array<std::string_view, N + M> result{};
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            result[i] = a[i];
+        }
+        for (std::size_t i = 0; i < M; ++i)
+        {
+            result[N + i] = b[i];
+        }
+        return result;
+    }
 
-                std::string command{};
-                std::vector<std::string> command_parts;
-                std::stringstream ss{};
-                ss << Context::cxx;
-                command_parts.push_back(std::string{Context::cxx});
+    template <typename Context>
+    constexpr auto cxxflags_or_empty()
+    {
+        if constexpr (has_cxxflags_v<Context>)
+        {
+            return Context::cxxflags;
+        }
+        else
+        {
+            return std::array<std::string_view, 0>{};
+        }
+    }
 
-                if constexpr (has_source_v<Target>)
-                {
-                    static_assert(!Target::source.view().empty(), "Source file cannot be empty");
+    template <typename Context>
+    constexpr auto ldflags_or_empty()
+    {
+        if constexpr (has_ldflags_v<Context>)
+        {
+            return Context::ldflags;
+        }
+        else
+        {
+            return std::array<std::string_view, 0>{};
+        }
+    }
 
-                    auto target = source_to_target(Target::source);
-                    ss << " -c " << Target::source.view() << Context::obj_prefix.view() << target.view();
-                    command_parts.push_back("-c");
-                    command_parts.push_back(std::string(Target::source.view()));
-                    command_parts.push_back(std::string(Context::obj_prefix.view()));
-                    command_parts.push_back(std::string(target.view()));
-                    std::filesystem::path target_path{target.view()};
-                    std::filesystem::create_directories(target_path.parent_path());
+    // A Context building into a directory of its own, so several variants of one target can be built side by side.
+    // Derive from it to change flags, e.g. `struct Debug : Variant<GxxContext, StaticString{"debug"}>`.
+    template <typename Context, StaticString Name>
+    struct Variant : Context
+    {
+        static constexpr auto variant_name = Name;
+        static constexpr auto build_prefix = concat(Context::build_prefix, Name, StaticString{"/"});
+        static constexpr auto target_prefix = build_prefix;
+    };
 
-                    if constexpr (has_cxxflags_v<Context>)
-                    {
-                        for (const auto& flag : Context::cxxflags)
-                        {
-                            ss << " " << flag;
-                            command_parts.push_back(std::string(flag));
-                        }
-                    }
+    // Wraps a link target in a profile-guided optimization pipeline: an instrumented build, a run of the
+    // instrumented binary with `TrainingArgs`, profile merging, and an optimized rebuild that places the binary where
+    // the plain target would go.
+    template <typename Target, StaticString TrainingArgs>
+    struct PgoTarget
+    {
+        using Base = Target;
+        static constexpr auto training_args = TrainingArgs;
+    };
 
-                    commands.emplace_back(CompileCommand{std::filesystem::current_path().string(), command_parts,
-                                                         std::string{Target::source.view()}});
-                }
-                else
-                {
-                    static_assert(std::tuple_size_v<typename Target::Dependent> > 0,
-                                  "Link target must have dependencies (object files)");
+    // Context of the instrumented build, kept apart from the plain and optimized builds in its own build_prefix.
+    template <typename Context>
+    struct PgoGenerateContext : Context
+    {
+        static constexpr auto build_prefix = concat(Context::build_prefix, StaticString{"pgo-generate/"});
+        static constexpr auto target_prefix = build_prefix;
+        static constexpr auto cxxflags = concat_flags(cxxflags_or_empty<Context>(), Context::pgo_generate_flags);
+        static constexpr auto ldflags = concat_flags(ldflags_or_empty<Context>(), Context::pgo_generate_flags);
+    };
 
-                    ss << DependentNameCollector::target.view();
-                    ss << Context::bin_prefix.view() << Target::target.view();
-                    if constexpr (has_ldflags_v<Context>)
-                    {
-                        for (const auto& flag : Context::ldflags)
-                        {
-                            ss << " " << flag;
-                        }
-                    }
-                }
+    // Context of the optimized build. Compile nodes take the merged profile as an input, so new training data
+    // rebuilds them.
+    template <typename Context>
+    struct PgoUseContext : Context
+    {
+        static constexpr auto build_prefix = concat(Context::build_prefix, StaticString{"pgo-use/"});
+        static constexpr auto cxxflags = concat_flags(cxxflags_or_empty<Context>(), Context::pgo_use_flags);
+        static constexpr auto ldflags = concat_flags(ldflags_or_empty<Context>(), Context::pgo_use_flags);
+        static constexpr bool pgo_use = true;
+    };
+
+    template <typename Context>
+    struct CxxToolchain
+    {
+
+        template <typename Target>
+        struct CxxBuilder;
 
-                command = ss.str();
+        template <size_t Size>
+        constexpr static auto source_to_target(StaticString<Size> source)
+        {
+            return concat(Context::build_prefix, strip_suffix(source, StaticString{".cpp"}), Context::obj_postfix);
+        }
 
-                std::cout << type_name<Target>() << ":" << command << std::endl;
-                std::system(command.data());
-                std::cout << type_name<Target>() << ":finished" << std::endl;
+        template <typename T>
+        constexpr static auto module_source_to_target()
+        {
+            if constexpr (has_suffix(T::source, StaticString{".ixx"}))
+            {
+                return concat(Context::build_prefix, strip_suffix(T::source, StaticString{".ixx"}),
+                              Context::obj_postfix);
+            }
+            else
+            {
+                static_assert(has_suffix(T::source, StaticString{".cppm"}), "Module interfaces end in .cppm or .ixx");
+                return concat(Context::build_prefix, strip_suffix(T::source, StaticString{".cppm"}),
+                              Context::obj_postfix);
+            }
+        }
 
-                return commands;
+        template <typename T>
+        constexpr static auto node_output()
+        {
+            if constexpr (has_module_interface_v<T>)
+            {
+                return module_source_to_target<T>();
             }
-        };
-    };
+            else if constexpr (has_source_v<T>)
+            {
+                return source_to_target(T::source);
+            }
+            else if constexpr (has_test_v<T>)
+            {
+                // Stamp of the last pass; runs of one binary with different arguments are told apart by a hash.
+                constexpr auto binary = std::tuple_element_t<0, typename T::Dependent>::target;
+                if constexpr (T::test_args.size() == 0)
+                {
+                    return concat(Context::build_prefix, binary, StaticString{".passed"});
+                }
+                else
+                {
+                    return concat(Context::build_prefix, binary, StaticString{"."}, detail::to_hex(fnv1a(T::test_args)),
+                                  StaticString{".passed"});
+                }
+            }
+            else if constexpr (has_shared_library_v<T>)
+            {
+                static_assert(has_shared_prefix_v<Context>,
+                              "Context needs shared_prefix and shared_postfix to link shared libraries");
+                if constexpr (has_target_prefix_v<Context>)
+                {
+                    return concat(Context::target_prefix, T::target, Context::shared_postfix);
+                }
+                else
+                {
+                    return concat(T::target, Context::shared_postfix);
+                }
+            }
+            else
+            {
+                if constexpr (has_target_prefix_v<Context>)
+                {
+                    return concat(Context::target_prefix, T::target);
+                }
+                else
+                {
+                    return T::target;
+                }
+            }
+        }
+
+        // Static storage for the output paths the plan's nodes point to.
+        template <typename T>
+        static constexpr auto node_output_v = node_output<T>();
+
+        // Hash of the command-line pieces every node of `kind` shares.
+        static constexpr std::uint64_t command_fingerprint(BuildNodeKind kind, bool position_independent)
+        {
+            std::uint64_t hash = hash_combine(fnv1a_offset_basis, kind, fnv1a(Context::cxx));
+            if constexpr (has_module_interface_flags_v<Context>)
+            {
+                if (kind == BuildNodeKind::ModuleInterface)
+                {
+                    for (const auto& flag : Context::module_interface_flags)
+                    {
+                        hash = hash_combine(hash, fnv1a(flag));
+                    }
+                }
+            }
+            if (is_compile(kind))
+            {
+                hash = hash_combine(hash, fnv1a(Context::obj_prefix));
+                if constexpr (has_include_paths_v<Context>)
+                {
+                    for (const auto& path : Context::include_paths)
+                    {
+                        hash = hash_combine(hash, fnv1a(Context::include_prefix), fnv1a(path));
+                    }
+                }
+                if constexpr (has_cxxflags_v<Context>)
+                {
+                    for (const auto& flag : Context::cxxflags)
+                    {
+                        hash = hash_combine(hash, fnv1a(flag));
+                    }
+                }
+                if constexpr (has_shared_cxxflags_v<Context>)
+                {
+                    if (position_independent)
+                    {
+                        for (const auto& flag : Context::shared_cxxflags)
+                        {
+                            hash = hash_combine(hash, fnv1a(flag));
+                        }
+                    }
+                }
+            }
+            else if (kind == BuildNodeKind::Link || kind == BuildNodeKind::SharedLink)
+            {
+                if constexpr (has_shared_prefix_v<Context>)
+                {
+                    if (kind == BuildNodeKind::SharedLink)
+                    {
+                        hash = hash_combine(hash, fnv1a(Context::shared_prefix));
+                    }
+                }
+                hash = hash_combine(hash, fnv1a(Context::bin_prefix));
+                if constexpr (has_ldflags_v<Context>)
+                {
+                    for (const auto& flag : Context::ldflags)
+                    {
+                        hash = hash_combine(hash, fnv1a(flag));
+                    }
+                }
+            }
+            return hash;
+        }
+
+        template <typename Target>
+        static constexpr auto make_build_plan()
+        {
+            return []<typename... Ts>(std::tuple<Ts...>*)
+            {
+                using Order = std::tuple<Ts...>;
+                constexpr std::size_t input_count = (std::tuple_size_v<dependent_or_empty_t<Ts>> + ... + 0);
+                BuildPlan<sizeof...(Ts), input_count> plan{};
+                std::uint32_t node_index = 0;
+                std::uint32_t input_index = 0;
+                (
+                    [&]
+                    {
+                        auto& node = plan.nodes[node_index++];
+                        node.kind = has_module_interface_v<Ts> ? BuildNodeKind::ModuleInterface
+                                    : has_source_v<Ts>             ? BuildNodeKind::Compile
+                                    : has_test_v<Ts>               ? BuildNodeKind::Test
+                                    : has_shared_library_v<Ts>     ? BuildNodeKind::SharedLink
+                                                                   : BuildNodeKind::Link;
+                        node.name = type_name<Ts>();
+                        if constexpr (has_source_v<Ts>)
+                        {
+                            static_assert(!Ts::source.view().empty(), "Source file cannot be empty");
+                            node.source = Ts::source.view();
+                            node.position_independent = detail::linked_into_shared_v<Order, Ts>;
+                        }
+                        else if constexpr (has_test_v<Ts>)
+                        {
+                            static_assert(!has_source_v<std::tuple_element_t<0, typename Ts::Dependent>>,
+                                          "A test runs a link target, not a source");
+                            node.arguments = Ts::test_args.view();
+                            node.timeout_seconds = Ts::timeout_seconds;
+                        }
+                        else
+                        {
+                            static_assert(std::tuple_size_v<typename Ts::Dependent> > 0,
+                                          "Link target must have dependencies (object files)");
+                        }
+                        node.output = node_output_v<Ts>.view();
+                        node.first_input = input_index;
+                        [&]<typename... Ds>(std::tuple<Ds...>*) {
+                            ((plan.inputs[input_index++] = detail::index_of<Ds>(static_cast<Order*>(nullptr))), ...);
+                        }(static_cast<dependent_or_empty_t<Ts>*>(nullptr));
+                        node.input_count = input_index - node.first_input;
+                        node.fingerprint =
+                            hash_combine(command_fingerprint(node.kind, node.position_independent), fnv1a(node.source),
+                                         fnv1a(node.output), fnv1a(node.arguments), node.timeout_seconds);
+                        for (auto input : plan.inputs_of(node))
+                        {
+                            node.fingerprint = hash_combine(node.fingerprint, fnv1a(plan.nodes[input].output));
+                            if constexpr (has_rpath_prefix_v<Context>)
+                            {
+                                if (plan.nodes[input].kind == BuildNodeKind::SharedLink && !is_compile(node.kind))
+                                {
+                                    node.fingerprint = hash_combine(node.fingerprint, fnv1a(Context::rpath_prefix));
+                                }
+                            }
+                        }
+                        if constexpr (has_soname_prefix_v<Context>)
+                        {
+                            if (node.kind == BuildNodeKind::SharedLink)
+                            {
+                                node.fingerprint = hash_combine(node.fingerprint, fnv1a(Context::soname_prefix));
+                            }
+                        }
+                    }(),
+                    ...);
+                return plan;
+            }(static_cast<BuildOrder<Target>*>(nullptr));
+        }
+
+        template <typename Target>
+        static constexpr auto build_plan = make_build_plan<Target>();
+
+        // Shared by every builder of this toolchain so headers common to several sources are scanned once.
+        static IncludeScanner& include_scanner()
+        {
+            static IncludeScanner scanner{[]
+                                          {
+                                              std::vector<std::filesystem::path> paths{};
+                                              if constexpr (has_include_paths_v<Context>)
+                                              {
+                                                  for (const auto& path : Context::include_paths)
+                                                  {
+                                                      paths.emplace_back(path);
+                                                  }
+                                              }
+                                              return paths;
+                                          }()};
+            return scanner;
+        }
+
+        // Module structure of a plan, scanned from the sources of its compile nodes, and the order to run the nodes
+        // in: plan order, except that a module's BMI is built before every unit that imports it.
+        struct ModuleGraph
+        {
+            std::vector<ModuleUnit> units{};
+            // Modules each node needs the BMIs of, transitively, dependencies first.
+            std::vector<std::vector<std::string>> imports{};
+            // Modules with a BMI built by this plan and the node building it.
+            std::map<std::string, std::uint32_t, std::less<>> providers{};
+            std::vector<std::uint32_t> order{};
+        };
+
+        // Interfaces and partitions get a BMI; implementation units of a primary module do not.
+        static bool provides_bmi(const ModuleUnit& unit)
+        {
+            return unit.interface || unit.name.find(':') != std::string::npos;
+        }
+
+        static std::string bmi_path(std::string_view module)
+        {
+            if constexpr (has_bmi_postfix_v<Context>)
+            {
+                std::string result{Context::build_prefix.view()};
+                for (char c : module)
+                {
+                    result.push_back(c == ':' ? '-' : c);
+                }
+                result += Context::bmi_postfix.view();
+                return result;
+            }
+            else
+            {
+                SOPHO_ASSERT(false, "module ", module, " needs Context::bmi_postfix");
+            }
+        }
+
+        static std::string module_mapper_path() { return std::string{Context::build_prefix.view()} + "modules.map"; }
+
+        template <typename Plan>
+        static ModuleGraph scan_modules(const Plan& plan)
+        {
+            ModuleGraph graph{};
+            graph.units.resize(plan.nodes.size());
+            graph.imports.resize(plan.nodes.size());
+            for (std::uint32_t index = 0; index < plan.nodes.size(); ++index)
+            {
+                const auto& node = plan.nodes[index];
+                if (!is_compile(node.kind))
+                {
+                    continue;
+                }
+                const auto& unit = graph.units[index] =
+                    include_scanner().module_unit(std::filesystem::path{node.source});
+                if (provides_bmi(unit))
+                {
+                    auto [iter, inserted] = graph.providers.emplace(unit.name, index);
+                    SOPHO_ASSERT(inserted, "module ", unit.name, " is declared by both ",
+                                 plan.nodes[iter->second].source, " and ", node.source);
+                }
+            }
+
+            // Depth first over plan inputs and imports. Imports of modules this plan does not build, such as
+            // `import std;`, are left to the compiler.
+            enum class Mark : std::uint8_t
+            {
+                Unvisited,
+                Visiting,
+                Done,
+            };
+            std::vector<Mark> marks(plan.nodes.size(), Mark::Unvisited);
+            auto visit = [&](auto& self, std::uint32_t index) -> void
+            {
+                if (marks[index] == Mark::Done)
+                {
+                    return;
+                }
+                SOPHO_ASSERT(marks[index] == Mark::Unvisited, "module import cycle through ",
+                             plan.nodes[index].source);
+                marks[index] = Mark::Visiting;
+                for (auto input : plan.inputs_of(plan.nodes[index]))
+                {
+                    self(self, input);
+                }
+                auto& imports = graph.imports[index];
+                auto add_import = [&](const std::string& name)
+                {
+                    auto iter = graph.providers.find(name);
+                    if (iter == graph.providers.end())
+                    {
+                        return;
+                    }
+                    self(self, iter->second);
+                    for (const auto& module : graph.imports[iter->second])
+                    {
+                        if (std::find(imports.begin(), imports.end(), module) == imports.end())
+                        {
+                            imports.push_back(module);
+                        }
+                    }
+                    if (std::find(imports.begin(), imports.end(), name) == imports.end())
+                    {
+                        imports.push_back(name);
+                    }
+                };
+                const auto& unit = graph.units[index];
+                if (!unit.name.empty() && !provides_bmi(unit))
+                {
+                    // An implementation unit implicitly imports its primary interface.
+                    add_import(unit.name);
+                }
+                for (const auto& name : unit.imports)
+                {
+                    add_import(name);
+                }
+                marks[index] = Mark::Done;
+                graph.order.push_back(index);
+            };
+            for (std::uint32_t index = 0; index < plan.nodes.size(); ++index)
+            {
+                visit(visit, index);
+            }
+            return graph;
+        }
+
+        // "name bmi" per line, the format of g++'s -fmodule-mapper file.
+        static void write_module_mapper(const ModuleGraph& graph)
+        {
+            if constexpr (has_module_mapper_prefix_v<Context>)
+            {
+                if (graph.providers.empty())
+                {
+                    return;
+                }
+                std::filesystem::create_directories(std::filesystem::path{module_mapper_path()}.parent_path());
+                std::ofstream out(module_mapper_path());
+                for (const auto& [name, index] : graph.providers)
+                {
+                    out << name << ' ' << bmi_path(name) << '\n';
+                }
+            }
+        }
+
+        // Where gcc's -fprofile-generate writes the counts of an object file, and -fprofile-use reads them from.
+        static std::string gcda_path(const BuildNode& node)
+        {
+            auto stem = node.output.substr(0, node.output.size() - Context::obj_postfix.size());
+            return std::string{stem} + ".gcda";
+        }
+
+        // The profile a compile node is optimized with: the merged profile when the Context merges with a command
+        // (llvm-profdata), the object's own .gcda otherwise.
+        static std::string pgo_profile(const BuildNode& node)
+        {
+            if constexpr (has_pgo_merge_command_v<Context>)
+            {
+                return std::string{Context::pgo_profile.view()};
+            }
+            else
+            {
+                return gcda_path(node);
+            }
+        }
+
+        // Hex hash of a shared library's exported symbols, rewritten only when it changes.
+        static std::string interface_path(const BuildNode& node) { return std::string{node.output} + ".interface"; }
+
+        // Touched on every check of the interface, so an unchanged library is not hashed again.
+        static std::string interface_checked_path(const BuildNode& node)
+        {
+            return std::string{node.output} + ".interface-checked";
+        }
+
+        static bool update_interface(const BuildNode& node)
+        {
+            SOPHO_STACK();
+            auto hash = library_interface_hash(std::filesystem::path{node.output});
+            std::string text = std::string{detail::to_hex(hash).view()} + "\n";
+            std::filesystem::path path{interface_path(node)};
+            if (!std::filesystem::exists(path) || read_file(path) != text)
+            {
+                std::ofstream{path} << text;
+            }
+            return true;
+        }
+
+        // Files whose timestamps decide whether a node is up to date: a source, its headers and the BMIs of the
+        // modules it imports, or the outputs of the nodes it links.
+        template <typename Plan>
+        static std::vector<std::filesystem::path> node_inputs(const Plan& plan, const ModuleGraph& graph,
+                                                              std::uint32_t index)
+        {
+            const auto& node = plan.nodes[index];
+            std::vector<std::filesystem::path> result{};
+            if (is_compile(node.kind))
+            {
+                result = include_scanner().dependencies(std::filesystem::path{node.source});
+                result.emplace_back(node.source);
+                for (const auto& module : graph.imports[index])
+                {
+                    result.emplace_back(bmi_path(module));
+                }
+                if constexpr (has_pgo_use_v<Context>)
+                {
+                    result.emplace_back(pgo_profile(node));
+                }
+            }
+            if (node.kind == BuildNodeKind::Test)
+            {
+                // The binary, and every shared library it loads: a test reruns on changes behind a stable interface.
+                std::vector<std::uint32_t> pending{plan.inputs_of(node).begin(), plan.inputs_of(node).end()};
+                while (!pending.empty())
+                {
+                    const auto& input = plan.nodes[pending.back()];
+                    pending.pop_back();
+                    result.emplace_back(input.output);
+                    for (auto dependency : plan.inputs_of(input))
+                    {
+                        if (plan.nodes[dependency].kind == BuildNodeKind::SharedLink)
+                        {
+                            pending.push_back(dependency);
+                        }
+                    }
+                }
+                return result;
+            }
+            for (auto input : plan.inputs_of(node))
+            {
+                // A shared library counts through its interface file, which only changes with its exported symbols.
+                result.emplace_back(plan.nodes[input].kind == BuildNodeKind::SharedLink
+                                        ? interface_path(plan.nodes[input])
+                                        : std::string{plan.nodes[input].output});
+            }
+            return result;
+        }
+
+        // Flags that tell the compiler where a unit's own BMI goes and where the BMIs it imports are.
+        static std::vector<std::string> module_flags(const ModuleUnit& unit, const std::vector<std::string>& imports)
+        {
+            std::vector<std::string> result{};
+            if (unit.name.empty() && unit.imports.empty())
+            {
+                return result;
+            }
+            if constexpr (has_module_flags_v<Context>)
+            {
+                for (const auto& flag : Context::module_flags)
+                {
+                    result.emplace_back(flag);
+                }
+            }
+            if constexpr (has_module_mapper_prefix_v<Context>)
+            {
+                result.push_back(std::string{Context::module_mapper_prefix.view()} + module_mapper_path());
+            }
+            else if constexpr (has_module_reference_prefix_v<Context>)
+            {
+                if (provides_bmi(unit))
+                {
+                    result.push_back(std::string{Context::module_output_prefix.view()} + bmi_path(unit.name));
+                }
+                for (const auto& module : imports)
+                {
+                    result.push_back(std::string{Context::module_reference_prefix.view()} + module + "=" +
+                                     bmi_path(module));
+                }
+            }
+            else
+            {
+                SOPHO_ASSERT(false, "Context has no module_mapper_prefix or module_reference_prefix for module ",
+                             unit.name);
+            }
+            return result;
+        }
+
+        // Per-node link flags, each with a leading space: a shared library's soname, and search paths, relative to the
+        // linked file through $ORIGIN, of the shared libraries a link takes. `ninja` escapes the dollar for a ninja
+        // file; both quote it for the shell.
+        template <typename Plan>
+        static std::string link_flags(const Plan& plan, const BuildNode& node, bool ninja)
+        {
+            std::string result{};
+            if constexpr (has_soname_prefix_v<Context>)
+            {
+                if (node.kind == BuildNodeKind::SharedLink)
+                {
+                    result += " '" + std::string{Context::soname_prefix.view()} +
+                              std::filesystem::path{node.output}.filename().string() + "'";
+                }
+            }
+            if constexpr (has_rpath_prefix_v<Context>)
+            {
+                auto origin = std::filesystem::path{node.output}.parent_path();
+                std::vector<std::string> directories{};
+                for (auto input : plan.inputs_of(node))
+                {
+                    if (plan.nodes[input].kind != BuildNodeKind::SharedLink)
+                    {
+                        continue;
+                    }
+                    auto relative = std::filesystem::path{plan.nodes[input].output}.parent_path().lexically_relative(
+                        origin.empty() ? std::filesystem::path{"."} : origin);
+                    auto directory = std::string{ninja ? "$$ORIGIN" : "$ORIGIN"};
+                    if (!relative.empty() && relative != ".")
+                    {
+                        directory += "/" + relative.generic_string();
+                    }
+                    if (std::find(directories.begin(), directories.end(), directory) == directories.end())
+                    {
+                        result += " '" + std::string{Context::rpath_prefix.view()} + directory + "'";
+                        directories.push_back(std::move(directory));
+                    }
+                }
+            }
+            else
+            {
+                static_cast<void>(plan);
+                static_cast<void>(ninja);
+            }
+            return result;
+        }
+
+        // The shell command for a node; compile nodes also get their compile_commands.json entry, in `directory`.
+        template <typename Plan>
+        static std::string node_command(const Plan& plan, const ModuleGraph& graph, std::uint32_t index,
+                                        CompileCommands& commands, std::string_view directory)
+        {
+            const auto& node = plan.nodes[index];
+            std::stringstream ss{};
+            if (node.kind == BuildNodeKind::Test)
+            {
+                // A bare file name would be looked up in PATH.
+                std::filesystem::path binary{plan.nodes[plan.inputs_of(node)[0]].output};
+                ss << (binary.has_parent_path() ? binary : std::filesystem::path{"."} / binary).string();
+                if (!node.arguments.empty())
+                {
+                    ss << " " << node.arguments;
+                }
+                return ss.str();
+            }
+            ss << Context::cxx;
+            if (is_compile(node.kind))
+            {
+                // Plan strings and Context flags are in static storage; only composed flags need interning.
+                commands.add(directory, node.source);
+                commands.add_argument(Context::cxx);
+                if constexpr (has_module_interface_flags_v<Context>)
+                {
+                    if (node.kind == BuildNodeKind::ModuleInterface)
+                    {
+                        for (const auto& flag : Context::module_interface_flags)
+                        {
+                            ss << " " << flag;
+                            commands.add_argument(flag);
+                        }
+                    }
+                }
+                ss << " -c " << node.source << Context::obj_prefix.view() << node.output;
+                commands.add_argument("-c");
+                commands.add_argument(node.source);
+                commands.add_argument(Context::obj_prefix.view());
+                commands.add_argument(node.output);
+
+                if constexpr (has_include_paths_v<Context>)
+                {
+                    for (const auto& path : Context::include_paths)
+                    {
+                        ss << " " << Context::include_prefix.view() << path;
+                        commands.add_argument(
+                            commands.intern(std::string{Context::include_prefix.view()} + std::string{path}));
+                    }
+                }
+
+                if constexpr (has_cxxflags_v<Context>)
+                {
+                    for (const auto& flag : Context::cxxflags)
+                    {
+                        ss << " " << flag;
+                        commands.add_argument(flag);
+                    }
+                }
+
+                if constexpr (has_shared_cxxflags_v<Context>)
+                {
+                    if (node.position_independent)
+                    {
+                        for (const auto& flag : Context::shared_cxxflags)
+                        {
+                            ss << " " << flag;
+                            commands.add_argument(flag);
+                        }
+                    }
+                }
+
+                for (const auto& flag : module_flags(graph.units[index], graph.imports[index]))
+                {
+                    ss << " " << flag;
+                    commands.add_argument(commands.intern(flag));
+                }
+            }
+            else
+            {
+                for (auto input : plan.inputs_of(node))
+                {
+                    ss << " " << plan.nodes[input].output;
+                }
+                if constexpr (has_shared_prefix_v<Context>)
+                {
+                    ss << (node.kind == BuildNodeKind::SharedLink ? Context::shared_prefix.view()
+                                                                  : Context::bin_prefix.view());
+                }
+                else
+                {
+                    ss << Context::bin_prefix.view();
+                }
+                ss << node.output << link_flags(plan, node, false);
+                if constexpr (has_ldflags_v<Context>)
+                {
+                    for (const auto& flag : Context::ldflags)
+                    {
+                        ss << " " << flag;
+                    }
+                }
+            }
+            return ss.str();
+        }
+
+        // Name of a node in build output, tagged with the variant when the Context is one. Tests go by their command
+        // line, which is also their name in reports and the duration history.
+        template <typename Plan>
+        static std::string job_name(const Plan& plan, const BuildNode& node)
+        {
+            std::string name{node.name};
+            if (node.kind == BuildNodeKind::Test)
+            {
+                name = plan.nodes[plan.inputs_of(node)[0]].output;
+                if (!node.arguments.empty())
+                {
+                    name += " " + std::string{node.arguments};
+                }
+            }
+            if constexpr (has_variant_name_v<Context>)
+            {
+                name += "@" + std::string{Context::variant_name.view()};
+            }
+            return name;
+        }
+
+        // A rough compile speed for jobs with no recorded duration: about a second per megabyte of source and headers.
+        static constexpr double seconds_per_input_byte = 1e-6;
+
+        // How long a node's job takes: its last duration, or for a compile never timed, a guess from the size of the
+        // files it reads. Other jobs are cheap next to compiles until measured.
+        static double expected_seconds(const BuildNode& node, const BuildJob& job)
+        {
+            if (auto seconds = job_history().seconds(node.output))
+            {
+                return *seconds;
+            }
+            if (!is_compile(node.kind))
+            {
+                return 0.0;
+            }
+            std::uintmax_t bytes = 0;
+            for (const auto& input : job.inputs)
+            {
+                std::error_code ec{};
+                auto size = std::filesystem::file_size(input, ec);
+                bytes += ec ? 0 : size;
+            }
+            return static_cast<double>(bytes) * seconds_per_input_byte;
+        }
+
+        // Adds the plan's nodes to `pool`, module interfaces ahead of their importers, and appends the
+        // compile_commands.json entries of its compile nodes to `commands`. Nothing runs until the pool does.
+        template <typename Plan>
+        static void enqueue(JobPool& pool, const Plan& plan, CompileCommands& commands)
+        {
+            SOPHO_STACK();
+            auto directory = commands.intern(std::filesystem::current_path().string());
+            auto graph = scan_modules(plan);
+            write_module_mapper(graph);
+            std::vector<std::size_t> job_of(plan.nodes.size());
+            for (auto index : graph.order)
+            {
+                const auto& node = plan.nodes[index];
+                BuildJob job{job_name(plan, node), node_command(plan, graph, index, commands, directory), {},
+                             node_inputs(plan, graph, index), {std::filesystem::path{node.output}}, {}};
+                job.expected_seconds = expected_seconds(node, job);
+                if (node.kind == BuildNodeKind::Test)
+                {
+                    if (!test_options().selects(job.name))
+                    {
+                        // Another shard runs it; nothing depends on a test.
+                        continue;
+                    }
+                    job.timeout = std::chrono::seconds{node.timeout_seconds};
+                    job.retries = test_options().retries;
+                    job.stamp_outputs = true;
+                    job.test = true;
+                    job.expected_seconds = test_history().expected_seconds(job.name);
+                }
+                if (provides_bmi(graph.units[index]))
+                {
+                    job.outputs.emplace_back(bmi_path(graph.units[index].name));
+                }
+                for (auto input : plan.inputs_of(node))
+                {
+                    job.dependencies.push_back(job_of[input]);
+                }
+                for (const auto& module : graph.imports[index])
+                {
+                    job.dependencies.push_back(job_of[graph.providers.find(module)->second]);
+                }
+                if (auto parent = std::filesystem::path{node.output}.parent_path(); !parent.empty())
+                {
+                    std::filesystem::create_directories(parent);
+                }
+                job_of[index] = pool.add(std::move(job));
+                if (node.kind == BuildNodeKind::SharedLink)
+                {
+                    // Binaries linking the library wait for its interface instead, and relink when that changed.
+                    BuildJob interface{job_name(plan, node) + ":interface", "hash exported symbols of " +
+                                                                                std::string{node.output},
+                                       [&node] { return update_interface(node); },
+                                       {std::filesystem::path{node.output}},
+                                       {std::filesystem::path{interface_checked_path(node)}},
+                                       {job_of[index]}};
+                    interface.stamp_outputs = true;
+                    job_of[index] = pool.add(std::move(interface));
+                }
+            }
+        }
+
+        // Ninja rules of this Context, named `rules` followed by _cxx, _link, _shared and _test. The Context's flags
+        // are part of the rules; build lines only add what differs between nodes.
+        static void write_ninja_rules(std::ostream& out, std::string_view rules)
+        {
+            out << "rule " << rules << "_cxx\n  command = " << Context::cxx << " $pre_flags -c $in"
+                << Context::obj_prefix.view() << "$out";
+            if constexpr (has_include_paths_v<Context>)
+            {
+                for (const auto& path : Context::include_paths)
+                {
+                    out << " " << Context::include_prefix.view() << path;
+                }
+            }
+            if constexpr (has_cxxflags_v<Context>)
+            {
+                for (const auto& flag : Context::cxxflags)
+                {
+                    out << " " << flag;
+                }
+            }
+            out << " $flags";
+            if constexpr (has_depfile_flags_v<Context>)
+            {
+                for (const auto& flag : Context::depfile_flags)
+                {
+                    out << " " << flag;
+                }
+                out << " $out.d\n  depfile = $out.d\n  deps = gcc";
+            }
+            else if constexpr (has_show_includes_flags_v<Context>)
+            {
+                for (const auto& flag : Context::show_includes_flags)
+                {
+                    out << " " << flag;
+                }
+                out << "\n  deps = msvc";
+            }
+            out << "\n  description = CXX $out\n\n";
+
+            auto ldflags = [&out]
+            {
+                if constexpr (has_ldflags_v<Context>)
+                {
+                    for (const auto& flag : Context::ldflags)
+                    {
+                        out << " " << flag;
+                    }
+                }
+            };
+            out << "rule " << rules << "_link\n  command = " << Context::cxx << " $in" << Context::bin_prefix.view()
+                << "$out$link_flags";
+            ldflags();
+            out << "\n  description = LINK $out\n\n";
+            if constexpr (has_shared_prefix_v<Context>)
+            {
+                out << "rule " << rules << "_shared\n  command = " << Context::cxx << " $in"
+                    << Context::shared_prefix.view() << "$out$link_flags";
+                ldflags();
+                out << "\n  description = LINK $out\n\n";
+            }
+            // The stamp marks the last pass, as in the native executor.
+            out << "rule " << rules << "_test\n  command = $binary $args && touch $out\n"
+                << "  description = TEST $binary\n\n";
+        }
+
+        // Build lines of the plan's nodes, using the rules write_ninja_rules() wrote under the same name. Outputs in
+        // `written` are skipped, so variants sharing outputs declare each once; the plan's outputs are added to it.
+        template <typename Plan>
+        static void write_ninja_edges(std::ostream& out, const Plan& plan, std::string_view rules,
+                                      std::set<std::string, std::less<>>& written)
+        {
+            SOPHO_STACK();
+            auto graph = scan_modules(plan);
+            write_module_mapper(graph);
+            for (auto index : graph.order)
+            {
+                const auto& node = plan.nodes[index];
+                if (!written.emplace(node.output).second)
+                {
+                    continue;
+                }
+                const auto& unit = graph.units[index];
+                out << "build " << ninja_escape(node.output);
+                if (provides_bmi(unit))
+                {
+                    out << " | " << ninja_escape(bmi_path(unit.name));
+                }
+                out << ": " << rules;
+                if (is_compile(node.kind))
+                {
+                    out << "_cxx " << ninja_escape(node.source);
+                    std::vector<std::string> implicit{};
+                    for (const auto& module : graph.imports[index])
+                    {
+                        implicit.push_back(bmi_path(module));
+                    }
+                    if constexpr (!has_depfile_flags_v<Context> && !has_show_includes_flags_v<Context>)
+                    {
+                        // Without compiler-reported dependencies, the scanned headers are listed up front.
+                        for (const auto& header : include_scanner().dependencies(std::filesystem::path{node.source}))
+                        {
+                            implicit.push_back(header.string());
+                        }
+                    }
+                    if (!implicit.empty())
+                    {
+                        out << " |";
+                        for (const auto& path : implicit)
+                        {
+                            out << " " << ninja_escape(path);
+                        }
+                    }
+                    out << "\n";
+                    if constexpr (has_module_interface_flags_v<Context>)
+                    {
+                        if (node.kind == BuildNodeKind::ModuleInterface)
+                        {
+                            out << "  pre_flags =";
+                            for (const auto& flag : Context::module_interface_flags)
+                            {
+                                out << " " << flag;
+                            }
+                            out << "\n";
+                        }
+                    }
+                    std::string flags{};
+                    if constexpr (has_shared_cxxflags_v<Context>)
+                    {
+                        if (node.position_independent)
+                        {
+                            for (const auto& flag : Context::shared_cxxflags)
+                            {
+                                flags += " " + std::string{flag};
+                            }
+                        }
+                    }
+                    for (const auto& flag : module_flags(unit, graph.imports[index]))
+                    {
+                        flags += " " + flag;
+                    }
+                    if (!flags.empty())
+                    {
+                        out << "  flags =" << flags << "\n";
+                    }
+                }
+                else if (node.kind == BuildNodeKind::Test)
+                {
+                    // The binary, and every shared library it loads.
+                    out << "_test |";
+                    std::vector<std::uint32_t> pending{plan.inputs_of(node).begin(), plan.inputs_of(node).end()};
+                    while (!pending.empty())
+                    {
+                        const auto& input = plan.nodes[pending.back()];
+                        pending.pop_back();
+                        out << " " << ninja_escape(input.output);
+                        for (auto dependency : plan.inputs_of(input))
+                        {
+                            if (plan.nodes[dependency].kind == BuildNodeKind::SharedLink)
+                            {
+                                pending.push_back(dependency);
+                            }
+                        }
+                    }
+                    std::filesystem::path binary{plan.nodes[plan.inputs_of(node)[0]].output};
+                    out << "\n  binary = "
+                        << (binary.has_parent_path() ? binary : std::filesystem::path{"."} / binary).string() << "\n";
+                    if (!node.arguments.empty())
+                    {
+                        out << "  args = " << node.arguments << "\n";
+                    }
+                }
+                else
+                {
+                    out << (node.kind == BuildNodeKind::SharedLink ? "_shared" : "_link");
+                    for (auto input : plan.inputs_of(node))
+                    {
+                        out << " " << ninja_escape(plan.nodes[input].output);
+                    }
+                    out << "\n";
+                    if (auto flags = link_flags(plan, node, true); !flags.empty())
+                    {
+                        out << "  link_flags =" << flags << "\n";
+                    }
+                }
+            }
+        }
+
+        // Runs the plan's nodes on a job pool of their own, skipping those whose outputs are newer than all of their
+        // inputs, then reports the tests among them and the build's critical path. Returns whether every job
+        // succeeded.
+        template <typename Plan>
+        static bool execute(const Plan& plan, CompileCommands& commands)
+        {
+            SOPHO_STACK();
+            JobPool pool{};
+            enqueue(pool, plan, commands);
+            bool succeeded = pool.run();
+            report_tests(pool.results());
+            report_build(pool);
+            return succeeded;
+        }
+
+        template <typename Target>
+        struct CxxBuilder
+        {
+            static constexpr const auto& plan = build_plan<Target>;
+
+            static bool build(CompileCommands& commands) { return execute(plan, commands); }
+
+            static BuildResult build()
+            {
+                BuildResult result{};
+                result.succeeded = build(result.commands);
+                return result;
+            }
+        };
+
+        // Each stage reruns only when its inputs changed: the two builds through execute(), the training run when the
+        // instrumented binary is newer than its stamp, the merge when the raw profiles are newer than the merged ones.
+        // The collected commands are those of the optimized build. A failed stage fails the build; the optimized build
+        // still runs after a failed training run, with the profiles there are.
+        template <typename Target, StaticString TrainingArgs>
+        struct CxxBuilder<PgoTarget<Target, TrainingArgs>>
+        {
+            using Generate = CxxToolchain<PgoGenerateContext<Context>>;
+            using Use = CxxToolchain<PgoUseContext<Context>>;
+
+            static constexpr const auto& generate_plan = Generate::template build_plan<Target>;
+            static constexpr const auto& use_plan = Use::template build_plan<Target>;
+            static constexpr auto training_stamp =
+                concat(PgoGenerateContext<Context>::build_prefix, StaticString{"training.stamp"});
+
+            static bool train()
+            {
+                SOPHO_STACK();
+                std::filesystem::path binary{generate_plan.nodes.back().output};
+                std::filesystem::path stamp{training_stamp.view()};
+                if (is_up_to_date(stamp, {binary}))
+                {
+                    std::cout << "pgo-train:up to date" << std::endl;
+                    return true;
+                }
+                if constexpr (!has_pgo_merge_command_v<Context>)
+                {
+                    // gcc adds to existing .gcda files, which would mix in counts of an older binary.
+                    for (const auto& node : generate_plan.nodes)
+                    {
+                        if (is_compile(node.kind))
+                        {
+                            std::error_code ec{};
+                            std::filesystem::remove(Generate::gcda_path(node), ec);
+                        }
+                    }
+                }
+                auto command = binary.string() + " " + std::string{TrainingArgs.view()};
+                std::cout << "pgo-train:" << command << std::endl;
+                if (std::system(command.data()) != 0)
+                {
+                    // No stamp, so the next build trains again.
+                    std::cout << "pgo-train:failed" << std::endl;
+                    return false;
+                }
+                std::ofstream{stamp};
+                std::cout << "pgo-train:finished" << std::endl;
+                return true;
+            }
+
+            static bool merge()
+            {
+                SOPHO_STACK();
+                if constexpr (has_pgo_merge_command_v<Context>)
+                {
+                    if (is_up_to_date(Context::pgo_profile.view(), {std::filesystem::path{training_stamp.view()}}))
+                    {
+                        return true;
+                    }
+                    std::string command{Context::pgo_merge_command.view()};
+                    std::cout << "pgo-merge:" << command << std::endl;
+                    if (std::system(command.data()) != 0)
+                    {
+                        std::cout << "pgo-merge:failed" << std::endl;
+                        return false;
+                    }
+                    return true;
+                }
+                else
+                {
+                    // The plans list the same targets in the same order, so node i is the same object in both.
+                    for (std::size_t i = 0; i < generate_plan.nodes.size(); ++i)
+                    {
+                        if (!is_compile(generate_plan.nodes[i].kind))
+                        {
+                            continue;
+                        }
+                        std::filesystem::path from{Generate::gcda_path(generate_plan.nodes[i])};
+                        std::filesystem::path to{Use::gcda_path(use_plan.nodes[i])};
+                        std::error_code ec{};
+                        if (!std::filesystem::exists(from, ec) || is_up_to_date(to, {from}))
+                        {
+                            continue;
+                        }
+                        std::filesystem::create_directories(to.parent_path());
+                        std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+                        SOPHO_ASSERT(!ec, "cannot copy ", from.string(), " to ", to.string(), ": ", ec.message());
+                    }
+                    return true;
+                }
+            }
+
+            static bool build(CompileCommands& commands)
+            {
+                SOPHO_STACK();
+                CompileCommands instrumented{};
+                // Training a binary that failed to build would run an older one.
+                bool succeeded = Generate::execute(generate_plan, instrumented) && train();
+                succeeded = merge() && succeeded;
+                return Use::execute(use_plan, commands) && succeeded;
+            }
+
+            static BuildResult build()
+            {
+                BuildResult result{};
+                result.succeeded = build(result.commands);
+                return result;
+            }
+        };
+    };
+
+    // Builds Target once per Context through one job pool, so the variants' jobs run interleaved on every core.
+    // Outputs the variants have in common are built once. Appends the compile_commands.json entries of all variants to
+    // `commands`. Returns whether every job of every variant succeeded.
+    template <typename Target, typename... Contexts>
+    bool build_variants(CompileCommands& commands)
+    {
+        SOPHO_STACK();
+        JobPool pool{};
+        (CxxToolchain<Contexts>::enqueue(pool, CxxToolchain<Contexts>::template build_plan<Target>, commands), ...);
+        bool succeeded = pool.run();
+        report_tests(pool.results());
+        report_build(pool);
+        return succeeded;
+    }
+
+    template <typename Target, typename... Contexts>
+    BuildResult build_variants()
+    {
+        BuildResult result{};
+        result.succeeded = build_variants<Target, Contexts...>(result.commands);
+        return result;
+    }
+
+    // Writes a ninja file that builds Target once per Context, for handing large graphs to ninja. Each Context gets
+    // its rules, named after its variant or its position; headers come from the compiler's depfile where the Context
+    // has depfile_flags or show_includes_flags. Like the single header, the file is rewritten only when its content
+    // changes, so ninja does not reload it. Shared libraries relink their dependents on every change, and tests have
+    // no timeout or retries.
+    template <typename Target, typename... Contexts>
+    void write_build_ninja(const std::filesystem::path& path = "build.ninja")
+    {
+        SOPHO_STACK();
+        static_assert(sizeof...(Contexts) > 0, "write_build_ninja needs at least one Context");
+        std::ostringstream out{};
+        out << "# Generated by sob.hpp; changes are overwritten.\nninja_required_version = 1.7\n\n";
+        std::set<std::string, std::less<>> written{};
+        std::size_t position = 0;
+        (
+            [&]
+            {
+                using Toolchain = CxxToolchain<Contexts>;
+                std::string rules{};
+                if constexpr (has_variant_name_v<Contexts>)
+                {
+                    rules = Contexts::variant_name.view();
+                }
+                else
+                {
+                    rules = "context" + std::to_string(position);
+                }
+                ++position;
+                Toolchain::write_ninja_rules(out, rules);
+                Toolchain::write_ninja_edges(out, Toolchain::template build_plan<Target>, rules, written);
+                out << "\n";
+            }(),
+            ...);
+        auto content = out.str();
+        if (!output_matches(path, {content}))
+        {
+            write_segments_atomic(path, {content});
+        }
+    }
 
 } // namespace sopho
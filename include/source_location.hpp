@@ -0,0 +1,12 @@
+#pragma once
+#include <cstdint>
+
+namespace sopho
+{
+    struct SourceLocation
+    {
+        const char* file_name{};
+        const char* function_name{};
+        std::uint32_t line_number{};
+    };
+} // namespace sopho
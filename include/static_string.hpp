@@ -71,4 +71,62 @@ namespace sopho
 
         return result;
     }
+
+    // Variadic append in a single step, so joining many strings does not nest one instantiation per part.
+    template <std::size_t... Sizes>
+    constexpr StaticString<(Sizes + ... + 0)> concat(const StaticString<Sizes>&... parts)
+    {
+        StaticString<(Sizes + ... + 0)> result{};
+        std::size_t offset = 0;
+        (
+            [&]
+            {
+                for (std::size_t i = 0; i < parts.size(); ++i)
+                {
+                    result.data[offset + i] = parts[i];
+                }
+                offset += parts.size();
+            }(),
+            ...);
+        return result;
+    }
+
+    inline constexpr std::uint64_t fnv1a_offset_basis = 0xcbf29ce484222325ULL;
+
+    // FNV-1a, stable across runs and platforms so it can be persisted in manifests and build logs. `hash` continues
+    // an earlier digest.
+    constexpr std::uint64_t fnv1a(std::string_view str, std::uint64_t hash = fnv1a_offset_basis)
+    {
+        for (char c : str)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    template <std::size_t Size>
+    constexpr std::uint64_t fnv1a(const StaticString<Size>& str)
+    {
+        return fnv1a(str.view());
+    }
+
+    // Folds each value into `seed` in order. Parts are hashed separately before combining, so {"ab", "c"} and
+    // {"a", "bc"} do not collide the way hashing their concatenation would.
+    template <typename... Values>
+    constexpr std::uint64_t hash_combine(std::uint64_t seed, Values... values)
+    {
+        (
+            [&]
+            {
+                std::uint64_t value = static_cast<std::uint64_t>(values);
+                for (int i = 0; i < 8; ++i)
+                {
+                    seed ^= (value >> (i * 8)) & 0xff;
+                    seed *= 0x100000001b3ULL;
+                }
+            }(),
+            ...);
+        return seed;
+    }
 } // namespace sopho
@@ -0,0 +1,175 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include "job_pool.hpp"
+#include "static_string.hpp"
+
+namespace sopho
+{
+    // How this process runs tests, read once from the environment:
+    //   SOB_TEST_SHARD_INDEX / SOB_TEST_SHARD_COUNT  run only the tests of one shard, e.g. one per CI machine
+    //   SOB_TEST_RETRIES                             extra attempts for a failing test
+    //   SOB_TEST_JUNIT                               where the JUnit XML report goes
+    //   SOB_TEST_HISTORY                             where test durations are kept between runs
+    struct TestOptions
+    {
+        std::uint64_t shard_index{0};
+        std::uint64_t shard_count{1};
+        std::uint32_t retries{0};
+        std::string junit_path{"build/test_results.xml"};
+        std::string history_path{"build/test_durations.txt"};
+
+        static TestOptions from_environment()
+        {
+            TestOptions options{};
+            auto number = [](const char* name, auto& value)
+            {
+                if (const char* text = std::getenv(name); text != nullptr && *text != '\0')
+                {
+                    value = static_cast<std::remove_reference_t<decltype(value)>>(std::strtoull(text, nullptr, 10));
+                }
+            };
+            number("SOB_TEST_SHARD_INDEX", options.shard_index);
+            number("SOB_TEST_SHARD_COUNT", options.shard_count);
+            number("SOB_TEST_RETRIES", options.retries);
+            if (const char* text = std::getenv("SOB_TEST_JUNIT"); text != nullptr && *text != '\0')
+            {
+                options.junit_path = text;
+            }
+            if (const char* text = std::getenv("SOB_TEST_HISTORY"); text != nullptr && *text != '\0')
+            {
+                options.history_path = text;
+            }
+            options.shard_count = std::max<std::uint64_t>(1, options.shard_count);
+            SOPHO_ASSERT(options.shard_index < options.shard_count, "SOB_TEST_SHARD_INDEX ", options.shard_index,
+                         " is not below SOB_TEST_SHARD_COUNT ", options.shard_count);
+            return options;
+        }
+
+        // Shards by a hash of the name, so every machine computes the same split without coordinating.
+        bool selects(std::string_view test_name) const { return fnv1a(test_name) % shard_count == shard_index; }
+    };
+
+    inline const TestOptions& test_options()
+    {
+        static const TestOptions options = TestOptions::from_environment();
+        return options;
+    }
+
+    // Duration of each test's last run, kept apart from job_history() so SOB_TEST_HISTORY can move it.
+    inline DurationHistory& test_history()
+    {
+        static DurationHistory history{test_options().history_path};
+        return history;
+    }
+
+    inline std::string xml_escape(std::string_view text)
+    {
+        std::string result{};
+        result.reserve(text.size());
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            case '&': result += "&amp;"; break;
+            case '"': result += "&quot;"; break;
+            case '\'': result += "&apos;"; break;
+            default: result.push_back(c);
+            }
+        }
+        return result;
+    }
+
+    // Writes the JUnit XML report, prints a timing summary (slowest first) and remembers durations for the next run.
+    // Tests skipped because they passed before are reported as skipped. Does nothing when no test was scheduled.
+    inline void report_tests(const std::vector<JobResult>& results)
+    {
+        SOPHO_STACK();
+        std::vector<const JobResult*> tests{};
+        for (const auto& result : results)
+        {
+            if (result.test)
+            {
+                tests.push_back(&result);
+            }
+        }
+        if (tests.empty())
+        {
+            return;
+        }
+        std::sort(tests.begin(), tests.end(), [](const auto* a, const auto* b) { return a->seconds > b->seconds; });
+
+        std::size_t failures = 0;
+        std::size_t skipped = 0;
+        double total_seconds = 0;
+        for (const auto* test : tests)
+        {
+            failures += test->status == JobStatus::Failed || test->status == JobStatus::TimedOut;
+            skipped += test->status == JobStatus::UpToDate || test->status == JobStatus::Skipped;
+            total_seconds += test->seconds;
+        }
+
+        std::stringstream xml{};
+        xml << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+        xml << "<testsuites tests=\"" << tests.size() << "\" failures=\"" << failures << "\" skipped=\"" << skipped
+            << "\" time=\"" << total_seconds << "\">\n";
+        xml << "  <testsuite name=\"sob\" tests=\"" << tests.size() << "\" failures=\"" << failures << "\" skipped=\""
+            << skipped << "\" time=\"" << total_seconds << "\">\n";
+        for (const auto* test : tests)
+        {
+            xml << "    <testcase classname=\"sob\" name=\"" << xml_escape(test->name) << "\" time=\"" << test->seconds
+                << "\"";
+            switch (test->status)
+            {
+            case JobStatus::Succeeded: xml << "/>\n"; continue;
+            case JobStatus::UpToDate: xml << ">\n      <skipped message=\"unchanged since last pass\"/>\n"; break;
+            case JobStatus::Skipped: xml << ">\n      <skipped message=\"not built, a dependency failed\"/>\n"; break;
+            case JobStatus::TimedOut: xml << ">\n      <failure message=\"timed out\"/>\n"; break;
+            case JobStatus::Failed:
+                xml << ">\n      <failure message=\"exit code " << test->exit_code << " after " << test->attempts
+                    << " attempt(s)\"/>\n";
+                break;
+            }
+            xml << "    </testcase>\n";
+        }
+        xml << "  </testsuite>\n</testsuites>\n";
+
+        std::filesystem::path junit_path{test_options().junit_path};
+        if (junit_path.has_parent_path())
+        {
+            std::filesystem::create_directories(junit_path.parent_path());
+        }
+        std::ofstream{junit_path} << xml.str();
+
+        auto& history = test_history();
+        // Formatted apart, so std::cout keeps the caller's precision.
+        std::ostringstream report{};
+        report << "tests: " << tests.size() - failures - skipped << " passed, " << failures << " failed, " << skipped
+               << " skipped in " << std::fixed << std::setprecision(3) << total_seconds << "s\n";
+        for (const auto* test : tests)
+        {
+            constexpr std::string_view status_names[]{"unchanged", "passed", "FAILED", "TIMED OUT", "skipped"};
+            report << "  " << std::setw(9) << test->seconds << "s " << std::setw(9)
+                   << status_names[static_cast<std::size_t>(test->status)] << " " << test->name << "\n";
+            if (test->status != JobStatus::UpToDate && test->status != JobStatus::Skipped)
+            {
+                history.record(test->name, test->seconds);
+            }
+        }
+        std::cout << report.str() << std::flush;
+        history.save();
+    }
+} // namespace sopho
@@ -0,0 +1,172 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include <thread>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "source_location.hpp"
+
+// Process-wide registry of the threads that entered a SOPHO_STACK scope, so a failing thread can also show what
+// every other thread was doing. SOPHO_DIAG_THREADS bounds the number of threads registered at once; threads beyond it
+// still record their own stack but are not visible to others.
+#ifndef SOPHO_DIAG_THREADS
+#define SOPHO_DIAG_THREADS 64
+#endif
+
+namespace sopho
+{
+    inline constexpr std::uint32_t diag_threads = SOPHO_DIAG_THREADS;
+    // Frames nested deeper than this are counted but not visible to other threads.
+    inline constexpr std::uint32_t max_thread_frames = 64;
+
+    // Kernel thread id where there is one (matches top/gdb), a hash of std::thread::id elsewhere.
+    inline std::uint64_t current_thread_id()
+    {
+#if defined(__linux__)
+        return static_cast<std::uint64_t>(::syscall(SYS_gettid));
+#else
+        return std::hash<std::thread::id>{}(std::this_thread::get_id());
+#endif
+    }
+
+    // A thread's entry in the registry. Its frames are a shadow of the owner's StackInfo list that holds only
+    // pointers to static SourceLocations, so another thread can read them at any time without the frames being
+    // alive: a stale entry still points at valid data. Values are not mirrored, they may be mid-update.
+    struct ThreadSlot
+    {
+        std::atomic<bool> used{};
+        std::atomic<std::uint32_t> depth{};
+        std::uint64_t thread_id{};
+        std::atomic<std::uint32_t> name_size{};
+        char name[32]{};
+        std::atomic<const SourceLocation*> frames[max_thread_frames]{};
+
+        void push(std::uint32_t index, const SourceLocation* location)
+        {
+            if (index < max_thread_frames)
+            {
+                frames[index].store(location, std::memory_order_relaxed);
+            }
+            depth.store(index + 1, std::memory_order_release);
+        }
+
+        void pop(std::uint32_t index) { depth.store(index, std::memory_order_release); }
+    };
+
+    namespace detail
+    {
+        inline ThreadSlot* thread_slots()
+        {
+            static ThreadSlot slots[diag_threads]{};
+            return slots;
+        }
+
+        inline void set_slot_name(ThreadSlot& slot, std::string_view name)
+        {
+            auto size = std::min(name.size(), sizeof(slot.name));
+            // Readers take name_size first; shrinking it before the copy keeps them inside written bytes.
+            slot.name_size.store(0, std::memory_order_release);
+            std::memcpy(slot.name, name.data(), size);
+            slot.name_size.store(static_cast<std::uint32_t>(size), std::memory_order_release);
+        }
+
+        inline ThreadSlot* claim_thread_slot()
+        {
+            auto* slots = thread_slots();
+            for (std::uint32_t i = 0; i < diag_threads; ++i)
+            {
+                bool expected = false;
+                if (slots[i].used.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+                {
+                    auto& slot = slots[i];
+                    slot.depth.store(0, std::memory_order_relaxed);
+                    slot.thread_id = current_thread_id();
+                    slot.name_size.store(0, std::memory_order_relaxed);
+#if defined(__linux__)
+                    char name[16]{};
+                    if (::pthread_getname_np(::pthread_self(), name, sizeof(name)) == 0)
+                    {
+                        set_slot_name(slot, name);
+                    }
+#endif
+                    return &slot;
+                }
+            }
+            return nullptr;
+        }
+
+        // Releases the slot when the thread exits, clearing the owner's pointer first so scopes that still run from
+        // later thread_local destructors cannot write to a slot another thread has claimed.
+        struct ThreadSlotOwner
+        {
+            ThreadSlot* slot{};
+            ThreadSlot** owner_slot{};
+            ~ThreadSlotOwner()
+            {
+                if (slot != nullptr)
+                {
+                    *owner_slot = nullptr;
+                    slot->used.store(false, std::memory_order_release);
+                }
+            }
+        };
+    } // namespace detail
+
+    // Claims a slot for the calling thread and arranges its release at thread exit; `slot` is the thread's own
+    // pointer to it. Returns nullptr when the registry is full.
+    inline ThreadSlot* register_thread(ThreadSlot*& slot)
+    {
+        static thread_local detail::ThreadSlotOwner owner{};
+        if (owner.slot == nullptr)
+        {
+            owner.slot = detail::claim_thread_slot();
+            owner.owner_slot = &slot;
+        }
+        slot = owner.slot;
+        return slot;
+    }
+
+    // Prints every registered thread except `self` as "thread <name> (id N)" followed by its frames, innermost
+    // first. Works with std::ostream and SignalSafeWriter alike and never dereferences anything but static data.
+    template <typename Out>
+    void dump_threads(Out& out, const ThreadSlot* self)
+    {
+        auto* slots = detail::thread_slots();
+        for (std::uint32_t i = 0; i < diag_threads; ++i)
+        {
+            const auto& slot = slots[i];
+            if (&slot == self || !slot.used.load(std::memory_order_acquire))
+            {
+                continue;
+            }
+            auto name_size = slot.name_size.load(std::memory_order_acquire);
+            std::string_view name = name_size == 0 ? std::string_view{"<unnamed>"} : std::string_view{slot.name, name_size};
+            out << "thread " << name << " (id " << slot.thread_id << ")\n";
+            auto depth = slot.depth.load(std::memory_order_acquire);
+            if (depth == 0)
+            {
+                out << "  (no active scopes)\n";
+            }
+            if (depth > max_thread_frames)
+            {
+                out << "  (" << depth - max_thread_frames << " inner frames not shown)\n";
+            }
+            for (std::uint32_t frame = std::min(depth, max_thread_frames); frame > 0; --frame)
+            {
+                const auto* location = slot.frames[frame - 1].load(std::memory_order_relaxed);
+                if (location != nullptr)
+                {
+                    out << "  " << location->file_name << ":" << location->line_number << "@"
+                        << location->function_name << "\n";
+                }
+            }
+        }
+    }
+} // namespace sopho
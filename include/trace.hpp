@@ -0,0 +1,504 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string_view>
+#include <thread>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include "thread_registry.hpp"
+
+// Post-mortem event trace, enabled with -DSOPHO_DIAG_TRACE=1. Every thread records enter/exit/value events of
+// SOPHO_STACK/SOPHO_VALUE into its own fixed-size ring; a failed assert or a fatal signal dumps the last events of
+// every thread (see crash_handler.hpp). Capacities are per thread (a power of two) and per process.
+#ifndef SOPHO_DIAG_TRACE
+#define SOPHO_DIAG_TRACE 0
+#endif
+#ifndef SOPHO_TRACE_CAPACITY
+#define SOPHO_TRACE_CAPACITY 256
+#endif
+#ifndef SOPHO_TRACE_THREADS
+#define SOPHO_TRACE_THREADS 64
+#endif
+
+namespace sopho
+{
+    inline constexpr bool diag_trace = SOPHO_DIAG_TRACE != 0;
+    inline constexpr std::uint32_t trace_capacity = SOPHO_TRACE_CAPACITY;
+    inline constexpr std::uint32_t trace_threads = SOPHO_TRACE_THREADS;
+    static_assert(trace_capacity > 0 && (trace_capacity & (trace_capacity - 1)) == 0,
+                  "SOPHO_TRACE_CAPACITY must be a power of two");
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "trace rings need lock-free 64-bit atomics");
+
+    // Formats into a fixed buffer and writes with write(2): no allocation, no locale, no locks, so it can be used
+    // from a signal handler.
+    class SignalSafeWriter
+    {
+    public:
+        explicit SignalSafeWriter(int fd) : fd_(fd) {}
+        ~SignalSafeWriter() { flush(); }
+        SignalSafeWriter(const SignalSafeWriter&) = delete;
+        SignalSafeWriter& operator=(const SignalSafeWriter&) = delete;
+
+        SignalSafeWriter& operator<<(std::string_view str)
+        {
+            while (!str.empty())
+            {
+                if (size_ == sizeof(buffer_))
+                {
+                    flush();
+                }
+                auto count = std::min(str.size(), sizeof(buffer_) - size_);
+                std::memcpy(buffer_ + size_, str.data(), count);
+                size_ += count;
+                str.remove_prefix(count);
+            }
+            return *this;
+        }
+
+        SignalSafeWriter& operator<<(const char* str) { return *this << std::string_view{str ? str : "<null>"}; }
+
+        SignalSafeWriter& operator<<(char c) { return *this << std::string_view{&c, 1}; }
+
+        SignalSafeWriter& operator<<(std::uint64_t value)
+        {
+            char digits[20];
+            std::size_t count = 0;
+            do
+            {
+                digits[sizeof(digits) - ++count] = static_cast<char>('0' + value % 10);
+                value /= 10;
+            }
+            while (value != 0);
+            return *this << std::string_view{digits + sizeof(digits) - count, count};
+        }
+
+        SignalSafeWriter& operator<<(std::uint32_t value) { return *this << static_cast<std::uint64_t>(value); }
+
+        SignalSafeWriter& operator<<(std::int64_t value)
+        {
+            if (value < 0)
+            {
+                *this << '-';
+                return *this << (~static_cast<std::uint64_t>(value) + 1);
+            }
+            return *this << static_cast<std::uint64_t>(value);
+        }
+
+        SignalSafeWriter& operator<<(int value) { return *this << static_cast<std::int64_t>(value); }
+
+        // Fixed notation with six decimals, enough for diagnostics; huge magnitudes print as "big".
+        SignalSafeWriter& operator<<(double value)
+        {
+            if (value != value)
+            {
+                return *this << "nan";
+            }
+            if (value < 0)
+            {
+                *this << '-';
+                value = -value;
+            }
+            if (value > 1e18)
+            {
+                return *this << (value == value + 1 && value > 1e308 ? "inf" : "big");
+            }
+            auto integral = static_cast<std::uint64_t>(value);
+            auto fraction = static_cast<std::uint64_t>((value - static_cast<double>(integral)) * 1e6 + 0.5);
+            if (fraction >= 1000000)
+            {
+                ++integral;
+                fraction -= 1000000;
+            }
+            *this << integral << '.';
+            for (std::uint64_t scale = 100000; scale > 0; scale /= 10)
+            {
+                *this << static_cast<char>('0' + fraction / scale % 10);
+            }
+            return *this;
+        }
+
+        SignalSafeWriter& hex(std::uint64_t value)
+        {
+            char digits[16];
+            for (int i = 15; i >= 0; --i)
+            {
+                digits[i] = "0123456789abcdef"[value & 0xf];
+                value >>= 4;
+            }
+            return *this << "0x" << std::string_view{digits, sizeof(digits)};
+        }
+
+        void flush()
+        {
+            std::size_t written = 0;
+            while (written < size_)
+            {
+#if defined(_WIN32)
+                auto result = std::fwrite(buffer_ + written, 1, size_ - written, fd_ == 1 ? stdout : stderr);
+                if (result == 0)
+                {
+                    break;
+                }
+#else
+                auto result = ::write(fd_, buffer_ + written, size_ - written);
+                if (result < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (result <= 0)
+                {
+                    break;
+                }
+#endif
+                written += static_cast<std::size_t>(result);
+            }
+            size_ = 0;
+        }
+
+    private:
+        int fd_{};
+        std::size_t size_{};
+        char buffer_[1024];
+    };
+
+    enum class TraceEventKind : std::uint8_t
+    {
+        Enter,
+        Exit,
+        Value,
+    };
+
+    enum class TraceValueKind : std::uint8_t
+    {
+        None,
+        Int,
+        UInt,
+        Double,
+        Text,
+    };
+
+    // Self-contained (no pointers), so a trace file can still be decoded after the process is gone. `label` is the
+    // function name for enter/exit and the value name for value events, truncated to fit.
+    struct TraceEvent
+    {
+        std::atomic<std::uint64_t> sequence; // index + 1 once complete, 0 while being written
+        std::uint32_t line;
+        TraceEventKind kind;
+        TraceValueKind value_kind;
+        std::uint8_t label_size;
+        std::uint8_t text_size;
+        char label[24];
+        union
+        {
+            std::int64_t i;
+            std::uint64_t u;
+            double d;
+            char text[24];
+        } payload;
+    };
+    static_assert(sizeof(TraceEvent) == 64, "TraceEvent is meant to be one cache line");
+
+    enum class TraceRingState : std::uint32_t
+    {
+        Free,
+        Owned,
+        Released, // the owning thread exited, its history stays readable until the ring is reused
+    };
+
+    // Single producer (the owning thread), any number of readers. Readers validate each event with its sequence
+    // number, seqlock style, and skip events that are being overwritten.
+    struct TraceRing
+    {
+        std::atomic<TraceRingState> state;
+        std::uint32_t index;
+        std::uint64_t thread_id;
+        std::atomic<std::uint64_t> head;
+        std::uint64_t reserved;
+        TraceEvent events[trace_capacity];
+    };
+
+    // Shared layout of the in-memory registry and of the on-disk trace file.
+    struct TraceRegistry
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t thread_capacity;
+        std::uint32_t event_capacity;
+        std::uint32_t event_size;
+        TraceRing rings[trace_threads];
+    };
+
+    inline constexpr char trace_magic[8] = {'S', 'O', 'P', 'H', 'O', 'T', 'R', 'C'};
+
+    inline void init_trace_registry(TraceRegistry& registry)
+    {
+        std::memcpy(registry.magic, trace_magic, sizeof(trace_magic));
+        registry.version = 1;
+        registry.thread_capacity = trace_threads;
+        registry.event_capacity = trace_capacity;
+        registry.event_size = sizeof(TraceEvent);
+    }
+
+    inline bool valid_trace_registry(const TraceRegistry& registry)
+    {
+        return std::memcmp(registry.magic, trace_magic, sizeof(trace_magic)) == 0 && registry.version == 1 &&
+            registry.thread_capacity == trace_threads && registry.event_capacity == trace_capacity &&
+            registry.event_size == sizeof(TraceEvent);
+    }
+
+    namespace detail
+    {
+        // Function-local so the storage only exists in programs that actually trace.
+        inline TraceRegistry* trace_memory_registry()
+        {
+            static TraceRegistry registry{};
+            static bool initialized = (init_trace_registry(registry), true);
+            (void)initialized;
+            return &registry;
+        }
+
+        inline std::atomic<TraceRegistry*>& trace_registry()
+        {
+            static std::atomic<TraceRegistry*> registry{trace_memory_registry()};
+            return registry;
+        }
+
+        inline thread_local TraceRing* current_trace_ring = nullptr;
+
+        struct TraceRingOwner
+        {
+            TraceRing* ring{};
+            ~TraceRingOwner()
+            {
+                if (ring != nullptr)
+                {
+                    current_trace_ring = nullptr;
+                    ring->state.store(TraceRingState::Released, std::memory_order_release);
+                }
+            }
+        };
+
+        inline TraceRing* claim_trace_ring(TraceRegistry& registry)
+        {
+            // Prefer never used rings, then recycle the history of exited threads.
+            for (auto wanted : {TraceRingState::Free, TraceRingState::Released})
+            {
+                for (std::uint32_t i = 0; i < trace_threads; ++i)
+                {
+                    auto& ring = registry.rings[i];
+                    auto expected = wanted;
+                    if (ring.state.compare_exchange_strong(expected, TraceRingState::Owned, std::memory_order_acq_rel))
+                    {
+                        ring.index = i;
+                        ring.thread_id = current_thread_id();
+                        ring.head.store(0, std::memory_order_release);
+                        return &ring;
+                    }
+                }
+            }
+            return nullptr;
+        }
+
+        inline TraceRing* this_thread_trace_ring()
+        {
+            if (current_trace_ring == nullptr)
+            {
+                static thread_local TraceRingOwner owner{};
+                static thread_local bool exhausted = false;
+                if (exhausted || owner.ring != nullptr)
+                {
+                    return owner.ring;
+                }
+                owner.ring = claim_trace_ring(*trace_registry().load(std::memory_order_acquire));
+                exhausted = owner.ring == nullptr;
+                current_trace_ring = owner.ring;
+            }
+            return current_trace_ring;
+        }
+
+        inline void copy_label(char (&out)[24], std::uint8_t& size, std::string_view str)
+        {
+            size = static_cast<std::uint8_t>(std::min(str.size(), sizeof(out)));
+            std::memcpy(out, str.data(), size);
+        }
+    } // namespace detail
+
+    // Appends an event to the calling thread's ring; `fill` writes the kind specific fields.
+    template <typename Fill>
+    inline void trace_event(TraceEventKind kind, std::string_view label, std::uint32_t line, Fill&& fill)
+    {
+        auto* ring = detail::this_thread_trace_ring();
+        if (ring == nullptr)
+        {
+            return;
+        }
+        auto index = ring->head.load(std::memory_order_relaxed);
+        auto& event = ring->events[index & (trace_capacity - 1)];
+        event.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        event.kind = kind;
+        event.line = line;
+        event.value_kind = TraceValueKind::None;
+        event.text_size = 0;
+        detail::copy_label(event.label, event.label_size, label);
+        fill(event);
+        event.sequence.store(index + 1, std::memory_order_release);
+        ring->head.store(index + 1, std::memory_order_release);
+    }
+
+    inline void trace_scope(TraceEventKind kind, const char* function_name, std::uint32_t line)
+    {
+        trace_event(kind, function_name, line, [](TraceEvent&) {});
+    }
+
+    inline void trace_text(TraceEvent& event, std::string_view text)
+    {
+        event.value_kind = TraceValueKind::Text;
+        event.text_size = static_cast<std::uint8_t>(std::min(text.size(), sizeof(event.payload.text)));
+        std::memcpy(event.payload.text, text.data(), event.text_size);
+    }
+
+    inline void dump_trace_ring(SignalSafeWriter& out, const TraceRing& ring, std::uint32_t max_events)
+    {
+        auto head = ring.head.load(std::memory_order_acquire);
+        auto count = std::min<std::uint64_t>({head, trace_capacity, max_events});
+        out << "trace ring " << ring.index << " (thread " << ring.thread_id
+            << (ring.state.load(std::memory_order_acquire) == TraceRingState::Released ? ", exited" : "") << "): last "
+            << count << " of " << head << " events\n";
+        for (auto index = head - count; index < head; ++index)
+        {
+            const auto& event = ring.events[index & (trace_capacity - 1)];
+            auto before = event.sequence.load(std::memory_order_acquire);
+            TraceEvent copy;
+            std::memcpy(static_cast<void*>(&copy), static_cast<const void*>(&event), sizeof(TraceEvent));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            auto after = event.sequence.load(std::memory_order_relaxed);
+            out << "  #" << index << ' ';
+            if (before != index + 1 || after != before)
+            {
+                out << "<overwritten>\n";
+                continue;
+            }
+            std::string_view label{copy.label, copy.label_size};
+            switch (copy.kind)
+            {
+                case TraceEventKind::Enter:
+                    out << "enter " << label << ':' << copy.line;
+                    break;
+                case TraceEventKind::Exit:
+                    out << "exit  " << label << ':' << copy.line;
+                    break;
+                case TraceEventKind::Value:
+                    out << "value " << label << '=';
+                    switch (copy.value_kind)
+                    {
+                        case TraceValueKind::Int:
+                            out << copy.payload.i;
+                            break;
+                        case TraceValueKind::UInt:
+                            out << copy.payload.u;
+                            break;
+                        case TraceValueKind::Double:
+                            out << copy.payload.d;
+                            break;
+                        case TraceValueKind::Text:
+                            out << std::string_view{copy.payload.text, copy.text_size};
+                            break;
+                        default:
+                            out << '?';
+                            break;
+                    }
+                    break;
+            }
+            out << '\n';
+        }
+    }
+
+    inline void dump_trace(SignalSafeWriter& out, const TraceRegistry& registry,
+                           std::uint32_t max_events = trace_capacity)
+    {
+        for (const auto& ring : registry.rings)
+        {
+            if (ring.state.load(std::memory_order_acquire) != TraceRingState::Free)
+            {
+                dump_trace_ring(out, ring, max_events);
+            }
+        }
+    }
+
+    // Dumps the last `max_events` events of every thread that ever traced.
+    inline void dump_trace(SignalSafeWriter& out, std::uint32_t max_events = trace_capacity)
+    {
+        if constexpr (diag_trace)
+        {
+            dump_trace(out, *detail::trace_registry().load(std::memory_order_acquire), max_events);
+        }
+    }
+
+    // True for the first caller only, so an assert that aborts does not get reported again by the SIGABRT handler.
+    inline bool begin_crash_report()
+    {
+        static std::atomic<bool> reported{false};
+        return !reported.exchange(true);
+    }
+
+#if !defined(_WIN32)
+    // Places the rings in a shared file mapping, so the trace survives a hard crash and can be decoded later with
+    // dump_trace_file(). Threads that already traced keep their in-memory ring, so call this early in main().
+    inline bool open_trace_file(const char* path)
+    {
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        bool sized = ::ftruncate(fd, sizeof(TraceRegistry)) == 0;
+        void* mapping =
+            sized ? ::mmap(nullptr, sizeof(TraceRegistry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        // The file is zero-filled, which is the Free state for every ring.
+        auto* registry = static_cast<TraceRegistry*>(mapping);
+        init_trace_registry(*registry);
+        detail::trace_registry().store(registry, std::memory_order_release);
+        return true;
+    }
+
+    // Decodes a trace file written by a previous (possibly crashed) run of the same build configuration.
+    inline bool dump_trace_file(const char* path, int out_fd = 1, std::uint32_t max_events = trace_capacity)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        void* mapping = ::mmap(nullptr, sizeof(TraceRegistry), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        const auto& registry = *static_cast<const TraceRegistry*>(mapping);
+        bool valid = valid_trace_registry(registry);
+        if (valid)
+        {
+            SignalSafeWriter out{out_fd};
+            dump_trace(out, registry, max_events);
+        }
+        ::munmap(mapping, sizeof(TraceRegistry));
+        return valid;
+    }
+#endif
+} // namespace sopho
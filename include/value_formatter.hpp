@@ -0,0 +1,189 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include "static_string.hpp"
+
+namespace sopho
+{
+    // Formats a captured SOPHO_VALUE into [first, last) and returns the end of the written characters, like
+    // std::to_chars. Output that does not fit is truncated. Implementations must not allocate and must not write
+    // past `last`; the crash handler calls them from a signal handler. Specialize it to capture user types:
+    //
+    //     template <>
+    //     struct sopho::StackValueFormatter<Job>
+    //     {
+    //         static char* format(const Job& job, char* first, char* last) { ... }
+    //     };
+    template <typename T>
+    struct StackValueFormatter;
+
+    template <typename T>
+    concept StackFormattable = requires(const T& value, char* out) {
+        { StackValueFormatter<T>::format(value, out, out) } -> std::same_as<char*>;
+    };
+
+    namespace detail
+    {
+        inline char* copy_chars(std::string_view str, char* first, char* last)
+        {
+            auto count = std::min(str.size(), static_cast<std::size_t>(last - first));
+            std::memcpy(first, str.data(), count);
+            return first + count;
+        }
+
+        template <typename T>
+        char* to_chars_or_truncate(T value, char* first, char* last)
+        {
+            auto [end, error] = std::to_chars(first, last, value);
+            return error == std::errc{} ? end : first;
+        }
+    } // namespace detail
+
+    template <>
+    struct StackValueFormatter<bool>
+    {
+        static char* format(bool value, char* first, char* last)
+        {
+            return detail::copy_chars(value ? "true" : "false", first, last);
+        }
+    };
+
+    template <>
+    struct StackValueFormatter<char>
+    {
+        static char* format(char value, char* first, char* last)
+        {
+            return detail::copy_chars(std::string_view{&value, 1}, first, last);
+        }
+    };
+
+    template <typename T>
+        requires(std::is_integral_v<T> || std::is_floating_point_v<T>)
+    struct StackValueFormatter<T>
+    {
+        static char* format(T value, char* first, char* last)
+        {
+            return detail::to_chars_or_truncate(value, first, last);
+        }
+    };
+
+    template <typename T>
+        requires std::is_enum_v<T>
+    struct StackValueFormatter<T>
+    {
+        static char* format(T value, char* first, char* last)
+        {
+            return detail::to_chars_or_truncate(static_cast<std::underlying_type_t<T>>(value), first, last);
+        }
+    };
+
+    template <>
+    struct StackValueFormatter<std::string_view>
+    {
+        static char* format(std::string_view value, char* first, char* last)
+        {
+            return detail::copy_chars(value, first, last);
+        }
+    };
+
+    template <>
+    struct StackValueFormatter<std::string>
+    {
+        static char* format(const std::string& value, char* first, char* last)
+        {
+            return detail::copy_chars(value, first, last);
+        }
+    };
+
+    template <>
+    struct StackValueFormatter<const char*>
+    {
+        static char* format(const char* value, char* first, char* last)
+        {
+            return detail::copy_chars(value ? std::string_view{value} : std::string_view{"<null>"}, first, last);
+        }
+    };
+
+    template <>
+    struct StackValueFormatter<char*> : StackValueFormatter<const char*>
+    {
+    };
+
+    // Character arrays stop at the first NUL, if any.
+    template <std::size_t N>
+    struct StackValueFormatter<char[N]>
+    {
+        static char* format(const char (&value)[N], char* first, char* last)
+        {
+            std::string_view str{value, N};
+            return detail::copy_chars(str.substr(0, str.find('\0')), first, last);
+        }
+    };
+
+    template <std::size_t N>
+    struct StackValueFormatter<StaticString<N>>
+    {
+        static char* format(const StaticString<N>& value, char* first, char* last)
+        {
+            return detail::copy_chars(value.view(), first, last);
+        }
+    };
+
+    template <>
+    struct StackValueFormatter<std::filesystem::path>
+    {
+        static char* format(const std::filesystem::path& value, char* first, char* last)
+        {
+            if constexpr (std::is_same_v<std::filesystem::path::value_type, char>)
+            {
+                return detail::copy_chars(value.native(), first, last);
+            }
+            else
+            {
+                // Wide native paths: ASCII passes through, anything else would need a conversion that allocates.
+                for (auto c : value.native())
+                {
+                    if (first == last)
+                    {
+                        break;
+                    }
+                    *first++ = static_cast<std::uint32_t>(c) < 0x80 ? static_cast<char>(c) : '?';
+                }
+                return first;
+            }
+        }
+    };
+
+    // A type-erased reference to a captured value and its formatter. The value is not copied, so it must outlive
+    // the reference, which SOPHO_VALUE guarantees by capturing named variables only.
+    struct StackValueReference
+    {
+        const void* object{};
+        char* (*format)(const void* object, char* first, char* last){};
+
+        template <StackFormattable T>
+        static StackValueReference of(const T& value)
+        {
+            return StackValueReference{&value, [](const void* object, char* first, char* last)
+                                       { return StackValueFormatter<T>::format(*static_cast<const T*>(object), first,
+                                                                               last); }};
+        }
+    };
+
+    // Buffer size the dumps format each value into; longer values are truncated.
+    inline constexpr std::size_t stack_value_buffer_size = 256;
+
+    inline std::string_view format_stack_value(const StackValueReference& value, char* buffer, std::size_t size)
+    {
+        auto* end = value.format(value.object, buffer, buffer + size);
+        return std::string_view{buffer, static_cast<std::size_t>(end - buffer)};
+    }
+} // namespace sopho
@@ -1,64 +1,83 @@
-#include "sob.hpp"
-
-#ifdef _MSVC_LANG
-#define SOPHO_CPP_VER _MSVC_LANG
-#else
-#define SOPHO_CPP_VER __cplusplus
-#endif
-
-// Helper function to convert version number to string
-constexpr const char* get_cpp_standard_name()
-{
-    if (SOPHO_CPP_VER > 202002L)
-        return "C++23 (or newer)";
-    if (SOPHO_CPP_VER == 202002L)
-        return "C++20";
-    if (SOPHO_CPP_VER == 201703L)
-        return "C++17";
-    if (SOPHO_CPP_VER == 201402L)
-        return "C++14";
-    if (SOPHO_CPP_VER == 201103L)
-        return "C++11";
-    if (SOPHO_CPP_VER == 199711L)
-        return "C++98";
-    return "Unknown/Pre-standard";
-}
-
-struct GxxContext
-{
-    static constexpr std::string_view cxx{"g++"};
-    static constexpr sopho::StaticString obj_prefix{" -o "};
-    static constexpr sopho::StaticString obj_postfix{".o"};
-    static constexpr sopho::StaticString bin_prefix{" -o "};
-    static constexpr sopho::StaticString build_prefix{"build/"};
-};
-
-struct ClContext
-{
-    static constexpr std::string_view cxx{"cl"};
-    static constexpr sopho::StaticString obj_prefix{" /Fo:"};
-    static constexpr sopho::StaticString obj_postfix{".obj"};
-    static constexpr sopho::StaticString bin_prefix{" /Fe:"};
-    static constexpr sopho::StaticString build_prefix{"build/"};
-    static constexpr std::array<std::string_view, 1> cxxflags{"/std:c++17"};
-};
-
-using MainSource = sopho::Source<sopho::StaticString{"main.cpp"}>;
-using Main = sopho::Target<std::tuple<MainSource>, sopho::StaticString{"main"}>;
-
-#if defined(_MSC_VER)
-using CxxContext = ClContext;
-#elif defined(__GNUC__)
-using CxxContext = GxxContext;
-#else
-#endif
-
-int main()
-{
-    sopho::single_header_generator("include/sob.hpp");
-    std::cout << get_cpp_standard_name() << std::endl;
-    auto commands = sopho::CxxToolchain<CxxContext>::CxxBuilder<Main>::build();
-    sopho::write_compile_commands_json("compile_commands.json", commands);
-
-    return 0;
-}
+#include "sob.hpp"
+
+#ifdef _MSVC_LANG
+#define SOPHO_CPP_VER _MSVC_LANG
+#else
+#define SOPHO_CPP_VER __cplusplus
+#endif
+
+// Helper function to convert version number to string
+constexpr const char* get_cpp_standard_name()
+{
+    if (SOPHO_CPP_VER > 202002L)
+        return "C++23 (or newer)";
+    if (SOPHO_CPP_VER == 202002L)
+        return "C++20";
+    if (SOPHO_CPP_VER == 201703L)
+        return "C++17";
+    if (SOPHO_CPP_VER == 201402L)
+        return "C++14";
+    if (SOPHO_CPP_VER == 201103L)
+        return "C++11";
+    if (SOPHO_CPP_VER == 199711L)
+        return "C++98";
+    return "Unknown/Pre-standard";
+}
+
+struct GxxContext
+{
+    static constexpr std::string_view cxx{"g++"};
+    static constexpr sopho::StaticString obj_prefix{" -o "};
+    static constexpr sopho::StaticString obj_postfix{".o"};
+    static constexpr sopho::StaticString bin_prefix{" -o "};
+    static constexpr sopho::StaticString build_prefix{"build/"};
+    static constexpr std::array<std::string_view, 1> cxxflags{"-std=c++20"};
+    static constexpr sopho::StaticString bmi_postfix{".gcm"};
+    static constexpr std::array<std::string_view, 1> module_flags{"-fmodules-ts"};
+    static constexpr std::array<std::string_view, 2> module_interface_flags{"-x", "c++"};
+    static constexpr sopho::StaticString module_mapper_prefix{"-fmodule-mapper="};
+    static constexpr std::array<std::string_view, 1> pgo_generate_flags{"-fprofile-generate"};
+    static constexpr std::array<std::string_view, 1> pgo_use_flags{"-fprofile-use"};
+    static constexpr sopho::StaticString shared_prefix{" -shared -o "};
+    static constexpr sopho::StaticString shared_postfix{".so"};
+    static constexpr std::array<std::string_view, 2> shared_cxxflags{"-fPIC", "-fvisibility=hidden"};
+    static constexpr sopho::StaticString rpath_prefix{"-Wl,-rpath,"};
+    static constexpr sopho::StaticString soname_prefix{"-Wl,-soname,"};
+    static constexpr std::array<std::string_view, 2> depfile_flags{"-MMD", "-MF"};
+};
+
+struct ClContext
+{
+    static constexpr std::string_view cxx{"cl"};
+    static constexpr sopho::StaticString obj_prefix{" /Fo:"};
+    static constexpr sopho::StaticString obj_postfix{".obj"};
+    static constexpr sopho::StaticString bin_prefix{" /Fe:"};
+    static constexpr sopho::StaticString build_prefix{"build/"};
+    static constexpr std::array<std::string_view, 1> cxxflags{"/std:c++17"};
+    static constexpr sopho::StaticString bmi_postfix{".ifc"};
+    static constexpr std::array<std::string_view, 1> module_interface_flags{"/interface"};
+    static constexpr sopho::StaticString module_output_prefix{"/ifcOutput "};
+    static constexpr sopho::StaticString module_reference_prefix{"/reference "};
+    static constexpr std::array<std::string_view, 1> show_includes_flags{"/showIncludes"};
+};
+
+using MainSource = sopho::Source<sopho::StaticString{"main.cpp"}>;
+using Main = sopho::Target<std::tuple<MainSource>, sopho::StaticString{"main"}>;
+
+#if defined(_MSC_VER)
+using CxxContext = ClContext;
+#elif defined(__GNUC__)
+using CxxContext = GxxContext;
+#else
+#endif
+
+int main()
+{
+    sopho::install_crash_handler();
+    sopho::single_header_generator("include/sob.hpp");
+    std::cout << get_cpp_standard_name() << std::endl;
+    auto result = sopho::CxxToolchain<CxxContext>::CxxBuilder<Main>::build();
+    sopho::write_compile_commands_json("compile_commands.json", result.commands);
+
+    return result.succeeded ? 0 : 1;
+}
@@ -1,98 +1,39 @@
 // include/sob.hpp
+#include <algorithm>
+#include <array>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <set>
+#include <span>
 #include <sstream>
 #include <string_view>
 #include <tuple>
 #include <type_traits>
 #include <utility>
 #include <vector>
+// include/crash_handler.hpp
+#if !defined(_WIN32)
+#include <csignal>
+#include <sys/mman.h>
+#endif
 // include/diag.hpp
-#include <cstdint>
-#include <functional>
-#include <list>
-#include <map>
 #include <string>
-#include <variant>
-// include/meta.hpp
-namespace sopho
-{
-    namespace detail
-    {
-        // Declaration: Map takes a Mapper template and a Tuple type
-        template <template <typename> class Mapper, typename List>
-        struct MapImpl;
-        // Specialization: Unpack the tuple types (Ts...), apply Mapper to each, repack.
-        template <template <typename> class Mapper, typename... Ts>
-        struct MapImpl<Mapper, std::tuple<Ts...>>
-        {
-            // The "return value" of a metafunction is usually defined as 'type'
-            using type = std::tuple<typename Mapper<Ts>::type...>;
-        };
-        template <template <typename> class Mapper, typename... Ts>
-        struct MapImpl<Mapper, std::variant<Ts...>>
-        {
-            // The "return value" of a metafunction is usually defined as 'type'
-            using type = std::variant<typename Mapper<Ts>::type...>;
-        };
-    } // namespace detail
-    // Helper alias for cleaner syntax (C++14 style aliases)
-    template <template <typename> class Mapper, typename List>
-    using Map = typename detail::MapImpl<Mapper, List>::type;
-    namespace detail
-    {
-        template <template <typename, typename> typename Folder, typename Value, typename List>
-        struct FoldlImpl;
-        template <template <typename, typename> typename Folder, typename Value, typename T, typename... Ts>
-        struct FoldlImpl<Folder, Value, std::tuple<T, Ts...>>
-        {
-            // The "return value" of a metafunction is usually defined as 'type'
-            using type = typename FoldlImpl<Folder, typename Folder<Value, T>::type, std::tuple<Ts...>>::type;
-        };
-        template <template <typename, typename> typename Folder, typename Value>
-        struct FoldlImpl<Folder, Value, std::tuple<>>
-        {
-            // The "return value" of a metafunction is usually defined as 'type'
-            using type = Value;
-        };
-        template <template <typename, typename> typename Folder, typename Value, typename T, typename... Ts>
-        struct FoldlImpl<Folder, Value, std::variant<T, Ts...>>
-        {
-            // The "return value" of a metafunction is usually defined as 'type'
-            using type = typename FoldlImpl<Folder, typename Folder<Value, T>::type, std::variant<Ts...>>::type;
-        };
-        template <template <typename, typename> typename Folder, typename Value>
-        struct FoldlImpl<Folder, Value, std::variant<>>
-        {
-            // The "return value" of a metafunction is usually defined as 'type'
-            using type = Value;
-        };
-    } // namespace detail
-    template <template <typename, typename> class Folder, typename Value, typename List>
-    using Foldl = typename detail::FoldlImpl<Folder, Value, List>::type;
-} // namespace sopho
-// include/diag.hpp
-#define SOPHO_DETAIL_JOIN2_IMPL(a, b) a##b
-#define SOPHO_DETAIL_JOIN2(a, b) SOPHO_DETAIL_JOIN2_IMPL(a, b)
-#define SOPHO_STACK()                                                                                                  \
-    ::sopho::StackScope SOPHO_DETAIL_JOIN2(_sopho_stack_scope_, __COUNTER__) { __FILE__, __func__, __LINE__ }
-#define SOPHO_VALUE(value)                                                                                             \
-    ::sopho::StackValue SOPHO_DETAIL_JOIN2(_sopho_stack_value_, __COUNTER__) { std::string(#value), value }
-#define SOPHO_SOURCE_LOCATION                                                                                          \
-    ::sopho::SourceLocation { __FILE__, __func__, static_cast<std::uint32_t>(__LINE__) }
-// expr + variadic msg parts (at least one msg token is required by your convention)
-#define SOPHO_ASSERT(expr, ...)                                                                                        \
-    do                                                                                                                 \
-    {                                                                                                                  \
-        if (!(expr))                                                                                                   \
-        {                                                                                                              \
-            ::sopho::assert_fail(#expr, ::sopho::build_message(__VA_ARGS__), SOPHO_SOURCE_LOCATION);                   \
-        }                                                                                                              \
-    }                                                                                                                  \
-    while (0)
+// include/profiler.hpp
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <iomanip>
+#include <limits>
+#if defined(__linux__)
+#include <time.h>
+#endif
+// include/source_location.hpp
 namespace sopho
 {
     struct SourceLocation
@@ -101,320 +42,937 @@ namespace sopho
         const char* function_name{};
         std::uint32_t line_number{};
     };
-    template <typename T>
-    struct ReferenceWrapper
+} // namespace sopho
+// include/profiler.hpp
+// Scope profiler, enabled with -DSOPHO_DIAG_PROFILE=1. Every SOPHO_STACK scope records its inclusive wall time into
+// per-thread aggregates keyed by its static SourceLocation; at exit a hot-spot report goes to stderr, and to the JSON
+// file named by the SOPHO_PROFILE_JSON environment variable when set. Needs a SOPHO_DIAG_LEVEL other than OFF, and
+// times every scope even at the SAMPLED level. SOPHO_PROFILE_SITES is the number of distinct scopes each thread can
+// track; scopes beyond it are counted as dropped.
+#ifndef SOPHO_DIAG_PROFILE
+#define SOPHO_DIAG_PROFILE 0
+#endif
+#ifndef SOPHO_PROFILE_SITES
+#define SOPHO_PROFILE_SITES 256
+#endif
+namespace sopho
+{
+    inline constexpr bool diag_profile = SOPHO_DIAG_PROFILE != 0;
+    inline constexpr std::uint32_t profile_sites = SOPHO_PROFILE_SITES;
+    static_assert(profile_sites > 0 && (profile_sites & (profile_sites - 1)) == 0,
+                  "SOPHO_PROFILE_SITES must be a power of two");
+    // Bucket 0 holds 0 ns, bucket b holds [2^(b-1), 2^b) ns; the last bucket also takes everything longer.
+    inline constexpr std::uint32_t profile_buckets = 40;
+    inline std::uint64_t profile_clock_ns()
+    {
+#if defined(__linux__)
+        // Not slewed by NTP, and served from the vDSO without a syscall.
+        timespec ts{};
+        ::clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000 + static_cast<std::uint64_t>(ts.tv_nsec);
+#else
+        return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                              std::chrono::steady_clock::now().time_since_epoch())
+                                              .count());
+#endif
+    }
+    // Only the owning thread writes a site, so updates are plain load + store; the atomics just make concurrent
+    // reports well defined.
+    struct ProfileSite
     {
-        using type = std::reference_wrapper<const T>;
+        std::atomic<const SourceLocation*> location{};
+        std::atomic<std::uint64_t> count{};
+        std::atomic<std::uint64_t> total_ns{};
+        std::atomic<std::uint64_t> min_ns{std::numeric_limits<std::uint64_t>::max()};
+        std::atomic<std::uint64_t> max_ns{};
+        std::array<std::atomic<std::uint32_t>, profile_buckets> histogram{};
     };
-    [[noreturn]] inline void assert_fail(std::string_view expr, std::string msg, SourceLocation loc);
-    // Build message only on failure path.
-    template <class... Args>
-    inline std::string build_message(Args&&... args)
+    // Open-addressed by location address. Tables are never freed: a thread that exits hands its table (and its
+    // aggregates) to the next new thread, so thread churn does not grow memory.
+    struct ProfileTable
     {
-        std::ostringstream os;
-        (os << ... << std::forward<Args>(args));
-        return os.str();
-    }
-    using StackValueReference =
-        Map<ReferenceWrapper, std::variant<std::int64_t, std::uint64_t, double, std::string, std::filesystem::path>>;
-    struct StackInfo
+        std::atomic<bool> owned{true};
+        ProfileTable* next{};
+        std::atomic<std::uint64_t> dropped{};
+        std::array<ProfileSite, profile_sites> sites{};
+    };
+    // One merged row of the report; times are inclusive of nested scopes.
+    struct ProfileEntry
     {
-        SourceLocation source_location{};
-        std::map<std::string, StackValueReference> stack_values{};
+        const SourceLocation* location{};
+        std::uint64_t count{};
+        std::uint64_t total_ns{};
+        std::uint64_t min_ns{std::numeric_limits<std::uint64_t>::max()};
+        std::uint64_t max_ns{};
+        std::array<std::uint64_t, profile_buckets> histogram{};
+        // Upper bound of the histogram bucket holding the given fraction of the calls, clamped to max_ns.
+        std::uint64_t percentile_ns(double fraction) const
+        {
+            auto wanted = static_cast<std::uint64_t>(fraction * static_cast<double>(count));
+            std::uint64_t seen = 0;
+            for (std::uint32_t bucket = 0; bucket < profile_buckets; ++bucket)
+            {
+                seen += histogram[bucket];
+                if (seen > wanted || seen == count)
+                {
+                    return std::min(bucket == 0 ? 0 : std::uint64_t{1} << bucket, max_ns);
+                }
+            }
+            return max_ns;
+        }
     };
-    inline std::string stack_value_to_string(const StackValueReference& v)
+    inline void print_profile(std::ostream& out, std::size_t limit = 30);
+    inline void write_profile_json(const std::filesystem::path& fs_path);
+    namespace detail
     {
-        return std::visit(
-            [](const auto& ref) -> std::string
+        struct ProfileRegistry
+        {
+            std::atomic<ProfileTable*> head{};
+            ~ProfileRegistry()
             {
-                const auto& x = ref.get();
-                using T = std::decay_t<decltype(x)>;
-                if constexpr (std::is_same_v<T, std::string>)
+                if (head.load(std::memory_order_acquire) == nullptr)
                 {
-                    return x;
+                    return;
                 }
-                else if constexpr (std::is_same_v<T, std::filesystem::path>)
+                print_profile(std::cerr);
+                if (const char* json = std::getenv("SOPHO_PROFILE_JSON"); json != nullptr && *json != '\0')
                 {
-                    // Note: string() is platform/native encoding; for cross-platform stable output you might prefer
-                    // generic_u8string().
-                    return x.string();
+                    write_profile_json(json);
                 }
-                else
+            }
+        };
+        inline ProfileRegistry& profile_registry()
+        {
+            static ProfileRegistry registry{};
+            return registry;
+        }
+        inline ProfileTable* claim_profile_table()
+        {
+            auto& registry = profile_registry();
+            for (auto* table = registry.head.load(std::memory_order_acquire); table != nullptr; table = table->next)
+            {
+                bool expected = false;
+                if (table->owned.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
                 {
-                    // Covers int64_t / uint64_t / double
-                    return std::to_string(x);
+                    return table;
                 }
-            },
-            v);
-    }
-    struct StackInfoInstance
+            }
+            auto* table = new ProfileTable{};
+            table->next = registry.head.load(std::memory_order_relaxed);
+            while (!registry.head.compare_exchange_weak(table->next, table, std::memory_order_release,
+                                                        std::memory_order_relaxed))
+            {
+            }
+            return table;
+        }
+        struct ProfileTableOwner
+        {
+            ProfileTable* table{claim_profile_table()};
+            ~ProfileTableOwner() { table->owned.store(false, std::memory_order_release); }
+        };
+        inline ProfileTable& this_thread_profile_table()
+        {
+            static thread_local ProfileTableOwner owner{};
+            return *owner.table;
+        }
+        inline void profile_bump(std::atomic<std::uint64_t>& value, std::uint64_t delta)
+        {
+            value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+        }
+    } // namespace detail
+    // Adds one call of `elapsed_ns` to the calling thread's aggregate for `location`.
+    inline void profile_record(const SourceLocation& location, std::uint64_t elapsed_ns)
     {
-        std::list<StackInfo> stack_infos;
-        static StackInfoInstance& get()
+        auto& table = detail::this_thread_profile_table();
+        auto hash = ((reinterpret_cast<std::uintptr_t>(&location) >> 3) * 0x9E3779B97F4A7C15ull) >> 32;
+        for (std::uint32_t probe = 0; probe < profile_sites; ++probe)
         {
-            static thread_local StackInfoInstance instance{};
-            return instance;
+            auto& site = table.sites[(hash + probe) & (profile_sites - 1)];
+            auto* current = site.location.load(std::memory_order_relaxed);
+            if (current == nullptr)
+            {
+                site.location.store(&location, std::memory_order_release);
+            }
+            else if (current != &location)
+            {
+                continue;
+            }
+            detail::profile_bump(site.count, 1);
+            detail::profile_bump(site.total_ns, elapsed_ns);
+            if (elapsed_ns < site.min_ns.load(std::memory_order_relaxed))
+            {
+                site.min_ns.store(elapsed_ns, std::memory_order_relaxed);
+            }
+            if (elapsed_ns > site.max_ns.load(std::memory_order_relaxed))
+            {
+                site.max_ns.store(elapsed_ns, std::memory_order_relaxed);
+            }
+            auto bucket = std::min<std::uint32_t>(std::bit_width(elapsed_ns), profile_buckets - 1);
+            auto& slot = site.histogram[bucket];
+            slot.store(slot.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return;
         }
+        detail::profile_bump(table.dropped, 1);
+    }
+    // Timing state of one StackScope; empty when profiling is disabled.
+    template <bool Enabled>
+    struct ScopeTimer
+    {
+        void start() {}
+        void stop(const SourceLocation&) {}
     };
-    struct StackScope
+    template <>
+    struct ScopeTimer<true>
+    {
+        std::uint64_t start_ns;
+        void start() { start_ns = profile_clock_ns(); }
+        void stop(const SourceLocation& location) { profile_record(location, profile_clock_ns() - start_ns); }
+    };
+    // Merges every thread's aggregates, hottest (largest total) first. Scopes of threads still running are read
+    // while they are being updated, so a report taken mid-run is approximate.
+    inline std::vector<ProfileEntry> collect_profile(std::uint64_t* dropped = nullptr)
     {
-        StackInfo* p_stack_info{};
-        StackScope(const char* file_name, const char* function_name, std::uint32_t line_number)
+        std::map<const SourceLocation*, ProfileEntry> merged{};
+        std::uint64_t dropped_count = 0;
+        for (auto* table = detail::profile_registry().head.load(std::memory_order_acquire); table != nullptr;
+             table = table->next)
+        {
+            dropped_count += table->dropped.load(std::memory_order_relaxed);
+            for (const auto& site : table->sites)
+            {
+                const auto* location = site.location.load(std::memory_order_acquire);
+                if (location == nullptr)
+                {
+                    continue;
+                }
+                auto& entry = merged[location];
+                entry.location = location;
+                entry.count += site.count.load(std::memory_order_relaxed);
+                entry.total_ns += site.total_ns.load(std::memory_order_relaxed);
+                entry.min_ns = std::min(entry.min_ns, site.min_ns.load(std::memory_order_relaxed));
+                entry.max_ns = std::max(entry.max_ns, site.max_ns.load(std::memory_order_relaxed));
+                for (std::uint32_t bucket = 0; bucket < profile_buckets; ++bucket)
+                {
+                    entry.histogram[bucket] += site.histogram[bucket].load(std::memory_order_relaxed);
+                }
+            }
+        }
+        if (dropped != nullptr)
         {
-            StackInfo stack_info{};
-            stack_info.source_location.file_name = file_name;
-            stack_info.source_location.function_name = function_name;
-            stack_info.source_location.line_number = line_number;
-            p_stack_info = &StackInfoInstance::get().stack_infos.emplace_front(stack_info);
+            *dropped = dropped_count;
         }
-        ~StackScope()
+        std::vector<ProfileEntry> result{};
+        result.reserve(merged.size());
+        for (auto& [location, entry] : merged)
         {
-            SOPHO_ASSERT(!StackInfoInstance::get().stack_infos.empty(), "Stack has been cleared");
-            SOPHO_ASSERT(&StackInfoInstance::get().stack_infos.front() == p_stack_info, "Stack Corrupted");
-            StackInfoInstance::get().stack_infos.pop_front();
+            result.push_back(entry);
         }
-        StackScope(const StackScope&) = delete;
-        StackScope& operator=(const StackScope&) = delete;
-        StackScope(StackScope&&) = delete;
-        StackScope& operator=(StackScope&&) = delete;
-    };
-    struct StackValue
+        std::sort(result.begin(), result.end(),
+                  [](const ProfileEntry& a, const ProfileEntry& b) { return a.total_ns > b.total_ns; });
+        return result;
+    }
+    inline void print_profile(std::ostream& out, std::size_t limit)
     {
-        std::string name{};
-        StackValue(std::string value_name, StackValueReference value)
+        std::uint64_t dropped = 0;
+        auto entries = collect_profile(&dropped);
+        auto us = [](std::uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+        // Formatted apart, so `out` keeps the caller's precision.
+        std::ostringstream text{};
+        text << "profile: " << entries.size() << " scopes (inclusive times, p50/p99 are histogram bounds)\n";
+        text << std::fixed << std::setprecision(1);
+        text << std::setw(12) << "total us" << std::setw(10) << "count" << std::setw(10) << "mean us" << std::setw(10)
+             << "min us" << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(10) << "max us"
+             << "  scope\n";
+        for (std::size_t i = 0; i < entries.size() && i < limit; ++i)
         {
-            name = value_name;
-            StackInfoInstance::get().stack_infos.front().stack_values.insert_or_assign(value_name, value);
+            const auto& entry = entries[i];
+            const auto& location = *entry.location;
+            text << std::setw(12) << us(entry.total_ns) << std::setw(10) << entry.count << std::setw(10)
+                 << us(entry.total_ns) / static_cast<double>(entry.count) << std::setw(10) << us(entry.min_ns)
+                 << std::setw(10) << us(entry.percentile_ns(0.5)) << std::setw(10) << us(entry.percentile_ns(0.99))
+                 << std::setw(10) << us(entry.max_ns) << "  " << location.function_name << " ("
+                 << location.file_name << ":" << location.line_number << ")\n";
         }
-        ~StackValue() { StackInfoInstance::get().stack_infos.front().stack_values.erase(name); }
-        StackValue(const StackValue&) = delete;
-        StackValue& operator=(const StackValue&) = delete;
-        StackValue(StackValue&&) = delete;
-        StackValue& operator=(StackValue&&) = delete;
-    };
-    void dump_callstack(std::ostringstream& ss)
+        if (entries.size() > limit)
+        {
+            text << "(" << entries.size() - limit << " more scopes)\n";
+        }
+        if (dropped != 0)
+        {
+            text << "(" << dropped << " calls dropped, raise SOPHO_PROFILE_SITES)\n";
+        }
+        out << text.str();
+    }
+    namespace detail
     {
-        auto& infos = StackInfoInstance::get().stack_infos;
-        std::uint32_t size{0};
-        for (const auto& info : infos)
+        inline void write_json_string(std::ostream& out, std::string_view str)
         {
-            ss << "stack" << size << ": " << info.source_location.file_name << ":" << info.source_location.line_number
-               << "@" << info.source_location.function_name << std::endl;
-            for (const auto& [key, value] : info.stack_values)
+            out << '"';
+            for (char c : str)
             {
-                ss << "name:" << key << " value:" << stack_value_to_string(value) << std::endl;
+                if (c == '"' || c == '\\')
+                {
+                    out << '\\' << c;
+                }
+                else if (static_cast<unsigned char>(c) < 0x20)
+                {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned>(c));
+                    out << escaped;
+                }
+                else
+                {
+                    out << c;
+                }
             }
-            ++size;
+            out << '"';
         }
-    }
-    [[noreturn]] inline void assert_fail(std::string_view expr, std::string msg, SourceLocation loc)
+    } // namespace detail
+    inline void write_profile_json(const std::filesystem::path& fs_path)
     {
-        std::ostringstream ss;
-        ss << "SOPHO_ASSERT failed: (" << expr << ")\n";
-        if (!msg.empty())
+        std::uint64_t dropped = 0;
+        auto entries = collect_profile(&dropped);
+        std::ofstream out(fs_path);
+        out << "{\n  \"dropped\": " << dropped << ",\n  \"scopes\": [";
+        for (std::size_t i = 0; i < entries.size(); ++i)
         {
-            ss << "Message: " << msg << "\n";
+            const auto& entry = entries[i];
+            out << (i == 0 ? "\n" : ",\n") << "    {\"file\": ";
+            detail::write_json_string(out, entry.location->file_name);
+            out << ", \"function\": ";
+            detail::write_json_string(out, entry.location->function_name);
+            out << ", \"line\": " << entry.location->line_number << ", \"count\": " << entry.count
+                << ", \"total_ns\": " << entry.total_ns << ", \"min_ns\": " << entry.min_ns
+                << ", \"max_ns\": " << entry.max_ns << ", \"histogram\": [";
+            for (std::uint32_t bucket = 0; bucket < profile_buckets; ++bucket)
+            {
+                out << (bucket == 0 ? "" : ", ") << entry.histogram[bucket];
+            }
+            out << "]}";
         }
-        ss << "Location: " << (loc.file_name ? loc.file_name : "<unknown>") << ":" << loc.line_number << " @ "
-           << (loc.function_name ? loc.function_name : "<unknown>") << "\n";
-        dump_callstack(ss);
-        std::cerr << ss.str();
-        std::cerr.flush();
-        std::abort();
+        out << "\n  ]\n}\n";
     }
 } // namespace sopho
-// include/sob.hpp
-// include/file_generator.hpp
-#include <deque>
-#include <memory>
-#include <set>
-// include/file_generator.hpp
+// include/diag.hpp
+// include/diag.hpp
+// include/thread_registry.hpp
+#include <cstring>
+#include <functional>
+#include <thread>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+// include/thread_registry.hpp
+// Process-wide registry of the threads that entered a SOPHO_STACK scope, so a failing thread can also show what
+// every other thread was doing. SOPHO_DIAG_THREADS bounds the number of threads registered at once; threads beyond it
+// still record their own stack but are not visible to others.
+#ifndef SOPHO_DIAG_THREADS
+#define SOPHO_DIAG_THREADS 64
+#endif
 namespace sopho
 {
-    std::string read_file(std::filesystem::path fs_path)
+    inline constexpr std::uint32_t diag_threads = SOPHO_DIAG_THREADS;
+    // Frames nested deeper than this are counted but not visible to other threads.
+    inline constexpr std::uint32_t max_thread_frames = 64;
+    // Kernel thread id where there is one (matches top/gdb), a hash of std::thread::id elsewhere.
+    inline std::uint64_t current_thread_id()
     {
-        std::ifstream file_stream(fs_path, std::ios::binary);
-        SOPHO_ASSERT(file_stream.is_open(), "open file failed, file name:", fs_path.string());
-        const auto file_size = std::filesystem::file_size(fs_path);
-        std::string content;
-        content.resize(file_size);
-        file_stream.read(content.data(), file_size);
-        return content;
+#if defined(__linux__)
+        return static_cast<std::uint64_t>(::syscall(SYS_gettid));
+#else
+        return std::hash<std::thread::id>{}(std::this_thread::get_id());
+#endif
     }
-    std::vector<std::string_view> split_lines(std::string_view str)
+    // A thread's entry in the registry. Its frames are a shadow of the owner's StackInfo list that holds only
+    // pointers to static SourceLocations, so another thread can read them at any time without the frames being
+    // alive: a stale entry still points at valid data. Values are not mirrored, they may be mid-update.
+    struct ThreadSlot
     {
-        std::vector<std::string_view> result;
-        size_t start = 0;
-        while (start < str.size())
+        std::atomic<bool> used{};
+        std::atomic<std::uint32_t> depth{};
+        std::uint64_t thread_id{};
+        std::atomic<std::uint32_t> name_size{};
+        char name[32]{};
+        std::atomic<const SourceLocation*> frames[max_thread_frames]{};
+        void push(std::uint32_t index, const SourceLocation* location)
         {
-            size_t end = str.find('\n', start);
-            if (end == std::string_view::npos)
+            if (index < max_thread_frames)
             {
-                result.emplace_back(str.substr(start));
-                break;
+                frames[index].store(location, std::memory_order_relaxed);
             }
-            size_t line_end = end;
-            if (line_end > start && str[line_end - 1] == '\r')
+            depth.store(index + 1, std::memory_order_release);
+        }
+        void pop(std::uint32_t index) { depth.store(index, std::memory_order_release); }
+    };
+    namespace detail
+    {
+        inline ThreadSlot* thread_slots()
+        {
+            static ThreadSlot slots[diag_threads]{};
+            return slots;
+        }
+        inline void set_slot_name(ThreadSlot& slot, std::string_view name)
+        {
+            auto size = std::min(name.size(), sizeof(slot.name));
+            // Readers take name_size first; shrinking it before the copy keeps them inside written bytes.
+            slot.name_size.store(0, std::memory_order_release);
+            std::memcpy(slot.name, name.data(), size);
+            slot.name_size.store(static_cast<std::uint32_t>(size), std::memory_order_release);
+        }
+        inline ThreadSlot* claim_thread_slot()
+        {
+            auto* slots = thread_slots();
+            for (std::uint32_t i = 0; i < diag_threads; ++i)
             {
-                line_end -= 1;
+                bool expected = false;
+                if (slots[i].used.compare_exchange_strong(expected, true, std::memory_order_acq_rel))
+                {
+                    auto& slot = slots[i];
+                    slot.depth.store(0, std::memory_order_relaxed);
+                    slot.thread_id = current_thread_id();
+                    slot.name_size.store(0, std::memory_order_relaxed);
+#if defined(__linux__)
+                    char name[16]{};
+                    if (::pthread_getname_np(::pthread_self(), name, sizeof(name)) == 0)
+                    {
+                        set_slot_name(slot, name);
+                    }
+#endif
+                    return &slot;
+                }
             }
-            result.emplace_back(str.substr(start, line_end - start));
-            start = end + 1;
+            return nullptr;
         }
-        return result;
-    }
-    std::string_view ltrim(std::string_view sv)
+        // Releases the slot when the thread exits, clearing the owner's pointer first so scopes that still run from
+        // later thread_local destructors cannot write to a slot another thread has claimed.
+        struct ThreadSlotOwner
+        {
+            ThreadSlot* slot{};
+            ThreadSlot** owner_slot{};
+            ~ThreadSlotOwner()
+            {
+                if (slot != nullptr)
+                {
+                    *owner_slot = nullptr;
+                    slot->used.store(false, std::memory_order_release);
+                }
+            }
+        };
+    } // namespace detail
+    // Claims a slot for the calling thread and arranges its release at thread exit; `slot` is the thread's own
+    // pointer to it. Returns nullptr when the registry is full.
+    inline ThreadSlot* register_thread(ThreadSlot*& slot)
     {
-        size_t i = 0;
-        while (i < sv.size() && (sv[i] == ' ' || sv[i] == '\t'))
+        static thread_local detail::ThreadSlotOwner owner{};
+        if (owner.slot == nullptr)
         {
-            ++i;
+            owner.slot = detail::claim_thread_slot();
+            owner.owner_slot = &slot;
         }
-        return sv.substr(i);
-    }
-    bool starts_with(std::string_view sv, std::string_view prefix)
-    {
-        return sv.size() >= prefix.size() && sv.compare(0, prefix.size(), prefix) == 0;
+        slot = owner.slot;
+        return slot;
     }
-    struct FileEntry
+    // Prints every registered thread except `self` as "thread <name> (id N)" followed by its frames, innermost
+    // first. Works with std::ostream and SignalSafeWriter alike and never dereferences anything but static data.
+    template <typename Out>
+    void dump_threads(Out& out, const ThreadSlot* self)
     {
-        std::string name{};
-        std::uint64_t size{};
-        std::uint64_t hash{};
-        std::unique_ptr<std::string> content{};
-        friend bool operator<(const FileEntry& a, const FileEntry& b)
+        auto* slots = detail::thread_slots();
+        for (std::uint32_t i = 0; i < diag_threads; ++i)
         {
-            if (a.name != b.name)
-                return a.name < b.name;
-            if (a.size != b.size)
-                return a.size < b.size;
-            if (a.hash != b.hash)
-                return a.hash < b.hash;
-            return *a.content < *b.content;
+            const auto& slot = slots[i];
+            if (&slot == self || !slot.used.load(std::memory_order_acquire))
+            {
+                continue;
+            }
+            auto name_size = slot.name_size.load(std::memory_order_acquire);
+            std::string_view name = name_size == 0 ? std::string_view{"<unnamed>"} : std::string_view{slot.name, name_size};
+            out << "thread " << name << " (id " << slot.thread_id << ")\n";
+            auto depth = slot.depth.load(std::memory_order_acquire);
+            if (depth == 0)
+            {
+                out << "  (no active scopes)\n";
+            }
+            if (depth > max_thread_frames)
+            {
+                out << "  (" << depth - max_thread_frames << " inner frames not shown)\n";
+            }
+            for (std::uint32_t frame = std::min(depth, max_thread_frames); frame > 0; --frame)
+            {
+                const auto* location = slot.frames[frame - 1].load(std::memory_order_relaxed);
+                if (location != nullptr)
+                {
+                    out << "  " << location->file_name << ":" << location->line_number << "@"
+                        << location->function_name << "\n";
+                }
+            }
         }
-    };
-    FileEntry make_entry(std::filesystem::path fs_path)
-    {
-        auto file_content = read_file(fs_path);
-        FileEntry entry{};
-        entry.name = fs_path.filename().string();
-        entry.size = file_content.size();
-        entry.hash = std::hash<std::string>{}(file_content);
-        entry.content = std::make_unique<std::string>(std::move(file_content));
-        return entry;
     }
-    struct Context
-    {
-        std::filesystem::path include_path{};
-        std::deque<std::string> file_content{};
-        std::set<FileEntry> file_entries{};
-        std::set<std::string> std_header{};
-    };
-    std::vector<std::string_view> collect_file(std::string_view file_path, Context& context)
+} // namespace sopho
+// include/diag.hpp
+// include/trace.hpp
+#include <cerrno>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+// include/trace.hpp
+// Post-mortem event trace, enabled with -DSOPHO_DIAG_TRACE=1. Every thread records enter/exit/value events of
+// SOPHO_STACK/SOPHO_VALUE into its own fixed-size ring; a failed assert or a fatal signal dumps the last events of
+// every thread (see crash_handler.hpp). Capacities are per thread (a power of two) and per process.
+#ifndef SOPHO_DIAG_TRACE
+#define SOPHO_DIAG_TRACE 0
+#endif
+#ifndef SOPHO_TRACE_CAPACITY
+#define SOPHO_TRACE_CAPACITY 256
+#endif
+#ifndef SOPHO_TRACE_THREADS
+#define SOPHO_TRACE_THREADS 64
+#endif
+namespace sopho
+{
+    inline constexpr bool diag_trace = SOPHO_DIAG_TRACE != 0;
+    inline constexpr std::uint32_t trace_capacity = SOPHO_TRACE_CAPACITY;
+    inline constexpr std::uint32_t trace_threads = SOPHO_TRACE_THREADS;
+    static_assert(trace_capacity > 0 && (trace_capacity & (trace_capacity - 1)) == 0,
+                  "SOPHO_TRACE_CAPACITY must be a power of two");
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "trace rings need lock-free 64-bit atomics");
+    // Formats into a fixed buffer and writes with write(2): no allocation, no locale, no locks, so it can be used
+    // from a signal handler.
+    class SignalSafeWriter
     {
-        std::vector<std::string_view> result{};
-        std::string file_name_comment = "// " + std::string(file_path);
-        auto& comment = context.file_content.emplace_back(file_name_comment);
-        result.emplace_back(comment);
-        std::filesystem::path fs_path = file_path;
-        SOPHO_ASSERT(std::filesystem::exists(fs_path), "file not exist ", fs_path.string());
-        auto [iter, inserted] = context.file_entries.emplace(make_entry(fs_path));
-        if (!inserted)
+    public:
+        explicit SignalSafeWriter(int fd) : fd_(fd) {}
+        ~SignalSafeWriter() { flush(); }
+        SignalSafeWriter(const SignalSafeWriter&) = delete;
+        SignalSafeWriter& operator=(const SignalSafeWriter&) = delete;
+        SignalSafeWriter& operator<<(std::string_view str)
         {
-            return {};
+            while (!str.empty())
+            {
+                if (size_ == sizeof(buffer_))
+                {
+                    flush();
+                }
+                auto count = std::min(str.size(), sizeof(buffer_) - size_);
+                std::memcpy(buffer_ + size_, str.data(), count);
+                size_ += count;
+                str.remove_prefix(count);
+            }
+            return *this;
         }
-        auto lines = split_lines(std::string_view(*iter->content));
-        for (const auto& line : lines)
+        SignalSafeWriter& operator<<(const char* str) { return *this << std::string_view{str ? str : "<null>"}; }
+        SignalSafeWriter& operator<<(char c) { return *this << std::string_view{&c, 1}; }
+        SignalSafeWriter& operator<<(std::uint64_t value)
         {
-            auto line_content = ltrim(line);
-            if (line_content.length() == 0)
+            char digits[20];
+            std::size_t count = 0;
+            do
             {
-                continue;
+                digits[sizeof(digits) - ++count] = static_cast<char>('0' + value % 10);
+                value /= 10;
             }
-            if (line_content[0] != '#')
+            while (value != 0);
+            return *this << std::string_view{digits + sizeof(digits) - count, count};
+        }
+        SignalSafeWriter& operator<<(std::uint32_t value) { return *this << static_cast<std::uint64_t>(value); }
+        SignalSafeWriter& operator<<(std::int64_t value)
+        {
+            if (value < 0)
             {
-                result.emplace_back(line);
-                continue;
+                *this << '-';
+                return *this << (~static_cast<std::uint64_t>(value) + 1);
             }
-            line_content = line_content.substr(1);
-            line_content = ltrim(line_content);
-            if (starts_with(line_content, "include"))
+            return *this << static_cast<std::uint64_t>(value);
+        }
+        SignalSafeWriter& operator<<(int value) { return *this << static_cast<std::int64_t>(value); }
+        // Fixed notation with six decimals, enough for diagnostics; huge magnitudes print as "big".
+        SignalSafeWriter& operator<<(double value)
+        {
+            if (value != value)
             {
-                line_content = line_content.substr(7);
-                line_content = ltrim(line_content);
-                if (line_content[0] == '<')
+                return *this << "nan";
+            }
+            if (value < 0)
+            {
+                *this << '-';
+                value = -value;
+            }
+            if (value > 1e18)
+            {
+                return *this << (value == value + 1 && value > 1e308 ? "inf" : "big");
+            }
+            auto integral = static_cast<std::uint64_t>(value);
+            auto fraction = static_cast<std::uint64_t>((value - static_cast<double>(integral)) * 1e6 + 0.5);
+            if (fraction >= 1000000)
+            {
+                ++integral;
+                fraction -= 1000000;
+            }
+            *this << integral << '.';
+            for (std::uint64_t scale = 100000; scale > 0; scale /= 10)
+            {
+                *this << static_cast<char>('0' + fraction / scale % 10);
+            }
+            return *this;
+        }
+        SignalSafeWriter& hex(std::uint64_t value)
+        {
+            char digits[16];
+            for (int i = 15; i >= 0; --i)
+            {
+                digits[i] = "0123456789abcdef"[value & 0xf];
+                value >>= 4;
+            }
+            return *this << "0x" << std::string_view{digits, sizeof(digits)};
+        }
+        void flush()
+        {
+            std::size_t written = 0;
+            while (written < size_)
+            {
+#if defined(_WIN32)
+                auto result = std::fwrite(buffer_ + written, 1, size_ - written, fd_ == 1 ? stdout : stderr);
+                if (result == 0)
+                {
+                    break;
+                }
+#else
+                auto result = ::write(fd_, buffer_ + written, size_ - written);
+                if (result < 0 && errno == EINTR)
                 {
-                    line_content = line_content.substr(1);
-                    auto index = line_content.find('>');
-                    SOPHO_ASSERT(index != std::string_view::npos, "find > failed");
-                    auto file_name = line_content.substr(0, index);
-                    if (context.std_header.find(std::string(file_name)) != context.std_header.end())
-                    {
-                        continue;
-                    }
-                    context.std_header.emplace(file_name);
-                    result.emplace_back(line);
                     continue;
                 }
-                else if (line_content[0] == '"')
+                if (result <= 0)
                 {
-                    line_content = line_content.substr(1);
-                    auto index = line_content.find('"');
-                    SOPHO_ASSERT(index != std::string_view::npos, "find \" failed");
-                    std::string file_name{line_content.substr(0, index)};
-                    std::filesystem::path new_fs_path = fs_path.parent_path() / file_name;
-                    if (!std::filesystem::exists(new_fs_path))
-                    {
-                        new_fs_path = context.include_path / file_name;
-                    }
-                    auto file_content = collect_file(std::string_view(new_fs_path.string()), context);
-                    result.insert(result.end(), file_content.begin(), file_content.end());
-                    result.emplace_back(comment);
+                    break;
                 }
-                else
+#endif
+                written += static_cast<std::size_t>(result);
+            }
+            size_ = 0;
+        }
+    private:
+        int fd_{};
+        std::size_t size_{};
+        char buffer_[1024];
+    };
+    enum class TraceEventKind : std::uint8_t
+    {
+        Enter,
+        Exit,
+        Value,
+    };
+    enum class TraceValueKind : std::uint8_t
+    {
+        None,
+        Int,
+        UInt,
+        Double,
+        Text,
+    };
+    // Self-contained (no pointers), so a trace file can still be decoded after the process is gone. `label` is the
+    // function name for enter/exit and the value name for value events, truncated to fit.
+    struct TraceEvent
+    {
+        std::atomic<std::uint64_t> sequence; // index + 1 once complete, 0 while being written
+        std::uint32_t line;
+        TraceEventKind kind;
+        TraceValueKind value_kind;
+        std::uint8_t label_size;
+        std::uint8_t text_size;
+        char label[24];
+        union
+        {
+            std::int64_t i;
+            std::uint64_t u;
+            double d;
+            char text[24];
+        } payload;
+    };
+    static_assert(sizeof(TraceEvent) == 64, "TraceEvent is meant to be one cache line");
+    enum class TraceRingState : std::uint32_t
+    {
+        Free,
+        Owned,
+        Released, // the owning thread exited, its history stays readable until the ring is reused
+    };
+    // Single producer (the owning thread), any number of readers. Readers validate each event with its sequence
+    // number, seqlock style, and skip events that are being overwritten.
+    struct TraceRing
+    {
+        std::atomic<TraceRingState> state;
+        std::uint32_t index;
+        std::uint64_t thread_id;
+        std::atomic<std::uint64_t> head;
+        std::uint64_t reserved;
+        TraceEvent events[trace_capacity];
+    };
+    // Shared layout of the in-memory registry and of the on-disk trace file.
+    struct TraceRegistry
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t thread_capacity;
+        std::uint32_t event_capacity;
+        std::uint32_t event_size;
+        TraceRing rings[trace_threads];
+    };
+    inline constexpr char trace_magic[8] = {'S', 'O', 'P', 'H', 'O', 'T', 'R', 'C'};
+    inline void init_trace_registry(TraceRegistry& registry)
+    {
+        std::memcpy(registry.magic, trace_magic, sizeof(trace_magic));
+        registry.version = 1;
+        registry.thread_capacity = trace_threads;
+        registry.event_capacity = trace_capacity;
+        registry.event_size = sizeof(TraceEvent);
+    }
+    inline bool valid_trace_registry(const TraceRegistry& registry)
+    {
+        return std::memcmp(registry.magic, trace_magic, sizeof(trace_magic)) == 0 && registry.version == 1 &&
+            registry.thread_capacity == trace_threads && registry.event_capacity == trace_capacity &&
+            registry.event_size == sizeof(TraceEvent);
+    }
+    namespace detail
+    {
+        // Function-local so the storage only exists in programs that actually trace.
+        inline TraceRegistry* trace_memory_registry()
+        {
+            static TraceRegistry registry{};
+            static bool initialized = (init_trace_registry(registry), true);
+            (void)initialized;
+            return &registry;
+        }
+        inline std::atomic<TraceRegistry*>& trace_registry()
+        {
+            static std::atomic<TraceRegistry*> registry{trace_memory_registry()};
+            return registry;
+        }
+        inline thread_local TraceRing* current_trace_ring = nullptr;
+        struct TraceRingOwner
+        {
+            TraceRing* ring{};
+            ~TraceRingOwner()
+            {
+                if (ring != nullptr)
                 {
-                    result.emplace_back(line);
+                    current_trace_ring = nullptr;
+                    ring->state.store(TraceRingState::Released, std::memory_order_release);
                 }
             }
-            else if (starts_with(line_content, "pragma"))
+        };
+        inline TraceRing* claim_trace_ring(TraceRegistry& registry)
+        {
+            // Prefer never used rings, then recycle the history of exited threads.
+            for (auto wanted : {TraceRingState::Free, TraceRingState::Released})
             {
-                line_content = line_content.substr(6);
-                line_content = ltrim(line_content);
-                if (starts_with(line_content, "once"))
+                for (std::uint32_t i = 0; i < trace_threads; ++i)
                 {
-                    continue;
+                    auto& ring = registry.rings[i];
+                    auto expected = wanted;
+                    if (ring.state.compare_exchange_strong(expected, TraceRingState::Owned, std::memory_order_acq_rel))
+                    {
+                        ring.index = i;
+                        ring.thread_id = current_thread_id();
+                        ring.head.store(0, std::memory_order_release);
+                        return &ring;
+                    }
                 }
-                result.emplace_back(line);
             }
-            else
+            return nullptr;
+        }
+        inline TraceRing* this_thread_trace_ring()
+        {
+            if (current_trace_ring == nullptr)
+            {
+                static thread_local TraceRingOwner owner{};
+                static thread_local bool exhausted = false;
+                if (exhausted || owner.ring != nullptr)
+                {
+                    return owner.ring;
+                }
+                owner.ring = claim_trace_ring(*trace_registry().load(std::memory_order_acquire));
+                exhausted = owner.ring == nullptr;
+                current_trace_ring = owner.ring;
+            }
+            return current_trace_ring;
+        }
+        inline void copy_label(char (&out)[24], std::uint8_t& size, std::string_view str)
+        {
+            size = static_cast<std::uint8_t>(std::min(str.size(), sizeof(out)));
+            std::memcpy(out, str.data(), size);
+        }
+    } // namespace detail
+    // Appends an event to the calling thread's ring; `fill` writes the kind specific fields.
+    template <typename Fill>
+    inline void trace_event(TraceEventKind kind, std::string_view label, std::uint32_t line, Fill&& fill)
+    {
+        auto* ring = detail::this_thread_trace_ring();
+        if (ring == nullptr)
+        {
+            return;
+        }
+        auto index = ring->head.load(std::memory_order_relaxed);
+        auto& event = ring->events[index & (trace_capacity - 1)];
+        event.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        event.kind = kind;
+        event.line = line;
+        event.value_kind = TraceValueKind::None;
+        event.text_size = 0;
+        detail::copy_label(event.label, event.label_size, label);
+        fill(event);
+        event.sequence.store(index + 1, std::memory_order_release);
+        ring->head.store(index + 1, std::memory_order_release);
+    }
+    inline void trace_scope(TraceEventKind kind, const char* function_name, std::uint32_t line)
+    {
+        trace_event(kind, function_name, line, [](TraceEvent&) {});
+    }
+    inline void trace_text(TraceEvent& event, std::string_view text)
+    {
+        event.value_kind = TraceValueKind::Text;
+        event.text_size = static_cast<std::uint8_t>(std::min(text.size(), sizeof(event.payload.text)));
+        std::memcpy(event.payload.text, text.data(), event.text_size);
+    }
+    inline void dump_trace_ring(SignalSafeWriter& out, const TraceRing& ring, std::uint32_t max_events)
+    {
+        auto head = ring.head.load(std::memory_order_acquire);
+        auto count = std::min<std::uint64_t>({head, trace_capacity, max_events});
+        out << "trace ring " << ring.index << " (thread " << ring.thread_id
+            << (ring.state.load(std::memory_order_acquire) == TraceRingState::Released ? ", exited" : "") << "): last "
+            << count << " of " << head << " events\n";
+        for (auto index = head - count; index < head; ++index)
+        {
+            const auto& event = ring.events[index & (trace_capacity - 1)];
+            auto before = event.sequence.load(std::memory_order_acquire);
+            TraceEvent copy;
+            std::memcpy(static_cast<void*>(&copy), static_cast<const void*>(&event), sizeof(TraceEvent));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            auto after = event.sequence.load(std::memory_order_relaxed);
+            out << "  #" << index << ' ';
+            if (before != index + 1 || after != before)
+            {
+                out << "<overwritten>\n";
+                continue;
+            }
+            std::string_view label{copy.label, copy.label_size};
+            switch (copy.kind)
             {
-                result.emplace_back(line);
+                case TraceEventKind::Enter:
+                    out << "enter " << label << ':' << copy.line;
+                    break;
+                case TraceEventKind::Exit:
+                    out << "exit  " << label << ':' << copy.line;
+                    break;
+                case TraceEventKind::Value:
+                    out << "value " << label << '=';
+                    switch (copy.value_kind)
+                    {
+                        case TraceValueKind::Int:
+                            out << copy.payload.i;
+                            break;
+                        case TraceValueKind::UInt:
+                            out << copy.payload.u;
+                            break;
+                        case TraceValueKind::Double:
+                            out << copy.payload.d;
+                            break;
+                        case TraceValueKind::Text:
+                            out << std::string_view{copy.payload.text, copy.text_size};
+                            break;
+                        default:
+                            out << '?';
+                            break;
+                    }
+                    break;
             }
+            out << '\n';
         }
-        return result;
     }
-    void single_header_generator(std::string_view file_path)
+    inline void dump_trace(SignalSafeWriter& out, const TraceRegistry& registry,
+                           std::uint32_t max_events = trace_capacity)
     {
-        SOPHO_STACK();
-        Context context{};
-        std::filesystem::path fs_path = file_path;
-        SOPHO_VALUE(fs_path);
-        SOPHO_ASSERT(std::filesystem::exists(fs_path), "file not exist");
-        context.include_path = fs_path.parent_path();
-        auto lines = collect_file(file_path, context);
-        std::ofstream out("sob.hpp", std::ios::binary);
-        SOPHO_ASSERT(out.is_open(), "open file failed");
-        for (auto sv : lines)
+        for (const auto& ring : registry.rings)
+        {
+            if (ring.state.load(std::memory_order_acquire) != TraceRingState::Free)
+            {
+                dump_trace_ring(out, ring, max_events);
+            }
+        }
+    }
+    // Dumps the last `max_events` events of every thread that ever traced.
+    inline void dump_trace(SignalSafeWriter& out, std::uint32_t max_events = trace_capacity)
+    {
+        if constexpr (diag_trace)
+        {
+            dump_trace(out, *detail::trace_registry().load(std::memory_order_acquire), max_events);
+        }
+    }
+    // True for the first caller only, so an assert that aborts does not get reported again by the SIGABRT handler.
+    inline bool begin_crash_report()
+    {
+        static std::atomic<bool> reported{false};
+        return !reported.exchange(true);
+    }
+#if !defined(_WIN32)
+    // Places the rings in a shared file mapping, so the trace survives a hard crash and can be decoded later with
+    // dump_trace_file(). Threads that already traced keep their in-memory ring, so call this early in main().
+    inline bool open_trace_file(const char* path)
+    {
+        int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            return false;
+        }
+        bool sized = ::ftruncate(fd, sizeof(TraceRegistry)) == 0;
+        void* mapping =
+            sized ? ::mmap(nullptr, sizeof(TraceRegistry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        // The file is zero-filled, which is the Free state for every ring.
+        auto* registry = static_cast<TraceRegistry*>(mapping);
+        init_trace_registry(*registry);
+        detail::trace_registry().store(registry, std::memory_order_release);
+        return true;
+    }
+    // Decodes a trace file written by a previous (possibly crashed) run of the same build configuration.
+    inline bool dump_trace_file(const char* path, int out_fd = 1, std::uint32_t max_events = trace_capacity)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        void* mapping = ::mmap(nullptr, sizeof(TraceRegistry), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        const auto& registry = *static_cast<const TraceRegistry*>(mapping);
+        bool valid = valid_trace_registry(registry);
+        if (valid)
         {
-            out.write(sv.data(), sv.size());
-            out.put('\n');
+            SignalSafeWriter out{out_fd};
+            dump_trace(out, registry, max_events);
         }
+        ::munmap(mapping, sizeof(TraceRegistry));
+        return valid;
     }
+#endif
 } // namespace sopho
-// include/sob.hpp
-// include/sob.hpp
+// include/diag.hpp
+// include/value_formatter.hpp
+#include <charconv>
+#include <concepts>
 // include/static_string.hpp
-#include <array>
 namespace sopho
 {
     template <std::size_t Size>
@@ -477,235 +1035,5031 @@ namespace sopho
         }
         return result;
     }
+    // Variadic append in a single step, so joining many strings does not nest one instantiation per part.
+    template <std::size_t... Sizes>
+    constexpr StaticString<(Sizes + ... + 0)> concat(const StaticString<Sizes>&... parts)
+    {
+        StaticString<(Sizes + ... + 0)> result{};
+        std::size_t offset = 0;
+        (
+            [&]
+            {
+                for (std::size_t i = 0; i < parts.size(); ++i)
+                {
+                    result.data[offset + i] = parts[i];
+                }
+                offset += parts.size();
+            }(),
+            ...);
+        return result;
+    }
+    inline constexpr std::uint64_t fnv1a_offset_basis = 0xcbf29ce484222325ULL;
+    // FNV-1a, stable across runs and platforms so it can be persisted in manifests and build logs. `hash` continues
+    // an earlier digest.
+    constexpr std::uint64_t fnv1a(std::string_view str, std::uint64_t hash = fnv1a_offset_basis)
+    {
+        for (char c : str)
+        {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 0x100000001b3ULL;
+        }
+        return hash;
+    }
+    template <std::size_t Size>
+    constexpr std::uint64_t fnv1a(const StaticString<Size>& str)
+    {
+        return fnv1a(str.view());
+    }
+    // Folds each value into `seed` in order. Parts are hashed separately before combining, so {"ab", "c"} and
+    // {"a", "bc"} do not collide the way hashing their concatenation would.
+    template <typename... Values>
+    constexpr std::uint64_t hash_combine(std::uint64_t seed, Values... values)
+    {
+        (
+            [&]
+            {
+                std::uint64_t value = static_cast<std::uint64_t>(values);
+                for (int i = 0; i < 8; ++i)
+                {
+                    seed ^= (value >> (i * 8)) & 0xff;
+                    seed *= 0x100000001b3ULL;
+                }
+            }(),
+            ...);
+        return seed;
+    }
 } // namespace sopho
-// include/sob.hpp
-template <class T>
-constexpr std::string_view type_name()
+// include/value_formatter.hpp
+namespace sopho
 {
-#if defined(__clang__) || defined(__GNUC__)
-    // __PRETTY_FUNCTION__ contains the type name in a compiler-specific format.
-    std::string_view p = __PRETTY_FUNCTION__;
-    // Example (clang): "constexpr std::string_view type_name() [T = int]"
-    auto start = p.find("T = ");
-    start = (start == std::string_view::npos) ? 0 : start + 4;
-    // GCC/Clang format contains "; ..." after T = Type
-    auto end = p.find(';', start);
-    if (end == std::string_view::npos)
-        end = p.find(']', start);
-    return p.substr(start, end - start);
-#elif defined(_MSC_VER)
-    // __FUNCSIG__ contains the type name in a compiler-specific format.
-    std::string_view p = __FUNCSIG__;
-    // Example (MSVC): "class std::basic_string_view<char,struct std::char_traits<char> > __cdecl type_name<int>(void)"
-    auto start = p.find("type_name<");
-    start = (start == std::string_view::npos) ? 0 : start + 10;
-    auto end = p.find(">(void)", start);
-    return p.substr(start, end - start);
-#else
-    return "unknown";
-#endif
-}
-namespace sopho
-{
-    struct CompileCommand
+    // Formats a captured SOPHO_VALUE into [first, last) and returns the end of the written characters, like
+    // std::to_chars. Output that does not fit is truncated. Implementations must not allocate and must not write
+    // past `last`; the crash handler calls them from a signal handler. Specialize it to capture user types:
+    //
+    //     template <>
+    //     struct sopho::StackValueFormatter<Job>
+    //     {
+    //         static char* format(const Job& job, char* first, char* last) { ... }
+    //     };
+    template <typename T>
+    struct StackValueFormatter;
+    template <typename T>
+    concept StackFormattable = requires(const T& value, char* out) {
+        { StackValueFormatter<T>::format(value, out, out) } -> std::same_as<char*>;
+    };
+    namespace detail
+    {
+        inline char* copy_chars(std::string_view str, char* first, char* last)
+        {
+            auto count = std::min(str.size(), static_cast<std::size_t>(last - first));
+            std::memcpy(first, str.data(), count);
+            return first + count;
+        }
+        template <typename T>
+        char* to_chars_or_truncate(T value, char* first, char* last)
+        {
+            auto [end, error] = std::to_chars(first, last, value);
+            return error == std::errc{} ? end : first;
+        }
+    } // namespace detail
+    template <>
+    struct StackValueFormatter<bool>
     {
-        std::string directory{};
-        std::vector<std::string> arguments{};
-        std::string file{};
+        static char* format(bool value, char* first, char* last)
+        {
+            return detail::copy_chars(value ? "true" : "false", first, last);
+        }
     };
-    inline void write_compile_commands_json(const std::string& path, const std::vector<CompileCommand>& commands)
+    template <>
+    struct StackValueFormatter<char>
     {
-        std::ofstream out(path);
-        out << "[\n";
-        for (size_t i = 0; i < commands.size(); ++i)
+        static char* format(char value, char* first, char* last)
         {
-            const auto& cmd = commands[i];
-            out << "  {\n";
-            out << "    \"directory\": \"" << cmd.directory << "\",\n";
-            out << "    \"file\": \"" << cmd.file << "\",\n";
-            out << "    \"arguments\": [";
-            for (size_t j = 0; j < cmd.arguments.size(); ++j)
-            {
-                out << "\"" << cmd.arguments[j] << "\"";
-                if (j + 1 < cmd.arguments.size())
-                    out << ", ";
-            }
-            out << "]\n";
-            out << "  }";
-            if (i + 1 < commands.size())
-                out << ",";
-            out << "\n";
+            return detail::copy_chars(std::string_view{&value, 1}, first, last);
         }
-        out << "]\n";
-    }
-    // Generic detection idiom core
-    template <typename, template <typename> class, typename = void>
-    struct is_detected : std::false_type
+    };
+    template <typename T>
+        requires(std::is_integral_v<T> || std::is_floating_point_v<T>)
+    struct StackValueFormatter<T>
     {
+        static char* format(T value, char* first, char* last)
+        {
+            return detail::to_chars_or_truncate(value, first, last);
+        }
     };
-    template <typename T, template <typename> class Op>
-    struct is_detected<T, Op, std::void_t<Op<T>>> : std::true_type
+    template <typename T>
+        requires std::is_enum_v<T>
+    struct StackValueFormatter<T>
     {
+        static char* format(T value, char* first, char* last)
+        {
+            return detail::to_chars_or_truncate(static_cast<std::underlying_type_t<T>>(value), first, last);
+        }
     };
-    template <typename T, template <typename> class Op>
-    inline constexpr bool is_detected_v = is_detected<T, Op>::value;
-    template <StaticString S>
-    struct Source
+    template <>
+    struct StackValueFormatter<std::string_view>
     {
-        static constexpr auto source = S;
+        static char* format(std::string_view value, char* first, char* last)
+        {
+            return detail::copy_chars(value, first, last);
+        }
     };
-    template <typename Deps, StaticString Name>
-    struct Target
+    template <>
+    struct StackValueFormatter<std::string>
     {
-        using Dependent = Deps;
-        static constexpr auto target = Name;
+        static char* format(const std::string& value, char* first, char* last)
+        {
+            return detail::copy_chars(value, first, last);
+        }
     };
-    // Expression template: get type of 'T::source' (works for static and non-static)
-    template <typename T>
-    using detect_source = decltype(std::declval<T&>().source);
-    // Final trait: has_source_v<T>
-    template <typename T>
-    inline constexpr bool has_source_v = is_detected_v<T, detect_source>;
-    template <typename T>
-    using detect_ldflags = decltype(std::declval<T&>().ldflags);
-    template <typename T>
-    inline constexpr bool has_ldflags_v = is_detected_v<T, detect_ldflags>;
-    template <typename T>
-    using detect_cxxflags = decltype(std::declval<T&>().cxxflags);
-    template <typename T>
-    inline constexpr bool has_cxxflags_v = is_detected_v<T, detect_cxxflags>;
-    template <typename T>
-    using detect_dependent_type = typename T::Dependent;
-    template <typename T>
-    inline constexpr bool has_dependent_v = is_detected_v<T, detect_dependent_type>;
-    template <typename T, typename = void>
-    struct dependent_or_empty
+    template <>
+    struct StackValueFormatter<const char*>
     {
-        using type = std::tuple<>;
+        static char* format(const char* value, char* first, char* last)
+        {
+            return detail::copy_chars(value ? std::string_view{value} : std::string_view{"<null>"}, first, last);
+        }
     };
-    template <typename T>
-    struct dependent_or_empty<T, std::void_t<typename T::Dependent>>
+    template <>
+    struct StackValueFormatter<char*> : StackValueFormatter<const char*>
     {
-        using type = typename T::Dependent;
     };
-    template <typename T>
-    using dependent_or_empty_t = typename dependent_or_empty<T>::type;
-    template <typename Context>
-    struct CxxToolchain
+    // Character arrays stop at the first NUL, if any.
+    template <std::size_t N>
+    struct StackValueFormatter<char[N]>
     {
-        template <typename Target>
-        struct CxxBuilder;
-        template <size_t Size>
-        constexpr static auto source_to_target(StaticString<Size> source)
+        static char* format(const char (&value)[N], char* first, char* last)
         {
-            return append(append(Context::build_prefix, strip_suffix(source, StaticString{".cpp"})),
-                          Context::obj_postfix);
+            std::string_view str{value, N};
+            return detail::copy_chars(str.substr(0, str.find('\0')), first, last);
         }
-        template <typename Target>
-        struct CxxBuilderWrapper
+    };
+    template <std::size_t N>
+    struct StackValueFormatter<StaticString<N>>
+    {
+        static char* format(const StaticString<N>& value, char* first, char* last)
         {
-            using type = CxxBuilder<Target>;
-        };
-        template <typename Target>
-        struct CxxBuilder
+            return detail::copy_chars(value.view(), first, last);
+        }
+    };
+    template <>
+    struct StackValueFormatter<std::filesystem::path>
+    {
+        static char* format(const std::filesystem::path& value, char* first, char* last)
         {
-            template <typename L, typename R>
-            struct BuildFolder
+            if constexpr (std::is_same_v<std::filesystem::path::value_type, char>)
+            {
+                return detail::copy_chars(value.native(), first, last);
+            }
+            else
             {
-                struct Builder
+                // Wide native paths: ASCII passes through, anything else would need a conversion that allocates.
+                for (auto c : value.native())
                 {
-                    static std::vector<CompileCommand> build()
+                    if (first == last)
                     {
-                        std::vector<CompileCommand> result;
-                        auto left = L::build();
-                        auto right = R::build();
-                        result.insert(result.end(), left.begin(), left.end());
-                        result.insert(result.end(), right.begin(), right.end());
-                        return result;
+                        break;
                     }
-                };
-                using type = Builder;
-            };
-            struct DumbBuilder
-            {
-                static std::vector<CompileCommand> build() { return {}; }
-            };
-            using DependentBuilder =
-                Foldl<BuildFolder, DumbBuilder, Map<CxxBuilderWrapper, dependent_or_empty_t<Target>>>;
-            template <typename T>
-            struct SourceToTarget
+                    *first++ = static_cast<std::uint32_t>(c) < 0x80 ? static_cast<char>(c) : '?';
+                }
+                return first;
+            }
+        }
+    };
+    // A type-erased reference to a captured value and its formatter. The value is not copied, so it must outlive
+    // the reference, which SOPHO_VALUE guarantees by capturing named variables only.
+    struct StackValueReference
+    {
+        const void* object{};
+        char* (*format)(const void* object, char* first, char* last){};
+        template <StackFormattable T>
+        static StackValueReference of(const T& value)
+        {
+            return StackValueReference{&value, [](const void* object, char* first, char* last)
+                                       { return StackValueFormatter<T>::format(*static_cast<const T*>(object), first,
+                                                                               last); }};
+        }
+    };
+    // Buffer size the dumps format each value into; longer values are truncated.
+    inline constexpr std::size_t stack_value_buffer_size = 256;
+    inline std::string_view format_stack_value(const StackValueReference& value, char* buffer, std::size_t size)
+    {
+        auto* end = value.format(value.object, buffer, buffer + size);
+        return std::string_view{buffer, static_cast<std::size_t>(end - buffer)};
+    }
+} // namespace sopho
+// include/diag.hpp
+#define SOPHO_DETAIL_JOIN2_IMPL(a, b) a##b
+#define SOPHO_DETAIL_JOIN2(a, b) SOPHO_DETAIL_JOIN2_IMPL(a, b)
+// Diagnostics level, chosen with -DSOPHO_DIAG_LEVEL=... before sob.hpp is included:
+//   SOPHO_DIAG_OFF     SOPHO_STACK/SOPHO_VALUE compile to nothing; a failed assert reports only its own location.
+//   SOPHO_DIAG_ASSERT  frames are recorded as assert context, SOPHO_VALUE compiles to nothing.
+//   SOPHO_DIAG_FULL    frames and values are recorded (default).
+//   SOPHO_DIAG_SAMPLED frames and values are recorded for 1 in SOPHO_DIAG_SAMPLE_RATE scopes per thread.
+#define SOPHO_DIAG_OFF 0
+#define SOPHO_DIAG_ASSERT 1
+#define SOPHO_DIAG_FULL 2
+#define SOPHO_DIAG_SAMPLED 3
+#ifndef SOPHO_DIAG_LEVEL
+#define SOPHO_DIAG_LEVEL SOPHO_DIAG_FULL
+#endif
+#ifndef SOPHO_DIAG_SAMPLE_RATE
+#define SOPHO_DIAG_SAMPLE_RATE 64
+#endif
+#if SOPHO_DIAG_LEVEL == SOPHO_DIAG_OFF
+#define SOPHO_STACK() static_cast<void>(0)
+#else
+#define SOPHO_STACK() SOPHO_DETAIL_STACK(SOPHO_DETAIL_JOIN2(_sopho_stack_scope_, __COUNTER__))
+#endif
+// The location is a constant-initialized static, so entering a scope only links a pointer into the frame list.
+#define SOPHO_DETAIL_STACK(name)                                                                                       \
+    static constexpr ::sopho::SourceLocation SOPHO_DETAIL_JOIN2(name, _location){                                      \
+        __FILE__, __func__, static_cast<std::uint32_t>(__LINE__)};                                                     \
+    ::sopho::StackScope name { SOPHO_DETAIL_JOIN2(name, _location) }
+#if SOPHO_DIAG_LEVEL == SOPHO_DIAG_OFF || SOPHO_DIAG_LEVEL == SOPHO_DIAG_ASSERT
+// sizeof keeps the operand "used" without evaluating it.
+#define SOPHO_VALUE(value) static_cast<void>(sizeof(value))
+#else
+#define SOPHO_VALUE(value)                                                                                             \
+    ::sopho::StackValue SOPHO_DETAIL_JOIN2(_sopho_stack_value_, __COUNTER__) { #value, value }
+#endif
+#define SOPHO_SOURCE_LOCATION                                                                                          \
+    ::sopho::SourceLocation { __FILE__, __func__, static_cast<std::uint32_t>(__LINE__) }
+// expr + variadic msg parts (at least one msg token is required by your convention)
+#define SOPHO_ASSERT(expr, ...)                                                                                        \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(expr))                                                                                                   \
+        {                                                                                                              \
+            ::sopho::assert_fail(#expr, ::sopho::build_message(__VA_ARGS__), SOPHO_SOURCE_LOCATION);                   \
+        }                                                                                                              \
+    }                                                                                                                  \
+    while (0)
+namespace sopho
+{
+    [[noreturn]] inline void assert_fail(std::string_view expr, std::string msg, SourceLocation loc);
+    // Build message only on failure path.
+    template <class... Args>
+    inline std::string build_message(Args&&... args)
+    {
+        std::ostringstream os;
+        (os << ... << std::forward<Args>(args));
+        return os.str();
+    }
+    enum class DiagLevel : std::uint8_t
+    {
+        Off = SOPHO_DIAG_OFF,
+        Assert = SOPHO_DIAG_ASSERT,
+        Full = SOPHO_DIAG_FULL,
+        Sampled = SOPHO_DIAG_SAMPLED,
+    };
+    inline constexpr DiagLevel diag_level = static_cast<DiagLevel>(SOPHO_DIAG_LEVEL);
+    inline constexpr std::uint32_t diag_sample_rate = SOPHO_DIAG_SAMPLE_RATE;
+    static_assert(diag_sample_rate > 0, "SOPHO_DIAG_SAMPLE_RATE must be positive");
+    struct StackValue;
+    // Values beyond this many per frame are counted but not shown in the dump.
+    inline constexpr std::uint32_t max_stack_values = 8;
+    // One frame of the diagnostic stack. Frames live inside their StackScope and are linked innermost first, so
+    // entering and leaving a scope never allocates. Captured values register themselves in the inline slots; only
+    // the first value_count entries are meaningful, so the slots are deliberately left uninitialized.
+    struct StackInfo
+    {
+        const SourceLocation* source_location{};
+        StackInfo* parent{};
+        std::uint32_t value_count{};
+        std::array<const StackValue*, max_stack_values> stack_values;
+    };
+    struct StackInfoInstance
+    {
+        StackInfo* top{};
+        // Sampled level only: scopes entered so far and whether the innermost scope is being recorded.
+        std::uint32_t sample_counter{};
+        bool recording{true};
+        // Registry slot mirroring this thread's frames for other threads, claimed when the first scope is entered.
+        bool registered{};
+        std::uint32_t depth{};
+        ThreadSlot* slot{};
+        static StackInfoInstance& get()
+        {
+            static thread_local StackInfoInstance instance{};
+            return instance;
+        }
+    };
+    // Names the calling thread in dumps of other threads; defaults to the OS thread name where there is one.
+    inline void set_thread_name(std::string_view name)
+    {
+        auto& instance = StackInfoInstance::get();
+        instance.registered = true;
+        if (auto* slot = instance.slot ? instance.slot : register_thread(instance.slot))
+        {
+            detail::set_slot_name(*slot, name);
+        }
+    }
+    struct StackScope
+    {
+        StackInfo stack_info;
+        bool recorded{true};
+        bool parent_recording{true};
+        [[no_unique_address]] ScopeTimer<diag_profile> timer;
+        explicit StackScope(const SourceLocation& source_location)
+        {
+            timer.start();
+            stack_info.source_location = &source_location;
+            auto& instance = StackInfoInstance::get();
+            if constexpr (diag_level == DiagLevel::Sampled)
             {
-                struct Result
+                recorded = ++instance.sample_counter % diag_sample_rate == 0;
+                parent_recording = instance.recording;
+                instance.recording = recorded;
+                if (!recorded)
                 {
-                    constexpr static auto target = source_to_target(T::source);
-                };
-                using type = Result;
-            };
-            template <typename L, typename R>
-            struct TargetStringFolder
+                    return;
+                }
+            }
+            stack_info.parent = instance.top;
+            instance.top = &stack_info;
+            if (!instance.registered)
             {
-                struct TargetString
-                {
-                    static constexpr auto target = append(append(L::target, StaticString(" ")), R::target);
-                };
-                using type = TargetString;
-            };
-            struct DumbTargetString
+                instance.registered = true;
+                register_thread(instance.slot);
+            }
+            if (instance.slot != nullptr)
             {
-                static constexpr StaticString target{""};
-            };
-            using DependentNameCollector =
-                Foldl<TargetStringFolder, DumbTargetString, Map<SourceToTarget, dependent_or_empty_t<Target>>>;
-            static std::vector<CompileCommand> build()
-            {
-                std::vector<CompileCommand> commands = DependentBuilder::build();
-                std::string command{};
-                std::vector<std::string> command_parts;
-                std::stringstream ss{};
-                ss << Context::cxx;
-                command_parts.push_back(std::string{Context::cxx});
-                if constexpr (has_source_v<Target>)
-                {
-                    static_assert(!Target::source.view().empty(), "Source file cannot be empty");
-                    auto target = source_to_target(Target::source);
-                    ss << " -c " << Target::source.view() << Context::obj_prefix.view() << target.view();
-                    command_parts.push_back("-c");
-                    command_parts.push_back(std::string(Target::source.view()));
-                    command_parts.push_back(std::string(Context::obj_prefix.view()));
-                    command_parts.push_back(std::string(target.view()));
-                    std::filesystem::path target_path{target.view()};
-                    std::filesystem::create_directories(target_path.parent_path());
-                    if constexpr (has_cxxflags_v<Context>)
-                    {
-                        for (const auto& flag : Context::cxxflags)
-                        {
-                            ss << " " << flag;
-                            command_parts.push_back(std::string(flag));
-                        }
-                    }
-                    commands.emplace_back(CompileCommand{std::filesystem::current_path().string(), command_parts,
-                                                         std::string{Target::source.view()}});
-                }
-                else
+                instance.slot->push(instance.depth, &source_location);
+            }
+            ++instance.depth;
+            if constexpr (diag_trace)
+            {
+                trace_scope(TraceEventKind::Enter, source_location.function_name, source_location.line_number);
+            }
+        }
+        ~StackScope()
+        {
+            timer.stop(*stack_info.source_location);
+            auto& instance = StackInfoInstance::get();
+            if constexpr (diag_level == DiagLevel::Sampled)
+            {
+                instance.recording = parent_recording;
+                if (!recorded)
                 {
-                    static_assert(std::tuple_size_v<typename Target::Dependent> > 0,
-                                  "Link target must have dependencies (object files)");
-                    ss << DependentNameCollector::target.view();
-                    ss << Context::bin_prefix.view() << Target::target.view();
-                    if constexpr (has_ldflags_v<Context>)
-                    {
-                        for (const auto& flag : Context::ldflags)
-                        {
-                            ss << " " << flag;
-                        }
-                    }
+                    return;
                 }
-                command = ss.str();
-                std::cout << type_name<Target>() << ":" << command << std::endl;
-                std::system(command.data());
-                std::cout << type_name<Target>() << ":finished" << std::endl;
-                return commands;
             }
-        };
+            SOPHO_ASSERT(instance.top == &stack_info, "Stack Corrupted");
+            if constexpr (diag_trace)
+            {
+                trace_scope(TraceEventKind::Exit, stack_info.source_location->function_name,
+                            stack_info.source_location->line_number);
+            }
+            instance.top = stack_info.parent;
+            --instance.depth;
+            if (instance.slot != nullptr)
+            {
+                instance.slot->pop(instance.depth);
+            }
+        }
+        StackScope(const StackScope&) = delete;
+        StackScope& operator=(const StackScope&) = delete;
+        StackScope(StackScope&&) = delete;
+        StackScope& operator=(StackScope&&) = delete;
+    };
+    // Captures a value by reference under its spelling in the source. Formatting is deferred to dump_callstack and
+    // goes through StackValueFormatter<T>; temporaries are rejected since they would dangle.
+    struct StackValue
+    {
+        std::string_view name{};
+        StackValueReference value;
+        StackInfo* stack_info{};
+        template <typename T>
+        StackValue(std::string_view value_name, const T& captured) :
+            name(value_name), value(StackValueReference::of(captured))
+        {
+            auto& instance = StackInfoInstance::get();
+            // Values outside of any recorded scope have no frame to attach to and are dropped.
+            if (!instance.recording || instance.top == nullptr)
+            {
+                return;
+            }
+            stack_info = instance.top;
+            if (stack_info->value_count < max_stack_values)
+            {
+                stack_info->stack_values[stack_info->value_count] = this;
+            }
+            ++stack_info->value_count;
+            if constexpr (diag_trace)
+            {
+                trace_event(TraceEventKind::Value, name, 0, [this](TraceEvent& event) { encode(event); });
+            }
+        }
+        ~StackValue()
+        {
+            if (stack_info != nullptr)
+            {
+                --stack_info->value_count;
+            }
+        }
+        template <typename T>
+        StackValue(std::string_view, const T&&) = delete;
+        StackValue(const StackValue&) = delete;
+        StackValue& operator=(const StackValue&) = delete;
+        StackValue(StackValue&&) = delete;
+        StackValue& operator=(StackValue&&) = delete;
+    private:
+        // Trace events outlive the referenced value, so the formatted value is copied in (truncated).
+        void encode(TraceEvent& event) const
+        {
+            auto* text = event.payload.text;
+            event.value_kind = TraceValueKind::Text;
+            auto* end = value.format(value.object, text, text + sizeof(event.payload.text));
+            event.text_size = static_cast<std::uint8_t>(end - text);
+        }
     };
+    void dump_callstack(std::ostringstream& ss)
+    {
+        if constexpr (diag_level == DiagLevel::Off)
+        {
+            ss << "(callstack not recorded, SOPHO_DIAG_LEVEL is SOPHO_DIAG_OFF)" << std::endl;
+            return;
+        }
+        else if constexpr (diag_level == DiagLevel::Sampled)
+        {
+            ss << "(callstack sampled 1 in " << diag_sample_rate << " scopes, frames may be missing)" << std::endl;
+        }
+        std::uint32_t size{0};
+        char buffer[stack_value_buffer_size];
+        for (const auto* info = StackInfoInstance::get().top; info != nullptr; info = info->parent)
+        {
+            const auto& location = *info->source_location;
+            ss << "stack" << size << ": " << location.file_name << ":" << location.line_number << "@"
+               << location.function_name << std::endl;
+            for (std::uint32_t i = 0; i < info->value_count && i < max_stack_values; ++i)
+            {
+                const auto& value = *info->stack_values[i];
+                ss << "name:" << value.name << " value:" << format_stack_value(value.value, buffer, sizeof(buffer))
+                   << std::endl;
+            }
+            if (info->value_count > max_stack_values)
+            {
+                ss << "(" << info->value_count - max_stack_values << " more values)" << std::endl;
+            }
+            ++size;
+        }
+    }
+    [[noreturn]] inline void assert_fail(std::string_view expr, std::string msg, SourceLocation loc)
+    {
+        std::ostringstream ss;
+        ss << "SOPHO_ASSERT failed: (" << expr << ")\n";
+        if (!msg.empty())
+        {
+            ss << "Message: " << msg << "\n";
+        }
+        ss << "Location: " << (loc.file_name ? loc.file_name : "<unknown>") << ":" << loc.line_number << " @ "
+           << (loc.function_name ? loc.function_name : "<unknown>") << "\n";
+        dump_callstack(ss);
+        dump_threads(ss, StackInfoInstance::get().slot);
+        std::cerr << ss.str();
+        std::cerr.flush();
+        // Claiming the report also keeps the SIGABRT handler from printing the stack a second time.
+        if (begin_crash_report() && diag_trace)
+        {
+            SignalSafeWriter out{2};
+            dump_trace(out);
+        }
+        std::abort();
+    }
+} // namespace sopho
+// include/crash_handler.hpp
+// include/crash_handler.hpp
+namespace sopho
+{
+    // Frames beyond this depth are not printed, which also bounds the walk if a crash corrupted the frame list.
+    inline constexpr std::uint32_t max_crash_frames = 256;
+    // Signal-safe counterpart of dump_callstack: locations are static data and values are formatted in place, so
+    // nothing allocates or locks.
+    inline void dump_callstack(SignalSafeWriter& out)
+    {
+        if constexpr (diag_level == DiagLevel::Off)
+        {
+            out << "(callstack not recorded, SOPHO_DIAG_LEVEL is SOPHO_DIAG_OFF)\n";
+            return;
+        }
+        else if constexpr (diag_level == DiagLevel::Sampled)
+        {
+            out << "(callstack sampled 1 in " << diag_sample_rate << " scopes, frames may be missing)\n";
+        }
+        std::uint32_t size{0};
+        char buffer[stack_value_buffer_size];
+        for (const auto* info = StackInfoInstance::get().top; info != nullptr && size < max_crash_frames;
+             info = info->parent)
+        {
+            const auto& location = *info->source_location;
+            out << "stack" << size << ": " << location.file_name << ":" << location.line_number << "@"
+                << location.function_name << "\n";
+            for (std::uint32_t i = 0; i < info->value_count && i < max_stack_values; ++i)
+            {
+                const auto& value = *info->stack_values[i];
+                out << "name:" << value.name << " value:" << format_stack_value(value.value, buffer, sizeof(buffer));
+                out << "\n";
+            }
+            if (info->value_count > max_stack_values)
+            {
+                out << "(" << info->value_count - max_stack_values << " more values)\n";
+            }
+            ++size;
+        }
+        if (size == max_crash_frames)
+        {
+            out << "(frame walk stopped at " << max_crash_frames << " frames)\n";
+        }
+    }
+#if !defined(_WIN32)
+    // Large enough for the handler's own frames plus a 1 KiB writer buffer, with room to spare.
+    inline constexpr std::size_t crash_signal_stack_size = 64 * 1024;
+    // Gives the calling thread an alternate signal stack, so a stack overflow can still be reported. Signal stacks
+    // are per thread: install_crash_handler() covers its caller, other threads call this themselves. The stack is
+    // kept for the life of the thread.
+    inline bool install_crash_signal_stack()
+    {
+        static thread_local bool installed = false;
+        if (installed)
+        {
+            return true;
+        }
+        void* memory =
+            ::mmap(nullptr, crash_signal_stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            return false;
+        }
+        stack_t stack{};
+        stack.ss_sp = memory;
+        stack.ss_size = crash_signal_stack_size;
+        if (::sigaltstack(&stack, nullptr) != 0)
+        {
+            ::munmap(memory, crash_signal_stack_size);
+            return false;
+        }
+        installed = true;
+        return true;
+    }
+    namespace detail
+    {
+        struct CrashSignal
+        {
+            int number;
+            std::string_view name;
+        };
+        inline constexpr CrashSignal crash_signals[] = {
+            {SIGSEGV, "SIGSEGV"}, {SIGBUS, "SIGBUS"}, {SIGABRT, "SIGABRT"}, {SIGFPE, "SIGFPE"}, {SIGILL, "SIGILL"},
+        };
+        inline void crash_signal_handler(int signal_number, siginfo_t* info, void*)
+        {
+            // An aborting SOPHO_ASSERT has already printed everything.
+            if (begin_crash_report())
+            {
+                SignalSafeWriter out{2};
+                out << "fatal signal " << signal_number;
+                for (const auto& crash_signal : crash_signals)
+                {
+                    if (crash_signal.number == signal_number)
+                    {
+                        out << " (" << crash_signal.name << ")";
+                    }
+                }
+                if (info != nullptr && signal_number != SIGABRT)
+                {
+                    out << " at ";
+                    out.hex(reinterpret_cast<std::uintptr_t>(info->si_addr));
+                }
+                out << "\n";
+                dump_callstack(out);
+                dump_threads(out, StackInfoInstance::get().slot);
+                dump_trace(out);
+            }
+            // SA_RESETHAND restored the default action; re-raise to terminate with the original signal.
+            ::raise(signal_number);
+        }
+    } // namespace detail
+    // Reports the SOPHO_STACK frames of the crashing thread (and the trace rings, when enabled) on SIGSEGV, SIGBUS,
+    // SIGABRT, SIGFPE and SIGILL, then lets the signal terminate the process as usual.
+    inline void install_crash_handler()
+    {
+        install_crash_signal_stack();
+        struct sigaction action{};
+        action.sa_sigaction = detail::crash_signal_handler;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK | SA_RESETHAND;
+        sigemptyset(&action.sa_mask);
+        for (const auto& crash_signal : detail::crash_signals)
+        {
+            ::sigaction(crash_signal.number, &action, nullptr);
+        }
+    }
+#else
+    inline bool install_crash_signal_stack() { return false; }
+    inline void install_crash_handler() {}
+#endif
+} // namespace sopho
+// include/sob.hpp
+// include/sob.hpp
+// include/file_generator.hpp
+#include <deque>
+#include <memory>
+#include <optional>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+// include/file_generator.hpp
+// include/directive.hpp
+namespace sopho
+{
+    // What the directive evaluator knows about macros. Names in neither set are unknown, and conditions that depend on
+    // them are kept verbatim in the output (unifdef style).
+    struct MacroSet
+    {
+        std::map<std::string, std::string, std::less<>> defined{};
+        std::set<std::string, std::less<>> undefined{};
+        void define(std::string_view name, std::string_view value = {})
+        {
+            undefined.erase(std::string(name));
+            defined.insert_or_assign(std::string(name), std::string(value));
+        }
+        void undefine(std::string_view name)
+        {
+            defined.erase(std::string(name));
+            undefined.emplace(name);
+        }
+        void forget(std::string_view name)
+        {
+            defined.erase(std::string(name));
+            undefined.erase(std::string(name));
+        }
+    };
+    enum class Tristate : std::uint8_t
+    {
+        False,
+        True,
+        Unknown,
+    };
+    inline Tristate is_defined(const MacroSet& macros, std::string_view name)
+    {
+        if (macros.defined.find(name) != macros.defined.end())
+        {
+            return Tristate::True;
+        }
+        if (macros.undefined.find(name) != macros.undefined.end())
+        {
+            return Tristate::False;
+        }
+        return Tristate::Unknown;
+    }
+    namespace detail
+    {
+        inline bool is_identifier_start(char c)
+        {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+        }
+        inline bool is_identifier_char(char c) { return is_identifier_start(c) || (c >= '0' && c <= '9'); }
+        inline std::vector<std::string_view> tokenize_expression(std::string_view expr)
+        {
+            std::vector<std::string_view> tokens{};
+            std::size_t i = 0;
+            while (i < expr.size())
+            {
+                char c = expr[i];
+                if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+                {
+                    ++i;
+                    continue;
+                }
+                if (expr.compare(i, 2, "//") == 0)
+                {
+                    break;
+                }
+                if (expr.compare(i, 2, "/*") == 0)
+                {
+                    auto end = expr.find("*/", i + 2);
+                    i = end == std::string_view::npos ? expr.size() : end + 2;
+                    continue;
+                }
+                std::size_t start = i;
+                if (is_identifier_char(c))
+                {
+                    // Identifiers and pp-numbers (including suffixes such as 1L or 0x10u).
+                    while (i < expr.size() && is_identifier_char(expr[i]))
+                    {
+                        ++i;
+                    }
+                }
+                else if (c == '\'' || c == '"')
+                {
+                    ++i;
+                    while (i < expr.size() && expr[i] != c)
+                    {
+                        i += expr[i] == '\\' ? 2 : 1;
+                    }
+                    i = i < expr.size() ? i + 1 : expr.size();
+                }
+                else
+                {
+                    static constexpr std::string_view two_char_ops[] = {"&&", "||", "==", "!=", "<=", ">=", "<<", ">>"};
+                    i += 1;
+                    for (auto op : two_char_ops)
+                    {
+                        if (expr.compare(start, 2, op) == 0)
+                        {
+                            i = start + 2;
+                            break;
+                        }
+                    }
+                }
+                tokens.emplace_back(expr.substr(start, i - start));
+            }
+            return tokens;
+        }
+        // Recursive descent over the #if grammar. Every value is optional: std::nullopt means "depends on an unknown
+        // macro", and && / || / ?: short-circuit so that "0 && UNKNOWN" is still a known 0.
+        class ExpressionEvaluator
+        {
+        public:
+            using Value = std::optional<std::int64_t>;
+            ExpressionEvaluator(std::vector<std::string_view> tokens, const MacroSet& macros, int depth) :
+                tokens_(std::move(tokens)), macros_(macros), depth_(depth)
+            {
+            }
+            Value evaluate()
+            {
+                auto value = conditional();
+                return pos_ == tokens_.size() && !error_ ? value : std::nullopt;
+            }
+        private:
+            std::vector<std::string_view> tokens_;
+            const MacroSet& macros_;
+            int depth_{};
+            std::size_t pos_{};
+            bool error_{};
+            std::string_view peek() const { return pos_ < tokens_.size() ? tokens_[pos_] : std::string_view{}; }
+            bool accept(std::string_view token)
+            {
+                if (peek() == token)
+                {
+                    ++pos_;
+                    return true;
+                }
+                return false;
+            }
+            void expect(std::string_view token)
+            {
+                if (!accept(token))
+                {
+                    error_ = true;
+                }
+            }
+            template <typename Op>
+            static Value apply(const Value& l, const Value& r, Op op)
+            {
+                if (!l || !r)
+                {
+                    return std::nullopt;
+                }
+                return op(*l, *r);
+            }
+            Value conditional()
+            {
+                auto cond = logical_or();
+                if (!accept("?"))
+                {
+                    return cond;
+                }
+                auto if_true = conditional();
+                expect(":");
+                auto if_false = conditional();
+                if (!cond)
+                {
+                    return if_true && if_false && *if_true == *if_false ? if_true : std::nullopt;
+                }
+                return *cond ? if_true : if_false;
+            }
+            Value logical_or()
+            {
+                auto l = logical_and();
+                while (accept("||"))
+                {
+                    auto r = logical_and();
+                    if ((l && *l) || (r && *r))
+                    {
+                        l = 1;
+                    }
+                    else
+                    {
+                        l = apply(l, r, [](auto, auto) { return std::int64_t{0}; });
+                    }
+                }
+                return l;
+            }
+            Value logical_and()
+            {
+                auto l = bit_or();
+                while (accept("&&"))
+                {
+                    auto r = bit_or();
+                    if ((l && !*l) || (r && !*r))
+                    {
+                        l = 0;
+                    }
+                    else
+                    {
+                        l = apply(l, r, [](auto, auto) { return std::int64_t{1}; });
+                    }
+                }
+                return l;
+            }
+            Value bit_or()
+            {
+                auto l = bit_xor();
+                while (peek() == "|")
+                {
+                    ++pos_;
+                    l = apply(l, bit_xor(), [](auto a, auto b) { return a | b; });
+                }
+                return l;
+            }
+            Value bit_xor()
+            {
+                auto l = bit_and();
+                while (accept("^"))
+                {
+                    l = apply(l, bit_and(), [](auto a, auto b) { return a ^ b; });
+                }
+                return l;
+            }
+            Value bit_and()
+            {
+                auto l = equality();
+                while (peek() == "&")
+                {
+                    ++pos_;
+                    l = apply(l, equality(), [](auto a, auto b) { return a & b; });
+                }
+                return l;
+            }
+            Value equality()
+            {
+                auto l = relational();
+                while (true)
+                {
+                    if (accept("=="))
+                    {
+                        l = apply(l, relational(), [](auto a, auto b) { return std::int64_t{a == b}; });
+                    }
+                    else if (accept("!="))
+                    {
+                        l = apply(l, relational(), [](auto a, auto b) { return std::int64_t{a != b}; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+            Value relational()
+            {
+                auto l = shift();
+                while (true)
+                {
+                    if (accept("<"))
+                    {
+                        l = apply(l, shift(), [](auto a, auto b) { return std::int64_t{a < b}; });
+                    }
+                    else if (accept(">"))
+                    {
+                        l = apply(l, shift(), [](auto a, auto b) { return std::int64_t{a > b}; });
+                    }
+                    else if (accept("<="))
+                    {
+                        l = apply(l, shift(), [](auto a, auto b) { return std::int64_t{a <= b}; });
+                    }
+                    else if (accept(">="))
+                    {
+                        l = apply(l, shift(), [](auto a, auto b) { return std::int64_t{a >= b}; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+            Value shift()
+            {
+                auto l = additive();
+                while (true)
+                {
+                    if (accept("<<"))
+                    {
+                        l = apply(l, additive(), [](auto a, auto b) { return b < 0 || b > 62 ? 0 : a << b; });
+                    }
+                    else if (accept(">>"))
+                    {
+                        l = apply(l, additive(), [](auto a, auto b) { return b < 0 || b > 62 ? 0 : a >> b; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+            Value additive()
+            {
+                auto l = multiplicative();
+                while (true)
+                {
+                    if (accept("+"))
+                    {
+                        l = apply(l, multiplicative(), [](auto a, auto b) { return a + b; });
+                    }
+                    else if (accept("-"))
+                    {
+                        l = apply(l, multiplicative(), [](auto a, auto b) { return a - b; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+            Value multiplicative()
+            {
+                auto l = unary();
+                while (true)
+                {
+                    if (accept("*"))
+                    {
+                        l = apply(l, unary(), [](auto a, auto b) { return a * b; });
+                    }
+                    else if (peek() == "/" || peek() == "%")
+                    {
+                        bool divide = peek() == "/";
+                        ++pos_;
+                        auto r = unary();
+                        if (r && *r == 0)
+                        {
+                            l = std::nullopt;
+                            continue;
+                        }
+                        l = apply(l, r, [divide](auto a, auto b) { return divide ? a / b : a % b; });
+                    }
+                    else
+                    {
+                        return l;
+                    }
+                }
+            }
+            Value unary()
+            {
+                if (accept("!"))
+                {
+                    auto v = unary();
+                    return v ? Value{!*v} : std::nullopt;
+                }
+                if (accept("-"))
+                {
+                    auto v = unary();
+                    return v ? Value{-*v} : std::nullopt;
+                }
+                if (accept("+"))
+                {
+                    return unary();
+                }
+                if (accept("~"))
+                {
+                    auto v = unary();
+                    return v ? Value{~*v} : std::nullopt;
+                }
+                return primary();
+            }
+            void skip_parenthesized()
+            {
+                int level = 0;
+                do
+                {
+                    if (pos_ >= tokens_.size())
+                    {
+                        error_ = true;
+                        return;
+                    }
+                    if (tokens_[pos_] == "(")
+                    {
+                        ++level;
+                    }
+                    else if (tokens_[pos_] == ")")
+                    {
+                        --level;
+                    }
+                    ++pos_;
+                }
+                while (level > 0);
+            }
+            static Value parse_number(std::string_view token)
+            {
+                std::int64_t value{0};
+                std::size_t i = 0;
+                int base = 10;
+                if (token.size() > 1 && token[0] == '0' && (token[1] == 'x' || token[1] == 'X'))
+                {
+                    base = 16;
+                    i = 2;
+                }
+                else if (token.size() > 1 && token[0] == '0' && (token[1] == 'b' || token[1] == 'B'))
+                {
+                    base = 2;
+                    i = 2;
+                }
+                else if (token.size() > 1 && token[0] == '0')
+                {
+                    base = 8;
+                    i = 1;
+                }
+                for (; i < token.size(); ++i)
+                {
+                    char c = token[i];
+                    int digit{};
+                    if (c >= '0' && c <= '9')
+                    {
+                        digit = c - '0';
+                    }
+                    else if (c >= 'a' && c <= 'f' && base == 16)
+                    {
+                        digit = c - 'a' + 10;
+                    }
+                    else if (c >= 'A' && c <= 'F' && base == 16)
+                    {
+                        digit = c - 'A' + 10;
+                    }
+                    else if (c == '\'')
+                    {
+                        continue;
+                    }
+                    else
+                    {
+                        break;
+                    }
+                    if (digit >= base)
+                    {
+                        return std::nullopt;
+                    }
+                    value = value * base + digit;
+                }
+                // Only integer suffixes may follow; anything else (e.g. a float) is not a valid #if operand.
+                for (; i < token.size(); ++i)
+                {
+                    char c = token[i];
+                    if (c != 'u' && c != 'U' && c != 'l' && c != 'L' && c != 'z' && c != 'Z')
+                    {
+                        return std::nullopt;
+                    }
+                }
+                return value;
+            }
+            Value primary()
+            {
+                if (accept("("))
+                {
+                    auto value = conditional();
+                    expect(")");
+                    return value;
+                }
+                auto token = peek();
+                if (token.empty())
+                {
+                    error_ = true;
+                    return std::nullopt;
+                }
+                ++pos_;
+                if (token[0] >= '0' && token[0] <= '9')
+                {
+                    return parse_number(token);
+                }
+                if (!is_identifier_start(token[0]))
+                {
+                    // Character literals and stray punctuation are left to the real preprocessor.
+                    return std::nullopt;
+                }
+                if (token == "defined")
+                {
+                    bool parenthesized = accept("(");
+                    auto name = peek();
+                    ++pos_;
+                    if (parenthesized)
+                    {
+                        expect(")");
+                    }
+                    switch (is_defined(macros_, name))
+                    {
+                        case Tristate::True:
+                            return 1;
+                        case Tristate::False:
+                            return 0;
+                        default:
+                            return std::nullopt;
+                    }
+                }
+                if (token == "true")
+                {
+                    return 1;
+                }
+                if (token == "false")
+                {
+                    return 0;
+                }
+                if (peek() == "(")
+                {
+                    // Function-like macros and __has_include & co.
+                    skip_parenthesized();
+                    return std::nullopt;
+                }
+                if (auto iter = macros_.defined.find(token); iter != macros_.defined.end())
+                {
+                    if (iter->second.empty() || depth_ > 16)
+                    {
+                        return std::nullopt;
+                    }
+                    return ExpressionEvaluator(tokenize_expression(iter->second), macros_, depth_ + 1).evaluate();
+                }
+                if (macros_.undefined.find(token) != macros_.undefined.end())
+                {
+                    return 0;
+                }
+                return std::nullopt;
+            }
+        };
+    } // namespace detail
+    // Evaluates the expression of an #if / #elif; Unknown when it depends on macros outside of `macros`.
+    inline Tristate evaluate_condition(std::string_view expr, const MacroSet& macros)
+    {
+        auto value = detail::ExpressionEvaluator(detail::tokenize_expression(expr), macros, 0).evaluate();
+        if (!value)
+        {
+            return Tristate::Unknown;
+        }
+        return *value ? Tristate::True : Tristate::False;
+    }
+    // How a conditional directive line has to appear in the output.
+    enum class DirectiveEmit : std::uint8_t
+    {
+        Drop,
+        Verbatim,
+        AsIf,   // an #elif that now opens the chain
+        AsElse, // a known-true #elif after branches that stayed in the output
+    };
+    // Tracks #if/#elif/#else/#endif nesting. A region is live when its lines are kept, and certain when it is kept
+    // unconditionally (no enclosing conditional is left in the output).
+    class ConditionalStack
+    {
+    public:
+        bool live() const { return frames_.empty() || frames_.back().live; }
+        bool certain() const { return frames_.empty() || (frames_.back().live && frames_.back().certain); }
+        std::size_t depth() const { return frames_.size(); }
+        // `verbatim` keeps the directive in the output even when its condition is known to be true.
+        DirectiveEmit on_if(Tristate cond, bool verbatim = false)
+        {
+            Frame frame{};
+            frame.parent_live = live();
+            frame.parent_certain = certain();
+            if (!frame.parent_live)
+            {
+                frames_.push_back(frame);
+                return DirectiveEmit::Drop;
+            }
+            switch (cond)
+            {
+                case Tristate::True:
+                    frame.live = true;
+                    frame.resolved = true;
+                    frame.certain = frame.parent_certain;
+                    frame.open = verbatim;
+                    break;
+                case Tristate::False:
+                    break;
+                default:
+                    frame.live = true;
+                    frame.open = true;
+                    break;
+            }
+            frames_.push_back(frame);
+            return frame.open ? DirectiveEmit::Verbatim : DirectiveEmit::Drop;
+        }
+        DirectiveEmit on_elif(Tristate cond)
+        {
+            if (frames_.empty())
+            {
+                return DirectiveEmit::Verbatim;
+            }
+            auto& frame = frames_.back();
+            if (!frame.parent_live || frame.resolved || cond == Tristate::False)
+            {
+                frame.live = false;
+                return DirectiveEmit::Drop;
+            }
+            frame.live = true;
+            if (cond == Tristate::True)
+            {
+                frame.resolved = true;
+                frame.certain = !frame.open && frame.parent_certain;
+                return frame.open ? DirectiveEmit::AsElse : DirectiveEmit::Drop;
+            }
+            frame.certain = false;
+            if (frame.open)
+            {
+                return DirectiveEmit::Verbatim;
+            }
+            frame.open = true;
+            return DirectiveEmit::AsIf;
+        }
+        DirectiveEmit on_else()
+        {
+            auto emit = on_elif(Tristate::True);
+            return emit == DirectiveEmit::AsElse ? DirectiveEmit::Verbatim : emit;
+        }
+        DirectiveEmit on_endif()
+        {
+            if (frames_.empty())
+            {
+                return DirectiveEmit::Verbatim;
+            }
+            auto frame = frames_.back();
+            frames_.pop_back();
+            return frame.parent_live && frame.open ? DirectiveEmit::Verbatim : DirectiveEmit::Drop;
+        }
+    private:
+        struct Frame
+        {
+            bool parent_live{};
+            bool parent_certain{};
+            bool live{};
+            bool certain{};
+            bool resolved{}; // an earlier branch of the chain was taken for sure
+            bool open{};     // the chain has a directive in the output and needs its #endif
+        };
+        std::vector<Frame> frames_{};
+    };
+} // namespace sopho
+// include/file_generator.hpp
+// include/file_generator.hpp
+namespace sopho
+{
+    std::string read_file(std::filesystem::path fs_path)
+    {
+        std::ifstream file_stream(fs_path, std::ios::binary);
+        SOPHO_ASSERT(file_stream.is_open(), "open file failed, file name:", fs_path.string());
+        const auto file_size = std::filesystem::file_size(fs_path);
+        std::string content;
+        content.resize(file_size);
+        file_stream.read(content.data(), file_size);
+        return content;
+    }
+    std::vector<std::string_view> split_lines(std::string_view str)
+    {
+        std::vector<std::string_view> result;
+        size_t start = 0;
+        while (start < str.size())
+        {
+            size_t end = str.find('\n', start);
+            if (end == std::string_view::npos)
+            {
+                result.emplace_back(str.substr(start));
+                break;
+            }
+            size_t line_end = end;
+            if (line_end > start && str[line_end - 1] == '\r')
+            {
+                line_end -= 1;
+            }
+            result.emplace_back(str.substr(start, line_end - start));
+            start = end + 1;
+        }
+        return result;
+    }
+    std::string_view ltrim(std::string_view sv)
+    {
+        size_t i = 0;
+        while (i < sv.size() && (sv[i] == ' ' || sv[i] == '\t'))
+        {
+            ++i;
+        }
+        return sv.substr(i);
+    }
+    bool starts_with(std::string_view sv, std::string_view prefix)
+    {
+        return sv.size() >= prefix.size() && sv.compare(0, prefix.size(), prefix) == 0;
+    }
+    std::int64_t file_mtime(const std::filesystem::path& fs_path)
+    {
+        return static_cast<std::int64_t>(std::filesystem::last_write_time(fs_path).time_since_epoch().count());
+    }
+    struct FileEntry
+    {
+        std::string name{};
+        std::uint64_t size{};
+        std::uint64_t hash{};
+        std::unique_ptr<std::string> content{};
+        friend bool operator<(const FileEntry& a, const FileEntry& b)
+        {
+            if (a.name != b.name)
+                return a.name < b.name;
+            if (a.size != b.size)
+                return a.size < b.size;
+            if (a.hash != b.hash)
+                return a.hash < b.hash;
+            return *a.content < *b.content;
+        }
+    };
+    FileEntry make_entry(std::filesystem::path fs_path)
+    {
+        auto file_content = read_file(fs_path);
+        FileEntry entry{};
+        entry.name = fs_path.filename().string();
+        entry.size = file_content.size();
+        entry.hash = fnv1a(file_content);
+        entry.content = std::make_unique<std::string>(std::move(file_content));
+        return entry;
+    }
+    // One input of the generator as recorded in the manifest next to the output.
+    struct ManifestEntry
+    {
+        std::string path{};
+        std::uint64_t size{};
+        std::int64_t mtime{};
+        std::uint64_t hash{};
+    };
+    struct GeneratorOptions
+    {
+        std::filesystem::path output{"sob.hpp"};
+        // Resolve #if/#ifdef/#elif/#else/#endif against `macros` and drop dead branches. Conditions on macros that are
+        // neither defined nor undefined in `macros` stay in the output untouched.
+        bool evaluate_directives{false};
+        MacroSet macros{};
+        // Consumer-optimized output: unconditional system includes are hoisted into one sorted prelude, comments,
+        // blank lines and file markers are stripped, and #line directives map the remaining lines back to their
+        // sources. Hoisting assumes no system header depends on macros defined by the amalgamated files.
+        bool compact{false};
+        // How many source lines compact output may run behind its sources before a #line resynchronizes them. Every
+        // stripped gap would otherwise cost a directive, more lines than the readable output, which drops blank lines
+        // without one. 0 keeps every line exact; with the default, diagnostics point at most 2 lines early.
+        std::size_t line_slack{2};
+    };
+    struct GeneratorReport
+    {
+        std::uint64_t readable_lines{};
+        std::uint64_t readable_bytes{};
+        std::uint64_t output_lines{};
+        std::uint64_t output_bytes{};
+    };
+    struct Context
+    {
+        std::vector<std::filesystem::path> include_paths{};
+        std::deque<std::string> file_content{};
+        std::set<FileEntry> file_entries{};
+        std::set<std::string> std_header{};
+        std::vector<ManifestEntry> inputs{};
+        bool evaluate_directives{false};
+        MacroSet macros{};
+        ConditionalStack conditionals{};
+        std::set<std::string, std::less<>> include_guards{};
+        bool compact{false};
+        std::size_t line_slack{};
+        std::string line_file{};
+        std::size_t next_line{};
+        GeneratorReport report{};
+    };
+    std::string_view read_identifier(std::string_view sv)
+    {
+        sv = ltrim(sv);
+        std::size_t i = 0;
+        while (i < sv.size() && detail::is_identifier_char(sv[i]))
+        {
+            ++i;
+        }
+        return sv.substr(0, i);
+    }
+    // Splits "#  keyword rest" into keyword and rest; the keyword is empty for non-directive lines.
+    std::pair<std::string_view, std::string_view> split_directive(std::string_view line)
+    {
+        auto line_content = ltrim(line);
+        if (line_content.empty() || line_content[0] != '#')
+        {
+            return {};
+        }
+        auto keyword = read_identifier(line_content.substr(1));
+        auto rest = ltrim(line_content.substr(1));
+        return {keyword, ltrim(rest.substr(keyword.size()))};
+    }
+    // Resolves an #include: quoted names relative to the including file first, then each include path in order.
+    // Returns nullopt when nothing matches, e.g. for system headers that live outside of `include_paths`.
+    std::optional<std::filesystem::path> resolve_include(const std::filesystem::path& including_file,
+                                                         std::string_view name, bool quoted,
+                                                         const std::vector<std::filesystem::path>& include_paths)
+    {
+        std::error_code ec{};
+        if (quoted)
+        {
+            auto candidate = including_file.parent_path() / name;
+            if (std::filesystem::is_regular_file(candidate, ec))
+            {
+                return candidate;
+            }
+        }
+        for (const auto& include_path : include_paths)
+        {
+            auto candidate = include_path / name;
+            if (std::filesystem::is_regular_file(candidate, ec))
+            {
+                return candidate;
+            }
+        }
+        return std::nullopt;
+    }
+    struct IncludeGuard
+    {
+        std::string_view name{};
+        std::size_t if_line{};
+    };
+    // Recognizes the classic "#ifndef X / #define X ... #endif" guard spanning the whole file, ignoring blank lines
+    // and comments around it.
+    std::optional<IncludeGuard> detect_include_guard(const std::vector<std::string_view>& lines)
+    {
+        std::vector<std::size_t> significant{};
+        bool in_comment = false;
+        for (std::size_t i = 0; i < lines.size(); ++i)
+        {
+            auto line_content = ltrim(lines[i]);
+            if (in_comment)
+            {
+                in_comment = line_content.find("*/") == std::string_view::npos;
+                continue;
+            }
+            if (line_content.empty() || starts_with(line_content, "//"))
+            {
+                continue;
+            }
+            if (starts_with(line_content, "/*"))
+            {
+                in_comment = line_content.find("*/", 2) == std::string_view::npos;
+                continue;
+            }
+            significant.push_back(i);
+        }
+        if (significant.size() < 3)
+        {
+            return std::nullopt;
+        }
+        auto [if_keyword, if_rest] = split_directive(lines[significant[0]]);
+        auto [define_keyword, define_rest] = split_directive(lines[significant[1]]);
+        auto name = read_identifier(if_rest);
+        if (if_keyword != "ifndef" || define_keyword != "define" || name.empty() ||
+            read_identifier(define_rest) != name)
+        {
+            return std::nullopt;
+        }
+        // The #endif matching the guard has to be the last significant line, with no #else/#elif on the guard level.
+        std::size_t depth = 0;
+        for (std::size_t k = 0; k < significant.size(); ++k)
+        {
+            auto keyword = split_directive(lines[significant[k]]).first;
+            if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef")
+            {
+                ++depth;
+            }
+            else if (depth == 1 && (starts_with(keyword, "el")))
+            {
+                return std::nullopt;
+            }
+            else if (keyword == "endif" && --depth == 0)
+            {
+                if (k + 1 != significant.size())
+                {
+                    return std::nullopt;
+                }
+                return IncludeGuard{name, significant[0]};
+            }
+        }
+        return std::nullopt;
+    }
+    // Feeds one conditional directive to context.conditionals and returns the line to emit, or nullopt to drop it.
+    std::optional<std::string_view> handle_conditional(std::string_view line, std::string_view keyword,
+                                                       std::string_view rest, bool is_guard, Context& context)
+    {
+        bool evaluate = context.evaluate_directives && !line.empty() && line.back() != '\\';
+        auto condition = [&]() -> Tristate
+        {
+            if (!evaluate)
+            {
+                return Tristate::Unknown;
+            }
+            if (keyword == "if" || keyword == "elif")
+            {
+                return evaluate_condition(rest, context.macros);
+            }
+            auto defined = is_defined(context.macros, read_identifier(rest));
+            bool negate = keyword == "ifndef" || keyword == "elifndef";
+            if (defined == Tristate::Unknown || !negate)
+            {
+                return defined;
+            }
+            return defined == Tristate::True ? Tristate::False : Tristate::True;
+        };
+        DirectiveEmit emit{};
+        if (is_guard)
+        {
+            // A guard seen for the first time is entered for sure unless the user defined its macro.
+            auto defined = is_defined(context.macros, read_identifier(rest)) == Tristate::True;
+            emit = context.conditionals.on_if(defined ? Tristate::False : Tristate::True, !context.evaluate_directives);
+        }
+        else if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef")
+        {
+            emit = context.conditionals.on_if(condition());
+        }
+        else if (keyword == "elif" || keyword == "elifdef" || keyword == "elifndef")
+        {
+            emit = context.conditionals.on_elif(condition());
+        }
+        else if (keyword == "else")
+        {
+            emit = context.conditionals.on_else();
+        }
+        else
+        {
+            emit = context.conditionals.on_endif();
+        }
+        switch (emit)
+        {
+            case DirectiveEmit::Verbatim:
+                return line;
+            case DirectiveEmit::AsIf:
+                return context.file_content.emplace_back("#" + std::string(keyword.substr(2)) + " " +
+                                                         std::string(rest));
+            case DirectiveEmit::AsElse:
+                return std::string_view{"#else"};
+            default:
+                return std::nullopt;
+        }
+    }
+    void handle_define(std::string_view keyword, std::string_view rest, Context& context)
+    {
+        if (!context.evaluate_directives)
+        {
+            return;
+        }
+        auto name = read_identifier(rest);
+        if (!context.conditionals.certain())
+        {
+            context.macros.forget(name);
+        }
+        else if (keyword == "undef")
+        {
+            context.macros.undefine(name);
+        }
+        else
+        {
+            auto value = rest.substr(name.size());
+            // Function-like macros are only tracked for defined(); their expansion is left to the compiler.
+            context.macros.define(name, starts_with(value, "(") ? std::string_view{} : ltrim(value));
+        }
+    }
+    // Lexer state carried from one line to the next while stripping comments in compact mode.
+    struct CommentStripper
+    {
+        bool in_block_comment{false};
+        std::string raw_terminator{}; // ")delim\"" while inside a multi-line raw string literal
+        // Returns `line` itself when nothing had to be removed, otherwise the stripped text kept alive in `storage`.
+        std::string_view strip(std::string_view line, std::deque<std::string>& storage)
+        {
+            std::string out{};
+            bool stripped = false;
+            std::size_t copy_from = 0;
+            std::size_t i = 0;
+            while (i < line.size())
+            {
+                if (in_block_comment)
+                {
+                    auto end = line.find("*/", i);
+                    in_block_comment = end == std::string_view::npos;
+                    i = in_block_comment ? line.size() : end + 2;
+                    copy_from = i;
+                    if (!in_block_comment && !out.empty())
+                    {
+                        out += ' ';
+                    }
+                    continue;
+                }
+                if (!raw_terminator.empty())
+                {
+                    auto end = line.find(raw_terminator, i);
+                    i = end == std::string_view::npos ? line.size() : end + raw_terminator.size();
+                    if (end != std::string_view::npos)
+                    {
+                        raw_terminator.clear();
+                    }
+                    continue;
+                }
+                char c = line[i];
+                if (c == '/' && i + 1 < line.size() && (line[i + 1] == '/' || line[i + 1] == '*'))
+                {
+                    out.append(line.substr(copy_from, i - copy_from));
+                    stripped = true;
+                    if (line[i + 1] == '/')
+                    {
+                        copy_from = i = line.size();
+                        break;
+                    }
+                    in_block_comment = true;
+                    i += 2;
+                    copy_from = i;
+                }
+                else if (c == '"' && i > 0 && line[i - 1] == 'R' &&
+                         (i < 2 || !detail::is_identifier_char(line[i - 2]) || line.substr(0, i).ends_with("u8R") ||
+                          line[i - 2] == 'u' || line[i - 2] == 'U' || line[i - 2] == 'L'))
+                {
+                    auto open = line.find('(', i);
+                    if (open == std::string_view::npos)
+                    {
+                        break;
+                    }
+                    raw_terminator = ")" + std::string(line.substr(i + 1, open - i - 1)) + "\"";
+                    i = open + 1;
+                }
+                else if (c == '"' || c == '\'')
+                {
+                    // A quote right after the digits of a number is a digit separator (1'000), not a literal.
+                    std::size_t start = i;
+                    while (start > 0 && (detail::is_identifier_char(line[start - 1]) || line[start - 1] == '\''))
+                    {
+                        --start;
+                    }
+                    if (c == '\'' && start < i && line[start] >= '0' && line[start] <= '9')
+                    {
+                        ++i;
+                        continue;
+                    }
+                    ++i;
+                    while (i < line.size() && line[i] != c)
+                    {
+                        i += line[i] == '\\' ? 2 : 1;
+                    }
+                    i = std::min(i + 1, line.size());
+                }
+                else
+                {
+                    ++i;
+                }
+            }
+            if (!stripped && copy_from == 0)
+            {
+                return line;
+            }
+            out.append(line.substr(std::min(copy_from, line.size())));
+            while (!out.empty() && (out.back() == ' ' || out.back() == '\t'))
+            {
+                out.pop_back();
+            }
+            if (ltrim(out).empty())
+            {
+                return {};
+            }
+            return storage.emplace_back(std::move(out));
+        }
+    };
+    // Generated lines such as the "// path" markers; they only appear in the readable output.
+    void emit_marker(std::vector<std::string_view>& result, std::string_view text, Context& context)
+    {
+        ++context.report.readable_lines;
+        context.report.readable_bytes += text.size() + 1;
+        if (!context.compact)
+        {
+            result.emplace_back(text);
+        }
+    }
+    // Lines taken from `file_path`, with `line_number` counted from 1. Compact output strips their comments and
+    // emits a #line directive when the file changes or the compiler's count would fall more than line_slack lines
+    // behind the source.
+    void emit_line(std::vector<std::string_view>& result, std::string_view text, std::string_view file_path,
+                   std::size_t line_number, CommentStripper& stripper, Context& context)
+    {
+        ++context.report.readable_lines;
+        context.report.readable_bytes += text.size() + 1;
+        if (!context.compact)
+        {
+            result.emplace_back(text);
+            return;
+        }
+        text = stripper.strip(text, context.file_content);
+        if (text.empty())
+        {
+            return;
+        }
+        // next_line is the line the compiler assigns to the next output line.
+        bool in_sync = context.line_file == file_path && line_number >= context.next_line &&
+                       line_number - context.next_line <= context.line_slack;
+        if (!in_sync)
+        {
+            std::string directive = "#line " + std::to_string(line_number) + " \"";
+            for (char c : file_path)
+            {
+                if (c == '\\' || c == '"')
+                {
+                    directive += '\\';
+                }
+                directive += c;
+            }
+            directive += '"';
+            result.emplace_back(context.file_content.emplace_back(std::move(directive)));
+            context.line_file = file_path;
+            context.next_line = line_number;
+        }
+        result.emplace_back(text);
+        ++context.next_line;
+    }
+    std::vector<std::string_view> collect_file(std::string_view file_path, Context& context)
+    {
+        SOPHO_STACK();
+        std::vector<std::string_view> result{};
+        std::filesystem::path fs_path = file_path;
+        SOPHO_ASSERT(std::filesystem::exists(fs_path), "file not exist ", fs_path.string());
+        auto mtime = file_mtime(fs_path);
+        auto [iter, inserted] = context.file_entries.emplace(make_entry(fs_path));
+        if (!inserted)
+        {
+            return {};
+        }
+        context.inputs.emplace_back(ManifestEntry{fs_path.string(), iter->size, mtime, iter->hash});
+        auto lines = split_lines(std::string_view(*iter->content));
+        auto guard = detect_include_guard(lines);
+        if (guard)
+        {
+            if (context.include_guards.find(guard->name) != context.include_guards.end())
+            {
+                return {};
+            }
+            context.include_guards.emplace(guard->name);
+        }
+        std::string file_name_comment = "// " + std::string(file_path);
+        auto& comment = context.file_content.emplace_back(file_name_comment);
+        emit_marker(result, comment, context);
+        CommentStripper stripper{};
+        auto emit = [&](std::string_view text, std::size_t line_index)
+        { emit_line(result, text, file_path, line_index + 1, stripper, context); };
+        for (std::size_t line_index = 0; line_index < lines.size(); ++line_index)
+        {
+            const auto& line = lines[line_index];
+            auto line_content = ltrim(line);
+            if (line_content.length() == 0)
+            {
+                continue;
+            }
+            if (line_content[0] != '#')
+            {
+                if (context.conditionals.live())
+                {
+                    emit(line, line_index);
+                }
+                continue;
+            }
+            auto [keyword, rest] = split_directive(line);
+            if (keyword == "if" || keyword == "ifdef" || keyword == "ifndef" || keyword == "elif" ||
+                keyword == "elifdef" || keyword == "elifndef" || keyword == "else" || keyword == "endif")
+            {
+                bool is_guard = guard && guard->if_line == line_index;
+                if (auto emitted = handle_conditional(line, keyword, rest, is_guard, context))
+                {
+                    emit(*emitted, line_index);
+                }
+                continue;
+            }
+            if (!context.conditionals.live())
+            {
+                continue;
+            }
+            line_content = line_content.substr(1);
+            line_content = ltrim(line_content);
+            if (starts_with(line_content, "include"))
+            {
+                line_content = line_content.substr(7);
+                line_content = ltrim(line_content);
+                if (line_content[0] == '<')
+                {
+                    line_content = line_content.substr(1);
+                    auto index = line_content.find('>');
+                    SOPHO_ASSERT(index != std::string_view::npos, "find > failed");
+                    auto file_name = line_content.substr(0, index);
+                    if (context.std_header.find(std::string(file_name)) != context.std_header.end())
+                    {
+                        continue;
+                    }
+                    // A header included under a condition may still be needed unconditionally later on.
+                    if (context.conditionals.certain())
+                    {
+                        context.std_header.emplace(file_name);
+                        if (context.compact)
+                        {
+                            // Counted as readable output here, emitted with the prelude.
+                            ++context.report.readable_lines;
+                            context.report.readable_bytes += line.size() + 1;
+                            continue;
+                        }
+                    }
+                    emit(line, line_index);
+                    continue;
+                }
+                else if (line_content[0] == '"')
+                {
+                    line_content = line_content.substr(1);
+                    auto index = line_content.find('"');
+                    SOPHO_ASSERT(index != std::string_view::npos, "find \" failed");
+                    std::string file_name{line_content.substr(0, index)};
+                    auto resolved = resolve_include(fs_path, file_name, true, context.include_paths);
+                    if (!resolved && !context.conditionals.certain())
+                    {
+                        // Left to the compiler, e.g. a platform header that only exists where its branch is taken.
+                        emit(line, line_index);
+                        continue;
+                    }
+                    std::filesystem::path new_fs_path = resolved ? *resolved : fs_path.parent_path() / file_name;
+                    auto file_content = collect_file(std::string_view(new_fs_path.string()), context);
+                    result.insert(result.end(), file_content.begin(), file_content.end());
+                    emit_marker(result, comment, context);
+                }
+                else
+                {
+                    emit(line, line_index);
+                }
+            }
+            else if (starts_with(line_content, "pragma"))
+            {
+                line_content = line_content.substr(6);
+                line_content = ltrim(line_content);
+                if (starts_with(line_content, "once"))
+                {
+                    continue;
+                }
+                emit(line, line_index);
+            }
+            else
+            {
+                if (keyword == "define" || keyword == "undef")
+                {
+                    handle_define(keyword, rest, context);
+                }
+                emit(line, line_index);
+            }
+        }
+        return result;
+    }
+    constexpr std::string_view manifest_magic{"sob-manifest 2"};
+    struct Manifest
+    {
+        std::uint64_t options{};
+        std::vector<ManifestEntry> entries{};
+    };
+    // Manifest layout: a magic line, the fingerprint of the generator options, then one "size mtime hash path" line
+    // per file. The first entry describes the output itself so that a hand-edited or deleted output is regenerated.
+    Manifest read_manifest(const std::filesystem::path& manifest_path)
+    {
+        Manifest manifest{};
+        std::ifstream in(manifest_path, std::ios::binary);
+        if (!in.is_open())
+        {
+            return manifest;
+        }
+        std::string line{};
+        if (!std::getline(in, line) || line != manifest_magic || !(in >> manifest.options) || in.get() != '\n')
+        {
+            return {};
+        }
+        while (std::getline(in, line))
+        {
+            std::istringstream ss(line);
+            ManifestEntry entry{};
+            if (!(ss >> entry.size >> entry.mtime >> entry.hash) || ss.get() != ' ' || !std::getline(ss, entry.path))
+            {
+                return {};
+            }
+            manifest.entries.emplace_back(std::move(entry));
+        }
+        return manifest;
+    }
+    void write_manifest(const std::filesystem::path& manifest_path, const Manifest& manifest)
+    {
+        auto tmp_path = manifest_path;
+        tmp_path += ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            SOPHO_ASSERT(out.is_open(), "open file failed, file name:", tmp_path.string());
+            out << manifest_magic << '\n' << manifest.options << '\n';
+            for (const auto& entry : manifest.entries)
+            {
+                out << entry.size << ' ' << entry.mtime << ' ' << entry.hash << ' ' << entry.path << '\n';
+            }
+        }
+        std::filesystem::rename(tmp_path, manifest_path);
+    }
+    std::uint64_t options_fingerprint(const GeneratorOptions& options)
+    {
+        std::string text{options.evaluate_directives ? "evaluate\n" : "\n"};
+        text += options.compact ? "compact " + std::to_string(options.line_slack) + "\n" : "\n";
+        for (const auto& [name, value] : options.macros.defined)
+        {
+            text += "D" + name + "=" + value + "\n";
+        }
+        for (const auto& name : options.macros.undefined)
+        {
+            text += "U" + name + "\n";
+        }
+        return fnv1a(text);
+    }
+    // Compares size and mtime only, so an unchanged tree is detected without reading any file contents.
+    bool manifest_entry_unchanged(const ManifestEntry& entry)
+    {
+        std::error_code ec{};
+        std::filesystem::path fs_path = entry.path;
+        auto size = std::filesystem::file_size(fs_path, ec);
+        if (ec || size != entry.size)
+        {
+            return false;
+        }
+        auto mtime = std::filesystem::last_write_time(fs_path, ec);
+        return !ec && static_cast<std::int64_t>(mtime.time_since_epoch().count()) == entry.mtime;
+    }
+    // Fallback for touched files: the inputs only count as changed if their contents differ.
+    bool manifest_entry_same_content(const ManifestEntry& entry)
+    {
+        std::error_code ec{};
+        std::filesystem::path fs_path = entry.path;
+        if (std::filesystem::file_size(fs_path, ec) != entry.size || ec)
+        {
+            return false;
+        }
+        return fnv1a(read_file(fs_path)) == entry.hash;
+    }
+    ManifestEntry make_output_entry(const std::filesystem::path& fs_path)
+    {
+        auto content = read_file(fs_path);
+        return ManifestEntry{fs_path.string(), content.size(), file_mtime(fs_path), fnv1a(content)};
+    }
+    // Turns output lines into as few contiguous segments as possible. Every line views a NUL-terminated buffer (a
+    // source file, a generated marker or a literal), so a line still followed by its '\n' in that buffer is emitted
+    // together with it, and runs of untouched source lines collapse into a single segment.
+    std::vector<std::string_view> gather_segments(const std::vector<std::string_view>& lines)
+    {
+        static constexpr std::string_view newline{"\n"};
+        std::vector<std::string_view> segments{};
+        for (auto sv : lines)
+        {
+            bool has_newline = sv.data()[sv.size()] == '\n';
+            if (!segments.empty() && segments.back().data() + segments.back().size() == sv.data() &&
+                segments.back().data() != newline.data())
+            {
+                auto& last = segments.back();
+                last = std::string_view{last.data(), last.size() + sv.size() + (has_newline ? 1 : 0)};
+            }
+            else
+            {
+                segments.emplace_back(sv.data(), sv.size() + (has_newline ? 1 : 0));
+            }
+            if (!has_newline)
+            {
+                segments.emplace_back(newline);
+            }
+        }
+        return segments;
+    }
+    bool output_matches(const std::filesystem::path& fs_path, const std::vector<std::string_view>& segments)
+    {
+        std::error_code ec{};
+        auto size = std::filesystem::file_size(fs_path, ec);
+        if (ec)
+        {
+            return false;
+        }
+        std::uint64_t expected_size{0};
+        for (auto sv : segments)
+        {
+            expected_size += sv.size();
+        }
+        if (size != expected_size)
+        {
+            return false;
+        }
+        auto content = read_file(fs_path);
+        std::string_view rest{content};
+        for (auto sv : segments)
+        {
+            if (rest.compare(0, sv.size(), sv) != 0)
+            {
+                return false;
+            }
+            rest.remove_prefix(sv.size());
+        }
+        return true;
+    }
+    // Writes the segments to a temporary file next to `fs_path` and renames it into place, so readers never observe
+    // a partially written output.
+    void write_segments_atomic(const std::filesystem::path& fs_path, const std::vector<std::string_view>& segments)
+    {
+        SOPHO_STACK();
+        auto tmp_path = fs_path;
+        tmp_path += ".tmp";
+        SOPHO_VALUE(tmp_path);
+#if defined(_WIN32)
+        std::size_t total_size{0};
+        for (auto sv : segments)
+        {
+            total_size += sv.size();
+        }
+        std::string buffer{};
+        buffer.reserve(total_size);
+        for (auto sv : segments)
+        {
+            buffer.append(sv);
+        }
+        {
+            std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+            SOPHO_ASSERT(out.is_open(), "open file failed");
+            out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            SOPHO_ASSERT(out.good(), "write file failed");
+        }
+#else
+#if defined(IOV_MAX)
+        constexpr std::size_t max_iov = IOV_MAX;
+#else
+        constexpr std::size_t max_iov = 1024;
+#endif
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        SOPHO_ASSERT(fd >= 0, "open file failed");
+        std::vector<iovec> iovs{};
+        iovs.reserve(segments.size());
+        for (auto sv : segments)
+        {
+            iovs.push_back(iovec{const_cast<char*>(sv.data()), sv.size()});
+        }
+        std::size_t index{0};
+        while (index < iovs.size())
+        {
+            auto count = std::min(iovs.size() - index, max_iov);
+            auto written = ::writev(fd, iovs.data() + index, static_cast<int>(count));
+            if (written < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            SOPHO_ASSERT(written >= 0, "writev failed, errno:", errno);
+            // Skip fully written buffers and trim a partially written one.
+            auto remaining = static_cast<std::size_t>(written);
+            while (index < iovs.size() && remaining >= iovs[index].iov_len)
+            {
+                remaining -= iovs[index].iov_len;
+                ++index;
+            }
+            if (remaining > 0)
+            {
+                iovs[index].iov_base = static_cast<char*>(iovs[index].iov_base) + remaining;
+                iovs[index].iov_len -= remaining;
+            }
+        }
+        SOPHO_ASSERT(::close(fd) == 0, "close file failed, errno:", errno);
+#endif
+        std::filesystem::rename(tmp_path, fs_path);
+    }
+    void single_header_generator(std::string_view file_path, const GeneratorOptions& options = {})
+    {
+        SOPHO_STACK();
+        Context context{};
+        std::filesystem::path fs_path = file_path;
+        SOPHO_VALUE(fs_path);
+        SOPHO_ASSERT(std::filesystem::exists(fs_path), "file not exist");
+        const auto& out_path = options.output;
+        auto manifest_path = out_path;
+        manifest_path += ".manifest";
+        auto manifest = read_manifest(manifest_path);
+        auto& entries = manifest.entries;
+        bool same_options = manifest.options == options_fingerprint(options);
+        if (same_options && !entries.empty() && std::all_of(entries.begin(), entries.end(), manifest_entry_unchanged))
+        {
+            return;
+        }
+        if (same_options && !entries.empty() &&
+            std::all_of(entries.begin(), entries.end(), manifest_entry_same_content))
+        {
+            for (auto& entry : entries)
+            {
+                entry.mtime = file_mtime(entry.path);
+            }
+            write_manifest(manifest_path, manifest);
+            return;
+        }
+        context.include_paths = {fs_path.parent_path()};
+        context.evaluate_directives = options.evaluate_directives;
+        context.macros = options.macros;
+        context.compact = options.compact;
+        context.line_slack = options.line_slack;
+        auto lines = collect_file(file_path, context);
+        if (context.compact)
+        {
+            std::vector<std::string_view> prelude{};
+            for (const auto& header : context.std_header)
+            {
+                prelude.emplace_back(context.file_content.emplace_back("#include <" + header + ">"));
+            }
+            lines.insert(lines.begin(), prelude.begin(), prelude.end());
+        }
+        auto segments = gather_segments(lines);
+        if (!output_matches(out_path, segments))
+        {
+            write_segments_atomic(out_path, segments);
+        }
+        if (context.compact)
+        {
+            auto& report = context.report;
+            report.output_lines = lines.size();
+            for (auto sv : segments)
+            {
+                report.output_bytes += sv.size();
+            }
+            auto percent = [](std::uint64_t before, std::uint64_t after)
+            {
+                auto change = before == 0 ? 0 : static_cast<std::int64_t>(after * 100 / before) - 100;
+                return (change > 0 ? "+" : "") + std::to_string(change) + "%";
+            };
+            std::cout << "single header " << out_path.string() << ": " << report.readable_lines << " -> "
+                      << report.output_lines << " lines (" << percent(report.readable_lines, report.output_lines)
+                      << "), " << report.readable_bytes << " -> " << report.output_bytes << " bytes ("
+                      << percent(report.readable_bytes, report.output_bytes) << ")" << std::endl;
+        }
+        manifest.options = options_fingerprint(options);
+        entries.clear();
+        entries.emplace_back(make_output_entry(out_path));
+        entries.insert(entries.end(), context.inputs.begin(), context.inputs.end());
+        write_manifest(manifest_path, manifest);
+    }
+} // namespace sopho
+// include/sob.hpp
+// include/include_scanner.hpp
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+// include/include_scanner.hpp
+// include/include_scanner.hpp
+namespace sopho
+{
+    // Identity of a file independent of the spelling of its path (device and inode where available).
+    struct FileIdentity
+    {
+        std::uint64_t device{};
+        std::uint64_t inode{};
+        friend auto operator<=>(const FileIdentity&, const FileIdentity&) = default;
+    };
+    struct FileStat
+    {
+        FileIdentity identity{};
+        std::uint64_t size{};
+        std::int64_t mtime{};
+    };
+    std::optional<FileStat> stat_file(const std::filesystem::path& fs_path)
+    {
+#if defined(_WIN32)
+        std::error_code ec{};
+        auto canonical = std::filesystem::canonical(fs_path, ec);
+        if (ec || !std::filesystem::is_regular_file(canonical, ec))
+        {
+            return std::nullopt;
+        }
+        FileStat result{};
+        result.identity = FileIdentity{0, fnv1a(canonical.string())};
+        result.size = std::filesystem::file_size(canonical, ec);
+        result.mtime = file_mtime(canonical);
+        return result;
+#else
+        struct stat st{};
+        if (::stat(fs_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            return std::nullopt;
+        }
+        FileStat result{};
+        result.identity = FileIdentity{static_cast<std::uint64_t>(st.st_dev), static_cast<std::uint64_t>(st.st_ino)};
+        result.size = static_cast<std::uint64_t>(st.st_size);
+        result.mtime = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        return result;
+#endif
+    }
+    // The named module a translation unit belongs to and the modules it imports. `name` is empty outside of
+    // modules; partitions are spelled "primary:partition". Header units are not tracked.
+    struct ModuleUnit
+    {
+        std::string name{};
+        bool interface{};
+        std::vector<std::string> imports{};
+    };
+    // Records an `[export] module name;` or `[export] import name;` line in `unit`; other lines leave it untouched.
+    // The global module fragment ("module;") and the private one ("module :private;") are not declarations.
+    inline void scan_module_line(std::string_view line, ModuleUnit& unit)
+    {
+        auto rest = ltrim(line);
+        auto keyword = read_identifier(rest);
+        bool exported = keyword == "export";
+        if (exported)
+        {
+            rest = ltrim(rest.substr(keyword.size()));
+            keyword = read_identifier(rest);
+        }
+        if (keyword != "module" && keyword != "import")
+        {
+            return;
+        }
+        rest = ltrim(rest.substr(keyword.size()));
+        std::size_t end = 0;
+        while (end < rest.size() && (detail::is_identifier_char(rest[end]) || rest[end] == '.' || rest[end] == ':'))
+        {
+            ++end;
+        }
+        auto name = rest.substr(0, end);
+        if (name.empty() || !starts_with(ltrim(rest.substr(end)), ";"))
+        {
+            return;
+        }
+        if (keyword == "module")
+        {
+            if (name[0] != ':')
+            {
+                unit.name = name;
+                unit.interface = exported;
+            }
+            return;
+        }
+        if (name[0] == ':')
+        {
+            unit.imports.push_back(unit.name.substr(0, unit.name.find(':')) + std::string{name});
+        }
+        else
+        {
+            unit.imports.emplace_back(name);
+        }
+    }
+    // In-process replacement for "-MM": follows #include lines to find the headers a source depends on, without a
+    // compiler round-trip. Conditional directives are not evaluated, so a header included under any configuration
+    // counts as a dependency. <...> includes that do not resolve in `include_paths` are system headers and skipped.
+    // The same pass records the module declaration and imports of each file, which stand in for P1689 scanning.
+    //
+    // Direct includes are cached per file identity and revalidated by size and mtime, so repeated queries over an
+    // unchanged tree cost one stat per header and read nothing.
+    class IncludeScanner
+    {
+    public:
+        explicit IncludeScanner(std::vector<std::filesystem::path> include_paths = {}) :
+            include_paths_(std::move(include_paths))
+        {
+        }
+        // Transitive header set of `source` in first-seen order, not including `source` itself. Missing quoted
+        // includes are skipped as well; the compiler reports them.
+        std::vector<std::filesystem::path> dependencies(const std::filesystem::path& source)
+        {
+            std::vector<std::filesystem::path> result{};
+            std::set<FileIdentity> visited{};
+            auto source_stat = stat_file(source);
+            SOPHO_ASSERT(source_stat.has_value(), "source not found: ", source.string());
+            visited.insert(source_stat->identity);
+            collect(source, *source_stat, visited, result);
+            return result;
+        }
+        // Module declaration and imports of `source` itself; imports in its headers are not followed.
+        ModuleUnit module_unit(const std::filesystem::path& source)
+        {
+            auto source_stat = stat_file(source);
+            SOPHO_ASSERT(source_stat.has_value(), "source not found: ", source.string());
+            return direct_includes(source, *source_stat).module;
+        }
+        const std::vector<std::filesystem::path>& include_paths() const { return include_paths_; }
+        void clear() { cache_.clear(); }
+    private:
+        struct CacheEntry
+        {
+            bool scanned{};
+            std::uint64_t size{};
+            std::int64_t mtime{};
+            std::vector<std::filesystem::path> includes{};
+            ModuleUnit module{};
+        };
+        std::vector<std::filesystem::path> include_paths_{};
+        std::map<FileIdentity, CacheEntry> cache_{};
+        const CacheEntry& direct_includes(const std::filesystem::path& fs_path, const FileStat& stat)
+        {
+            auto& entry = cache_[stat.identity];
+            if (entry.scanned && entry.size == stat.size && entry.mtime == stat.mtime)
+            {
+                return entry;
+            }
+            entry = CacheEntry{true, stat.size, stat.mtime, {}};
+            auto content = read_file(fs_path);
+            for (auto line : split_lines(content))
+            {
+                auto [keyword, rest] = split_directive(line);
+                if (keyword.empty())
+                {
+                    scan_module_line(line, entry.module);
+                    continue;
+                }
+                if (keyword != "include" || rest.empty() || (rest[0] != '"' && rest[0] != '<'))
+                {
+                    continue;
+                }
+                bool quoted = rest[0] == '"';
+                auto end = rest.find(quoted ? '"' : '>', 1);
+                if (end == std::string_view::npos)
+                {
+                    continue;
+                }
+                if (auto resolved = resolve_include(fs_path, rest.substr(1, end - 1), quoted, include_paths_))
+                {
+                    entry.includes.emplace_back(std::move(*resolved));
+                }
+            }
+            return entry;
+        }
+        void collect(const std::filesystem::path& fs_path, const FileStat& stat, std::set<FileIdentity>& visited,
+                     std::vector<std::filesystem::path>& result)
+        {
+            // Entries stay put in the map, and `visited` keeps the recursion from rescanning this one.
+            const auto& includes = direct_includes(fs_path, stat).includes;
+            for (const auto& include : includes)
+            {
+                auto include_stat = stat_file(include);
+                if (!include_stat || !visited.insert(include_stat->identity).second)
+                {
+                    continue;
+                }
+                result.push_back(include);
+                collect(include, *include_stat, visited, result);
+            }
+        }
+    };
+} // namespace sopho
+// include/sob.hpp
+// include/job_pool.hpp
+#include <condition_variable>
+#include <mutex>
+#if !defined(_WIN32)
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+// include/job_pool.hpp
+// include/jobserver.hpp
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+// include/jobserver.hpp
+namespace sopho
+{
+    // Where a GNU make jobserver's tokens are, as advertised in MAKEFLAGS: "--jobserver-auth=fifo:PATH" (make 4.4),
+    // "--jobserver-auth=R,W" or the older "--jobserver-fds=R,W" with inherited pipe descriptors.
+    struct JobserverAuth
+    {
+        std::string fifo{};
+        int read_fd{-1};
+        int write_fd{-1};
+        // The last advertisement wins, as in make; nullopt when there is none.
+        static std::optional<JobserverAuth> parse(std::string_view makeflags)
+        {
+            std::optional<JobserverAuth> result{};
+            std::size_t position = 0;
+            while (position < makeflags.size())
+            {
+                auto end = makeflags.find(' ', position);
+                auto word = makeflags.substr(position, end == std::string_view::npos ? end : end - position);
+                position = end == std::string_view::npos ? makeflags.size() : end + 1;
+                std::string_view value{};
+                for (std::string_view option : {"--jobserver-auth=", "--jobserver-fds="})
+                {
+                    if (word.substr(0, option.size()) == option)
+                    {
+                        value = word.substr(option.size());
+                    }
+                }
+                if (value.empty())
+                {
+                    continue;
+                }
+                JobserverAuth auth{};
+                if (value.substr(0, 5) == "fifo:")
+                {
+                    auth.fifo = value.substr(5);
+                    result = auth;
+                    continue;
+                }
+                auto comma = value.find(',');
+                if (comma == std::string_view::npos)
+                {
+                    // "fifo:" is the only other form; Windows semaphore names are not supported.
+                    continue;
+                }
+                auth.read_fd = std::atoi(std::string{value.substr(0, comma)}.data());
+                auth.write_fd = std::atoi(std::string{value.substr(comma + 1)}.data());
+                if (auth.read_fd >= 0 && auth.write_fd >= 0)
+                {
+                    result = auth;
+                }
+            }
+            return result;
+        }
+    };
+    // A client of GNU make's jobserver, so an outer make and this build together run at most make's -j jobs, and a
+    // server for the processes this build starts, so sub-makes and nested builds share this build's limit.
+    //
+    // Every process holds one implicit token; each further job in flight holds a one-byte token read from the
+    // jobserver pipe or fifo, and writes the same byte back when it finishes. On Windows, and when no jobserver is
+    // usable, acquire() never blocks and the pool's worker count is the only limit.
+    class Jobserver
+    {
+    public:
+        // A slot to run one job in; destroying it gives the slot back.
+        class Token
+        {
+        public:
+            Token() = default;
+            Token(const Token&) = delete;
+            Token& operator=(const Token&) = delete;
+            Token(Token&& other) noexcept :
+                owner_(std::exchange(other.owner_, nullptr)), byte_(other.byte_), implicit_(other.implicit_)
+            {
+            }
+            Token& operator=(Token&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    release();
+                    owner_ = std::exchange(other.owner_, nullptr);
+                    byte_ = other.byte_;
+                    implicit_ = other.implicit_;
+                }
+                return *this;
+            }
+            ~Token() { release(); }
+        private:
+            friend class Jobserver;
+            Token(Jobserver* owner, char byte, bool implicit) : owner_(owner), byte_(byte), implicit_(implicit) {}
+            void release()
+            {
+                if (owner_ != nullptr)
+                {
+                    std::exchange(owner_, nullptr)->release(byte_, implicit_);
+                }
+            }
+            Jobserver* owner_{};
+            char byte_{};
+            bool implicit_{};
+        };
+        // Joins the jobserver MAKEFLAGS advertises, or else serves `slots` tokens to child processes through a pipe
+        // and advertises it in this process's MAKEFLAGS.
+        explicit Jobserver(std::size_t slots)
+        {
+#if !defined(_WIN32)
+            if (const char* makeflags = std::getenv("MAKEFLAGS"); makeflags != nullptr)
+            {
+                if (auto auth = JobserverAuth::parse(makeflags))
+                {
+                    connect(*auth);
+                    return;
+                }
+            }
+            serve(slots);
+#else
+            static_cast<void>(slots);
+#endif
+        }
+        Jobserver(const Jobserver&) = delete;
+        Jobserver& operator=(const Jobserver&) = delete;
+        ~Jobserver()
+        {
+#if !defined(_WIN32)
+            if (owns_fds_)
+            {
+                ::close(read_fd_);
+                if (write_fd_ != read_fd_)
+                {
+                    ::close(write_fd_);
+                }
+            }
+#endif
+        }
+        bool active() const { return read_fd_ >= 0; }
+        bool is_client() const { return client_; }
+        // Blocks until a job may start. A job takes this process's implicit token whenever it is free.
+        Token acquire()
+        {
+            while (true)
+            {
+                {
+                    std::lock_guard lock{mutex_};
+                    if (implicit_free_)
+                    {
+                        implicit_free_ = false;
+                        return Token{this, '+', true};
+                    }
+                }
+                if (!active())
+                {
+                    return Token{this, '+', false};
+                }
+#if !defined(_WIN32)
+                // Waits in short slices, so a job of this process giving back the implicit token is noticed.
+                pollfd readable{read_fd_, POLLIN, 0};
+                if (::poll(&readable, 1, 10) <= 0)
+                {
+                    continue;
+                }
+                char byte{};
+                auto count = ::read(read_fd_, &byte, 1);
+                if (count == 1)
+                {
+                    return Token{this, byte, false};
+                }
+                // make 4.3 and later set the pipe non-blocking, and another client may have taken the token.
+                SOPHO_ASSERT(count < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK),
+                             "cannot read a jobserver token: ",
+                             count == 0 ? "the jobserver closed" : std::strerror(errno));
+#endif
+            }
+        }
+    private:
+#if !defined(_WIN32)
+        void connect(const JobserverAuth& auth)
+        {
+            if (!auth.fifo.empty())
+            {
+                read_fd_ = write_fd_ = ::open(auth.fifo.data(), O_RDWR | O_CLOEXEC);
+                owns_fds_ = read_fd_ >= 0;
+            }
+            else if (is_pipe(auth.read_fd) && is_pipe(auth.write_fd))
+            {
+                // Inherited, and left open for children, so sub-makes join the same jobserver.
+                read_fd_ = auth.read_fd;
+                write_fd_ = auth.write_fd;
+            }
+            if (!active())
+            {
+                // make closes the descriptors for recipes not marked with '+'; it warns about that case itself.
+                read_fd_ = write_fd_ = -1;
+                std::cout << "jobserver:advertised in MAKEFLAGS but not accessible, running without it" << std::endl;
+                return;
+            }
+            client_ = true;
+        }
+        // An open descriptor could be any file the parent left at that number, and writing tokens to it would
+        // corrupt it; make's jobserver is always a pipe.
+        static bool is_pipe(int fd)
+        {
+            struct stat st{};
+            return ::fcntl(fd, F_GETFD) >= 0 && ::fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+        }
+        void serve(std::size_t slots)
+        {
+            if (slots <= 1)
+            {
+                return;
+            }
+            int fds[2]{};
+            if (::pipe(fds) != 0)
+            {
+                return;
+            }
+            read_fd_ = fds[0];
+            write_fd_ = fds[1];
+            owns_fds_ = true;
+            std::string tokens(slots - 1, '+');
+            auto written = ::write(write_fd_, tokens.data(), tokens.size());
+            SOPHO_ASSERT(written == static_cast<ssize_t>(tokens.size()), "cannot fill the jobserver pipe");
+            // The descriptors stay open across exec, so children started through the shell inherit them. Flags already
+            // in MAKEFLAGS, such as -k or variable assignments, still reach the sub-makes.
+            const char* inherited = std::getenv("MAKEFLAGS");
+            auto makeflags = std::string{inherited != nullptr ? inherited : ""} + " -j" + std::to_string(slots) +
+                             " --jobserver-auth=" + std::to_string(read_fd_) + "," + std::to_string(write_fd_);
+            ::setenv("MAKEFLAGS", makeflags.data(), 1);
+        }
+#endif
+        void release(char byte, bool implicit)
+        {
+            if (implicit)
+            {
+                std::lock_guard lock{mutex_};
+                implicit_free_ = true;
+                return;
+            }
+#if !defined(_WIN32)
+            if (active())
+            {
+                while (::write(write_fd_, &byte, 1) < 0 && errno == EINTR)
+                {
+                }
+            }
+#else
+            static_cast<void>(byte);
+#endif
+        }
+        std::mutex mutex_{};
+        bool implicit_free_{true};
+        bool client_{};
+        bool owns_fds_{};
+        int read_fd_{-1};
+        int write_fd_{-1};
+    };
+    // The jobserver of this process, joined or started on first use; every JobPool takes its tokens from it. `slots`
+    // only counts on that first use, when it sizes the server.
+    inline Jobserver& jobserver(std::size_t slots = std::max(1u, std::thread::hardware_concurrency()))
+    {
+        static Jobserver instance{slots};
+        return instance;
+    }
+} // namespace sopho
+// include/job_pool.hpp
+namespace sopho
+{
+    // An output is up to date when it exists and is not older than any of its inputs.
+    inline bool is_up_to_date(const std::filesystem::path& output, const std::vector<std::filesystem::path>& inputs)
+    {
+        std::error_code ec{};
+        auto output_time = std::filesystem::last_write_time(output, ec);
+        if (ec)
+        {
+            return false;
+        }
+        for (const auto& input : inputs)
+        {
+            auto input_time = std::filesystem::last_write_time(input, ec);
+            if (ec || input_time > output_time)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    // Duration of each job's last successful run, one "seconds key" line per job.
+    class DurationHistory
+    {
+    public:
+        explicit DurationHistory(std::filesystem::path path) : path_(std::move(path))
+        {
+            std::ifstream in(path_);
+            double seconds{};
+            std::string name{};
+            while (in >> seconds && in.get() == ' ' && std::getline(in, name))
+            {
+                seconds_[name] = seconds;
+            }
+        }
+        std::optional<double> seconds(std::string_view name) const
+        {
+            auto iter = seconds_.find(name);
+            return iter == seconds_.end() ? std::nullopt : std::optional<double>{iter->second};
+        }
+        // Zero for jobs never run, so they start after the known slow ones.
+        double expected_seconds(std::string_view name) const { return seconds(name).value_or(0.0); }
+        void record(const std::string& name, double seconds) { seconds_[name] = seconds; }
+        void save() const
+        {
+            if (path_.has_parent_path())
+            {
+                std::filesystem::create_directories(path_.parent_path());
+            }
+            std::ofstream out(path_);
+            for (const auto& [name, seconds] : seconds_)
+            {
+                out << seconds << ' ' << name << '\n';
+            }
+        }
+    private:
+        std::filesystem::path path_{};
+        std::map<std::string, double, std::less<>> seconds_{};
+    };
+    // Durations of the jobs of every build, tests aside, from which the pool estimates critical paths. Jobs are keyed
+    // by their first output: job names come from type names, which GCC abbreviates past a length, so two targets
+    // may share one.
+    inline DurationHistory& job_history()
+    {
+        static DurationHistory history{"build/job_durations.txt"};
+        return history;
+    }
+    struct CommandResult
+    {
+        int exit_code{};
+        bool timed_out{};
+    };
+    // Runs `command` through the shell. With a non-zero `timeout` the command runs in a process group of its own that
+    // is killed as a whole when the time is up; on Windows the timeout is not enforced.
+    inline CommandResult run_command(const std::string& command, std::chrono::milliseconds timeout = {})
+    {
+#if defined(_WIN32)
+        static_cast<void>(timeout);
+        return CommandResult{std::system(command.data()), false};
+#else
+        if (timeout.count() == 0)
+        {
+            int status = std::system(command.data());
+            return CommandResult{WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status), false};
+        }
+        pid_t pid = ::fork();
+        if (pid == 0)
+        {
+            ::setpgid(0, 0);
+            ::execl("/bin/sh", "sh", "-c", command.data(), static_cast<char*>(nullptr));
+            ::_exit(127);
+        }
+        if (pid < 0)
+        {
+            return CommandResult{-1, false};
+        }
+        // Also set here, so the group exists even if the child has not run yet when the timeout kills it.
+        ::setpgid(pid, pid);
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        int status = 0;
+        while (true)
+        {
+            auto result = ::waitpid(pid, &status, WNOHANG);
+            if (result == pid)
+            {
+                break;
+            }
+            if (result < 0 && errno != EINTR)
+            {
+                return CommandResult{-1, false};
+            }
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                ::kill(-pid, SIGKILL);
+                ::waitpid(pid, &status, 0);
+                return CommandResult{-1, true};
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds{10});
+        }
+        return CommandResult{WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status), false};
+#endif
+    }
+    // One command of a build. It runs unless every output is up to date with respect to `inputs`, and only after its
+    // dependencies, which are always jobs added to the pool before it.
+    struct BuildJob
+    {
+        std::string name{};
+        std::string command{};
+        // Runs in-process instead of `command`, which then only describes it; returns whether it succeeded.
+        std::function<bool()> action{};
+        std::vector<std::filesystem::path> inputs{};
+        std::vector<std::filesystem::path> outputs{};
+        std::vector<std::size_t> dependencies{};
+        // Zero for no limit.
+        std::chrono::milliseconds timeout{};
+        std::uint32_t retries{};
+        // The outputs are stamps the pool writes when the command succeeds, and removes before it runs.
+        bool stamp_outputs{};
+        bool test{};
+        // Among ready jobs the one with the longest expected path through its dependents, itself included, starts
+        // first, so the slowest chain of the build is never left for last.
+        double expected_seconds{};
+    };
+    enum class JobStatus : std::uint8_t
+    {
+        UpToDate,
+        Succeeded,
+        Failed,
+        TimedOut,
+        Skipped,
+    };
+    struct JobResult
+    {
+        std::string name{};
+        // The job's first output, or empty; keys job_history().
+        std::string output{};
+        bool test{};
+        JobStatus status{};
+        int exit_code{};
+        std::uint32_t attempts{};
+        // Measured when the job ran; expected_seconds stands in for it otherwise.
+        double seconds{};
+        double expected_seconds{};
+    };
+    // Runs the jobs of any number of build plans on one set of worker threads, so several variants of a target build
+    // side by side instead of one after another. Each job that runs holds a token of the process's jobserver(), which
+    // the first pool to run sizes to its worker count.
+    class JobPool
+    {
+    public:
+        explicit JobPool(std::size_t workers = std::max(1u, std::thread::hardware_concurrency())) :
+            workers_(std::max<std::size_t>(1, workers))
+        {
+        }
+        // Returns the index to depend on. A job whose first output an earlier job already produces is not added;
+        // the earlier one is returned, so outputs shared between plans are built once.
+        std::size_t add(BuildJob job)
+        {
+            SOPHO_ASSERT(!job.outputs.empty(), "job ", job.name, " has no outputs");
+            if (auto iter = producers_.find(job.outputs.front()); iter != producers_.end())
+            {
+                const auto& existing = jobs_[iter->second];
+                SOPHO_ASSERT(existing.command == job.command, job.outputs.front().string(),
+                             " is produced by two different commands:\n  ", existing.command, "\n  ", job.command);
+                return iter->second;
+            }
+            for (auto dependency : job.dependencies)
+            {
+                SOPHO_ASSERT(dependency < jobs_.size(), "job ", job.name, " depends on a job not added yet");
+            }
+            producers_.emplace(job.outputs.front(), jobs_.size());
+            jobs_.push_back(std::move(job));
+            return jobs_.size() - 1;
+        }
+        std::size_t size() const { return jobs_.size(); }
+        const std::vector<JobResult>& results() const { return results_; }
+        // Indices into results() of the longest chain of dependent jobs of the last run, first job first. Jobs count
+        // with their measured time when they ran and their expected time otherwise.
+        const std::vector<std::size_t>& critical_path() const { return critical_path_; }
+        // Runs every job once its dependencies are done and empties the pool; results() then describes each job in the
+        // order they were added. Jobs depending on a failed one are skipped. Returns whether every job succeeded.
+        bool run()
+        {
+            SOPHO_STACK();
+            auto& tokens = jobserver(workers_);
+            results_.assign(jobs_.size(), JobResult{});
+            std::vector<std::size_t> pending(jobs_.size());
+            std::vector<std::vector<std::size_t>> dependents(jobs_.size());
+            std::vector<bool> failed(jobs_.size());
+            std::deque<std::size_t> ready{};
+            for (std::size_t index = 0; index < jobs_.size(); ++index)
+            {
+                pending[index] = jobs_[index].dependencies.size();
+                for (auto dependency : jobs_[index].dependencies)
+                {
+                    dependents[dependency].push_back(index);
+                }
+                if (pending[index] == 0)
+                {
+                    ready.push_back(index);
+                }
+            }
+            // Dependencies are added before their dependents, so walking backwards sees every dependent first.
+            std::vector<double> priority(jobs_.size());
+            for (std::size_t index = jobs_.size(); index-- > 0;)
+            {
+                double longest = 0;
+                for (auto dependent : dependents[index])
+                {
+                    longest = std::max(longest, priority[dependent]);
+                }
+                priority[index] = jobs_[index].expected_seconds + longest;
+            }
+            std::mutex mutex{};
+            std::condition_variable changed{};
+            std::size_t remaining = jobs_.size();
+            bool succeeded = true;
+            auto print = [&mutex](const std::string& name, std::string_view message)
+            {
+                std::lock_guard lock{mutex};
+                std::cout << name << ":" << message << std::endl;
+            };
+            auto work = [&](std::size_t worker)
+            {
+                set_thread_name("sob-job-" + std::to_string(worker));
+                SOPHO_STACK();
+                while (true)
+                {
+                    std::size_t index{};
+                    bool skip{};
+                    {
+                        std::unique_lock lock{mutex};
+                        changed.wait(lock, [&] { return !ready.empty() || remaining == 0; });
+                        if (ready.empty())
+                        {
+                            return;
+                        }
+                        auto by_priority = [&priority](std::size_t a, std::size_t b)
+                        { return priority[a] < priority[b]; };
+                        auto next = std::max_element(ready.begin(), ready.end(), by_priority);
+                        index = *next;
+                        ready.erase(next);
+                        const auto& dependencies = jobs_[index].dependencies;
+                        skip = std::any_of(dependencies.begin(), dependencies.end(),
+                                           [&failed](std::size_t dependency) { return failed[dependency]; });
+                    }
+                    const auto& job = jobs_[index];
+                    SOPHO_VALUE(job.name);
+                    JobResult result{job.name, {}, job.test, JobStatus::Skipped};
+                    if (!job.outputs.empty())
+                    {
+                        result.output = job.outputs.front().string();
+                    }
+                    result.expected_seconds = job.expected_seconds;
+                    if (skip)
+                    {
+                        print(job.name, "skipped, a dependency failed");
+                    }
+                    else if (std::all_of(job.outputs.begin(), job.outputs.end(),
+                                         [&job](const auto& output) { return is_up_to_date(output, job.inputs); }))
+                    {
+                        result.status = JobStatus::UpToDate;
+                        print(job.name, "up to date");
+                    }
+                    else
+                    {
+                        // Held for every attempt, so an outer make or a sibling build does not oversubscribe.
+                        auto token = tokens.acquire();
+                        run_job(job, result, print);
+                    }
+                    bool ok = result.status == JobStatus::UpToDate || result.status == JobStatus::Succeeded;
+                    std::lock_guard lock{mutex};
+                    results_[index] = std::move(result);
+                    failed[index] = !ok;
+                    succeeded = succeeded && ok;
+                    --remaining;
+                    for (auto dependent : dependents[index])
+                    {
+                        if (--pending[dependent] == 0)
+                        {
+                            ready.push_back(dependent);
+                        }
+                    }
+                    changed.notify_all();
+                }
+            };
+            std::vector<std::thread> threads{};
+            for (std::size_t worker = 0; worker < std::min(workers_, jobs_.size()); ++worker)
+            {
+                threads.emplace_back(work, worker);
+            }
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+            find_critical_path();
+            jobs_.clear();
+            producers_.clear();
+            return succeeded;
+        }
+    private:
+        void find_critical_path()
+        {
+            std::vector<double> finish(jobs_.size());
+            std::vector<std::size_t> previous(jobs_.size());
+            std::size_t last = 0;
+            for (std::size_t index = 0; index < jobs_.size(); ++index)
+            {
+                const auto& result = results_[index];
+                bool ran = result.status != JobStatus::UpToDate && result.status != JobStatus::Skipped;
+                previous[index] = index;
+                double start = 0;
+                for (auto dependency : jobs_[index].dependencies)
+                {
+                    if (finish[dependency] > start)
+                    {
+                        start = finish[dependency];
+                        previous[index] = dependency;
+                    }
+                }
+                finish[index] = start + (ran ? result.seconds : result.expected_seconds);
+                last = finish[index] > finish[last] ? index : last;
+            }
+            critical_path_.clear();
+            if (jobs_.empty())
+            {
+                return;
+            }
+            critical_path_.push_back(last);
+            while (previous[critical_path_.back()] != critical_path_.back())
+            {
+                critical_path_.push_back(previous[critical_path_.back()]);
+            }
+            std::reverse(critical_path_.begin(), critical_path_.end());
+        }
+        template <typename Print>
+        static void run_job(const BuildJob& job, JobResult& result, const Print& print)
+        {
+            std::error_code ec{};
+            if (job.stamp_outputs)
+            {
+                for (const auto& output : job.outputs)
+                {
+                    std::filesystem::remove(output, ec);
+                }
+            }
+            auto start = std::chrono::steady_clock::now();
+            CommandResult command_result{};
+            do
+            {
+                if (result.attempts > 0)
+                {
+                    print(job.name, "retrying (attempt " + std::to_string(result.attempts + 1) + ")");
+                }
+                ++result.attempts;
+                print(job.name, job.command);
+                command_result = job.action ? CommandResult{job.action() ? 0 : 1, false}
+                                            : run_command(job.command, job.timeout);
+            }
+            while (command_result.exit_code != 0 && result.attempts <= job.retries);
+            result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            result.exit_code = command_result.exit_code;
+            result.status = command_result.timed_out ? JobStatus::TimedOut
+                            : command_result.exit_code == 0 ? JobStatus::Succeeded
+                                                            : JobStatus::Failed;
+            if (result.status == JobStatus::Succeeded && job.stamp_outputs)
+            {
+                for (const auto& output : job.outputs)
+                {
+                    std::ofstream{output};
+                }
+            }
+            print(job.name, result.status == JobStatus::Succeeded ? "finished"
+                            : result.status == JobStatus::TimedOut ? "timed out"
+                                                                   : "failed");
+        }
+        std::size_t workers_{};
+        std::vector<BuildJob> jobs_{};
+        std::map<std::filesystem::path, std::size_t> producers_{};
+        std::vector<JobResult> results_{};
+        std::vector<std::size_t> critical_path_{};
+    };
+    // Remembers how long the jobs of the last run took, tests aside, and prints its critical path: the chain of jobs
+    // that bounds the build's wall time however many workers there are, and where splitting a TU pays off. Prints
+    // nothing when no job ran.
+    inline void report_build(const JobPool& pool)
+    {
+        SOPHO_STACK();
+        const auto& results = pool.results();
+        auto& history = job_history();
+        bool ran = false;
+        for (const auto& result : results)
+        {
+            if (result.status == JobStatus::Succeeded && !result.test && !result.output.empty())
+            {
+                history.record(result.output, result.seconds);
+            }
+            ran = ran || (result.status != JobStatus::UpToDate && result.status != JobStatus::Skipped);
+        }
+        if (!ran)
+        {
+            return;
+        }
+        history.save();
+        auto seconds_of = [](const JobResult& result)
+        {
+            bool measured = result.status != JobStatus::UpToDate && result.status != JobStatus::Skipped;
+            return measured ? result.seconds : result.expected_seconds;
+        };
+        double total_seconds = 0;
+        for (auto index : pool.critical_path())
+        {
+            total_seconds += seconds_of(results[index]);
+        }
+        // Formatted apart, so std::cout keeps the caller's precision.
+        std::ostringstream report{};
+        report << "critical path: " << pool.critical_path().size() << " jobs in " << std::fixed
+               << std::setprecision(3) << total_seconds << "s\n";
+        for (auto index : pool.critical_path())
+        {
+            const auto& result = results[index];
+            report << "  " << std::setw(9) << seconds_of(result) << "s " << result.name
+                   << (result.status == JobStatus::UpToDate ? " (up to date)" : "") << "\n";
+        }
+        std::cout << report.str() << std::flush;
+    }
+} // namespace sopho
+// include/sob.hpp
+// include/library_interface.hpp
+// include/library_interface.hpp
+// include/library_interface.hpp
+namespace sopho
+{
+    namespace detail
+    {
+        // Little-endian field of `size` bytes at `offset`; false when it lies outside of `data`.
+        inline bool read_elf_field(std::string_view data, std::uint64_t offset, std::size_t size, std::uint64_t& value)
+        {
+            if (offset > data.size() || data.size() - offset < size)
+            {
+                return false;
+            }
+            value = 0;
+            for (std::size_t i = 0; i < size; ++i)
+            {
+                value |= static_cast<std::uint64_t>(static_cast<unsigned char>(data[offset + i])) << (i * 8);
+            }
+            return true;
+        }
+        // "name type binding [size]" of every defined, visible dynamic symbol of a little-endian ELF file, or nullopt
+        // when `data` is not one. Object sizes are part of the interface because executables copy-relocate data.
+        inline std::optional<std::vector<std::string>> elf_exported_symbols(std::string_view data)
+        {
+            // "\x7fELF" would read as the escape \x7fE.
+            constexpr std::string_view magic{"\x7f"
+                                             "ELF"};
+            if (data.size() < 64 || data.substr(0, 4) != magic || data[5] != 1)
+            {
+                return std::nullopt;
+            }
+            bool is64 = data[4] == 2;
+            std::uint64_t section_offset{}, section_size{}, section_count{};
+            if (!read_elf_field(data, is64 ? 0x28 : 0x20, is64 ? 8 : 4, section_offset) ||
+                !read_elf_field(data, is64 ? 0x3a : 0x2e, 2, section_size) ||
+                !read_elf_field(data, is64 ? 0x3c : 0x30, 2, section_count))
+            {
+                return std::nullopt;
+            }
+            struct Section
+            {
+                std::uint64_t type{}, offset{}, size{}, link{}, entry_size{};
+            };
+            auto section = [&](std::uint64_t index, Section& result)
+            {
+                auto base = section_offset + index * section_size;
+                std::size_t word = is64 ? 8 : 4;
+                return read_elf_field(data, base + 4, 4, result.type) &&
+                       read_elf_field(data, base + (is64 ? 0x18 : 0x10), word, result.offset) &&
+                       read_elf_field(data, base + (is64 ? 0x20 : 0x14), word, result.size) &&
+                       read_elf_field(data, base + (is64 ? 0x28 : 0x18), 4, result.link) &&
+                       read_elf_field(data, base + (is64 ? 0x38 : 0x24), word, result.entry_size);
+            };
+            constexpr std::uint64_t section_dynsym = 11;
+            std::vector<std::string> result{};
+            for (std::uint64_t index = 0; index < section_count; ++index)
+            {
+                Section symbols{}, strings{};
+                if (!section(index, symbols) || symbols.type != section_dynsym || symbols.entry_size == 0 ||
+                    !section(symbols.link, strings))
+                {
+                    continue;
+                }
+                for (std::uint64_t offset = symbols.offset; offset + symbols.entry_size <= symbols.offset + symbols.size;
+                     offset += symbols.entry_size)
+                {
+                    std::uint64_t name{}, info{}, other{}, section_index{}, size{};
+                    if (!read_elf_field(data, offset, 4, name) ||
+                        !read_elf_field(data, offset + (is64 ? 4 : 12), 1, info) ||
+                        !read_elf_field(data, offset + (is64 ? 5 : 13), 1, other) ||
+                        !read_elf_field(data, offset + (is64 ? 6 : 14), 2, section_index) ||
+                        !read_elf_field(data, offset + (is64 ? 16 : 8), is64 ? 8 : 4, size))
+                    {
+                        return std::nullopt;
+                    }
+                    auto binding = info >> 4;
+                    auto type = info & 0xf;
+                    auto visibility = other & 0x3;
+                    // Undefined symbols are imports; local, internal and hidden ones are not visible to users.
+                    bool exported = section_index != 0 && (binding == 1 || binding == 2 || binding == 10) &&
+                                    (visibility == 0 || visibility == 3);
+                    if (!exported || strings.offset + name >= data.size())
+                    {
+                        continue;
+                    }
+                    auto name_start = data.substr(strings.offset + name);
+                    std::string entry{name_start.substr(0, name_start.find('\0'))};
+                    entry += " " + std::to_string(type) + " " + std::to_string(binding);
+                    if (type == 1)
+                    {
+                        entry += " " + std::to_string(size);
+                    }
+                    result.push_back(std::move(entry));
+                }
+            }
+            std::sort(result.begin(), result.end());
+            return result;
+        }
+    } // namespace detail
+    // Hash of what a shared library offers to the binaries linking against it: its exported dynamic symbols. Code
+    // changes behind an unchanged interface keep the hash, so dependents need not relink. Files that are not ELF
+    // hash their whole content, making every change an interface change.
+    inline std::uint64_t library_interface_hash(const std::filesystem::path& library)
+    {
+        auto content = read_file(library);
+        auto symbols = detail::elf_exported_symbols(content);
+        if (!symbols)
+        {
+            return fnv1a(content);
+        }
+        std::uint64_t hash = fnv1a_offset_basis;
+        for (const auto& symbol : *symbols)
+        {
+            hash = hash_combine(hash, fnv1a(symbol));
+        }
+        return hash;
+    }
+} // namespace sopho
+// include/sob.hpp
+// include/meta.hpp
+#include <variant>
+namespace sopho
+{
+    namespace detail
+    {
+        // Declaration: Map takes a Mapper template and a Tuple type
+        template <template <typename> class Mapper, typename List>
+        struct MapImpl;
+        // Specialization: Unpack the tuple types (Ts...), apply Mapper to each, repack.
+        template <template <typename> class Mapper, typename... Ts>
+        struct MapImpl<Mapper, std::tuple<Ts...>>
+        {
+            // The "return value" of a metafunction is usually defined as 'type'
+            using type = std::tuple<typename Mapper<Ts>::type...>;
+        };
+        template <template <typename> class Mapper, typename... Ts>
+        struct MapImpl<Mapper, std::variant<Ts...>>
+        {
+            // The "return value" of a metafunction is usually defined as 'type'
+            using type = std::variant<typename Mapper<Ts>::type...>;
+        };
+    } // namespace detail
+    // Helper alias for cleaner syntax (C++14 style aliases)
+    template <template <typename> class Mapper, typename List>
+    using Map = typename detail::MapImpl<Mapper, List>::type;
+    namespace detail
+    {
+        // Foldl is a left fold expression over operator<< on these tag types, so instantiation depth stays constant
+        // however long the list is; each step only instantiates Folder<Value, T> with an already complete Value.
+        template <template <typename, typename> typename Folder, typename Value>
+        struct FoldState
+        {
+            using type = Value;
+        };
+        template <typename T>
+        struct FoldElement
+        {
+        };
+        template <template <typename, typename> typename Folder, typename Value, typename T>
+        FoldState<Folder, typename Folder<Value, T>::type> operator<<(FoldState<Folder, Value>, FoldElement<T>);
+        template <template <typename, typename> typename Folder, typename Value, typename List>
+        struct FoldlImpl;
+        template <template <typename, typename> typename Folder, typename Value, typename... Ts>
+        struct FoldlImpl<Folder, Value, std::tuple<Ts...>>
+        {
+            // The "return value" of a metafunction is usually defined as 'type'
+            using type = typename decltype((FoldState<Folder, Value>{} << ... << FoldElement<Ts>{}))::type;
+        };
+        template <template <typename, typename> typename Folder, typename Value, typename... Ts>
+        struct FoldlImpl<Folder, Value, std::variant<Ts...>>
+        {
+            // The "return value" of a metafunction is usually defined as 'type'
+            using type = typename decltype((FoldState<Folder, Value>{} << ... << FoldElement<Ts>{}))::type;
+        };
+    } // namespace detail
+    template <template <typename, typename> class Folder, typename Value, typename List>
+    using Foldl = typename detail::FoldlImpl<Folder, Value, List>::type;
+} // namespace sopho
+// include/sob.hpp
+// include/sob.hpp
+// include/test_runner.hpp
+// include/test_runner.hpp
+// include/test_runner.hpp
+namespace sopho
+{
+    // How this process runs tests, read once from the environment:
+    //   SOB_TEST_SHARD_INDEX / SOB_TEST_SHARD_COUNT  run only the tests of one shard, e.g. one per CI machine
+    //   SOB_TEST_RETRIES                             extra attempts for a failing test
+    //   SOB_TEST_JUNIT                               where the JUnit XML report goes
+    //   SOB_TEST_HISTORY                             where test durations are kept between runs
+    struct TestOptions
+    {
+        std::uint64_t shard_index{0};
+        std::uint64_t shard_count{1};
+        std::uint32_t retries{0};
+        std::string junit_path{"build/test_results.xml"};
+        std::string history_path{"build/test_durations.txt"};
+        static TestOptions from_environment()
+        {
+            TestOptions options{};
+            auto number = [](const char* name, auto& value)
+            {
+                if (const char* text = std::getenv(name); text != nullptr && *text != '\0')
+                {
+                    value = static_cast<std::remove_reference_t<decltype(value)>>(std::strtoull(text, nullptr, 10));
+                }
+            };
+            number("SOB_TEST_SHARD_INDEX", options.shard_index);
+            number("SOB_TEST_SHARD_COUNT", options.shard_count);
+            number("SOB_TEST_RETRIES", options.retries);
+            if (const char* text = std::getenv("SOB_TEST_JUNIT"); text != nullptr && *text != '\0')
+            {
+                options.junit_path = text;
+            }
+            if (const char* text = std::getenv("SOB_TEST_HISTORY"); text != nullptr && *text != '\0')
+            {
+                options.history_path = text;
+            }
+            options.shard_count = std::max<std::uint64_t>(1, options.shard_count);
+            SOPHO_ASSERT(options.shard_index < options.shard_count, "SOB_TEST_SHARD_INDEX ", options.shard_index,
+                         " is not below SOB_TEST_SHARD_COUNT ", options.shard_count);
+            return options;
+        }
+        // Shards by a hash of the name, so every machine computes the same split without coordinating.
+        bool selects(std::string_view test_name) const { return fnv1a(test_name) % shard_count == shard_index; }
+    };
+    inline const TestOptions& test_options()
+    {
+        static const TestOptions options = TestOptions::from_environment();
+        return options;
+    }
+    // Duration of each test's last run, kept apart from job_history() so SOB_TEST_HISTORY can move it.
+    inline DurationHistory& test_history()
+    {
+        static DurationHistory history{test_options().history_path};
+        return history;
+    }
+    inline std::string xml_escape(std::string_view text)
+    {
+        std::string result{};
+        result.reserve(text.size());
+        for (char c : text)
+        {
+            switch (c)
+            {
+            case '<': result += "&lt;"; break;
+            case '>': result += "&gt;"; break;
+            case '&': result += "&amp;"; break;
+            case '"': result += "&quot;"; break;
+            case '\'': result += "&apos;"; break;
+            default: result.push_back(c);
+            }
+        }
+        return result;
+    }
+    // Writes the JUnit XML report, prints a timing summary (slowest first) and remembers durations for the next run.
+    // Tests skipped because they passed before are reported as skipped. Does nothing when no test was scheduled.
+    inline void report_tests(const std::vector<JobResult>& results)
+    {
+        SOPHO_STACK();
+        std::vector<const JobResult*> tests{};
+        for (const auto& result : results)
+        {
+            if (result.test)
+            {
+                tests.push_back(&result);
+            }
+        }
+        if (tests.empty())
+        {
+            return;
+        }
+        std::sort(tests.begin(), tests.end(), [](const auto* a, const auto* b) { return a->seconds > b->seconds; });
+        std::size_t failures = 0;
+        std::size_t skipped = 0;
+        double total_seconds = 0;
+        for (const auto* test : tests)
+        {
+            failures += test->status == JobStatus::Failed || test->status == JobStatus::TimedOut;
+            skipped += test->status == JobStatus::UpToDate || test->status == JobStatus::Skipped;
+            total_seconds += test->seconds;
+        }
+        std::stringstream xml{};
+        xml << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+        xml << "<testsuites tests=\"" << tests.size() << "\" failures=\"" << failures << "\" skipped=\"" << skipped
+            << "\" time=\"" << total_seconds << "\">\n";
+        xml << "  <testsuite name=\"sob\" tests=\"" << tests.size() << "\" failures=\"" << failures << "\" skipped=\""
+            << skipped << "\" time=\"" << total_seconds << "\">\n";
+        for (const auto* test : tests)
+        {
+            xml << "    <testcase classname=\"sob\" name=\"" << xml_escape(test->name) << "\" time=\"" << test->seconds
+                << "\"";
+            switch (test->status)
+            {
+            case JobStatus::Succeeded: xml << "/>\n"; continue;
+            case JobStatus::UpToDate: xml << ">\n      <skipped message=\"unchanged since last pass\"/>\n"; break;
+            case JobStatus::Skipped: xml << ">\n      <skipped message=\"not built, a dependency failed\"/>\n"; break;
+            case JobStatus::TimedOut: xml << ">\n      <failure message=\"timed out\"/>\n"; break;
+            case JobStatus::Failed:
+                xml << ">\n      <failure message=\"exit code " << test->exit_code << " after " << test->attempts
+                    << " attempt(s)\"/>\n";
+                break;
+            }
+            xml << "    </testcase>\n";
+        }
+        xml << "  </testsuite>\n</testsuites>\n";
+        std::filesystem::path junit_path{test_options().junit_path};
+        if (junit_path.has_parent_path())
+        {
+            std::filesystem::create_directories(junit_path.parent_path());
+        }
+        std::ofstream{junit_path} << xml.str();
+        auto& history = test_history();
+        // Formatted apart, so std::cout keeps the caller's precision.
+        std::ostringstream report{};
+        report << "tests: " << tests.size() - failures - skipped << " passed, " << failures << " failed, " << skipped
+               << " skipped in " << std::fixed << std::setprecision(3) << total_seconds << "s\n";
+        for (const auto* test : tests)
+        {
+            constexpr std::string_view status_names[]{"unchanged", "passed", "FAILED", "TIMED OUT", "skipped"};
+            report << "  " << std::setw(9) << test->seconds << "s " << std::setw(9)
+                   << status_names[static_cast<std::size_t>(test->status)] << " " << test->name << "\n";
+            if (test->status != JobStatus::UpToDate && test->status != JobStatus::Skipped)
+            {
+                history.record(test->name, test->seconds);
+            }
+        }
+        std::cout << report.str() << std::flush;
+        history.save();
+    }
+} // namespace sopho
+// include/sob.hpp
+template <class T>
+constexpr std::string_view type_name()
+{
+#if defined(__clang__) || defined(__GNUC__)
+    // __PRETTY_FUNCTION__ contains the type name in a compiler-specific format.
+    std::string_view p = __PRETTY_FUNCTION__;
+    // Example (clang): "constexpr std::string_view type_name() [T = int]"
+    auto start = p.find("T = ");
+    start = (start == std::string_view::npos) ? 0 : start + 4;
+    // GCC/Clang format contains "; ..." after T = Type
+    auto end = p.find(';', start);
+    if (end == std::string_view::npos)
+        end = p.find(']', start);
+    return p.substr(start, end - start);
+#elif defined(_MSC_VER)
+    // __FUNCSIG__ contains the type name in a compiler-specific format.
+    std::string_view p = __FUNCSIG__;
+    // Example (MSVC): "class std::basic_string_view<char,struct std::char_traits<char> > __cdecl type_name<int>(void)"
+    auto start = p.find("type_name<");
+    start = (start == std::string_view::npos) ? 0 : start + 10;
+    auto end = p.find(">(void)", start);
+    return p.substr(start, end - start);
+#else
+    return "unknown";
+#endif
+}
+namespace sopho
+{
+    // One compile_commands.json entry. Its strings are views into static storage or into the CompileCommands that
+    // holds it; the arguments are a range of that collection's argument list.
+    struct CompileCommand
+    {
+        std::string_view directory{};
+        std::uint32_t first_argument{};
+        std::uint32_t argument_count{};
+        std::string_view file{};
+    };
+    // The compile_commands.json entries of a build. The pipeline appends to one caller-provided collection instead of
+    // returning vectors of strings, and strings that are not in static storage, such as the directory and include or
+    // module flags, are interned, so entries sharing them store one copy.
+    class CompileCommands
+    {
+    public:
+        CompileCommands() = default;
+        // Entries point into strings_, which a copy would not own.
+        CompileCommands(const CompileCommands&) = delete;
+        CompileCommands& operator=(const CompileCommands&) = delete;
+        CompileCommands(CompileCommands&&) = default;
+        CompileCommands& operator=(CompileCommands&&) = default;
+        // A view of `text` that lives as long as the collection.
+        std::string_view intern(std::string_view text)
+        {
+            auto iter = strings_.find(text);
+            if (iter == strings_.end())
+            {
+                iter = strings_.emplace(text).first;
+            }
+            return *iter;
+        }
+        // Starts an entry; add_argument() appends to the latest one. Both take views that outlive the collection,
+        // static strings or results of intern().
+        void add(std::string_view directory, std::string_view file)
+        {
+            commands_.push_back(
+                CompileCommand{directory, static_cast<std::uint32_t>(arguments_.size()), 0, file});
+        }
+        void add_argument(std::string_view argument)
+        {
+            SOPHO_ASSERT(!commands_.empty(), "argument ", argument, " added before any compile command");
+            arguments_.push_back(argument);
+            ++commands_.back().argument_count;
+        }
+        std::size_t size() const { return commands_.size(); }
+        const std::vector<CompileCommand>& entries() const { return commands_; }
+        std::span<const std::string_view> arguments_of(const CompileCommand& command) const
+        {
+            return std::span<const std::string_view>{arguments_}.subspan(command.first_argument,
+                                                                          command.argument_count);
+        }
+    private:
+        std::set<std::string, std::less<>> strings_{};
+        std::vector<CompileCommand> commands_{};
+        std::vector<std::string_view> arguments_{};
+    };
+    // What a build returns: its compile_commands.json entries, and whether every job, tests included, succeeded.
+    struct BuildResult
+    {
+        CompileCommands commands{};
+        bool succeeded{};
+    };
+    inline void write_compile_commands_json(const std::string& path, const CompileCommands& commands)
+    {
+        std::ofstream out(path);
+        out << "[\n";
+        const auto& entries = commands.entries();
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            const auto& cmd = entries[i];
+            auto arguments = commands.arguments_of(cmd);
+            out << "  {\n";
+            out << "    \"directory\": \"" << cmd.directory << "\",\n";
+            out << "    \"file\": \"" << cmd.file << "\",\n";
+            out << "    \"arguments\": [";
+            for (size_t j = 0; j < arguments.size(); ++j)
+            {
+                out << "\"" << arguments[j] << "\"";
+                if (j + 1 < arguments.size())
+                    out << ", ";
+            }
+            out << "]\n";
+            out << "  }";
+            if (i + 1 < entries.size())
+                out << ",";
+            out << "\n";
+        }
+        out << "]\n";
+    }
+    // A path as it appears on a build line of a ninja file, where spaces, colons and dollars are special.
+    inline std::string ninja_escape(std::string_view path)
+    {
+        std::string result{};
+        for (char c : path)
+        {
+            if (c == ' ' || c == ':' || c == '$')
+            {
+                result.push_back('$');
+            }
+            result.push_back(c);
+        }
+        return result;
+    }
+    // Generic detection idiom core
+    template <typename, template <typename> class, typename = void>
+    struct is_detected : std::false_type
+    {
+    };
+    template <typename T, template <typename> class Op>
+    struct is_detected<T, Op, std::void_t<Op<T>>> : std::true_type
+    {
+    };
+    template <typename T, template <typename> class Op>
+    inline constexpr bool is_detected_v = is_detected<T, Op>::value;
+    template <StaticString S>
+    struct Source
+    {
+        static constexpr auto source = S;
+    };
+    // A module interface unit (.cppm, .ixx). Its BMI is built before every unit that imports it; which modules those
+    // are is scanned from the sources at build time.
+    template <StaticString S>
+    struct ModuleSource
+    {
+        static constexpr auto source = S;
+        static constexpr bool module_interface = true;
+    };
+    // Runs the binary of link target `Target` with `Args` as soon as it is linked. A test passes when it exits with 0
+    // within `TimeoutSeconds`, and is not run again until its binary changes.
+    template <typename Target, StaticString Args = StaticString{""}, std::uint32_t TimeoutSeconds = 300>
+    struct Test
+    {
+        using Dependent = std::tuple<Target>;
+        static constexpr auto test_args = Args;
+        static constexpr std::uint32_t timeout_seconds = TimeoutSeconds;
+    };
+    template <typename Deps, StaticString Name>
+    struct Target
+    {
+        using Dependent = Deps;
+        static constexpr auto target = Name;
+    };
+    // A shared library linked from `Deps`, named `Name` plus the Context's shared_postfix. Its sources are compiled
+    // with the Context's shared_cxxflags (-fPIC, visibility). Binaries linking it relink only when its exported
+    // symbols change, not on every rebuild of the library.
+    template <typename Deps, StaticString Name>
+    struct SharedLibrary
+    {
+        using Dependent = Deps;
+        static constexpr auto target = Name;
+        static constexpr bool shared_library = true;
+    };
+    // Expression template: get type of 'T::source' (works for static and non-static)
+    template <typename T>
+    using detect_source = decltype(std::declval<T&>().source);
+    // Final trait: has_source_v<T>
+    template <typename T>
+    inline constexpr bool has_source_v = is_detected_v<T, detect_source>;
+    template <typename T>
+    using detect_ldflags = decltype(std::declval<T&>().ldflags);
+    template <typename T>
+    inline constexpr bool has_ldflags_v = is_detected_v<T, detect_ldflags>;
+    template <typename T>
+    using detect_cxxflags = decltype(std::declval<T&>().cxxflags);
+    template <typename T>
+    inline constexpr bool has_cxxflags_v = is_detected_v<T, detect_cxxflags>;
+    template <typename T>
+    using detect_include_paths = decltype(std::declval<T&>().include_paths);
+    template <typename T>
+    inline constexpr bool has_include_paths_v = is_detected_v<T, detect_include_paths>;
+    template <typename T>
+    using detect_module_interface = decltype(std::declval<T&>().module_interface);
+    template <typename T>
+    inline constexpr bool has_module_interface_v = is_detected_v<T, detect_module_interface>;
+    template <typename T>
+    using detect_shared_library = decltype(std::declval<T&>().shared_library);
+    template <typename T>
+    inline constexpr bool has_shared_library_v = is_detected_v<T, detect_shared_library>;
+    template <typename T>
+    using detect_shared_prefix = decltype(std::declval<T&>().shared_prefix);
+    template <typename T>
+    inline constexpr bool has_shared_prefix_v = is_detected_v<T, detect_shared_prefix>;
+    // Linker flag a runtime library search path follows, e.g. "-Wl,-rpath,". Binaries linking shared libraries of the
+    // plan find them relative to their own location through it.
+    template <typename T>
+    using detect_rpath_prefix = decltype(std::declval<T&>().rpath_prefix);
+    template <typename T>
+    inline constexpr bool has_rpath_prefix_v = is_detected_v<T, detect_rpath_prefix>;
+    // Linker flag a shared library's own name follows, e.g. "-Wl,-soname,". Without one, binaries record the path the
+    // library was linked by, which only resolves from the directory the build ran in.
+    template <typename T>
+    using detect_soname_prefix = decltype(std::declval<T&>().soname_prefix);
+    template <typename T>
+    inline constexpr bool has_soname_prefix_v = is_detected_v<T, detect_soname_prefix>;
+    template <typename T>
+    using detect_shared_cxxflags = decltype(std::declval<T&>().shared_cxxflags);
+    template <typename T>
+    inline constexpr bool has_shared_cxxflags_v = is_detected_v<T, detect_shared_cxxflags>;
+    // Flags that make the compiler write a gcc-style depfile; the exported ninja file appends its path.
+    template <typename T>
+    using detect_depfile_flags = decltype(std::declval<T&>().depfile_flags);
+    template <typename T>
+    inline constexpr bool has_depfile_flags_v = is_detected_v<T, detect_depfile_flags>;
+    // Flags that make the compiler print the headers it reads, as ninja's "deps = msvc" parses them.
+    template <typename T>
+    using detect_show_includes_flags = decltype(std::declval<T&>().show_includes_flags);
+    template <typename T>
+    inline constexpr bool has_show_includes_flags_v = is_detected_v<T, detect_show_includes_flags>;
+    template <typename T>
+    using detect_test_args = decltype(std::declval<T&>().test_args);
+    template <typename T>
+    inline constexpr bool has_test_v = is_detected_v<T, detect_test_args>;
+    template <typename T>
+    using detect_bmi_postfix = decltype(std::declval<T&>().bmi_postfix);
+    template <typename T>
+    inline constexpr bool has_bmi_postfix_v = is_detected_v<T, detect_bmi_postfix>;
+    template <typename T>
+    using detect_module_flags = decltype(std::declval<T&>().module_flags);
+    template <typename T>
+    inline constexpr bool has_module_flags_v = is_detected_v<T, detect_module_flags>;
+    template <typename T>
+    using detect_module_interface_flags = decltype(std::declval<T&>().module_interface_flags);
+    template <typename T>
+    inline constexpr bool has_module_interface_flags_v = is_detected_v<T, detect_module_interface_flags>;
+    // g++ style: one mapper file names the BMI of every module.
+    template <typename T>
+    using detect_module_mapper_prefix = decltype(std::declval<T&>().module_mapper_prefix);
+    template <typename T>
+    inline constexpr bool has_module_mapper_prefix_v = is_detected_v<T, detect_module_mapper_prefix>;
+    // clang/cl style: the interface names its BMI output and importers reference each BMI as "name=path".
+    template <typename T>
+    using detect_module_reference_prefix = decltype(std::declval<T&>().module_reference_prefix);
+    template <typename T>
+    inline constexpr bool has_module_reference_prefix_v = is_detected_v<T, detect_module_reference_prefix>;
+    // Directory the final binaries of a link are placed in; the working directory when absent.
+    template <typename T>
+    using detect_target_prefix = decltype(std::declval<T&>().target_prefix);
+    template <typename T>
+    inline constexpr bool has_target_prefix_v = is_detected_v<T, detect_target_prefix>;
+    template <typename T>
+    using detect_variant_name = decltype(std::declval<T&>().variant_name);
+    template <typename T>
+    inline constexpr bool has_variant_name_v = is_detected_v<T, detect_variant_name>;
+    template <typename T>
+    using detect_pgo_merge_command = decltype(std::declval<T&>().pgo_merge_command);
+    template <typename T>
+    inline constexpr bool has_pgo_merge_command_v = is_detected_v<T, detect_pgo_merge_command>;
+    template <typename T>
+    using detect_pgo_use = decltype(std::declval<T&>().pgo_use);
+    template <typename T>
+    inline constexpr bool has_pgo_use_v = is_detected_v<T, detect_pgo_use>;
+    template <typename T>
+    using detect_dependent_type = typename T::Dependent;
+    template <typename T>
+    inline constexpr bool has_dependent_v = is_detected_v<T, detect_dependent_type>;
+    template <typename T, typename = void>
+    struct dependent_or_empty
+    {
+        using type = std::tuple<>;
+    };
+    template <typename T>
+    struct dependent_or_empty<T, std::void_t<typename T::Dependent>>
+    {
+        using type = typename T::Dependent;
+    };
+    template <typename T>
+    using dependent_or_empty_t = typename dependent_or_empty<T>::type;
+    enum class BuildNodeKind : std::uint8_t
+    {
+        Compile,
+        ModuleInterface,
+        Link,
+        SharedLink,
+        Test,
+    };
+    constexpr bool is_compile(BuildNodeKind kind)
+    {
+        return kind == BuildNodeKind::Compile || kind == BuildNodeKind::ModuleInterface;
+    }
+    // One step of a build plan. The strings live in static storage of the target types; inputs are indices of
+    // earlier nodes, whose outputs this node consumes.
+    struct BuildNode
+    {
+        BuildNodeKind kind{};
+        std::string_view name{};
+        std::string_view source{};
+        std::string_view output{};
+        // Command-line arguments and time limit of a test.
+        std::string_view arguments{};
+        std::uint32_t timeout_seconds{};
+        // Compiled for a shared library.
+        bool position_independent{};
+        std::uint32_t first_input{};
+        std::uint32_t input_count{};
+        // Hash of the static part of the node's command: compiler, flags, source, output and input paths. Cache keys
+        // fold file contents and environment into it at runtime.
+        std::uint64_t fingerprint{};
+    };
+    // Flat, topologically ordered (dependencies first) and de-duplicated form of a target graph, computed at
+    // compile time so consumers iterate contiguous data instead of instantiating per-target functions.
+    template <std::size_t NodeCount, std::size_t InputCount>
+    struct BuildPlan
+    {
+        std::array<BuildNode, NodeCount> nodes{};
+        std::array<std::uint32_t, InputCount> inputs{};
+        constexpr std::span<const std::uint32_t> inputs_of(const BuildNode& node) const
+        {
+            return std::span<const std::uint32_t>{inputs}.subspan(node.first_input, node.input_count);
+        }
+    };
+    namespace detail
+    {
+        template <typename List, typename T>
+        inline constexpr bool contains_v = false;
+        template <typename... Ts, typename T>
+        inline constexpr bool contains_v<std::tuple<Ts...>, T> = (std::is_same_v<T, Ts> || ...);
+        // Whether a shared library in List links T, which then has to be compiled position independent.
+        template <typename List, typename T>
+        inline constexpr bool linked_into_shared_v = false;
+        template <typename... Ts, typename T>
+        inline constexpr bool linked_into_shared_v<std::tuple<Ts...>, T> =
+            ((has_shared_library_v<Ts> && contains_v<dependent_or_empty_t<Ts>, T>) || ...);
+        template <typename List, typename T>
+        struct PostorderFolder;
+        // Visits the dependencies of T before T itself; a type already in the list is skipped with its subgraph.
+        template <typename List, typename T, bool Seen = contains_v<List, T>>
+        struct PostorderStep
+        {
+            using type = List;
+        };
+        template <typename... Ts, typename T>
+        struct PostorderStep<std::tuple<Ts...>, T, false>
+        {
+            template <typename Visited>
+            struct Append;
+            template <typename... Vs>
+            struct Append<std::tuple<Vs...>>
+            {
+                using type = std::tuple<Vs..., T>;
+            };
+            using type = typename Append<Foldl<PostorderFolder, std::tuple<Ts...>, dependent_or_empty_t<T>>>::type;
+        };
+        template <typename List, typename T>
+        struct PostorderFolder
+        {
+            using type = typename PostorderStep<List, T>::type;
+        };
+        constexpr StaticString<16> to_hex(std::uint64_t value)
+        {
+            StaticString<16> result{};
+            for (std::size_t i = 0; i < 16; ++i)
+            {
+                result.data[15 - i] = "0123456789abcdef"[(value >> (i * 4)) & 0xf];
+            }
+            return result;
+        }
+        template <typename T, typename... Ts>
+        constexpr std::uint32_t index_of(std::tuple<Ts...>*)
+        {
+            std::uint32_t index = 0;
+            std::uint32_t result = 0;
+            ((std::is_same_v<T, Ts> ? (result = index++) : index++), ...);
+            return result;
+        }
+    } // namespace detail
+    namespace detail
+    {
+        template <typename Target>
+        struct BuildOrderOf
+        {
+            using type = typename PostorderStep<std::tuple<>, Target>::type;
+        };
+        // A tuple of roots builds them all in one plan, e.g. a binary and the tests that run while it compiles.
+        template <typename... Targets>
+        struct BuildOrderOf<std::tuple<Targets...>>
+        {
+            using type = Foldl<PostorderFolder, std::tuple<>, std::tuple<Targets...>>;
+        };
+    } // namespace detail
+    // Every type reachable from Target, dependencies first, each once.
+    template <typename Target>
+    using BuildOrder = typename detail::BuildOrderOf<Target>::type;
+    template <std::size_t N, std::size_t M>
+    constexpr std::array<std::string_view, N + M> concat_flags(const std::array<std::string_view, N>& a,
+                                                               const std::array<std::string_view, M>& b)
+    {
+        std::array<std::string_view, N + M> result{};
+        for (std::size_t i = 0; i < N; ++i)
+        {
+            result[i] = a[i];
+        }
+        for (std::size_t i = 0; i < M; ++i)
+        {
+            result[N + i] = b[i];
+        }
+        return result;
+    }
+    template <typename Context>
+    constexpr auto cxxflags_or_empty()
+    {
+        if constexpr (has_cxxflags_v<Context>)
+        {
+            return Context::cxxflags;
+        }
+        else
+        {
+            return std::array<std::string_view, 0>{};
+        }
+    }
+    template <typename Context>
+    constexpr auto ldflags_or_empty()
+    {
+        if constexpr (has_ldflags_v<Context>)
+        {
+            return Context::ldflags;
+        }
+        else
+        {
+            return std::array<std::string_view, 0>{};
+        }
+    }
+    // A Context building into a directory of its own, so several variants of one target can be built side by side.
+    // Derive from it to change flags, e.g. `struct Debug : Variant<GxxContext, StaticString{"debug"}>`.
+    template <typename Context, StaticString Name>
+    struct Variant : Context
+    {
+        static constexpr auto variant_name = Name;
+        static constexpr auto build_prefix = concat(Context::build_prefix, Name, StaticString{"/"});
+        static constexpr auto target_prefix = build_prefix;
+    };
+    // Wraps a link target in a profile-guided optimization pipeline: an instrumented build, a run of the
+    // instrumented binary with `TrainingArgs`, profile merging, and an optimized rebuild that places the binary where
+    // the plain target would go.
+    template <typename Target, StaticString TrainingArgs>
+    struct PgoTarget
+    {
+        using Base = Target;
+        static constexpr auto training_args = TrainingArgs;
+    };
+    // Context of the instrumented build, kept apart from the plain and optimized builds in its own build_prefix.
+    template <typename Context>
+    struct PgoGenerateContext : Context
+    {
+        static constexpr auto build_prefix = concat(Context::build_prefix, StaticString{"pgo-generate/"});
+        static constexpr auto target_prefix = build_prefix;
+        static constexpr auto cxxflags = concat_flags(cxxflags_or_empty<Context>(), Context::pgo_generate_flags);
+        static constexpr auto ldflags = concat_flags(ldflags_or_empty<Context>(), Context::pgo_generate_flags);
+    };
+    // Context of the optimized build. Compile nodes take the merged profile as an input, so new training data
+    // rebuilds them.
+    template <typename Context>
+    struct PgoUseContext : Context
+    {
+        static constexpr auto build_prefix = concat(Context::build_prefix, StaticString{"pgo-use/"});
+        static constexpr auto cxxflags = concat_flags(cxxflags_or_empty<Context>(), Context::pgo_use_flags);
+        static constexpr auto ldflags = concat_flags(ldflags_or_empty<Context>(), Context::pgo_use_flags);
+        static constexpr bool pgo_use = true;
+    };
+    template <typename Context>
+    struct CxxToolchain
+    {
+        template <typename Target>
+        struct CxxBuilder;
+        template <size_t Size>
+        constexpr static auto source_to_target(StaticString<Size> source)
+        {
+            return concat(Context::build_prefix, strip_suffix(source, StaticString{".cpp"}), Context::obj_postfix);
+        }
+        template <typename T>
+        constexpr static auto module_source_to_target()
+        {
+            if constexpr (has_suffix(T::source, StaticString{".ixx"}))
+            {
+                return concat(Context::build_prefix, strip_suffix(T::source, StaticString{".ixx"}),
+                              Context::obj_postfix);
+            }
+            else
+            {
+                static_assert(has_suffix(T::source, StaticString{".cppm"}), "Module interfaces end in .cppm or .ixx");
+                return concat(Context::build_prefix, strip_suffix(T::source, StaticString{".cppm"}),
+                              Context::obj_postfix);
+            }
+        }
+        template <typename T>
+        constexpr static auto node_output()
+        {
+            if constexpr (has_module_interface_v<T>)
+            {
+                return module_source_to_target<T>();
+            }
+            else if constexpr (has_source_v<T>)
+            {
+                return source_to_target(T::source);
+            }
+            else if constexpr (has_test_v<T>)
+            {
+                // Stamp of the last pass; runs of one binary with different arguments are told apart by a hash.
+                constexpr auto binary = std::tuple_element_t<0, typename T::Dependent>::target;
+                if constexpr (T::test_args.size() == 0)
+                {
+                    return concat(Context::build_prefix, binary, StaticString{".passed"});
+                }
+                else
+                {
+                    return concat(Context::build_prefix, binary, StaticString{"."}, detail::to_hex(fnv1a(T::test_args)),
+                                  StaticString{".passed"});
+                }
+            }
+            else if constexpr (has_shared_library_v<T>)
+            {
+                static_assert(has_shared_prefix_v<Context>,
+                              "Context needs shared_prefix and shared_postfix to link shared libraries");
+                if constexpr (has_target_prefix_v<Context>)
+                {
+                    return concat(Context::target_prefix, T::target, Context::shared_postfix);
+                }
+                else
+                {
+                    return concat(T::target, Context::shared_postfix);
+                }
+            }
+            else
+            {
+                if constexpr (has_target_prefix_v<Context>)
+                {
+                    return concat(Context::target_prefix, T::target);
+                }
+                else
+                {
+                    return T::target;
+                }
+            }
+        }
+        // Static storage for the output paths the plan's nodes point to.
+        template <typename T>
+        static constexpr auto node_output_v = node_output<T>();
+        // Hash of the command-line pieces every node of `kind` shares.
+        static constexpr std::uint64_t command_fingerprint(BuildNodeKind kind, bool position_independent)
+        {
+            std::uint64_t hash = hash_combine(fnv1a_offset_basis, kind, fnv1a(Context::cxx));
+            if constexpr (has_module_interface_flags_v<Context>)
+            {
+                if (kind == BuildNodeKind::ModuleInterface)
+                {
+                    for (const auto& flag : Context::module_interface_flags)
+                    {
+                        hash = hash_combine(hash, fnv1a(flag));
+                    }
+                }
+            }
+            if (is_compile(kind))
+            {
+                hash = hash_combine(hash, fnv1a(Context::obj_prefix));
+                if constexpr (has_include_paths_v<Context>)
+                {
+                    for (const auto& path : Context::include_paths)
+                    {
+                        hash = hash_combine(hash, fnv1a(Context::include_prefix), fnv1a(path));
+                    }
+                }
+                if constexpr (has_cxxflags_v<Context>)
+                {
+                    for (const auto& flag : Context::cxxflags)
+                    {
+                        hash = hash_combine(hash, fnv1a(flag));
+                    }
+                }
+                if constexpr (has_shared_cxxflags_v<Context>)
+                {
+                    if (position_independent)
+                    {
+                        for (const auto& flag : Context::shared_cxxflags)
+                        {
+                            hash = hash_combine(hash, fnv1a(flag));
+                        }
+                    }
+                }
+            }
+            else if (kind == BuildNodeKind::Link || kind == BuildNodeKind::SharedLink)
+            {
+                if constexpr (has_shared_prefix_v<Context>)
+                {
+                    if (kind == BuildNodeKind::SharedLink)
+                    {
+                        hash = hash_combine(hash, fnv1a(Context::shared_prefix));
+                    }
+                }
+                hash = hash_combine(hash, fnv1a(Context::bin_prefix));
+                if constexpr (has_ldflags_v<Context>)
+                {
+                    for (const auto& flag : Context::ldflags)
+                    {
+                        hash = hash_combine(hash, fnv1a(flag));
+                    }
+                }
+            }
+            return hash;
+        }
+        template <typename Target>
+        static constexpr auto make_build_plan()
+        {
+            return []<typename... Ts>(std::tuple<Ts...>*)
+            {
+                using Order = std::tuple<Ts...>;
+                constexpr std::size_t input_count = (std::tuple_size_v<dependent_or_empty_t<Ts>> + ... + 0);
+                BuildPlan<sizeof...(Ts), input_count> plan{};
+                std::uint32_t node_index = 0;
+                std::uint32_t input_index = 0;
+                (
+                    [&]
+                    {
+                        auto& node = plan.nodes[node_index++];
+                        node.kind = has_module_interface_v<Ts> ? BuildNodeKind::ModuleInterface
+                                    : has_source_v<Ts>             ? BuildNodeKind::Compile
+                                    : has_test_v<Ts>               ? BuildNodeKind::Test
+                                    : has_shared_library_v<Ts>     ? BuildNodeKind::SharedLink
+                                                                   : BuildNodeKind::Link;
+                        node.name = type_name<Ts>();
+                        if constexpr (has_source_v<Ts>)
+                        {
+                            static_assert(!Ts::source.view().empty(), "Source file cannot be empty");
+                            node.source = Ts::source.view();
+                            node.position_independent = detail::linked_into_shared_v<Order, Ts>;
+                        }
+                        else if constexpr (has_test_v<Ts>)
+                        {
+                            static_assert(!has_source_v<std::tuple_element_t<0, typename Ts::Dependent>>,
+                                          "A test runs a link target, not a source");
+                            node.arguments = Ts::test_args.view();
+                            node.timeout_seconds = Ts::timeout_seconds;
+                        }
+                        else
+                        {
+                            static_assert(std::tuple_size_v<typename Ts::Dependent> > 0,
+                                          "Link target must have dependencies (object files)");
+                        }
+                        node.output = node_output_v<Ts>.view();
+                        node.first_input = input_index;
+                        [&]<typename... Ds>(std::tuple<Ds...>*) {
+                            ((plan.inputs[input_index++] = detail::index_of<Ds>(static_cast<Order*>(nullptr))), ...);
+                        }(static_cast<dependent_or_empty_t<Ts>*>(nullptr));
+                        node.input_count = input_index - node.first_input;
+                        node.fingerprint =
+                            hash_combine(command_fingerprint(node.kind, node.position_independent), fnv1a(node.source),
+                                         fnv1a(node.output), fnv1a(node.arguments), node.timeout_seconds);
+                        for (auto input : plan.inputs_of(node))
+                        {
+                            node.fingerprint = hash_combine(node.fingerprint, fnv1a(plan.nodes[input].output));
+                            if constexpr (has_rpath_prefix_v<Context>)
+                            {
+                                if (plan.nodes[input].kind == BuildNodeKind::SharedLink && !is_compile(node.kind))
+                                {
+                                    node.fingerprint = hash_combine(node.fingerprint, fnv1a(Context::rpath_prefix));
+                                }
+                            }
+                        }
+                        if constexpr (has_soname_prefix_v<Context>)
+                        {
+                            if (node.kind == BuildNodeKind::SharedLink)
+                            {
+                                node.fingerprint = hash_combine(node.fingerprint, fnv1a(Context::soname_prefix));
+                            }
+                        }
+                    }(),
+                    ...);
+                return plan;
+            }(static_cast<BuildOrder<Target>*>(nullptr));
+        }
+        template <typename Target>
+        static constexpr auto build_plan = make_build_plan<Target>();
+        // Shared by every builder of this toolchain so headers common to several sources are scanned once.
+        static IncludeScanner& include_scanner()
+        {
+            static IncludeScanner scanner{[]
+                                          {
+                                              std::vector<std::filesystem::path> paths{};
+                                              if constexpr (has_include_paths_v<Context>)
+                                              {
+                                                  for (const auto& path : Context::include_paths)
+                                                  {
+                                                      paths.emplace_back(path);
+                                                  }
+                                              }
+                                              return paths;
+                                          }()};
+            return scanner;
+        }
+        // Module structure of a plan, scanned from the sources of its compile nodes, and the order to run the nodes
+        // in: plan order, except that a module's BMI is built before every unit that imports it.
+        struct ModuleGraph
+        {
+            std::vector<ModuleUnit> units{};
+            // Modules each node needs the BMIs of, transitively, dependencies first.
+            std::vector<std::vector<std::string>> imports{};
+            // Modules with a BMI built by this plan and the node building it.
+            std::map<std::string, std::uint32_t, std::less<>> providers{};
+            std::vector<std::uint32_t> order{};
+        };
+        // Interfaces and partitions get a BMI; implementation units of a primary module do not.
+        static bool provides_bmi(const ModuleUnit& unit)
+        {
+            return unit.interface || unit.name.find(':') != std::string::npos;
+        }
+        static std::string bmi_path(std::string_view module)
+        {
+            if constexpr (has_bmi_postfix_v<Context>)
+            {
+                std::string result{Context::build_prefix.view()};
+                for (char c : module)
+                {
+                    result.push_back(c == ':' ? '-' : c);
+                }
+                result += Context::bmi_postfix.view();
+                return result;
+            }
+            else
+            {
+                SOPHO_ASSERT(false, "module ", module, " needs Context::bmi_postfix");
+            }
+        }
+        static std::string module_mapper_path() { return std::string{Context::build_prefix.view()} + "modules.map"; }
+        template <typename Plan>
+        static ModuleGraph scan_modules(const Plan& plan)
+        {
+            ModuleGraph graph{};
+            graph.units.resize(plan.nodes.size());
+            graph.imports.resize(plan.nodes.size());
+            for (std::uint32_t index = 0; index < plan.nodes.size(); ++index)
+            {
+                const auto& node = plan.nodes[index];
+                if (!is_compile(node.kind))
+                {
+                    continue;
+                }
+                const auto& unit = graph.units[index] =
+                    include_scanner().module_unit(std::filesystem::path{node.source});
+                if (provides_bmi(unit))
+                {
+                    auto [iter, inserted] = graph.providers.emplace(unit.name, index);
+                    SOPHO_ASSERT(inserted, "module ", unit.name, " is declared by both ",
+                                 plan.nodes[iter->second].source, " and ", node.source);
+                }
+            }
+            // Depth first over plan inputs and imports. Imports of modules this plan does not build, such as
+            // `import std;`, are left to the compiler.
+            enum class Mark : std::uint8_t
+            {
+                Unvisited,
+                Visiting,
+                Done,
+            };
+            std::vector<Mark> marks(plan.nodes.size(), Mark::Unvisited);
+            auto visit = [&](auto& self, std::uint32_t index) -> void
+            {
+                if (marks[index] == Mark::Done)
+                {
+                    return;
+                }
+                SOPHO_ASSERT(marks[index] == Mark::Unvisited, "module import cycle through ",
+                             plan.nodes[index].source);
+                marks[index] = Mark::Visiting;
+                for (auto input : plan.inputs_of(plan.nodes[index]))
+                {
+                    self(self, input);
+                }
+                auto& imports = graph.imports[index];
+                auto add_import = [&](const std::string& name)
+                {
+                    auto iter = graph.providers.find(name);
+                    if (iter == graph.providers.end())
+                    {
+                        return;
+                    }
+                    self(self, iter->second);
+                    for (const auto& module : graph.imports[iter->second])
+                    {
+                        if (std::find(imports.begin(), imports.end(), module) == imports.end())
+                        {
+                            imports.push_back(module);
+                        }
+                    }
+                    if (std::find(imports.begin(), imports.end(), name) == imports.end())
+                    {
+                        imports.push_back(name);
+                    }
+                };
+                const auto& unit = graph.units[index];
+                if (!unit.name.empty() && !provides_bmi(unit))
+                {
+                    // An implementation unit implicitly imports its primary interface.
+                    add_import(unit.name);
+                }
+                for (const auto& name : unit.imports)
+                {
+                    add_import(name);
+                }
+                marks[index] = Mark::Done;
+                graph.order.push_back(index);
+            };
+            for (std::uint32_t index = 0; index < plan.nodes.size(); ++index)
+            {
+                visit(visit, index);
+            }
+            return graph;
+        }
+        // "name bmi" per line, the format of g++'s -fmodule-mapper file.
+        static void write_module_mapper(const ModuleGraph& graph)
+        {
+            if constexpr (has_module_mapper_prefix_v<Context>)
+            {
+                if (graph.providers.empty())
+                {
+                    return;
+                }
+                std::filesystem::create_directories(std::filesystem::path{module_mapper_path()}.parent_path());
+                std::ofstream out(module_mapper_path());
+                for (const auto& [name, index] : graph.providers)
+                {
+                    out << name << ' ' << bmi_path(name) << '\n';
+                }
+            }
+        }
+        // Where gcc's -fprofile-generate writes the counts of an object file, and -fprofile-use reads them from.
+        static std::string gcda_path(const BuildNode& node)
+        {
+            auto stem = node.output.substr(0, node.output.size() - Context::obj_postfix.size());
+            return std::string{stem} + ".gcda";
+        }
+        // The profile a compile node is optimized with: the merged profile when the Context merges with a command
+        // (llvm-profdata), the object's own .gcda otherwise.
+        static std::string pgo_profile(const BuildNode& node)
+        {
+            if constexpr (has_pgo_merge_command_v<Context>)
+            {
+                return std::string{Context::pgo_profile.view()};
+            }
+            else
+            {
+                return gcda_path(node);
+            }
+        }
+        // Hex hash of a shared library's exported symbols, rewritten only when it changes.
+        static std::string interface_path(const BuildNode& node) { return std::string{node.output} + ".interface"; }
+        // Touched on every check of the interface, so an unchanged library is not hashed again.
+        static std::string interface_checked_path(const BuildNode& node)
+        {
+            return std::string{node.output} + ".interface-checked";
+        }
+        static bool update_interface(const BuildNode& node)
+        {
+            SOPHO_STACK();
+            auto hash = library_interface_hash(std::filesystem::path{node.output});
+            std::string text = std::string{detail::to_hex(hash).view()} + "\n";
+            std::filesystem::path path{interface_path(node)};
+            if (!std::filesystem::exists(path) || read_file(path) != text)
+            {
+                std::ofstream{path} << text;
+            }
+            return true;
+        }
+        // Files whose timestamps decide whether a node is up to date: a source, its headers and the BMIs of the
+        // modules it imports, or the outputs of the nodes it links.
+        template <typename Plan>
+        static std::vector<std::filesystem::path> node_inputs(const Plan& plan, const ModuleGraph& graph,
+                                                              std::uint32_t index)
+        {
+            const auto& node = plan.nodes[index];
+            std::vector<std::filesystem::path> result{};
+            if (is_compile(node.kind))
+            {
+                result = include_scanner().dependencies(std::filesystem::path{node.source});
+                result.emplace_back(node.source);
+                for (const auto& module : graph.imports[index])
+                {
+                    result.emplace_back(bmi_path(module));
+                }
+                if constexpr (has_pgo_use_v<Context>)
+                {
+                    result.emplace_back(pgo_profile(node));
+                }
+            }
+            if (node.kind == BuildNodeKind::Test)
+            {
+                // The binary, and every shared library it loads: a test reruns on changes behind a stable interface.
+                std::vector<std::uint32_t> pending{plan.inputs_of(node).begin(), plan.inputs_of(node).end()};
+                while (!pending.empty())
+                {
+                    const auto& input = plan.nodes[pending.back()];
+                    pending.pop_back();
+                    result.emplace_back(input.output);
+                    for (auto dependency : plan.inputs_of(input))
+                    {
+                        if (plan.nodes[dependency].kind == BuildNodeKind::SharedLink)
+                        {
+                            pending.push_back(dependency);
+                        }
+                    }
+                }
+                return result;
+            }
+            for (auto input : plan.inputs_of(node))
+            {
+                // A shared library counts through its interface file, which only changes with its exported symbols.
+                result.emplace_back(plan.nodes[input].kind == BuildNodeKind::SharedLink
+                                        ? interface_path(plan.nodes[input])
+                                        : std::string{plan.nodes[input].output});
+            }
+            return result;
+        }
+        // Flags that tell the compiler where a unit's own BMI goes and where the BMIs it imports are.
+        static std::vector<std::string> module_flags(const ModuleUnit& unit, const std::vector<std::string>& imports)
+        {
+            std::vector<std::string> result{};
+            if (unit.name.empty() && unit.imports.empty())
+            {
+                return result;
+            }
+            if constexpr (has_module_flags_v<Context>)
+            {
+                for (const auto& flag : Context::module_flags)
+                {
+                    result.emplace_back(flag);
+                }
+            }
+            if constexpr (has_module_mapper_prefix_v<Context>)
+            {
+                result.push_back(std::string{Context::module_mapper_prefix.view()} + module_mapper_path());
+            }
+            else if constexpr (has_module_reference_prefix_v<Context>)
+            {
+                if (provides_bmi(unit))
+                {
+                    result.push_back(std::string{Context::module_output_prefix.view()} + bmi_path(unit.name));
+                }
+                for (const auto& module : imports)
+                {
+                    result.push_back(std::string{Context::module_reference_prefix.view()} + module + "=" +
+                                     bmi_path(module));
+                }
+            }
+            else
+            {
+                SOPHO_ASSERT(false, "Context has no module_mapper_prefix or module_reference_prefix for module ",
+                             unit.name);
+            }
+            return result;
+        }
+        // Per-node link flags, each with a leading space: a shared library's soname, and search paths, relative to the
+        // linked file through $ORIGIN, of the shared libraries a link takes. `ninja` escapes the dollar for a ninja
+        // file; both quote it for the shell.
+        template <typename Plan>
+        static std::string link_flags(const Plan& plan, const BuildNode& node, bool ninja)
+        {
+            std::string result{};
+            if constexpr (has_soname_prefix_v<Context>)
+            {
+                if (node.kind == BuildNodeKind::SharedLink)
+                {
+                    result += " '" + std::string{Context::soname_prefix.view()} +
+                              std::filesystem::path{node.output}.filename().string() + "'";
+                }
+            }
+            if constexpr (has_rpath_prefix_v<Context>)
+            {
+                auto origin = std::filesystem::path{node.output}.parent_path();
+                std::vector<std::string> directories{};
+                for (auto input : plan.inputs_of(node))
+                {
+                    if (plan.nodes[input].kind != BuildNodeKind::SharedLink)
+                    {
+                        continue;
+                    }
+                    auto relative = std::filesystem::path{plan.nodes[input].output}.parent_path().lexically_relative(
+                        origin.empty() ? std::filesystem::path{"."} : origin);
+                    auto directory = std::string{ninja ? "$$ORIGIN" : "$ORIGIN"};
+                    if (!relative.empty() && relative != ".")
+                    {
+                        directory += "/" + relative.generic_string();
+                    }
+                    if (std::find(directories.begin(), directories.end(), directory) == directories.end())
+                    {
+                        result += " '" + std::string{Context::rpath_prefix.view()} + directory + "'";
+                        directories.push_back(std::move(directory));
+                    }
+                }
+            }
+            else
+            {
+                static_cast<void>(plan);
+                static_cast<void>(ninja);
+            }
+            return result;
+        }
+        // The shell command for a node; compile nodes also get their compile_commands.json entry, in `directory`.
+        template <typename Plan>
+        static std::string node_command(const Plan& plan, const ModuleGraph& graph, std::uint32_t index,
+                                        CompileCommands& commands, std::string_view directory)
+        {
+            const auto& node = plan.nodes[index];
+            std::stringstream ss{};
+            if (node.kind == BuildNodeKind::Test)
+            {
+                // A bare file name would be looked up in PATH.
+                std::filesystem::path binary{plan.nodes[plan.inputs_of(node)[0]].output};
+                ss << (binary.has_parent_path() ? binary : std::filesystem::path{"."} / binary).string();
+                if (!node.arguments.empty())
+                {
+                    ss << " " << node.arguments;
+                }
+                return ss.str();
+            }
+            ss << Context::cxx;
+            if (is_compile(node.kind))
+            {
+                // Plan strings and Context flags are in static storage; only composed flags need interning.
+                commands.add(directory, node.source);
+                commands.add_argument(Context::cxx);
+                if constexpr (has_module_interface_flags_v<Context>)
+                {
+                    if (node.kind == BuildNodeKind::ModuleInterface)
+                    {
+                        for (const auto& flag : Context::module_interface_flags)
+                        {
+                            ss << " " << flag;
+                            commands.add_argument(flag);
+                        }
+                    }
+                }
+                ss << " -c " << node.source << Context::obj_prefix.view() << node.output;
+                commands.add_argument("-c");
+                commands.add_argument(node.source);
+                commands.add_argument(Context::obj_prefix.view());
+                commands.add_argument(node.output);
+                if constexpr (has_include_paths_v<Context>)
+                {
+                    for (const auto& path : Context::include_paths)
+                    {
+                        ss << " " << Context::include_prefix.view() << path;
+                        commands.add_argument(
+                            commands.intern(std::string{Context::include_prefix.view()} + std::string{path}));
+                    }
+                }
+                if constexpr (has_cxxflags_v<Context>)
+                {
+                    for (const auto& flag : Context::cxxflags)
+                    {
+                        ss << " " << flag;
+                        commands.add_argument(flag);
+                    }
+                }
+                if constexpr (has_shared_cxxflags_v<Context>)
+                {
+                    if (node.position_independent)
+                    {
+                        for (const auto& flag : Context::shared_cxxflags)
+                        {
+                            ss << " " << flag;
+                            commands.add_argument(flag);
+                        }
+                    }
+                }
+                for (const auto& flag : module_flags(graph.units[index], graph.imports[index]))
+                {
+                    ss << " " << flag;
+                    commands.add_argument(commands.intern(flag));
+                }
+            }
+            else
+            {
+                for (auto input : plan.inputs_of(node))
+                {
+                    ss << " " << plan.nodes[input].output;
+                }
+                if constexpr (has_shared_prefix_v<Context>)
+                {
+                    ss << (node.kind == BuildNodeKind::SharedLink ? Context::shared_prefix.view()
+                                                                  : Context::bin_prefix.view());
+                }
+                else
+                {
+                    ss << Context::bin_prefix.view();
+                }
+                ss << node.output << link_flags(plan, node, false);
+                if constexpr (has_ldflags_v<Context>)
+                {
+                    for (const auto& flag : Context::ldflags)
+                    {
+                        ss << " " << flag;
+                    }
+                }
+            }
+            return ss.str();
+        }
+        // Name of a node in build output, tagged with the variant when the Context is one. Tests go by their command
+        // line, which is also their name in reports and the duration history.
+        template <typename Plan>
+        static std::string job_name(const Plan& plan, const BuildNode& node)
+        {
+            std::string name{node.name};
+            if (node.kind == BuildNodeKind::Test)
+            {
+                name = plan.nodes[plan.inputs_of(node)[0]].output;
+                if (!node.arguments.empty())
+                {
+                    name += " " + std::string{node.arguments};
+                }
+            }
+            if constexpr (has_variant_name_v<Context>)
+            {
+                name += "@" + std::string{Context::variant_name.view()};
+            }
+            return name;
+        }
+        // A rough compile speed for jobs with no recorded duration: about a second per megabyte of source and headers.
+        static constexpr double seconds_per_input_byte = 1e-6;
+        // How long a node's job takes: its last duration, or for a compile never timed, a guess from the size of the
+        // files it reads. Other jobs are cheap next to compiles until measured.
+        static double expected_seconds(const BuildNode& node, const BuildJob& job)
+        {
+            if (auto seconds = job_history().seconds(node.output))
+            {
+                return *seconds;
+            }
+            if (!is_compile(node.kind))
+            {
+                return 0.0;
+            }
+            std::uintmax_t bytes = 0;
+            for (const auto& input : job.inputs)
+            {
+                std::error_code ec{};
+                auto size = std::filesystem::file_size(input, ec);
+                bytes += ec ? 0 : size;
+            }
+            return static_cast<double>(bytes) * seconds_per_input_byte;
+        }
+        // Adds the plan's nodes to `pool`, module interfaces ahead of their importers, and appends the
+        // compile_commands.json entries of its compile nodes to `commands`. Nothing runs until the pool does.
+        template <typename Plan>
+        static void enqueue(JobPool& pool, const Plan& plan, CompileCommands& commands)
+        {
+            SOPHO_STACK();
+            auto directory = commands.intern(std::filesystem::current_path().string());
+            auto graph = scan_modules(plan);
+            write_module_mapper(graph);
+            std::vector<std::size_t> job_of(plan.nodes.size());
+            for (auto index : graph.order)
+            {
+                const auto& node = plan.nodes[index];
+                BuildJob job{job_name(plan, node), node_command(plan, graph, index, commands, directory), {},
+                             node_inputs(plan, graph, index), {std::filesystem::path{node.output}}, {}};
+                job.expected_seconds = expected_seconds(node, job);
+                if (node.kind == BuildNodeKind::Test)
+                {
+                    if (!test_options().selects(job.name))
+                    {
+                        // Another shard runs it; nothing depends on a test.
+                        continue;
+                    }
+                    job.timeout = std::chrono::seconds{node.timeout_seconds};
+                    job.retries = test_options().retries;
+                    job.stamp_outputs = true;
+                    job.test = true;
+                    job.expected_seconds = test_history().expected_seconds(job.name);
+                }
+                if (provides_bmi(graph.units[index]))
+                {
+                    job.outputs.emplace_back(bmi_path(graph.units[index].name));
+                }
+                for (auto input : plan.inputs_of(node))
+                {
+                    job.dependencies.push_back(job_of[input]);
+                }
+                for (const auto& module : graph.imports[index])
+                {
+                    job.dependencies.push_back(job_of[graph.providers.find(module)->second]);
+                }
+                if (auto parent = std::filesystem::path{node.output}.parent_path(); !parent.empty())
+                {
+                    std::filesystem::create_directories(parent);
+                }
+                job_of[index] = pool.add(std::move(job));
+                if (node.kind == BuildNodeKind::SharedLink)
+                {
+                    // Binaries linking the library wait for its interface instead, and relink when that changed.
+                    BuildJob interface{job_name(plan, node) + ":interface", "hash exported symbols of " +
+                                                                                std::string{node.output},
+                                       [&node] { return update_interface(node); },
+                                       {std::filesystem::path{node.output}},
+                                       {std::filesystem::path{interface_checked_path(node)}},
+                                       {job_of[index]}};
+                    interface.stamp_outputs = true;
+                    job_of[index] = pool.add(std::move(interface));
+                }
+            }
+        }
+        // Ninja rules of this Context, named `rules` followed by _cxx, _link, _shared and _test. The Context's flags
+        // are part of the rules; build lines only add what differs between nodes.
+        static void write_ninja_rules(std::ostream& out, std::string_view rules)
+        {
+            out << "rule " << rules << "_cxx\n  command = " << Context::cxx << " $pre_flags -c $in"
+                << Context::obj_prefix.view() << "$out";
+            if constexpr (has_include_paths_v<Context>)
+            {
+                for (const auto& path : Context::include_paths)
+                {
+                    out << " " << Context::include_prefix.view() << path;
+                }
+            }
+            if constexpr (has_cxxflags_v<Context>)
+            {
+                for (const auto& flag : Context::cxxflags)
+                {
+                    out << " " << flag;
+                }
+            }
+            out << " $flags";
+            if constexpr (has_depfile_flags_v<Context>)
+            {
+                for (const auto& flag : Context::depfile_flags)
+                {
+                    out << " " << flag;
+                }
+                out << " $out.d\n  depfile = $out.d\n  deps = gcc";
+            }
+            else if constexpr (has_show_includes_flags_v<Context>)
+            {
+                for (const auto& flag : Context::show_includes_flags)
+                {
+                    out << " " << flag;
+                }
+                out << "\n  deps = msvc";
+            }
+            out << "\n  description = CXX $out\n\n";
+            auto ldflags = [&out]
+            {
+                if constexpr (has_ldflags_v<Context>)
+                {
+                    for (const auto& flag : Context::ldflags)
+                    {
+                        out << " " << flag;
+                    }
+                }
+            };
+            out << "rule " << rules << "_link\n  command = " << Context::cxx << " $in" << Context::bin_prefix.view()
+                << "$out$link_flags";
+            ldflags();
+            out << "\n  description = LINK $out\n\n";
+            if constexpr (has_shared_prefix_v<Context>)
+            {
+                out << "rule " << rules << "_shared\n  command = " << Context::cxx << " $in"
+                    << Context::shared_prefix.view() << "$out$link_flags";
+                ldflags();
+                out << "\n  description = LINK $out\n\n";
+            }
+            // The stamp marks the last pass, as in the native executor.
+            out << "rule " << rules << "_test\n  command = $binary $args && touch $out\n"
+                << "  description = TEST $binary\n\n";
+        }
+        // Build lines of the plan's nodes, using the rules write_ninja_rules() wrote under the same name. Outputs in
+        // `written` are skipped, so variants sharing outputs declare each once; the plan's outputs are added to it.
+        template <typename Plan>
+        static void write_ninja_edges(std::ostream& out, const Plan& plan, std::string_view rules,
+                                      std::set<std::string, std::less<>>& written)
+        {
+            SOPHO_STACK();
+            auto graph = scan_modules(plan);
+            write_module_mapper(graph);
+            for (auto index : graph.order)
+            {
+                const auto& node = plan.nodes[index];
+                if (!written.emplace(node.output).second)
+                {
+                    continue;
+                }
+                const auto& unit = graph.units[index];
+                out << "build " << ninja_escape(node.output);
+                if (provides_bmi(unit))
+                {
+                    out << " | " << ninja_escape(bmi_path(unit.name));
+                }
+                out << ": " << rules;
+                if (is_compile(node.kind))
+                {
+                    out << "_cxx " << ninja_escape(node.source);
+                    std::vector<std::string> implicit{};
+                    for (const auto& module : graph.imports[index])
+                    {
+                        implicit.push_back(bmi_path(module));
+                    }
+                    if constexpr (!has_depfile_flags_v<Context> && !has_show_includes_flags_v<Context>)
+                    {
+                        // Without compiler-reported dependencies, the scanned headers are listed up front.
+                        for (const auto& header : include_scanner().dependencies(std::filesystem::path{node.source}))
+                        {
+                            implicit.push_back(header.string());
+                        }
+                    }
+                    if (!implicit.empty())
+                    {
+                        out << " |";
+                        for (const auto& path : implicit)
+                        {
+                            out << " " << ninja_escape(path);
+                        }
+                    }
+                    out << "\n";
+                    if constexpr (has_module_interface_flags_v<Context>)
+                    {
+                        if (node.kind == BuildNodeKind::ModuleInterface)
+                        {
+                            out << "  pre_flags =";
+                            for (const auto& flag : Context::module_interface_flags)
+                            {
+                                out << " " << flag;
+                            }
+                            out << "\n";
+                        }
+                    }
+                    std::string flags{};
+                    if constexpr (has_shared_cxxflags_v<Context>)
+                    {
+                        if (node.position_independent)
+                        {
+                            for (const auto& flag : Context::shared_cxxflags)
+                            {
+                                flags += " " + std::string{flag};
+                            }
+                        }
+                    }
+                    for (const auto& flag : module_flags(unit, graph.imports[index]))
+                    {
+                        flags += " " + flag;
+                    }
+                    if (!flags.empty())
+                    {
+                        out << "  flags =" << flags << "\n";
+                    }
+                }
+                else if (node.kind == BuildNodeKind::Test)
+                {
+                    // The binary, and every shared library it loads.
+                    out << "_test |";
+                    std::vector<std::uint32_t> pending{plan.inputs_of(node).begin(), plan.inputs_of(node).end()};
+                    while (!pending.empty())
+                    {
+                        const auto& input = plan.nodes[pending.back()];
+                        pending.pop_back();
+                        out << " " << ninja_escape(input.output);
+                        for (auto dependency : plan.inputs_of(input))
+                        {
+                            if (plan.nodes[dependency].kind == BuildNodeKind::SharedLink)
+                            {
+                                pending.push_back(dependency);
+                            }
+                        }
+                    }
+                    std::filesystem::path binary{plan.nodes[plan.inputs_of(node)[0]].output};
+                    out << "\n  binary = "
+                        << (binary.has_parent_path() ? binary : std::filesystem::path{"."} / binary).string() << "\n";
+                    if (!node.arguments.empty())
+                    {
+                        out << "  args = " << node.arguments << "\n";
+                    }
+                }
+                else
+                {
+                    out << (node.kind == BuildNodeKind::SharedLink ? "_shared" : "_link");
+                    for (auto input : plan.inputs_of(node))
+                    {
+                        out << " " << ninja_escape(plan.nodes[input].output);
+                    }
+                    out << "\n";
+                    if (auto flags = link_flags(plan, node, true); !flags.empty())
+                    {
+                        out << "  link_flags =" << flags << "\n";
+                    }
+                }
+            }
+        }
+        // Runs the plan's nodes on a job pool of their own, skipping those whose outputs are newer than all of their
+        // inputs, then reports the tests among them and the build's critical path. Returns whether every job
+        // succeeded.
+        template <typename Plan>
+        static bool execute(const Plan& plan, CompileCommands& commands)
+        {
+            SOPHO_STACK();
+            JobPool pool{};
+            enqueue(pool, plan, commands);
+            bool succeeded = pool.run();
+            report_tests(pool.results());
+            report_build(pool);
+            return succeeded;
+        }
+        template <typename Target>
+        struct CxxBuilder
+        {
+            static constexpr const auto& plan = build_plan<Target>;
+            static bool build(CompileCommands& commands) { return execute(plan, commands); }
+            static BuildResult build()
+            {
+                BuildResult result{};
+                result.succeeded = build(result.commands);
+                return result;
+            }
+        };
+        // Each stage reruns only when its inputs changed: the two builds through execute(), the training run when the
+        // instrumented binary is newer than its stamp, the merge when the raw profiles are newer than the merged ones.
+        // The collected commands are those of the optimized build. A failed stage fails the build; the optimized build
+        // still runs after a failed training run, with the profiles there are.
+        template <typename Target, StaticString TrainingArgs>
+        struct CxxBuilder<PgoTarget<Target, TrainingArgs>>
+        {
+            using Generate = CxxToolchain<PgoGenerateContext<Context>>;
+            using Use = CxxToolchain<PgoUseContext<Context>>;
+            static constexpr const auto& generate_plan = Generate::template build_plan<Target>;
+            static constexpr const auto& use_plan = Use::template build_plan<Target>;
+            static constexpr auto training_stamp =
+                concat(PgoGenerateContext<Context>::build_prefix, StaticString{"training.stamp"});
+            static bool train()
+            {
+                SOPHO_STACK();
+                std::filesystem::path binary{generate_plan.nodes.back().output};
+                std::filesystem::path stamp{training_stamp.view()};
+                if (is_up_to_date(stamp, {binary}))
+                {
+                    std::cout << "pgo-train:up to date" << std::endl;
+                    return true;
+                }
+                if constexpr (!has_pgo_merge_command_v<Context>)
+                {
+                    // gcc adds to existing .gcda files, which would mix in counts of an older binary.
+                    for (const auto& node : generate_plan.nodes)
+                    {
+                        if (is_compile(node.kind))
+                        {
+                            std::error_code ec{};
+                            std::filesystem::remove(Generate::gcda_path(node), ec);
+                        }
+                    }
+                }
+                auto command = binary.string() + " " + std::string{TrainingArgs.view()};
+                std::cout << "pgo-train:" << command << std::endl;
+                if (std::system(command.data()) != 0)
+                {
+                    // No stamp, so the next build trains again.
+                    std::cout << "pgo-train:failed" << std::endl;
+                    return false;
+                }
+                std::ofstream{stamp};
+                std::cout << "pgo-train:finished" << std::endl;
+                return true;
+            }
+            static bool merge()
+            {
+                SOPHO_STACK();
+                if constexpr (has_pgo_merge_command_v<Context>)
+                {
+                    if (is_up_to_date(Context::pgo_profile.view(), {std::filesystem::path{training_stamp.view()}}))
+                    {
+                        return true;
+                    }
+                    std::string command{Context::pgo_merge_command.view()};
+                    std::cout << "pgo-merge:" << command << std::endl;
+                    if (std::system(command.data()) != 0)
+                    {
+                        std::cout << "pgo-merge:failed" << std::endl;
+                        return false;
+                    }
+                    return true;
+                }
+                else
+                {
+                    // The plans list the same targets in the same order, so node i is the same object in both.
+                    for (std::size_t i = 0; i < generate_plan.nodes.size(); ++i)
+                    {
+                        if (!is_compile(generate_plan.nodes[i].kind))
+                        {
+                            continue;
+                        }
+                        std::filesystem::path from{Generate::gcda_path(generate_plan.nodes[i])};
+                        std::filesystem::path to{Use::gcda_path(use_plan.nodes[i])};
+                        std::error_code ec{};
+                        if (!std::filesystem::exists(from, ec) || is_up_to_date(to, {from}))
+                        {
+                            continue;
+                        }
+                        std::filesystem::create_directories(to.parent_path());
+                        std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, ec);
+                        SOPHO_ASSERT(!ec, "cannot copy ", from.string(), " to ", to.string(), ": ", ec.message());
+                    }
+                    return true;
+                }
+            }
+            static bool build(CompileCommands& commands)
+            {
+                SOPHO_STACK();
+                CompileCommands instrumented{};
+                // Training a binary that failed to build would run an older one.
+                bool succeeded = Generate::execute(generate_plan, instrumented) && train();
+                succeeded = merge() && succeeded;
+                return Use::execute(use_plan, commands) && succeeded;
+            }
+            static BuildResult build()
+            {
+                BuildResult result{};
+                result.succeeded = build(result.commands);
+                return result;
+            }
+        };
+    };
+    // Builds Target once per Context through one job pool, so the variants' jobs run interleaved on every core.
+    // Outputs the variants have in common are built once. Appends the compile_commands.json entries of all variants to
+    // `commands`. Returns whether every job of every variant succeeded.
+    template <typename Target, typename... Contexts>
+    bool build_variants(CompileCommands& commands)
+    {
+        SOPHO_STACK();
+        JobPool pool{};
+        (CxxToolchain<Contexts>::enqueue(pool, CxxToolchain<Contexts>::template build_plan<Target>, commands), ...);
+        bool succeeded = pool.run();
+        report_tests(pool.results());
+        report_build(pool);
+        return succeeded;
+    }
+    template <typename Target, typename... Contexts>
+    BuildResult build_variants()
+    {
+        BuildResult result{};
+        result.succeeded = build_variants<Target, Contexts...>(result.commands);
+        return result;
+    }
+    // Writes a ninja file that builds Target once per Context, for handing large graphs to ninja. Each Context gets
+    // its rules, named after its variant or its position; headers come from the compiler's depfile where the Context
+    // has depfile_flags or show_includes_flags. Like the single header, the file is rewritten only when its content
+    // changes, so ninja does not reload it. Shared libraries relink their dependents on every change, and tests have
+    // no timeout or retries.
+    template <typename Target, typename... Contexts>
+    void write_build_ninja(const std::filesystem::path& path = "build.ninja")
+    {
+        SOPHO_STACK();
+        static_assert(sizeof...(Contexts) > 0, "write_build_ninja needs at least one Context");
+        std::ostringstream out{};
+        out << "# Generated by sob.hpp; changes are overwritten.\nninja_required_version = 1.7\n\n";
+        std::set<std::string, std::less<>> written{};
+        std::size_t position = 0;
+        (
+            [&]
+            {
+                using Toolchain = CxxToolchain<Contexts>;
+                std::string rules{};
+                if constexpr (has_variant_name_v<Contexts>)
+                {
+                    rules = Contexts::variant_name.view();
+                }
+                else
+                {
+                    rules = "context" + std::to_string(position);
+                }
+                ++position;
+                Toolchain::write_ninja_rules(out, rules);
+                Toolchain::write_ninja_edges(out, Toolchain::template build_plan<Target>, rules, written);
+                out << "\n";
+            }(),
+            ...);
+        auto content = out.str();
+        if (!output_matches(path, {content}))
+        {
+            write_segments_atomic(path, {content});
+        }
+    }
 } // namespace sopho
@@ -0,0 +1,57 @@
+// A build reports failure when a compile or a test fails, so a driver can exit non-zero and gate CI on it.
+#include <fstream>
+#include <iostream>
+#include "sob.hpp"
+
+struct Context
+{
+    static constexpr std::string_view cxx{"g++"};
+    static constexpr sopho::StaticString obj_prefix{" -o "};
+    static constexpr sopho::StaticString obj_postfix{".o"};
+    static constexpr sopho::StaticString bin_prefix{" -o "};
+    static constexpr sopho::StaticString build_prefix{"build/"};
+};
+
+using Exit = sopho::Target<std::tuple<sopho::Source<sopho::StaticString{"exit.cpp"}>>, sopho::StaticString{"exit"}>;
+using Broken =
+    sopho::Target<std::tuple<sopho::Source<sopho::StaticString{"broken.cpp"}>>, sopho::StaticString{"broken"}>;
+
+template <typename Root>
+bool builds()
+{
+    return sopho::CxxToolchain<Context>::CxxBuilder<Root>::build().succeeded;
+}
+
+int main()
+{
+    std::ofstream{"exit.cpp"} << "#include <cstdlib>\n"
+                                 "int main(int argc, char** argv) { return argc > 1 ? std::atoi(argv[1]) : 0; }\n";
+    std::ofstream{"broken.cpp"} << "int main() { return undeclared; }\n";
+    int failures = 0;
+    auto expect = [&failures](bool actual, bool expected, std::string_view what)
+    {
+        if (actual != expected)
+        {
+            std::cerr << what << ": expected " << (expected ? "success" : "failure") << "\n";
+            ++failures;
+        }
+    };
+
+    expect(builds<std::tuple<Exit, sopho::Test<Exit, sopho::StaticString{"0"}>>>(), true, "passing test");
+    expect(builds<std::tuple<Exit, sopho::Test<Exit, sopho::StaticString{"3"}>>>(), false, "failing test");
+    expect(builds<Broken>(), false, "failing compile");
+    // An up-to-date build succeeds again, and a failed test is not taken for passed on the next run.
+    expect(builds<std::tuple<Exit, sopho::Test<Exit, sopho::StaticString{"0"}>>>(), true, "up-to-date build");
+    expect(builds<std::tuple<Exit, sopho::Test<Exit, sopho::StaticString{"3"}>>>(), false, "failing test rerun");
+
+    // The timing reports leave std::cout's formatting alone, and durations are keyed by output path.
+    expect(std::cout.precision() == 6 && (std::cout.flags() & std::ios::floatfield) == std::ios::fmtflags{}, true,
+           "std::cout formatting after the reports");
+    expect(sopho::job_history().seconds("build/exit.o").has_value(), true, "duration of build/exit.o");
+
+    {
+        sopho::CompileCommands commands{};
+        expect(sopho::build_variants<Broken, Context>(commands), false, "failing variant build");
+    }
+    return failures == 0 ? 0 : 1;
+}
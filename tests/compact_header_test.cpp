@@ -0,0 +1,69 @@
+// Compact single headers have fewer lines than readable ones and keep __LINE__ within line_slack of the source.
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include "sob.hpp"
+
+namespace
+{
+    // Each CHECK(n) sits on source line n and asserts the compiler's __LINE__ is at most `slack` lines early.
+    void write_fixture()
+    {
+        std::filesystem::create_directories("fixture");
+        std::ofstream{"fixture/checks.hpp"} << "#pragma once\n"                                        // 1
+                                               "// A comment the compact output strips.\n"            // 2
+                                               "\n"                                                   // 3
+                                               "CHECK(4)\n"                                           // 4
+                                               "\n"                                                   // 5
+                                               "/* a block\n"                                         // 6
+                                               "   comment */\n"                                      // 7
+                                               "CHECK(8)\n"                                           // 8
+                                               "\n"                                                   // 9
+                                               "\n"                                                   // 10
+                                               "\n"                                                   // 11
+                                               "\n"                                                   // 12
+                                               "CHECK(13)\n";                                         // 13
+        std::ofstream{"fixture/main.hpp"} << "#pragma once\n"
+                                             "#include <cstddef>\n"
+                                             "#define CHECK(n) static_assert(__LINE__ <= (n) && __LINE__ + SLACK >= (n));\n"
+                                             "\n"
+                                             "// Comment\n"
+                                             "#include \"checks.hpp\"\n"
+                                             "\n"
+                                             "CHECK(8)\n";
+    }
+
+    std::size_t count_lines(const std::filesystem::path& path)
+    {
+        auto content = sopho::read_file(path);
+        return static_cast<std::size_t>(std::count(content.begin(), content.end(), '\n'));
+    }
+} // namespace
+
+int main()
+{
+    write_fixture();
+    int failures = 0;
+    sopho::single_header_generator("fixture/main.hpp", sopho::GeneratorOptions{"readable.hpp"});
+    for (std::size_t slack : {0, 2})
+    {
+        auto output = "compact" + std::to_string(slack) + ".hpp";
+        sopho::GeneratorOptions options{output};
+        options.compact = true;
+        options.line_slack = slack;
+        sopho::single_header_generator("fixture/main.hpp", options);
+        auto command = "g++ -std=c++20 -fsyntax-only -DSLACK=" + std::to_string(slack) + " -x c++ " + output;
+        if (std::system(command.data()) != 0)
+        {
+            std::cerr << output << ": __LINE__ is off by more than " << slack << " lines\n";
+            ++failures;
+        }
+    }
+    if (count_lines("compact2.hpp") >= count_lines("readable.hpp"))
+    {
+        std::cerr << "compact2.hpp has " << count_lines("compact2.hpp") << " lines, readable.hpp "
+                  << count_lines("readable.hpp") << "\n";
+        ++failures;
+    }
+    return failures == 0 ? 0 : 1;
+}
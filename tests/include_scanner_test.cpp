@@ -0,0 +1,116 @@
+// IncludeScanner::dependencies() must name the same headers as `g++ -MM` for guarded, quoted and <...> includes.
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include "sob.hpp"
+
+namespace
+{
+    void write(const std::filesystem::path& path, std::string_view content)
+    {
+        std::filesystem::create_directories(path.parent_path());
+        std::ofstream{path} << content;
+    }
+
+    // Canonical paths, so "src/../include/x.hpp" and "include/x.hpp" compare equal.
+    std::set<std::filesystem::path> canonical(const std::vector<std::filesystem::path>& paths)
+    {
+        std::set<std::filesystem::path> result{};
+        for (const auto& path : paths)
+        {
+            result.insert(std::filesystem::canonical(path));
+        }
+        return result;
+    }
+
+    // The prerequisites of a make rule as written by -MM, without the source itself.
+    std::vector<std::filesystem::path> parse_make_rule(std::string rule)
+    {
+        std::vector<std::filesystem::path> result{};
+        std::string word{};
+        bool target = true;
+        for (std::size_t i = 0; i <= rule.size(); ++i)
+        {
+            char c = i < rule.size() ? rule[i] : ' ';
+            if (c == '\\' && i + 1 < rule.size() && rule[i + 1] == '\n')
+            {
+                ++i;
+                c = ' ';
+            }
+            if (c != ' ' && c != '\n')
+            {
+                word += c;
+                continue;
+            }
+            if (!word.empty() && !target)
+            {
+                result.emplace_back(word);
+            }
+            if (!word.empty() && word.back() == ':')
+            {
+                target = false;
+            }
+            word.clear();
+        }
+        SOPHO_ASSERT(!result.empty(), "no prerequisites in: ", rule);
+        result.erase(result.begin());
+        return result;
+    }
+} // namespace
+
+int main()
+{
+    write("src/main.cpp", "#include \"local.hpp\"\n"
+                          "#include <lib/api.hpp>\n"
+                          "#include <vector>\n"
+                          "#include \"local.hpp\"\n"
+                          "int main() { return answer() + twice(); }\n");
+    // Guarded, and included again through the library header.
+    write("src/local.hpp", "#ifndef LOCAL_HPP\n"
+                           "#define LOCAL_HPP\n"
+                           "#include \"detail/impl.hpp\"\n"
+                           "inline int answer() { return impl(); }\n"
+                           "#endif\n");
+    write("src/detail/impl.hpp", "#pragma once\n"
+                                 "inline int impl() { return 42; }\n");
+    // Found through -I; its quoted include resolves next to it first.
+    write("include/lib/api.hpp", "#pragma once\n"
+                                 "#include \"types.hpp\"\n"
+                                 "#include \"../../src/local.hpp\"\n"
+                                 "#include <string>\n"
+                                 "inline int twice() { return Count{answer()}.value * 2; }\n");
+    write("include/lib/types.hpp", "#pragma once\n"
+                                   "struct Count { int value; };\n");
+
+    if (std::system("g++ -std=c++20 -MM -I include src/main.cpp > main.d") != 0)
+    {
+        std::cerr << "g++ -MM failed\n";
+        return 1;
+    }
+    auto expected = canonical(parse_make_rule(sopho::read_file("main.d")));
+    sopho::IncludeScanner scanner{{"include"}};
+    auto actual = canonical(scanner.dependencies("src/main.cpp"));
+
+    if (actual != expected)
+    {
+        std::cerr << "g++ -MM:";
+        for (const auto& path : expected)
+        {
+            std::cerr << ' ' << path.string();
+        }
+        std::cerr << "\nIncludeScanner:";
+        for (const auto& path : actual)
+        {
+            std::cerr << ' ' << path.string();
+        }
+        std::cerr << '\n';
+        return 1;
+    }
+    if (expected.size() != 4)
+    {
+        std::cerr << "expected the 4 fixture headers, g++ -MM named " << expected.size() << '\n';
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,47 @@
+// A jobserver joins only pipes advertised in MAKEFLAGS, and serving one keeps the flags already there.
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include "sob.hpp"
+
+int main()
+{
+    int failures = 0;
+    auto expect = [&failures](bool ok, std::string_view what)
+    {
+        if (!ok)
+        {
+            std::cerr << what << "\n";
+            ++failures;
+        }
+    };
+
+    {
+        ::setenv("MAKEFLAGS", "k -- NAME=value", 1);
+        sopho::Jobserver server{4};
+        std::string makeflags = std::getenv("MAKEFLAGS");
+        expect(server.active() && !server.is_client(), "serves a jobserver when none is advertised");
+        expect(makeflags.rfind("k -- NAME=value -j4 --jobserver-auth=", 0) == 0, "keeps inherited MAKEFLAGS");
+    }
+
+    {
+        // A regular file left open at the advertised numbers is not a jobserver.
+        int fd = ::open("not_a_pipe", O_RDWR | O_CREAT, 0644);
+        auto fds = std::to_string(fd);
+        ::setenv("MAKEFLAGS", (" -j4 --jobserver-auth=" + fds + "," + fds).data(), 1);
+        sopho::Jobserver client{4};
+        expect(!client.active(), "rejects descriptors that are not pipes");
+        ::close(fd);
+    }
+
+    {
+        int fds[2]{};
+        expect(::pipe(fds) == 0, "cannot create a pipe");
+        auto makeflags = " -j2 --jobserver-auth=" + std::to_string(fds[0]) + "," + std::to_string(fds[1]);
+        ::setenv("MAKEFLAGS", makeflags.data(), 1);
+        sopho::Jobserver client{4};
+        expect(client.active() && client.is_client(), "joins an advertised pipe");
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+# Builds and runs every tests/*_test.cpp against the headers in include/. Each test runs in a scratch directory of its
+# own and gets the repository root as its first argument, for fixtures. Usage: tests/run_tests.sh [name_test ...]
+set -u
+root=$(cd "$(dirname "$0")/.." && pwd)
+cxx=${CXX:-g++}
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failed=0
+if [ $# -eq 0 ]; then
+    set -- $(cd "$root/tests" && ls *_test.cpp | sed 's/\.cpp$//')
+fi
+for name in "$@"; do
+    mkdir -p "$work/$name"
+    if ! "$cxx" -std=c++20 -I"$root/include" -pthread "$root/tests/$name.cpp" -o "$work/$name/$name"; then
+        echo "$name: BUILD FAILED"
+        failed=1
+        continue
+    fi
+    if (cd "$work/$name" && "./$name" "$root" > output.txt 2>&1); then
+        echo "$name: passed"
+    else
+        echo "$name: FAILED"
+        cat "$work/$name/output.txt"
+        failed=1
+    fi
+done
+exit $failed
@@ -0,0 +1,67 @@
+// A binary linking a SharedLibrary of the plan must run from wherever it is placed, so its link carries an rpath.
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include "sob.hpp"
+
+struct Context
+{
+    static constexpr std::string_view cxx{"g++"};
+    static constexpr sopho::StaticString obj_prefix{" -o "};
+    static constexpr sopho::StaticString obj_postfix{".o"};
+    static constexpr sopho::StaticString bin_prefix{" -o "};
+    static constexpr sopho::StaticString build_prefix{"build/"};
+    static constexpr sopho::StaticString shared_prefix{" -shared -o "};
+    static constexpr sopho::StaticString shared_postfix{".so"};
+    static constexpr std::array<std::string_view, 2> shared_cxxflags{"-fPIC", "-fvisibility=hidden"};
+    static constexpr sopho::StaticString rpath_prefix{"-Wl,-rpath,"};
+    static constexpr sopho::StaticString soname_prefix{"-Wl,-soname,"};
+};
+
+using LibSource = sopho::Source<sopho::StaticString{"lib.cpp"}>;
+using AppSource = sopho::Source<sopho::StaticString{"app.cpp"}>;
+using Lib = sopho::SharedLibrary<std::tuple<LibSource>, sopho::StaticString{"lib/libanswer"}>;
+// In another directory than the library, so the rpath has to be relative to $ORIGIN.
+using App = sopho::Target<std::tuple<AppSource, Lib>, sopho::StaticString{"bin/app"}>;
+
+int main()
+{
+    std::ofstream{"lib.cpp"} << "__attribute__((visibility(\"default\"))) int answer() { return 42; }\n";
+    std::ofstream{"app.cpp"} << "int answer();\nint main() { return answer() == 42 ? 0 : 1; }\n";
+    std::filesystem::create_directories("lib");
+    std::filesystem::create_directories("bin");
+
+    if (!sopho::CxxToolchain<Context>::CxxBuilder<std::tuple<App, sopho::Test<App>>>::build().succeeded)
+    {
+        std::cerr << "the build failed\n";
+        return 1;
+    }
+
+    // Run from another working directory, so the library is not found by accident.
+    std::filesystem::create_directories("elsewhere");
+    int status = std::system("cd elsewhere && ../bin/app");
+    if (status != 0)
+    {
+        std::cerr << "bin/app exited with " << status << "\n";
+        return 1;
+    }
+    if (!std::filesystem::exists("build/bin/app.passed"))
+    {
+        std::cerr << "the test of bin/app did not pass\n";
+        return 1;
+    }
+
+    // The exported ninja file links the same way, with the dollar escaped for ninja.
+    sopho::write_build_ninja<App, Context>("build.ninja");
+    auto ninja = sopho::read_file("build.ninja");
+    for (std::string_view expected :
+         {"link_flags = '-Wl,-rpath,$$ORIGIN/../lib'", "link_flags = '-Wl,-soname,libanswer.so'"})
+    {
+        if (ninja.find(expected) == std::string::npos)
+        {
+            std::cerr << "build.ninja lacks " << expected << ":\n" << ninja;
+            return 1;
+        }
+    }
+    return 0;
+}